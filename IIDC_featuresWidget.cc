@@ -94,41 +94,20 @@ void IIDC_featuresWidget::initMappings(map<modeSelection_t, const char*>&
     modeStrings[MAN_ABSOLUTE] = "Manual in absolute coordinates";
 }
 
-static void* syncControlsThread(void *pArg)
+// The controls are synced periodically by an FLTK timeout in the GUI thread. Unlike a separate
+// thread, this needs no Fl::lock(), and nothing needs to be stopped when the widget goes away
+// other than removing the timeout
+void IIDC_featuresWidget::syncControlsTimeout(void* widget)
 {
-    IIDC_featuresWidget* widget = (IIDC_featuresWidget*)pArg;
-
-    while(1)
-    {
-        struct timespec delay;
-        delay.tv_sec  = SYNC_CONTROLS_PERIOD_US / 1000000;
-        delay.tv_nsec = (SYNC_CONTROLS_PERIOD_US - delay.tv_sec*1000000) * 1000;
-        nanosleep(&delay, NULL);
-
-        Fl::lock();
-        widget->syncControls();
-        Fl::unlock();
-    }
-
-    return NULL;
-}
-
-void IIDC_featuresWidget::cleanupThreads(void)
-{
-    if(syncControlsThread_id != 0)
-    {
-        pthread_cancel(syncControlsThread_id);
-        pthread_join(syncControlsThread_id, NULL);
-        syncControlsThread_id = 0;
-    }
+    ((IIDC_featuresWidget*)widget)->syncControls();
+    Fl::repeat_timeout(SYNC_CONTROLS_PERIOD_US / 1e6, &syncControlsTimeout, widget);
 }
 
 IIDC_featuresWidget::IIDC_featuresWidget(dc1394camera_t *_camera,
                                          int X,int Y,int W,int H,const char*l,
                                          bool doResizeNatural)
     : Fl_Pack(X, Y, W, H, l), camera(_camera),
-      widestFeatureLabel(0), widestUnitLabel(0),
-      syncControlsThread_id(0)
+      widestFeatureLabel(0), widestUnitLabel(0)
 {
     int ww, hh;
 
@@ -252,11 +231,7 @@ IIDC_featuresWidget::IIDC_featuresWidget(dc1394camera_t *_camera,
     }
     parent()->init_sizes();
 
-    if(pthread_create(&syncControlsThread_id, NULL, &syncControlsThread, this) != 0)
-    {
-        fprintf(stderr, "IIDC_featuresWidget couldn't spawn syncControls thread\n");
-        syncControlsThread_id = 0;
-    }
+    Fl::add_timeout(SYNC_CONTROLS_PERIOD_US / 1e6, &syncControlsTimeout, this);
 }
 
 void IIDC_featuresWidget::getNaturalSize(int* ww, int* hh)
@@ -267,7 +242,7 @@ void IIDC_featuresWidget::getNaturalSize(int* ww, int* hh)
 
 IIDC_featuresWidget::~IIDC_featuresWidget()
 {
-    cleanupThreads();
+    Fl::remove_timeout(&syncControlsTimeout, this);
 
     FOREACH(vector<featureUI_t*>::iterator, itr, featureUIs)
     {
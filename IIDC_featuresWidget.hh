@@ -7,7 +7,6 @@
 #include <FL/Fl_Value_Slider.H>
 #include <FL/Fl_Box.H>
 #include <FL/Fl_Pack.H>
-#include <pthread.h>
 #include <vector>
 #include <map>
 using namespace std;
@@ -31,10 +30,6 @@ class IIDC_featuresWidget : public Fl_Pack
     };
     vector<featureUI_t*>          featureUIs;
 
-    pthread_t                     syncControlsThread_id;
-
-
-
     void addModeUI(Fl_Choice* modes,
                    map<modeSelection_t, const char*>& modeStrings,
                    modeSelection_t modeChoice);
@@ -43,8 +38,7 @@ class IIDC_featuresWidget : public Fl_Pack
                       map<dc1394feature_t, const char*>&          featureNames,
                       map<dc1394feature_t, const char*>&          absUnits);
 
-    void cleanupThreads(void);
-
+    static void syncControlsTimeout(void* widget);
 
 public:
     IIDC_featuresWidget(dc1394camera_t *_camera,
@@ -0,0 +1,377 @@
+#include <iostream>
+#include "bayerDemosaic.hh"
+#include "workerPool.hh"
+using namespace std;
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The luma weights of the grayscale output, out of 256. These are the BT.601 weights, as
+// libswscale uses
+#define LUMA_R 77
+#define LUMA_G 150
+#define LUMA_B 29
+
+bool bayerDemosaic_fromPixfmt(enum AVPixelFormat pixfmt, BayerDemosaic_Pattern* pattern,
+                              int* bytesPerSample)
+{
+    switch(pixfmt)
+    {
+    case AV_PIX_FMT_BAYER_RGGB8:    *pattern = BAYERDEMOSAIC_RGGB; *bytesPerSample = 1; return true;
+    case AV_PIX_FMT_BAYER_BGGR8:    *pattern = BAYERDEMOSAIC_BGGR; *bytesPerSample = 1; return true;
+    case AV_PIX_FMT_BAYER_GRBG8:    *pattern = BAYERDEMOSAIC_GRBG; *bytesPerSample = 1; return true;
+    case AV_PIX_FMT_BAYER_GBRG8:    *pattern = BAYERDEMOSAIC_GBRG; *bytesPerSample = 1; return true;
+    case AV_PIX_FMT_BAYER_RGGB16LE: *pattern = BAYERDEMOSAIC_RGGB; *bytesPerSample = 2; return true;
+    case AV_PIX_FMT_BAYER_BGGR16LE: *pattern = BAYERDEMOSAIC_BGGR; *bytesPerSample = 2; return true;
+    case AV_PIX_FMT_BAYER_GRBG16LE: *pattern = BAYERDEMOSAIC_GRBG; *bytesPerSample = 2; return true;
+    case AV_PIX_FMT_BAYER_GBRG16LE: *pattern = BAYERDEMOSAIC_GBRG; *bytesPerSample = 2; return true;
+    default:                        return false;
+    }
+}
+
+static bool isBinned(CvRect window, int outWidth, int outHeight)
+{
+    return outWidth == window.width/2 && outHeight == window.height/2;
+}
+
+bool bayerDemosaic_needsScratch(CvRect window, int outWidth, int outHeight)
+{
+    bool sameSize = outWidth == window.width && outHeight == window.height;
+    return !sameSize && !isBinned(window, outWidth, outHeight);
+}
+
+// One demosaicing job, split into bands of output rows
+struct BayerDemosaic_Job
+{
+    const uint8_t* src;
+    int            srcStride, srcWidth, srcHeight, bytesPerSample;
+
+    // where the red sample is in each 2x2 quad, in frame coordinates
+    int            redX, redY;
+
+    CvRect         window;
+    bool           binned;
+
+    uint8_t*       dst;
+    int            dstStride, dstWidth, dstHeight, channels;
+};
+
+// the sample at (x,y) of the frame, as 8 bits. The neighbors of the edge pixels are off the
+// frame by one; I reflect those back in, which lands on a sample of the same color
+static inline int sample(const BayerDemosaic_Job* job, int x, int y)
+{
+    if     (x < 0)              x = 1;
+    else if(x >= job->srcWidth) x = job->srcWidth - 2;
+    if     (y < 0)               y = 1;
+    else if(y >= job->srcHeight) y = job->srcHeight - 2;
+
+    const uint8_t* p = job->src + y*job->srcStride + x*job->bytesPerSample;
+
+    // 16-bit samples are little-endian. I keep the top byte
+    return job->bytesPerSample == 1 ? p[0] : p[1];
+}
+
+static inline void storePixel(const BayerDemosaic_Job* job, uint8_t* d, int r, int g, int b)
+{
+    if(job->channels == 3)
+    {
+        d[0] = (uint8_t)r;
+        d[1] = (uint8_t)g;
+        d[2] = (uint8_t)b;
+    }
+    else
+        d[0] = (uint8_t)((LUMA_R*r + LUMA_G*g + LUMA_B*b + 128) >> 8);
+}
+
+// Bilinear demosaicing of pixels [x0,x1) of row y, in frame coordinates. Each row has green
+// samples and one other color (the row's color), alternating. At a green sample the row's color
+// comes from the horizontal neighbors, and the other from the vertical ones. At a non-green
+// sample, the green comes from the 4 nearest neighbors, and the other color from the 4 diagonal
+// ones
+static void bilinear_scalar(const BayerDemosaic_Job* job, int y, int x0, int x1, uint8_t* dst)
+{
+    bool redRow = ((y ^ job->redY) & 1) == 0;
+
+    for(int x=x0; x<x1; x++)
+    {
+        int  c      = sample(job, x, y);
+        bool redCol = ((x ^ job->redX) & 1) == 0;
+
+        int rowColor, green, otherColor;
+        if(redRow == redCol)
+        {
+            rowColor   = c;
+            green      = (sample(job, x-1, y  ) + sample(job, x+1, y  ) +
+                          sample(job, x,   y-1) + sample(job, x,   y+1) + 2) >> 2;
+            otherColor = (sample(job, x-1, y-1) + sample(job, x+1, y-1) +
+                          sample(job, x-1, y+1) + sample(job, x+1, y+1) + 2) >> 2;
+        }
+        else
+        {
+            rowColor   = (sample(job, x-1, y) + sample(job, x+1, y) + 1) >> 1;
+            green      = c;
+            otherColor = (sample(job, x, y-1) + sample(job, x, y+1) + 1) >> 1;
+        }
+
+        uint8_t* d = dst + (x - x0)*job->channels;
+        if(redRow) storePixel(job, d, rowColor,   green, otherColor);
+        else       storePixel(job, d, otherColor, green, rowColor);
+    }
+}
+
+#ifdef __SSE2__
+static inline __m128i load8(const uint8_t* p)
+{
+    return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+}
+
+static inline __m128i blend(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Stores 8 pixels, given as 16-bit lanes
+static inline void store8(const BayerDemosaic_Job* job, uint8_t* d, __m128i r, __m128i g, __m128i b)
+{
+    if(job->channels == 1)
+    {
+        __m128i y = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(LUMA_R)),
+                                                _mm_mullo_epi16(g, _mm_set1_epi16(LUMA_G))),
+                                  _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(LUMA_B)),
+                                                _mm_set1_epi16(128)));
+
+        // the sum can exceed 32767, so the shift must be a logical one
+        y = _mm_srli_epi16(y, 8);
+        _mm_storel_epi64((__m128i*)d, _mm_packus_epi16(y, y));
+        return;
+    }
+
+    // SSE2 has no byte shuffle, so I interleave the channels one pixel at a time
+    uint8_t rgb[3][16];
+    _mm_storeu_si128((__m128i*)rgb[0], _mm_packus_epi16(r, r));
+    _mm_storeu_si128((__m128i*)rgb[1], _mm_packus_epi16(g, g));
+    _mm_storeu_si128((__m128i*)rgb[2], _mm_packus_epi16(b, b));
+    for(int i=0; i<8; i++)
+    {
+        d[3*i + 0] = rgb[0][i];
+        d[3*i + 1] = rgb[1][i];
+        d[3*i + 2] = rgb[2][i];
+    }
+}
+
+// The bilinear kernel on 8 pixels at a time. Only for 8-bit samples, and only away from the
+// edges of the frame: row y must have a row above and below it, and pixels x-1 .. x+8 must
+// exist. Returns how far it got
+static int bilinear_sse2(const BayerDemosaic_Job* job, int y, int x0, int x1, uint8_t* dst)
+{
+    int x = x0;
+    if(x < 1) return x;
+
+    bool redRow = ((y ^ job->redY) & 1) == 0;
+
+    // Which lanes hold green samples. Since I step by 8, this is the same for the whole row
+    int16_t greenLanes[8];
+    for(int i=0; i<8; i++)
+    {
+        bool redCol   = (((x + i) ^ job->redX) & 1) == 0;
+        greenLanes[i] = redRow != redCol ? -1 : 0;
+    }
+    __m128i isGreen = _mm_loadu_si128((const __m128i*)greenLanes);
+    __m128i one     = _mm_set1_epi16(1);
+    __m128i two     = _mm_set1_epi16(2);
+
+    const uint8_t* above = job->src + (y-1)*job->srcStride;
+    const uint8_t* row   = job->src +  y   *job->srcStride;
+    const uint8_t* below = job->src + (y+1)*job->srcStride;
+
+    for(; x <= x1-8 && x+8 < job->srcWidth; x += 8)
+    {
+        __m128i a0  = load8(above + x);
+        __m128i al  = load8(above + x - 1);
+        __m128i ar  = load8(above + x + 1);
+        __m128i c   = load8(row   + x);
+        __m128i cl  = load8(row   + x - 1);
+        __m128i cr  = load8(row   + x + 1);
+        __m128i b0  = load8(below + x);
+        __m128i bl  = load8(below + x - 1);
+        __m128i br  = load8(below + x + 1);
+
+        __m128i h   = _mm_add_epi16(cl, cr);
+        __m128i v   = _mm_add_epi16(a0, b0);
+        __m128i horizontal = _mm_srli_epi16(_mm_add_epi16(h, one), 1);
+        __m128i vertical   = _mm_srli_epi16(_mm_add_epi16(v, one), 1);
+        __m128i cross      = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(h, v), two), 2);
+        __m128i diagonal   = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_add_epi16(al, ar),
+                                                                        _mm_add_epi16(bl, br)),
+                                                          two), 2);
+
+        __m128i rowColor   = blend(isGreen, horizontal, c);
+        __m128i green      = blend(isGreen, c,          cross);
+        __m128i otherColor = blend(isGreen, vertical,   diagonal);
+
+        uint8_t* d = dst + (x - x0)*job->channels;
+        if(redRow) store8(job, d, rowColor,   green, otherColor);
+        else       store8(job, d, otherColor, green, rowColor);
+    }
+    return x;
+}
+#endif
+
+// 2x2 binning of quads [i0,i1) of output row j. The quads are aligned to the window, so which
+// sample in each quad has which color depends on the window's position
+static void binned_scalar(const BayerDemosaic_Job* job, int j, int i0, int i1, uint8_t* dst)
+{
+    int Y  = job->window.y + 2*j;
+    int dx = (job->redX ^ job->window.x) & 1; // where the red is within the quad
+    int dy = (job->redY ^ Y)             & 1;
+
+    for(int i=i0; i<i1; i++)
+    {
+        int X = job->window.x + 2*i;
+        int r = sample(job, X + dx,     Y + dy);
+        int b = sample(job, X + (dx^1), Y + (dy^1));
+        int g = (sample(job, X + (dx^1), Y + dy) + sample(job, X + dx, Y + (dy^1)) + 1) >> 1;
+        storePixel(job, dst + i*job->channels, r, g, b);
+    }
+}
+
+#ifdef __SSE2__
+// 2x2 binning of 8 quads at a time. Only for 8-bit samples. Returns how far it got
+static int binned_sse2(const BayerDemosaic_Job* job, int j, int i0, int i1, uint8_t* dst)
+{
+    int Y  = job->window.y + 2*j;
+    int dx = (job->redX ^ job->window.x) & 1;
+    int dy = (job->redY ^ Y)             & 1;
+
+    const uint8_t* rows[2] = { job->src +  Y   *job->srcStride + job->window.x,
+                               job->src + (Y+1)*job->srcStride + job->window.x };
+    __m128i mask = _mm_set1_epi16(0x00ff);
+    __m128i one  = _mm_set1_epi16(1);
+
+    int i = i0;
+    for(; i <= i1-8; i += 8)
+    {
+        // q[row][column] within each quad, 8 quads in the 16-bit lanes
+        __m128i q[2][2];
+        for(int k=0; k<2; k++)
+        {
+            __m128i s = _mm_loadu_si128((const __m128i*)(rows[k] + 2*i));
+            q[k][0]   = _mm_and_si128 (s, mask);
+            q[k][1]   = _mm_srli_epi16(s, 8);
+        }
+
+        __m128i r = q[dy][dx];
+        __m128i b = q[dy^1][dx^1];
+        __m128i g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(q[dy][dx^1], q[dy^1][dx]), one), 1);
+        store8(job, dst + i*job->channels, r, g, b);
+    }
+    return i;
+}
+#endif
+
+static void demosaicBand(void* cookie, int band, int numBands)
+{
+    const BayerDemosaic_Job* job = (const BayerDemosaic_Job*)cookie;
+
+    int j0, j1;
+    WorkerPool::bandRows(band, numBands, job->dstHeight, 1, &j0, &j1);
+
+    for(int j=j0; j<j1; j++)
+    {
+        uint8_t* dst  = job->dst + j*job->dstStride;
+        int      done = 0;
+
+        if(job->binned)
+        {
+#ifdef __SSE2__
+            if(job->bytesPerSample == 1)
+                done = binned_sse2(job, j, 0, job->dstWidth, dst);
+#endif
+            binned_scalar(job, j, done, job->dstWidth, dst);
+            continue;
+        }
+
+        // The SIMD kernel does the bulk of the row. The scalar one does the edges of the frame,
+        // and whatever is left over
+        int y  = job->window.y + j;
+        int x0 = job->window.x;
+        int x1 = job->window.x + job->window.width;
+        int x  = x0;
+#ifdef __SSE2__
+        if(job->bytesPerSample == 1 && y >= 1 && y+1 < job->srcHeight)
+        {
+            if(x < 1)
+            {
+                bilinear_scalar(job, y, x, 1, dst);
+                x = 1;
+            }
+            x = bilinear_sse2(job, y, x, x1, dst + (x - x0)*job->channels);
+        }
+#endif
+        bilinear_scalar(job, y, x, x1, dst + (x - x0)*job->channels);
+    }
+}
+
+bool bayerDemosaic_convert(const uint8_t* src, int srcStride, int srcWidth, int srcHeight,
+                           int bytesPerSample, BayerDemosaic_Pattern pattern,
+                           CvRect window, IplImage* output, IplImage* scratch,
+                           FrameResizer* resizer, FrameResize_Interpolation interpolation,
+                           int maxThreads)
+{
+    if(srcWidth < 2 || srcHeight < 2 || window.width < 1 || window.height < 1 ||
+       window.x < 0 || window.y < 0 ||
+       window.x + window.width > srcWidth || window.y + window.height > srcHeight ||
+       (output->nChannels != 1 && output->nChannels != 3))
+    {
+        cerr << "bayerDemosaic: invalid geometry" << endl;
+        return false;
+    }
+
+    BayerDemosaic_Job job;
+    job.src            = src;
+    job.srcStride      = srcStride;
+    job.srcWidth       = srcWidth;
+    job.srcHeight      = srcHeight;
+    job.bytesPerSample = bytesPerSample;
+    job.redX           = (pattern == BAYERDEMOSAIC_RGGB || pattern == BAYERDEMOSAIC_GBRG) ? 0 : 1;
+    job.redY           = (pattern == BAYERDEMOSAIC_RGGB || pattern == BAYERDEMOSAIC_GRBG) ? 0 : 1;
+    job.window         = window;
+    job.binned         = isBinned(window, output->width, output->height);
+    job.channels       = output->nChannels;
+
+    bool viaScratch = bayerDemosaic_needsScratch(window, output->width, output->height);
+    if(viaScratch)
+    {
+        if(scratch == NULL || scratch->nChannels != output->nChannels ||
+           scratch->width < window.width || scratch->height < window.height)
+        {
+            cerr << "bayerDemosaic: no usable scratch buffer for scaling" << endl;
+            return false;
+        }
+        job.dst       = (uint8_t*)scratch->imageData;
+        job.dstStride = scratch->widthStep;
+        job.dstWidth  = window.width;
+        job.dstHeight = window.height;
+    }
+    else
+    {
+        job.dst       = (uint8_t*)output->imageData;
+        job.dstStride = output->widthStep;
+        job.dstWidth  = output->width;
+        job.dstHeight = output->height;
+    }
+
+    // Each band needs at least a few rows to be worth the trouble
+    int numBands = maxThreads;
+    if(numBands > job.dstHeight / 16) numBands = job.dstHeight / 16;
+    if(numBands < 1)                  numBands = 1;
+    WorkerPool::shared()->run(&demosaicBand, &job, numBands, numBands);
+
+    if(viaScratch)
+        resizer->resize(job.dst, window.width, window.height, job.dstStride,
+                        (uint8_t*)output->imageData,
+                        output->width, output->height, output->widthStep,
+                        output->nChannels, interpolation, maxThreads);
+    return true;
+}
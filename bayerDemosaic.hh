@@ -0,0 +1,57 @@
+// -*- c++ -*-
+
+#ifndef __BAYER_DEMOSAIC_HH__
+#define __BAYER_DEMOSAIC_HH__
+
+#include <stdint.h>
+#include <opencv2/core/types_c.h>
+#include "frameResize.hh"
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+}
+
+// Demosaicing of raw Bayer frames, as given out by many industrial sensors. A raw frame has one
+// sample per pixel, so it takes a third of the bandwidth of RGB24. I convert it straight into the
+// output frame, RGB or grayscale, with the cropping window applied: only the window is ever
+// demosaiced. There are two kernels, both SIMD:
+//
+// - bilinear: each missing color comes from the average of the nearest samples of that color.
+//   Used when the output has the size of the window
+//
+// - binned: each 2x2 quad of samples becomes one pixel. The red and blue come from their samples,
+//   and the green is the average of the two green samples. This produces a half-resolution image
+//   much more cheaply than a full demosaic followed by a downscale. Used when the output is half
+//   the size of the window
+//
+// Any other scaling demosaics the window with the bilinear kernel, and resizes that
+
+// the colors of the top-left 2x2 quad of the frame, in raster order
+enum BayerDemosaic_Pattern
+{
+    BAYERDEMOSAIC_RGGB,
+    BAYERDEMOSAIC_BGGR,
+    BAYERDEMOSAIC_GRBG,
+    BAYERDEMOSAIC_GBRG
+};
+
+// Is this libav pixel format raw Bayer that I can demosaic? If so, the pattern and the size of
+// each sample are returned. 16-bit samples are little-endian; I use their top 8 bits
+bool bayerDemosaic_fromPixfmt(enum AVPixelFormat pixfmt, BayerDemosaic_Pattern* pattern,
+                              int* bytesPerSample);
+
+// Do I need a scratch buffer to produce an output of this size from this window?
+bool bayerDemosaic_needsScratch(CvRect window, int outWidth, int outHeight);
+
+// Demosaics the given window of a raw frame into the output image, scaling it to the output's
+// size. The output is RGB24 or GRAY8. If bayerDemosaic_needsScratch(), scratch is an image of at
+// least the window's size with the output's channel count, and the resizer scales from it.
+// Returns false if the frame can't be demosaiced
+bool bayerDemosaic_convert(const uint8_t* src, int srcStride, int srcWidth, int srcHeight,
+                           int bytesPerSample, BayerDemosaic_Pattern pattern,
+                           CvRect window, IplImage* output, IplImage* scratch,
+                           FrameResizer* resizer, FrameResize_Interpolation interpolation,
+                           int maxThreads);
+
+#endif
@@ -0,0 +1,841 @@
+// Microbenchmarks of the per-frame kernels of the library: the cropping/scaling, the libswscale
+// conversions, the luma and Bayer fast paths, the dc1394 conversions, the encoder and the display
+// widget. Each kernel is timed in isolation, on synthetic frames, across a set of resolutions, so
+// that a change to one of them can be measured without a camera. This is run by "make bench".
+//
+// Usage: benchmark [--format=json|csv] [--output=FILE] [--sizes=WxH,WxH,...]
+//                  [--filter=SUBSTRING] [--threads=N] [--min-time=SECONDS]
+//
+// Each case is run a few times to warm up, and then repeatedly for at least --min-time seconds.
+// The results are the per-frame times (minimum, median, mean), and the throughput in megapixels
+// of the source frame per second, from the median. --filter runs only the cases whose
+// "kernel/variant" name contains the given string
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <FL/Fl.H>
+#include <FL/Fl_Window.H>
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/imgproc/imgproc_c.h>
+
+#include <dc1394/dc1394.h>
+
+#include "frameSource.hh"
+#include "frameResize.hh"
+#include "framePool.hh"
+#include "swsCrop.hh"
+#include "lumaPlane.hh"
+#include "bayerDemosaic.hh"
+#include "ffmpegInterface.hh"
+#include "cvFltkWidget.hh"
+
+
+// each case runs at least this many times, even if that takes longer than --min-time
+#define BENCH_MIN_ITERATIONS 5
+#define BENCH_MAX_ITERATIONS 100000
+#define BENCH_WARMUP         2
+
+typedef void (Bench_Kernel_t)(void* cookie);
+
+struct Bench_Result
+{
+    string kernel, variant;
+    int    width, height;
+    int    iterations;
+    double min_us, median_us, mean_us;
+};
+
+static vector<Bench_Result> results;
+static string               filter;
+static int                  threads = 1;
+static double               minTime_s = 0.2;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+// Deterministic noise, so that the compressing kernels (the encoder) see the same data on every
+// run. I don't use flat frames, since some kernels have shortcuts for those
+static void fillNoise(unsigned char* data, size_t size, uint32_t seed)
+{
+    uint32_t x = seed * 2654435761U + 1;
+    for(size_t i=0; i<size; i++)
+    {
+        x = x*1664525U + 1013904223U;
+        data[i] = (unsigned char)(x >> 24);
+    }
+}
+
+static IplImage* noiseImage(int width, int height, int channels, uint32_t seed)
+{
+    IplImage* image = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, channels);
+    if(image != NULL)
+        fillNoise((unsigned char*)image->imageData, image->imageSize, seed);
+    return image;
+}
+
+static bool wanted(const string& kernel, const string& variant)
+{
+    return filter.empty() || (kernel + "/" + variant).find(filter) != string::npos;
+}
+
+static void runCase(const string& kernel, const string& variant, int width, int height,
+                    Bench_Kernel_t* fn, void* cookie)
+{
+    for(int i=0; i<BENCH_WARMUP; i++)
+        fn(cookie);
+
+    vector<double> times_us;
+    uint64_t       t0      = now_ns();
+    uint64_t       minTime = (uint64_t)(minTime_s * 1e9);
+    while((int)times_us.size() < BENCH_MIN_ITERATIONS ||
+          (now_ns() - t0 < minTime && times_us.size() < BENCH_MAX_ITERATIONS))
+    {
+        uint64_t t = now_ns();
+        fn(cookie);
+        times_us.push_back((double)(now_ns() - t) / 1000.0);
+    }
+
+    sort(times_us.begin(), times_us.end());
+
+    Bench_Result result;
+    result.kernel     = kernel;
+    result.variant    = variant;
+    result.width      = width;
+    result.height     = height;
+    result.iterations = times_us.size();
+    result.min_us     = times_us.front();
+    result.median_us  = times_us[times_us.size() / 2];
+    result.mean_us    = 0.0;
+    for(size_t i=0; i<times_us.size(); i++)
+        result.mean_us += times_us[i];
+    result.mean_us /= (double)times_us.size();
+    results.push_back(result);
+
+    fprintf(stderr, "%-16s %-28s %5dx%-5d %10.1f us\n",
+            kernel.c_str(), variant.c_str(), width, height, result.median_us);
+}
+
+static const char* interpolationName(FrameResize_Interpolation interpolation)
+{
+    switch(interpolation)
+    {
+    case FRAMERESIZE_NEAREST:  return "nearest";
+    case FRAMERESIZE_BILINEAR: return "bilinear";
+    case FRAMERESIZE_AREA:     return "area";
+    default:                   return "cubic";
+    }
+}
+
+static int cvInterpolation(FrameResize_Interpolation interpolation)
+{
+    switch(interpolation)
+    {
+    case FRAMERESIZE_NEAREST:  return CV_INTER_NN;
+    case FRAMERESIZE_BILINEAR: return CV_INTER_LINEAR;
+    case FRAMERESIZE_AREA:     return CV_INTER_AREA;
+    default:                   return CV_INTER_CUBIC;
+    }
+}
+
+// the window used by all the cropping cases: the middle 3/4 of the frame, on even pixels so that
+// the chroma subsampling of any format lines up
+static CvRect benchWindow(int width, int height)
+{
+    return cvRect((width  / 8) & ~1, (height / 8) & ~1,
+                  (width  * 3 / 4) & ~1, (height * 3 / 4) & ~1);
+}
+
+
+
+// FrameSource::applyCroppingScaling() is protected, and only reachable through a source. This is
+// a source that does nothing but that
+class CropScaleHarness : public FrameSource
+{
+public:
+    CropScaleHarness(FrameSource_UserColorChoice _userColorMode, int _width, int _height,
+                     CvRect cropRect, double scale)
+        : FrameSource(_userColorMode)
+    {
+        width  = _width;
+        height = _height;
+        setupCroppingScaling(cropRect, scale);
+    }
+
+    operator bool() { return preCropScaleBuffer != NULL; }
+
+    IplImage* input(void) { return preCropScaleBuffer; }
+    void      apply(IplImage* output) { applyCroppingScaling(preCropScaleBuffer, output); }
+
+private:
+    bool _restartStream(void) { return false; }
+    bool _resumeStream (void) { return false; }
+    bool _stopStream   (void) { return false; }
+    bool _getNextFrame  (IplImage* image __attribute__((unused)),
+                         uint64_t* timestamp_us __attribute__((unused)))
+    {
+        return false;
+    }
+    bool _getLatestFrame(IplImage* image __attribute__((unused)),
+                         uint64_t* timestamp_us __attribute__((unused)))
+    {
+        return false;
+    }
+};
+
+struct CropScaleCase
+{
+    CropScaleHarness* source;
+    IplImage*         output;
+    CvRect            window;
+    int               cvInterpolation;
+};
+
+static void kernel_applyCroppingScaling(void* cookie)
+{
+    CropScaleCase* c = (CropScaleCase*)cookie;
+    c->source->apply(c->output);
+}
+
+// the OpenCV equivalent, for comparison
+static void kernel_cvResize(void* cookie)
+{
+    CropScaleCase* c = (CropScaleCase*)cookie;
+    cvSetImageROI(c->source->input(), c->window);
+    if(c->output->width == c->window.width && c->output->height == c->window.height)
+        cvCopy(c->source->input(), c->output);
+    else
+        cvResize(c->source->input(), c->output, c->cvInterpolation);
+    cvResetImageROI(c->source->input());
+}
+
+static void cropScaleCase(int width, int height, FrameSource_UserColorChoice colorMode,
+                          bool crop, double scale, FrameResize_Interpolation interpolation)
+{
+    string variant = colorMode == FRAMESOURCE_COLOR ? "rgb" : "gray";
+    if(crop)
+        variant += "_crop";
+    if(scale == 1.0)
+        variant += "_copy";
+    else
+    {
+        char scaling[32];
+        snprintf(scaling, sizeof(scaling), "_scale%.1f_", scale);
+        variant += string(scaling) + interpolationName(interpolation);
+    }
+
+    bool ours   = wanted("applyCropScale", variant);
+    bool theirs = wanted("cvResize",       variant);
+    if(!ours && !theirs)
+        return;
+
+    CvRect window = crop ? benchWindow(width, height) : cvRect(0, 0, width, height);
+
+    CropScaleHarness source(colorMode, width, height,
+                            crop ? window : cvRect(-1, -1, -1, -1), scale);
+    if(!source)
+    {
+        cerr << "couldn't set up the cropping/scaling for " << variant << endl;
+        return;
+    }
+    source.setInterpolation(interpolation);
+    source.setMaxThreads(threads);
+    fillNoise((unsigned char*)source.input()->imageData, source.input()->imageSize, 1);
+
+    CropScaleCase c;
+    c.source          = &source;
+    c.window          = window;
+    c.cvInterpolation = cvInterpolation(interpolation);
+    c.output          = cvCreateImage(cvSize(source.w(), source.h()), IPL_DEPTH_8U,
+                                      colorMode == FRAMESOURCE_COLOR ? 3 : 1);
+    if(c.output == NULL)
+        return;
+
+    if(ours)
+        runCase("applyCropScale", variant, width, height, &kernel_applyCroppingScaling, &c);
+    if(theirs)
+        runCase("cvResize",       variant, width, height, &kernel_cvResize,             &c);
+
+    cvReleaseImage(&c.output);
+}
+
+static void bench_cropScale(int width, int height)
+{
+    static const FrameResize_Interpolation interpolations[] =
+        { FRAMERESIZE_NEAREST, FRAMERESIZE_BILINEAR, FRAMERESIZE_AREA, FRAMERESIZE_CUBIC };
+
+    for(int color=0; color<2; color++)
+    {
+        FrameSource_UserColorChoice colorMode = color == 0 ? FRAMESOURCE_COLOR : FRAMESOURCE_GRAYSCALE;
+
+        cropScaleCase(width, height, colorMode, true, 1.0, FRAMERESIZE_CUBIC);
+        for(unsigned int i=0; i<sizeof(interpolations)/sizeof(interpolations[0]); i++)
+            cropScaleCase(width, height, colorMode, false, 0.5, interpolations[i]);
+        cropScaleCase(width, height, colorMode, true, 0.5, FRAMERESIZE_BILINEAR);
+        cropScaleCase(width, height, colorMode, false, 1.5, FRAMERESIZE_BILINEAR);
+    }
+}
+
+
+
+// A raw frame in some libav pixel format, with its planes packed one after another, as a V4L2
+// driver gives them out
+struct RawFrame
+{
+    enum AVPixelFormat pixfmt;
+    int                width, height;
+    unsigned char*     data;
+    size_t             size;
+    uint8_t*           planes[4];
+    int                strides[4];
+};
+
+// bytes per pixel of the first plane of the formats I benchmark
+static int firstPlaneBytes(enum AVPixelFormat pixfmt)
+{
+    switch(pixfmt)
+    {
+    case AV_PIX_FMT_YUYV422:
+    case AV_PIX_FMT_UYVY422: return 2;
+    case AV_PIX_FMT_RGB24:
+    case AV_PIX_FMT_BGR24:   return 3;
+    default:                 return 1;
+    }
+}
+
+static bool rawFrame_alloc(RawFrame* frame, enum AVPixelFormat pixfmt, int width, int height)
+{
+    frame->pixfmt = pixfmt;
+    frame->width  = width;
+    frame->height = height;
+
+    // big enough for any 8-bit format: 3 planes of the full size at most
+    int stride  = width * firstPlaneBytes(pixfmt);
+    frame->size = (size_t)stride * height * 3;
+    frame->data = (unsigned char*)FramePool::allocAligned(frame->size);
+    if(frame->data == NULL)
+        return false;
+    fillNoise(frame->data, frame->size, 2);
+
+    if(!swsCrop_findPlanes(pixfmt, width, height, stride, frame->data,
+                           frame->planes, frame->strides))
+    {
+        FramePool::freeAligned(frame->data, frame->size);
+        frame->data = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void rawFrame_free(RawFrame* frame)
+{
+    if(frame->data != NULL)
+        FramePool::freeAligned(frame->data, frame->size);
+    frame->data = NULL;
+}
+
+struct SwsCase
+{
+    SwsCrop_Scaler scaler;
+    uint8_t*       planes[4];
+    const int*     strides;
+    IplImage*      output;
+};
+
+static void kernel_sws(void* cookie)
+{
+    SwsCase* c = (SwsCase*)cookie;
+    c->scaler.scale(c->planes, c->strides,
+                    (unsigned char*)c->output->imageData, c->output->widthStep);
+}
+
+struct LumaCase
+{
+    RawFrame*    frame;
+    CvRect       window;
+    IplImage*    output;
+    FrameResizer resizer;
+};
+
+static void kernel_lumaPlane(void* cookie)
+{
+    LumaCase* c = (LumaCase*)cookie;
+    lumaPlane_convert(c->frame->pixfmt, c->frame->planes, c->frame->strides,
+                      c->window, c->output,
+                      &c->resizer, FRAMERESIZE_CUBIC, threads);
+}
+
+static void bench_pixfmts(int width, int height)
+{
+    static const enum AVPixelFormat pixfmts[] =
+        { AV_PIX_FMT_YUYV422, AV_PIX_FMT_UYVY422, AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUVJ420P,
+          AV_PIX_FMT_YUV422P, AV_PIX_FMT_NV12,    AV_PIX_FMT_RGB24,   AV_PIX_FMT_BGR24,
+          AV_PIX_FMT_GRAY8 };
+
+    for(unsigned int i=0; i<sizeof(pixfmts)/sizeof(pixfmts[0]); i++)
+    {
+        RawFrame frame;
+        if(!rawFrame_alloc(&frame, pixfmts[i], width, height))
+        {
+            cerr << "couldn't set up a " << av_get_pix_fmt_name(pixfmts[i]) << " frame" << endl;
+            continue;
+        }
+
+        for(int color=0; color<2; color++)
+        {
+            enum AVPixelFormat dstPixfmt = color == 0 ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_GRAY8;
+            int                channels  = color == 0 ? 3 : 1;
+
+            // the whole frame, and the cropped window scaled by 1/2
+            for(int cropped=0; cropped<2; cropped++)
+            {
+                CvRect window = cropped ? benchWindow(width, height) : cvRect(0, 0, width, height);
+                int    outW   = cropped ? window.width  / 2 : width;
+                int    outH   = cropped ? window.height / 2 : height;
+
+                string variant = string(av_get_pix_fmt_name(pixfmts[i])) + "_to_" +
+                    av_get_pix_fmt_name(dstPixfmt) + (cropped ? "_crop_scale0.5" : "");
+
+                if(wanted("sws_scale", variant) && swsCrop_supported(pixfmts[i], window))
+                {
+                    SwsCase c;
+                    c.strides = frame.strides;
+                    c.output  = cvCreateImage(cvSize(outW, outH), IPL_DEPTH_8U, channels);
+                    swsCrop_planes(pixfmts[i], window, frame.planes, frame.strides, c.planes);
+                    if(c.output != NULL &&
+                       c.scaler.setup(pixfmts[i], window.width, window.height,
+                                      dstPixfmt, outW, outH,
+                                      swsCrop_flags(FRAMERESIZE_CUBIC), threads))
+                        runCase("sws_scale", variant, width, height, &kernel_sws, &c);
+                    else
+                        cerr << "couldn't set up the conversion " << variant << endl;
+                    if(c.output != NULL)
+                        cvReleaseImage(&c.output);
+                }
+
+                // the luma fast path, which replaces libswscale for grayscale where it can
+                if(color == 1 && lumaPlane_layout(pixfmts[i]) != LUMAPLANE_NONE &&
+                   wanted("lumaPlane", variant))
+                {
+                    LumaCase c;
+                    c.frame  = &frame;
+                    c.window = window;
+                    c.output = cvCreateImage(cvSize(outW, outH), IPL_DEPTH_8U, 1);
+                    if(c.output != NULL &&
+                       lumaPlane_convert(pixfmts[i], frame.planes, frame.strides, window, c.output,
+                                         &c.resizer, FRAMERESIZE_CUBIC, threads))
+                        runCase("lumaPlane", variant, width, height, &kernel_lumaPlane, &c);
+                    if(c.output != NULL)
+                        cvReleaseImage(&c.output);
+                }
+            }
+        }
+
+        rawFrame_free(&frame);
+    }
+}
+
+
+
+struct BayerCase
+{
+    RawFrame*    frame;
+    CvRect       window;
+    IplImage*    output;
+    IplImage*    scratch;
+    FrameResizer resizer;
+};
+
+static void kernel_bayerDemosaic(void* cookie)
+{
+    BayerCase* c = (BayerCase*)cookie;
+    bayerDemosaic_convert(c->frame->data, c->frame->strides[0], c->frame->width, c->frame->height,
+                          1, BAYERDEMOSAIC_RGGB, c->window, c->output, c->scratch,
+                          &c->resizer, FRAMERESIZE_CUBIC, threads);
+}
+
+struct DC1394BayerCase
+{
+    RawFrame*            frame;
+    unsigned char*       output;
+    dc1394bayer_method_t method;
+};
+
+// what the IIDC cameras would use without my demosaicing, for comparison
+static void kernel_dc1394Bayer(void* cookie)
+{
+    DC1394BayerCase* c = (DC1394BayerCase*)cookie;
+    dc1394_bayer_decoding_8bit(c->frame->data, c->output, c->frame->width, c->frame->height,
+                               DC1394_COLOR_FILTER_RGGB, c->method);
+}
+
+static void bench_bayer(int width, int height)
+{
+    RawFrame frame;
+    if(!rawFrame_alloc(&frame, AV_PIX_FMT_BAYER_RGGB8, width, height))
+    {
+        cerr << "couldn't set up a Bayer frame" << endl;
+        return;
+    }
+
+    static const struct { const char* name; bool color; int divisor; } variants[] =
+        { { "bilinear_rgb24", true,  1 },
+          { "bilinear_gray8", false, 1 },
+          { "binned_rgb24",   true,  2 },
+          { "binned_gray8",   false, 2 } };
+
+    for(unsigned int i=0; i<sizeof(variants)/sizeof(variants[0]); i++)
+    {
+        if(!wanted("bayerDemosaic", variants[i].name))
+            continue;
+
+        BayerCase c;
+        c.frame   = &frame;
+        c.window  = cvRect(0, 0, width, height);
+        c.scratch = NULL;
+        c.output  = cvCreateImage(cvSize(width / variants[i].divisor, height / variants[i].divisor),
+                                  IPL_DEPTH_8U, variants[i].color ? 3 : 1);
+        if(c.output == NULL)
+            continue;
+
+        runCase("bayerDemosaic", variants[i].name, width, height, &kernel_bayerDemosaic, &c);
+        cvReleaseImage(&c.output);
+    }
+
+    static const struct { const char* name; dc1394bayer_method_t method; int divisor; } methods[] =
+        { { "bilinear_rgb24",   DC1394_BAYER_METHOD_BILINEAR,   1 },
+          { "downsample_rgb24", DC1394_BAYER_METHOD_DOWNSAMPLE, 2 } };
+
+    for(unsigned int i=0; i<sizeof(methods)/sizeof(methods[0]); i++)
+    {
+        if(!wanted("dc1394_bayer", methods[i].name))
+            continue;
+
+        // the output is written at the full size even when downsampling
+        DC1394BayerCase c;
+        c.frame  = &frame;
+        c.method = methods[i].method;
+        c.output = (unsigned char*)malloc((size_t)width * height * 3);
+        if(c.output == NULL)
+            continue;
+
+        runCase("dc1394_bayer", methods[i].name, width, height, &kernel_dc1394Bayer, &c);
+        ::free(c.output);
+    }
+
+    rawFrame_free(&frame);
+}
+
+
+
+struct DC1394Case
+{
+    unsigned char*       src;
+    unsigned char*       dst;
+    int                  width, height;
+    dc1394color_coding_t coding;
+    bool                 color;
+};
+
+static void kernel_dc1394(void* cookie)
+{
+    DC1394Case* c = (DC1394Case*)cookie;
+    if(c->color)
+        dc1394_convert_to_RGB8 (c->src, c->dst, c->width, c->height,
+                                DC1394_BYTE_ORDER_UYVY, c->coding, 16);
+    else
+        dc1394_convert_to_MONO8(c->src, c->dst, c->width, c->height,
+                                DC1394_BYTE_ORDER_UYVY, c->coding, 16);
+}
+
+static void bench_dc1394(int width, int height)
+{
+    static const struct { const char* name; dc1394color_coding_t coding; bool toColor, toMono; } codings[] =
+        { { "YUV411", DC1394_COLOR_CODING_YUV411, true, false },
+          { "YUV422", DC1394_COLOR_CODING_YUV422, true, false },
+          { "YUV444", DC1394_COLOR_CODING_YUV444, true, false },
+          { "RGB8",   DC1394_COLOR_CODING_RGB8,   true, false },
+          { "MONO8",  DC1394_COLOR_CODING_MONO8,  true, true  },
+          { "MONO16", DC1394_COLOR_CODING_MONO16, true, true  } };
+
+    // big enough for any of the codings
+    size_t size = (size_t)width * height * 3;
+
+    DC1394Case c;
+    c.width  = width;
+    c.height = height;
+    c.src    = (unsigned char*)FramePool::allocAligned(size);
+    c.dst    = (unsigned char*)FramePool::allocAligned(size);
+    if(c.src == NULL || c.dst == NULL)
+    {
+        cerr << "couldn't allocate the dc1394 buffers" << endl;
+        if(c.src != NULL) FramePool::freeAligned(c.src, size);
+        if(c.dst != NULL) FramePool::freeAligned(c.dst, size);
+        return;
+    }
+    fillNoise(c.src, size, 3);
+
+    for(unsigned int i=0; i<sizeof(codings)/sizeof(codings[0]); i++)
+        for(int color=0; color<2; color++)
+        {
+            if(color == 0 ? !codings[i].toColor : !codings[i].toMono)
+                continue;
+
+            string variant = string(codings[i].name) + (color == 0 ? "_to_RGB8" : "_to_MONO8");
+            if(!wanted("dc1394_convert", variant))
+                continue;
+
+            c.coding = codings[i].coding;
+            c.color  = color == 0;
+            runCase("dc1394_convert", variant, width, height, &kernel_dc1394, &c);
+        }
+
+    FramePool::freeAligned(c.src, size);
+    FramePool::freeAligned(c.dst, size);
+}
+
+
+
+struct EncoderCase
+{
+    FFmpegEncoder* encoder;
+    IplImage*      frames[2];
+    int            i;
+};
+
+static void kernel_encoder(void* cookie)
+{
+    EncoderCase* c = (EncoderCase*)cookie;
+
+    // I alternate between two frames, so the encoder can't just repeat the last one
+    c->encoder->writeFrame(c->frames[c->i]);
+    c->i ^= 1;
+}
+
+static void bench_encoder(int width, int height)
+{
+    for(int color=0; color<2; color++)
+    {
+        const char* variant = color == 0 ? "rgb24" : "gray8";
+        if(!wanted("ffmpegEncoder", variant))
+            continue;
+
+        char filename[] = "/tmp/visionio-bench-XXXXXX.avi";
+        int  fd         = mkstemps(filename, 4);
+        if(fd < 0)
+        {
+            cerr << "couldn't create a temporary file for the encoder" << endl;
+            return;
+        }
+        close(fd);
+
+        FFmpegEncoder encoder;
+        EncoderCase   c;
+        c.encoder   = &encoder;
+        c.i         = 0;
+        c.frames[0] = noiseImage(width, height, color == 0 ? 3 : 1, 4);
+        c.frames[1] = noiseImage(width, height, color == 0 ? 3 : 1, 5);
+
+        if(c.frames[0] != NULL && c.frames[1] != NULL &&
+           encoder.open(filename, width, height, 30,
+                        color == 0 ? FRAMESOURCE_COLOR : FRAMESOURCE_GRAYSCALE))
+        {
+            runCase("ffmpegEncoder", variant, width, height, &kernel_encoder, &c);
+            encoder.close();
+        }
+        else
+            cerr << "couldn't set up the encoder for " << variant << endl;
+
+        for(int i=0; i<2; i++)
+            if(c.frames[i] != NULL)
+                cvReleaseImage(&c.frames[i]);
+        unlink(filename);
+    }
+}
+
+
+
+static void kernel_widget(void* cookie)
+{
+    CvFltkWidget* widget = (CvFltkWidget*)cookie;
+
+    // the redraw only happens when FLTK gets around to it, so I make it do that now
+    widget->redrawNewFrame();
+    Fl::flush();
+}
+
+static void bench_widget(int width, int height)
+{
+    for(int color=0; color<2; color++)
+    {
+        const char* variant = color == 0 ? "rgb24" : "gray8";
+        if(!wanted("cvFltkWidget", variant))
+            continue;
+
+        if(getenv("DISPLAY") == NULL)
+        {
+            cerr << "no DISPLAY; skipping the widget benchmark" << endl;
+            return;
+        }
+
+        Fl_Window window(width, height);
+        CvFltkWidget widget(0, 0, width, height, color == 0 ? WIDGET_COLOR : WIDGET_GRAYSCALE);
+        window.end();
+        window.show();
+        Fl::check();
+
+        IplImage* image = widget;
+        fillNoise((unsigned char*)image->imageData, image->imageSize, 6);
+
+        runCase("cvFltkWidget", variant, width, height, &kernel_widget, &widget);
+        window.hide();
+        Fl::check();
+    }
+}
+
+
+
+static void writeJSON(FILE* fp)
+{
+    fprintf(fp, "{\n  \"threads\": %d,\n  \"min_time_s\": %g,\n  \"results\": [\n",
+            threads, minTime_s);
+    for(size_t i=0; i<results.size(); i++)
+    {
+        const Bench_Result& r = results[i];
+        fprintf(fp,
+                "    {\"kernel\": \"%s\", \"variant\": \"%s\", \"width\": %d, \"height\": %d, "
+                "\"iterations\": %d, \"min_us\": %.2f, \"median_us\": %.2f, \"mean_us\": %.2f, "
+                "\"mpix_per_s\": %.2f}%s\n",
+                r.kernel.c_str(), r.variant.c_str(), r.width, r.height, r.iterations,
+                r.min_us, r.median_us, r.mean_us,
+                (double)r.width * r.height / r.median_us,
+                i+1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+static void writeCSV(FILE* fp)
+{
+    fprintf(fp, "kernel,variant,width,height,threads,iterations,min_us,median_us,mean_us,mpix_per_s\n");
+    for(size_t i=0; i<results.size(); i++)
+    {
+        const Bench_Result& r = results[i];
+        fprintf(fp, "%s,%s,%d,%d,%d,%d,%.2f,%.2f,%.2f,%.2f\n",
+                r.kernel.c_str(), r.variant.c_str(), r.width, r.height, threads, r.iterations,
+                r.min_us, r.median_us, r.mean_us,
+                (double)r.width * r.height / r.median_us);
+    }
+}
+
+static bool parseSizes(const char* arg, vector<CvSize>* sizes)
+{
+    sizes->clear();
+    while(*arg)
+    {
+        int w, h, n;
+        if(sscanf(arg, "%dx%d%n", &w, &h, &n) != 2 || w < 16 || h < 16)
+            return false;
+        // the chroma subsampling and the Bayer quads want even sizes
+        sizes->push_back(cvSize(w & ~1, h & ~1));
+
+        arg += n;
+        if(*arg == ',')
+            arg++;
+        else if(*arg)
+            return false;
+    }
+    return !sizes->empty();
+}
+
+static void usage(const char* argv0)
+{
+    cerr << "Usage: " << argv0 << " [--format=json|csv] [--output=FILE] [--sizes=WxH,WxH,...]\n"
+         << "       [--filter=SUBSTRING] [--threads=N] [--min-time=SECONDS]" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    string         format = "json";
+    const char*    output = NULL;
+    vector<CvSize> sizes;
+    parseSizes("640x480,1280x720,1920x1080,3840x2160", &sizes);
+
+    for(int i=1; i<argc; i++)
+    {
+        const char* arg = argv[i];
+        if     (strncmp(arg, "--format=",   9) == 0) format    = arg + 9;
+        else if(strncmp(arg, "--output=",   9) == 0) output    = arg + 9;
+        else if(strncmp(arg, "--filter=",   9) == 0) filter    = arg + 9;
+        else if(strncmp(arg, "--threads=", 10) == 0) threads   = atoi(arg + 10);
+        else if(strncmp(arg, "--min-time=",11) == 0) minTime_s = atof(arg + 11);
+        else if(strncmp(arg, "--sizes=",    8) == 0)
+        {
+            if(!parseSizes(arg + 8, &sizes))
+            {
+                cerr << "couldn't parse the sizes '" << arg + 8 << "'" << endl;
+                return 1;
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if((format != "json" && format != "csv") || threads < 1 || minTime_s < 0.0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Fl::visual(FL_RGB);
+
+    for(size_t i=0; i<sizes.size(); i++)
+    {
+        int width  = sizes[i].width;
+        int height = sizes[i].height;
+
+        bench_cropScale(width, height);
+        bench_pixfmts  (width, height);
+        bench_bayer    (width, height);
+        bench_dc1394   (width, height);
+        bench_encoder  (width, height);
+        bench_widget   (width, height);
+    }
+
+    FILE* fp = stdout;
+    if(output != NULL && strcmp(output, "-") != 0)
+    {
+        fp = fopen(output, "w");
+        if(fp == NULL)
+        {
+            cerr << "couldn't open '" << output << "' for writing" << endl;
+            return 1;
+        }
+    }
+
+    if(format == "json") writeJSON(fp);
+    else                 writeCSV (fp);
+
+    if(fp != stdout)
+    {
+        fclose(fp);
+        cerr << "wrote " << results.size() << " results to '" << output << "'" << endl;
+    }
+    return 0;
+}
@@ -1,9 +1,14 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <string.h>
 #include <iostream>
 #include <sstream>
 #include "cameraSource_IIDC.hh"
+#include "workerPool.hh"
+#include "nativeFrame.hh"
+#include "bayerDemosaic.hh"
+#include "frameTrace.hh"
 using namespace std;
 
 // These describe the whole camera bus, not just a single camera. Thus we keep only one copy by
@@ -26,8 +31,7 @@ enum resolution_t { MODE_UNWANTED,
 static resolution_t getResolutionWorth(dc1394video_mode_t mode)
 {
     // I only look at the modes that were defined in libdc1394 as of version 2.1.2-1 of the
-    // libdc1394-22 debian package (~ 2/2010). I explicitly ignore format 7 since I don't want to
-    // bother supporting it until I need it
+    // libdc1394-22 debian package (~ 2/2010). Format 7 is handled by getFormat7Worth()
 
     switch(mode)
     {
@@ -82,6 +86,8 @@ enum colormode_t { COLORMODE_UNWANTED,
                    COLORMODE_YUV411,
                    COLORMODE_YUV422,
                    COLORMODE_YUV444,
+                   COLORMODE_RAW8,   // raw Bayer, which I demosaic myself. Full color resolution
+                                     // at a third of the bandwidth of RGB8
                    COLORMODE_RGB8,
 
                    // if we wanted grayscale output, then it is more desireable still
@@ -91,8 +97,7 @@ enum colormode_t { COLORMODE_UNWANTED,
 static colormode_t getColormodeWorth(dc1394video_mode_t mode, bool wantColor)
 {
     // I only look at the modes that were defined in libdc1394 as of version 2.1.2-1 of the
-    // libdc1394-22 debian package (~ 2/2010). I explicitly ignore format 7 since I don't want to
-    // bother supporting it until I need it
+    // libdc1394-22 debian package (~ 2/2010). Format 7 is handled by getFormat7Worth()
 
     switch(mode)
     {
@@ -136,11 +141,69 @@ static colormode_t getColormodeWorth(dc1394video_mode_t mode, bool wantColor)
     }
 }
 
+// the libav pixel format of the raw Bayer frames with this color filter
+static enum AVPixelFormat raw8Pixfmt(dc1394color_filter_t filter)
+{
+    switch(filter)
+    {
+    case DC1394_COLOR_FILTER_RGGB: return AV_PIX_FMT_BAYER_RGGB8;
+    case DC1394_COLOR_FILTER_GBRG: return AV_PIX_FMT_BAYER_GBRG8;
+    case DC1394_COLOR_FILTER_GRBG: return AV_PIX_FMT_BAYER_GRBG8;
+    case DC1394_COLOR_FILTER_BGGR: return AV_PIX_FMT_BAYER_BGGR8;
+    default:                       return AV_PIX_FMT_NONE;
+    }
+}
+
+// Format 7 (scalable) modes can have any size and color coding, so I have to ask the camera
+// about them. I only use them for raw Bayer (RAW8) data, at the largest size the mode allows. The
+// resolution is ranked as the largest of the fixed resolutions that fits. Returns false if this
+// isn't a usable format 7 mode. A mode with a Bayer pattern I can't demosaic isn't usable
+static bool getFormat7Worth(dc1394camera_t* camera, dc1394video_mode_t mode,
+                            resolution_t* res, colormode_t* colormode)
+{
+    if(!dc1394_is_video_mode_scalable(mode))
+        return false;
+
+    dc1394color_codings_t codings;
+    if(dc1394_format7_get_color_codings(camera, mode, &codings) != DC1394_SUCCESS)
+        return false;
+
+    bool haveRaw8 = false;
+    for(unsigned int i=0; i<codings.num; i++)
+        if(codings.codings[i] == DC1394_COLOR_CODING_RAW8)
+            haveRaw8 = true;
+    if(!haveRaw8)
+        return false;
+
+    dc1394color_filter_t filter;
+    if(dc1394_format7_get_color_filter(camera, mode, &filter) != DC1394_SUCCESS ||
+       raw8Pixfmt(filter) == AV_PIX_FMT_NONE)
+        return false;
+
+    uint32_t w, h;
+    if(dc1394_format7_get_max_image_size(camera, mode, &w, &h) != DC1394_SUCCESS)
+        return false;
+
+    if     (w >= 1600 && h >= 1200) *res = MODE_1600x1200;
+    else if(w >= 1280 && h >= 960 ) *res = MODE_1280x960;
+    else if(w >= 1024 && h >= 768 ) *res = MODE_1024x768;
+    else if(w >= 800  && h >= 600 ) *res = MODE_800x600;
+    else if(w >= 640  && h >= 480 ) *res = MODE_640x480;
+    else if(w >= 320  && h >= 240 ) *res = MODE_320x240;
+    else if(w >= 160  && h >= 120 ) *res = MODE_160x120;
+    else                            return false;
+
+    *colormode = COLORMODE_RAW8;
+    return true;
+}
+
 CameraSource_IIDC::CameraSource_IIDC(FrameSource_UserColorChoice _userColorMode,
                                      bool resetbus, uint64_t guid,
                                      CvRect _cropRect,
                                      double scale)
-    : FrameSource(_userColorMode), inited(false), camera(NULL), cameraFrame(NULL)
+    : FrameSource(_userColorMode), inited(false), camera(NULL), cameraFrame(NULL),
+      cameraColorFilter(DC1394_COLOR_FILTER_RGGB),
+      framePeriod_us(0), lastFrameTimestamp_us(0)
 {
     if(!uninitedCamerasLeft())
     {
@@ -202,8 +265,8 @@ CameraSource_IIDC::CameraSource_IIDC(FrameSource_UserColorChoice _userColorMode,
     // I am now configuring the camera. Right now this is hardcoded to pick the highest available
     // spatial resolution then the best color resolution then the highest framerate
 
-    // Resolution. For simplicity I currently avoid mode 7 (scalable video) since it requires
-    // more configuration. I will add it later when/if I need it
+    // Resolution. Of the mode 7 (scalable video) modes I only use those that give out raw Bayer
+    // data
     dc1394video_modes_t  video_modes;
 
     err = dc1394_video_get_supported_modes(camera, &video_modes);
@@ -214,8 +277,13 @@ CameraSource_IIDC::CameraSource_IIDC(FrameSource_UserColorChoice _userColorMode,
     int bestModeIdx = -1;
     for (unsigned int i=0; i<video_modes.num; i++)
     {
-        resolution_t res = getResolutionWorth(video_modes.modes[i]);
-        colormode_t colormode = getColormodeWorth(video_modes.modes[i], userColorMode==FRAMESOURCE_COLOR);
+        resolution_t res;
+        colormode_t  colormode;
+        if(!getFormat7Worth(camera, video_modes.modes[i], &res, &colormode))
+        {
+            res       = getResolutionWorth(video_modes.modes[i]);
+            colormode = getColormodeWorth(video_modes.modes[i], userColorMode==FRAMESOURCE_COLOR);
+        }
         if(res > bestRes)
         {
             if(colormode != COLORMODE_UNWANTED)
@@ -238,18 +306,23 @@ CameraSource_IIDC::CameraSource_IIDC(FrameSource_UserColorChoice _userColorMode,
         return;
     }
     cameraVideoMode = video_modes.modes[bestModeIdx];
+    bool scalable   = dc1394_is_video_mode_scalable(cameraVideoMode);
 
-    // get the highest framerate
-    dc1394framerates_t framerates;
-    dc1394framerate_t  bestFramerate = DC1394_FRAMERATE_MIN;
-    err = dc1394_video_get_supported_framerates(camera, cameraVideoMode, &framerates);
-    DC1394_ERR(err, "Could not get framerates");
-    for(unsigned int i=0; i<framerates.num; i++)
+    // get the highest framerate. The format 7 modes have none; their framerate follows from the
+    // packet size
+    dc1394framerate_t bestFramerate = DC1394_FRAMERATE_MIN;
+    if(!scalable)
     {
-        // the framerates defined by the dc1394framerate_t enum are sorted from worst to best, so I
-        // just loop through and pick the highest one
-        if(framerates.framerates[i] > bestFramerate)
-            bestFramerate = framerates.framerates[i];
+        dc1394framerates_t framerates;
+        err = dc1394_video_get_supported_framerates(camera, cameraVideoMode, &framerates);
+        DC1394_ERR(err, "Could not get framerates");
+        for(unsigned int i=0; i<framerates.num; i++)
+        {
+            // the framerates defined by the dc1394framerate_t enum are sorted from worst to best,
+            // so I just loop through and pick the highest one
+            if(framerates.framerates[i] > bestFramerate)
+                bestFramerate = framerates.framerates[i];
+        }
     }
 
     // setup capture. Use the 1394-B mode if possible
@@ -270,8 +343,38 @@ CameraSource_IIDC::CameraSource_IIDC(FrameSource_UserColorChoice _userColorMode,
     err = dc1394_video_set_mode(camera, cameraVideoMode);
     DC1394_ERR(err,"Could not set video mode");
 
-    err = dc1394_video_set_framerate(camera, bestFramerate);
-    DC1394_ERR(err,"Could not set framerate");
+    if(scalable)
+    {
+        // I ask for the whole sensor, as raw Bayer, in the largest packets the bus allows. This
+        // gives the highest framerate
+        uint32_t maxWidth, maxHeight;
+        err = dc1394_format7_get_max_image_size(camera, cameraVideoMode, &maxWidth, &maxHeight);
+        DC1394_ERR(err,"Could not get the format7 image size");
+
+        err = dc1394_format7_set_roi(camera, cameraVideoMode, DC1394_COLOR_CODING_RAW8,
+                                     DC1394_USE_MAX_AVAIL, 0, 0, maxWidth, maxHeight);
+        DC1394_ERR(err,"Could not set the format7 region of interest");
+
+        err = dc1394_format7_get_color_filter(camera, cameraVideoMode, &cameraColorFilter);
+        DC1394_ERR(err,"Could not get the Bayer color filter");
+
+        // getFormat7Worth() checked this already, but the camera could report differently now
+        // that the ROI is set
+        if(raw8Pixfmt(cameraColorFilter) == AV_PIX_FMT_NONE)
+        {
+            cerr << "The format7 mode has a Bayer pattern I don't know how to demosaic" << endl;
+            return;
+        }
+    }
+    else
+    {
+        err = dc1394_video_set_framerate(camera, bestFramerate);
+        DC1394_ERR(err,"Could not set framerate");
+
+        float fps;
+        if(dc1394_framerate_as_float(bestFramerate, &fps) == DC1394_SUCCESS && fps > 0.0f)
+            framePeriod_us = (uint64_t)(1e6 / fps + 0.5);
+    }
 
     // Using 5 frame buffers. This should work for many applications
     err = dc1394_capture_setup(camera, 5, DC1394_CAPTURE_FLAGS_DEFAULT);
@@ -306,9 +409,14 @@ CameraSource_IIDC::CameraSource_IIDC(FrameSource_UserColorChoice _userColorMode,
 
     descriptionStream << "Resolution: " << width << ' ' << height << std::endl;
 
-    float framerate;
-    dc1394_framerate_as_float(bestFramerate, &framerate);
-    descriptionStream << "Framerate: " << framerate << " frames per second" << std::endl;
+    if(scalable)
+        descriptionStream << "Framerate: set by the format7 packet size" << std::endl;
+    else
+    {
+        float framerate;
+        dc1394_framerate_as_float(bestFramerate, &framerate);
+        descriptionStream << "Framerate: " << framerate << " frames per second" << std::endl;
+    }
 
     descriptionStream << "Color coding: ";
     dc1394_get_color_coding_from_video_mode(camera, cameraVideoMode, &cameraColorCoding);
@@ -338,7 +446,14 @@ CameraSource_IIDC::CameraSource_IIDC(FrameSource_UserColorChoice _userColorMode,
     inited = true;
     numInitedCameras++;
 
-    setupCroppingScaling(_cropRect, scale);
+    // dc1394_convert_...() can't handle padded rows, so I ask for packed ones
+    setupCroppingScaling(_cropRect, scale, true);
+
+    // Raw Bayer is demosaiced straight into the output frame, cropped. I need the scratch buffer
+    // only if I'm scaling by something other than a half
+    if(cameraColorCoding == DC1394_COLOR_CODING_RAW8 &&
+       !bayerDemosaic_needsScratch(cropWindow(), width, height))
+        dropPreCropScaleBuffer();
 
     isRunningNow.setTrue();
 }
@@ -366,14 +481,36 @@ CameraSource_IIDC::~CameraSource_IIDC(void)
     }
 }
 
-// _getNextFrame() blocks until a frame is available. true is returned on success.
-bool CameraSource_IIDC::_getNextFrame(IplImage* image, uint64_t* timestamp_us)
+// peekFrame() dequeues a frame, leaving it in cameraFrame until unpeekFrame() is called. If
+// !latest, this blocks until a frame is available. If latest, the frame buffer is checked first. If
+// there are no frames in it, we block until a frame is available. If there are frames, the buffer
+// is purged and the next frame is returned. true is returned on success.
+bool CameraSource_IIDC::peekFrame(bool latest, uint64_t* timestamp_us)
 {
+    FRAMETRACE_SPAN("iidc.dequeue");
+
     beginPeek();
 
     dc1394error_t err;
-    err = dc1394_capture_dequeue(camera, DC1394_CAPTURE_POLICY_WAIT, &cameraFrame);
+    if(latest)
+    {
+        // first, poll the buffer. If no frames are available, wait for one
+        err = dc1394_capture_dequeue(camera, DC1394_CAPTURE_POLICY_POLL, &cameraFrame);
+        if( err != DC1394_SUCCESS )
+        {
+            dc1394_log_warning("%s: in %s (%s, line %d): Could not capture a frame\n",
+                               dc1394_error_get_string(err),
+                               __FUNCTION__, __FILE__, __LINE__);
+            return false;
+        }
+
+        // A frame was available. When the buffer fills up, newest incoming frames are thrown
+        // away. Thus, I purge the buffer and get a fresh new frame
+        if(cameraFrame != NULL && !purgeBuffer())
+            return false;
+    }
 
+    err = dc1394_capture_dequeue(camera, DC1394_CAPTURE_POLICY_WAIT, &cameraFrame);
     if( err != DC1394_SUCCESS )
     {
         dc1394_log_warning("%s: in %s (%s, line %d): Could not capture a frame\n",
@@ -382,39 +519,70 @@ bool CameraSource_IIDC::_getNextFrame(IplImage* image, uint64_t* timestamp_us)
         return false;
     }
 
+    noteFrame();
+
+    // libdc1394 timestamps the frames with the wall clock
+    noteCapture(FrameStats::realtimeToMonotonic_us(cameraFrame->timestamp));
+
     finishPeek(timestamp_us);
+    return true;
+}
+
+// _getNextFrame() blocks until a frame is available. true is returned on success.
+bool CameraSource_IIDC::_getNextFrame(IplImage* image, uint64_t* timestamp_us)
+{
+    if(!peekFrame(false, timestamp_us))
+        return false;
     return finishGet(image);
 }
 
-// _getLatestFrame() checks the frame buffer. If there are no frames in it, it blocks until a
-// frame is available. If there are frames, the buffer is purged and the most recent frame is
-// returned. true is returned on success.
+// _getLatestFrame() purges the frame buffer, and returns the next frame. true is returned on
+// success.
 bool CameraSource_IIDC::_getLatestFrame(IplImage* image, uint64_t* timestamp_us)
 {
-    beginPeek();
+    if(!peekFrame(true, timestamp_us))
+        return false;
+    return finishGet(image);
+}
 
-    // first, poll the buffer. If no frames are available, use the plain peekNextFrame() call to
-    // wait for one
-    dc1394error_t err;
-    err = dc1394_capture_dequeue(camera, DC1394_CAPTURE_POLICY_POLL, &cameraFrame);
-    if( err != DC1394_SUCCESS )
-    {
-        dc1394_log_warning("%s: in %s (%s, line %d): Could not capture a frame\n",
-                           dc1394_error_get_string(err),
-                           __FUNCTION__, __FILE__, __LINE__);
+bool CameraSource_IIDC::_borrowFrame(IplImage* header, bool latest, uint64_t* timestamp_us)
+{
+    // I can lend out the DMA buffer only if the camera is already giving me the pixel format the
+    // user wants, and if all I need to do is to crop it. Otherwise I convert into a separate buffer
+    dc1394color_coding_t wantedColorCoding = userColorMode == FRAMESOURCE_COLOR ?
+        DC1394_COLOR_CODING_RGB8 : DC1394_COLOR_CODING_MONO8;
+    if(cameraColorCoding != wantedColorCoding || !isCropOnly())
+        return borrowIntoBuffer(header, latest, timestamp_us);
+
+    if(!peekFrame(latest, timestamp_us))
         return false;
-    }
-    if(cameraFrame == NULL)
-        return _getNextFrame(image, timestamp_us);
 
+    // the frame stays dequeued until _returnFrame()
+    initBorrowedHeader(header, cameraFrame->image, cameraFrame->stride);
+    return true;
+}
+
+void CameraSource_IIDC::_returnFrame(void)
+{
+    unpeekFrame();
+}
 
-    // A frame was available. When the buffer fills up, newest incoming frames are thrown
-    // away. Thus, I purge the buffer and get a fresh new frame
-    if(!purgeBuffer())
-        return NULL;
+// Updates the stats with the frame in cameraFrame. frames_behind tells me how many more frames
+// the DMA ring is holding. When the ring fills up, the newest frames are thrown away. I see those
+// as gaps in the timestamps
+void CameraSource_IIDC::noteFrame(void)
+{
+    stats.setBacklog(cameraFrame->frames_behind);
 
-    // flushed the queue now, so grab the next frame
-    return _getNextFrame(image, timestamp_us);
+    if(framePeriod_us != 0 && lastFrameTimestamp_us != 0 &&
+       cameraFrame->timestamp > lastFrameTimestamp_us)
+    {
+        uint64_t periods = (cameraFrame->timestamp - lastFrameTimestamp_us + framePeriod_us/2) /
+            framePeriod_us;
+        if(periods > 1)
+            stats.addDropped(periods - 1);
+    }
+    lastFrameTimestamp_us = cameraFrame->timestamp;
 }
 
 bool CameraSource_IIDC::purgeBuffer(void)
@@ -425,6 +593,9 @@ bool CameraSource_IIDC::purgeBuffer(void)
         // If I have a dequeued frame, give it back to the OS.
         if(cameraFrame != NULL)
         {
+            noteFrame();
+            stats.addFlushed();
+
             err = dc1394_capture_enqueue(camera, cameraFrame);
             if( err != DC1394_SUCCESS )
             {
@@ -467,8 +638,127 @@ unsigned char* CameraSource_IIDC::finishPeek(uint64_t* timestamp_us)
     return cameraFrame->image;
 }
 
+// The dc1394 conversions work on each row independently, so I can split them into bands of
+// rows, and convert those in parallel
+struct IIDC_convertJob
+{
+    unsigned char*       src;
+    int                  width, height, stride;
+    dc1394color_coding_t colorCoding;
+    uint32_t             byteOrder;
+
+    unsigned char*       dst;
+    bool                 color;
+    bool                 failed;
+};
+
+static void convertBand(void* cookie, int band, int numBands)
+{
+    IIDC_convertJob* job = (IIDC_convertJob*)cookie;
+
+    int y0, y1;
+    WorkerPool::bandRows(band, numBands, job->height, 1, &y0, &y1);
+    if(y1 <= y0)
+        return;
+
+    // the output rows are packed
+    int            channels = job->color ? 3 : 1;
+    unsigned char* src      = job->src + y0 * job->stride;
+    unsigned char* dst      = job->dst + y0 * job->width * channels;
+
+    dc1394error_t err;
+    if(job->color)
+        err = dc1394_convert_to_RGB8(src, dst,
+                                     job->width, y1 - y0,
+                                     job->byteOrder,
+                                     job->colorCoding,
+                                     0 // supposedly useful for 16-bit formats only, so I don't care
+                                     );
+    else
+        err = dc1394_convert_to_MONO8(src, dst,
+                                      job->width, y1 - y0,
+                                      job->byteOrder,
+                                      job->colorCoding,
+                                      0 // supposedly useful for 16-bit formats only, so I don't care
+                                      );
+
+    if(err != DC1394_SUCCESS)
+        job->failed = true;
+}
+
+// Converts a native IIDC frame. The color coding and the byte order are the frame's format and
+// formatDetail
+static bool convertNative(const NativeFrame* frame, IplImage* fullFrame,
+                          FrameSource_UserColorChoice mode, int maxThreads)
+{
+    IIDC_convertJob job;
+    job.src         = (unsigned char*)frame->getData();
+    job.width       = frame->getWidth();
+    job.height      = frame->getHeight();
+    job.stride      = frame->getStride();
+    job.colorCoding = (dc1394color_coding_t)frame->getFormat();
+    job.byteOrder   = frame->getFormatDetail();
+    job.dst         = (unsigned char*)fullFrame->imageData;
+    job.color       = mode == FRAMESOURCE_COLOR;
+    job.failed      = false;
+
+    // dc1394 doesn't convert color to grayscale. The NativeFrame derives that from the color
+    // frame instead
+    if(!job.color &&
+       job.colorCoding != DC1394_COLOR_CODING_MONO8 &&
+       job.colorCoding != DC1394_COLOR_CODING_MONO16)
+        return false;
+
+    WorkerPool::shared()->run(&convertBand, &job, maxThreads, maxThreads);
+    return !job.failed;
+}
+
+bool CameraSource_IIDC::_getNativeFrame(NativeFrame* frame, bool latest, uint64_t* timestamp_us)
+{
+    if(!peekFrame(latest, timestamp_us))
+        return false;
+
+    // The 8-bit mono, RGB and raw Bayer codings are libav pixel formats as they are. The others
+    // only dc1394 understands
+    int    w   = cameraFrame->size[0];
+    int    h   = cameraFrame->size[1];
+    size_t len = cameraFrame->image_bytes;
+    unsigned char* native;
+    if(cameraFrame->color_coding == DC1394_COLOR_CODING_MONO8)
+        native = frame->setPixels(AV_PIX_FMT_GRAY8, w, h, cameraFrame->stride, len);
+    else if(cameraFrame->color_coding == DC1394_COLOR_CODING_RGB8)
+        native = frame->setPixels(AV_PIX_FMT_RGB24, w, h, cameraFrame->stride, len);
+    else if(cameraFrame->color_coding == DC1394_COLOR_CODING_RAW8)
+    {
+        // dc1394 can't convert raw Bayer, so an unknown pattern can't go to convertNative()
+        native = NULL;
+        if(raw8Pixfmt(cameraColorFilter) != AV_PIX_FMT_NONE)
+            native = frame->setPixels(raw8Pixfmt(cameraColorFilter), w, h, cameraFrame->stride, len);
+        else
+            cerr << "unknown Bayer pattern. Can't describe the native frame" << endl;
+    }
+    else
+        native = frame->setCustom(&convertNative,
+                                  cameraFrame->color_coding, cameraFrame->yuv_byte_order,
+                                  w, h, cameraFrame->stride, len);
+
+    // the DMA buffer goes right back to the ring
+    if(native != NULL)
+    {
+        memcpy(native, cameraFrame->image, len);
+        setNativeGeometry(frame);
+    }
+    unpeekFrame();
+
+    return native != NULL;
+}
+
 bool CameraSource_IIDC::finishGet(IplImage* image)
 {
+    FRAMETRACE_SPAN("iidc.convert");
+
+    FrameStats_Timer timer(&stats);
+
     // These convert the data to my desired colorspace from the raw format of the camera. These
     // functions have a few drawbacks:
     //
@@ -479,7 +769,8 @@ bool CameraSource_IIDC::finishGet(IplImage* image)
     //    but it didn't support all the color modes I needed for IIDC cameras.
     // 2. These function assume a default stride in both the input and output data. This is likely
     //    OK for the input, since the cameras will not output anything weird, but the image we're
-    //    writing into may have unusual padding. For now, I assert that this is not the case.
+    //    writing into may have unusual padding. For now, I assert that this is not the case. The
+    //    frames from my own pool have packed rows for this reason.
     //
     // To address these shortcomings I wanted to use the ffmpeg scaler (sws_scale) to perform these
     // conversions instead. That works great EXCEPT, a packed YUV411 mode is not currently supported
@@ -487,41 +778,56 @@ bool CameraSource_IIDC::finishGet(IplImage* image)
     // implementation of these conversions, so it can be accessed from the version control. I will
     // add that mode to sws_scale if the above shortcomings prove overly-problematic
 
+    // Raw Bayer I demosaic myself, cropping and scaling as I go. Unlike the dc1394 conversions,
+    // this can produce grayscale too
+    BayerDemosaic_Pattern pattern;
+    int                   bytesPerSample;
+    if(cameraFrame->color_coding == DC1394_COLOR_CODING_RAW8)
+    {
+        // dc1394 can't convert raw Bayer, so there's no falling back to it
+        if(!bayerDemosaic_fromPixfmt(raw8Pixfmt(cameraColorFilter), &pattern, &bytesPerSample))
+        {
+            cerr << "unknown Bayer pattern. Can't convert the frame" << endl;
+            unpeekFrame();
+            return false;
+        }
+
+        bool result = bayerDemosaic_convert(cameraFrame->image, cameraFrame->stride,
+                                            cameraFrame->size[0], cameraFrame->size[1],
+                                            bytesPerSample, pattern, cropWindow(), image,
+                                            preCropScaleBuffer, &resizer, interpolation,
+                                            maxThreads);
+        unpeekFrame();
+        return result;
+    }
+
     IplImage* buffer;
     if(preCropScaleBuffer == NULL) buffer = image;
     else                           buffer = preCropScaleBuffer;
 
-    dc1394error_t err;
+    // these assertions are explained in the long comment above
     if(userColorMode == FRAMESOURCE_COLOR)
-    {
-        // these assertions are explained in the long comment above
         assert(buffer->widthStep == buffer->width * 3);
-
-        err = dc1394_convert_to_RGB8(cameraFrame->image,
-                                     (unsigned char*)buffer->imageData,
-                                     cameraFrame->size[0], cameraFrame->size[1],
-                                     cameraFrame->yuv_byte_order,
-                                     cameraFrame->color_coding,
-                                     0 // supposedly useful for 16-bit formats only, so I don't care
-                                     );
-    }
     else
     {
-        // these assertions are explained in the long comment above
         assert(buffer->widthStep == buffer->width);
         assert(cameraFrame->color_coding == DC1394_COLOR_CODING_MONO8 ||
                cameraFrame->color_coding == DC1394_COLOR_CODING_MONO16);
-
-        err = dc1394_convert_to_MONO8(cameraFrame->image,
-                                      (unsigned char*)buffer->imageData,
-                                      cameraFrame->size[0], cameraFrame->size[1],
-                                      cameraFrame->yuv_byte_order,
-                                      cameraFrame->color_coding,
-                                      0 // supposedly useful for 16-bit formats only, so I don't care
-                                      );
     }
 
-    assert(err == DC1394_SUCCESS);
+    IIDC_convertJob job;
+    job.src         = cameraFrame->image;
+    job.width       = cameraFrame->size[0];
+    job.height      = cameraFrame->size[1];
+    job.stride      = cameraFrame->stride;
+    job.colorCoding = cameraFrame->color_coding;
+    job.byteOrder   = cameraFrame->yuv_byte_order;
+    job.dst         = (unsigned char*)buffer->imageData;
+    job.color       = userColorMode == FRAMESOURCE_COLOR;
+    job.failed      = false;
+    WorkerPool::shared()->run(&convertBand, &job, maxThreads, maxThreads);
+
+    assert(!job.failed);
 
     if(preCropScaleBuffer != NULL)
     {
@@ -536,6 +842,8 @@ bool CameraSource_IIDC::finishGet(IplImage* image)
 
 void CameraSource_IIDC::unpeekFrame(void)
 {
+    FRAMETRACE_SPAN("iidc.requeue");
+
     if(cameraFrame == NULL)
         return;
 
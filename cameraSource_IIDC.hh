@@ -12,9 +12,15 @@ class CameraSource_IIDC : public FrameSource
     dc1394video_frame_t* cameraFrame;
     dc1394video_mode_t   cameraVideoMode;
     dc1394color_coding_t cameraColorCoding;
+    dc1394color_filter_t cameraColorFilter; // the Bayer pattern of the RAW8 (format 7) modes
 
     std::string          cameraDescription;
 
+    // used to detect dropped frames: the camera timestamps frames that should be one frame
+    // period apart
+    uint64_t             framePeriod_us;
+    uint64_t             lastFrameTimestamp_us;
+
     // These describe the whole camera bus, not just a single camera. Thus we keep only one copy by
     // declaring them static
     static dc1394_t*            dc1394Context;
@@ -27,10 +33,12 @@ class CameraSource_IIDC : public FrameSource
     // These private versions of the peek() functions contain 99% of the functionality. The public
     // functions perform some checks to make sure it is valid to use these at all.
     void beginPeek(void);
+    bool peekFrame(bool latest, uint64_t* timestamp_us);
 
     void unpeekFrame(void);
 
     bool purgeBuffer(void);
+    void noteFrame(void);
 
 public:
     // The firewire stack may still have resources allocated from previous usage. I have no way to
@@ -51,6 +59,12 @@ public:
 
     const std::string& getDescription(void) { return cameraDescription; }
 
+    // the capture file descriptor. This becomes readable when a frame is waiting in the DMA ring
+    int getFD(void)
+    {
+        return inited ? dc1394_capture_get_fileno(camera) : -1;
+    }
+
     static bool uninitedCamerasLeft(void)
     {
         // if we don't yet have a camera list, say there are cameras left to try to open them
@@ -64,6 +78,12 @@ private:
     bool _getNextFrame  (IplImage* image, uint64_t* timestamp_us = NULL);
     bool _getLatestFrame(IplImage* image, uint64_t* timestamp_us = NULL);
 
+    bool _borrowFrame(IplImage* header, bool latest, uint64_t* timestamp_us);
+    void _returnFrame(void);
+
+    // the native frames are copies of the DMA buffers, in the camera's color coding
+    bool _getNativeFrame(NativeFrame* frame, bool latest, uint64_t* timestamp_us);
+
     bool _stopStream   (void)
     {
         if(DC1394_SUCCESS == dc1394_video_set_transmission(camera, DC1394_OFF))
@@ -75,10 +95,17 @@ private:
     }
     bool _resumeStream (void)
     {
+        // the pause isn't a gap in the frames
+        lastFrameTimestamp_us = 0;
         purgeBuffer();
         return DC1394_SUCCESS == dc1394_video_set_transmission(camera, DC1394_ON);
     }
 
+    bool _flushFrames  (void)
+    {
+        return purgeBuffer();
+    }
+
     // There's no concept of rewinding in a real camera, so restart == resume
     bool _restartStream(void)
     {
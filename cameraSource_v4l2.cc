@@ -19,6 +19,10 @@
 #include <linux/videodev2.h>
 
 #include "cameraSource_v4l2.hh"
+#include "nativeFrame.hh"
+#include "lumaPlane.hh"
+#include "bayerDemosaic.hh"
+#include "frameTrace.hh"
 
 
 
@@ -27,6 +31,7 @@ extern "C"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
 }
 
 // The v4l2 driver is very immature. It has been tested a bit and basically
@@ -54,6 +59,16 @@ static unsigned int getPixfmtCost(uint32_t pixfmt, bool bWantColor)
             V4L2_PIX_FMT_RGB32, /* 32  RGB-8-8-8-8   */
             V4L2_PIX_FMT_BGR24, /* 24  BGR-8-8-8     */
             V4L2_PIX_FMT_RGB24, /* 24  RGB-8-8-8     */
+
+            /* Raw Bayer formats, which I demosaic myself. These have full color resolution
+               at a third of the bandwidth of RGB24, so I prefer them to everything else that
+               needs converting */
+            V4L2_PIX_FMT_SBGGR16, /* 16  BGBG.. GRGR.. */
+            V4L2_PIX_FMT_SBGGR8, /*  8  BGBG.. GRGR.. */
+            V4L2_PIX_FMT_SGBRG8, /*  8  GBGB.. RGRG.. */
+            V4L2_PIX_FMT_SGRBG8, /*  8  GRGR.. BGBG.. */
+            V4L2_PIX_FMT_SRGGB8, /*  8  RGRG.. GBGB.. */
+
             V4L2_PIX_FMT_RGB444, /* 16  xxxxrrrr ggggbbbb */
             V4L2_PIX_FMT_RGB555, /* 16  RGB-5-5-5     */
             V4L2_PIX_FMT_RGB565, /* 16  RGB-5-6-5     */
@@ -92,16 +107,8 @@ static unsigned int getPixfmtCost(uint32_t pixfmt, bool bWantColor)
 
             /* Bayer formats - see http://www.siliconimaging.com/RGB%20Bayer.htm */
             V4L2_PIX_FMT_SGRBG10, /* 10bit raw bayer */
-            /*
-             * 10bit raw bayer, expanded to 16 bits
-             * xxxxrrrrrrrrrrxxxxgggggggggg xxxxggggggggggxxxxbbbbbbbbbb...
-             */
-            V4L2_PIX_FMT_SBGGR16, /* 16  BGBG.. GRGR.. */
             /* 10bit raw bayer DPCM compressed to 8 bits */
             V4L2_PIX_FMT_SGRBG10DPCM8,
-            V4L2_PIX_FMT_SBGGR8, /*  8  BGBG.. GRGR.. */
-            V4L2_PIX_FMT_SGBRG8, /*  8  GBGB.. RGRG.. */
-            V4L2_PIX_FMT_SGRBG8, /*  8  GRGR.. BGBG.. */
 
             /* compressed formats */
             V4L2_PIX_FMT_MJPEG, /* Motion-JPEG   */
@@ -191,6 +198,13 @@ static enum AVPixelFormat pixfmt_V4L2_to_swscale(uint32_t v4l2Pixfmt)
     case V4L2_PIX_FMT_NV16: return AV_PIX_FMT_YUV422P; /* 16  Y/CbCr 4:2:2  */
     case V4L2_PIX_FMT_NV61: return AV_PIX_FMT_NONE;    /* 16  Y/CrCb 4:2:2  */
 
+        /* Bayer formats. I demosaic these myself; libswscale isn't used */
+    case V4L2_PIX_FMT_SBGGR8:  return AV_PIX_FMT_BAYER_BGGR8;    /*  8  BGBG.. GRGR.. */
+    case V4L2_PIX_FMT_SGBRG8:  return AV_PIX_FMT_BAYER_GBRG8;    /*  8  GBGB.. RGRG.. */
+    case V4L2_PIX_FMT_SGRBG8:  return AV_PIX_FMT_BAYER_GRBG8;    /*  8  GRGR.. BGBG.. */
+    case V4L2_PIX_FMT_SRGGB8:  return AV_PIX_FMT_BAYER_RGGB8;    /*  8  RGRG.. GBGB.. */
+    case V4L2_PIX_FMT_SBGGR16: return AV_PIX_FMT_BAYER_BGGR16LE; /* 16  BGBG.. GRGR.. */
+
         /* Grey formats */
     case V4L2_PIX_FMT_Y16:  return AV_PIX_FMT_GRAY16LE;  /* 16  Greyscale     */
     case V4L2_PIX_FMT_GREY: return AV_PIX_FMT_GRAY8;     /*  8  Greyscale     */
@@ -236,6 +250,18 @@ bool CameraSource_V4L2::findDecoder(void)
         }
     }
 
+    // Raw Bayer is demosaiced straight into the output frame, cropped. I need the scratch buffer
+    // only if I'm scaling by something other than a half
+    BayerDemosaic_Pattern pattern;
+    int                   bytesPerSample;
+    if(bayerDemosaic_fromPixfmt(swscalePixfmt, &pattern, &bytesPerSample))
+    {
+        scalePixfmt = swscalePixfmt;
+        if(bayerDemosaic_needsScratch(cropWindow(), width, height)) restorePreCropScaleBuffer();
+        else                                                        dropPreCropScaleBuffer();
+        return true;
+    }
+
     // at this point we should have the scaler pixel format selected, whether it comes from avcodec
     // or not
     if(swscalePixfmt != AV_PIX_FMT_NONE)
@@ -247,18 +273,40 @@ bool CameraSource_V4L2::findDecoder(void)
 
 bool CameraSource_V4L2::setupSwsContext(enum AVPixelFormat swscalePixfmt)
 {
-#warning shouldnt need setupCroppingScaling since Im doing this anyway
-    scaleContext = sws_getContext(pixfmt.width, pixfmt.height, swscalePixfmt,
-                                  pixfmt.width, pixfmt.height,
-                                  userColorMode == FRAMESOURCE_COLOR ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_GRAY8,
-                                  SWS_POINT, NULL, NULL, NULL);
-    if(scaleContext == NULL)
+    enum AVPixelFormat outputPixfmt =
+        userColorMode == FRAMESOURCE_COLOR ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_GRAY8;
+
+    // If I can, I have the scaler look only at the cropping window, and scale it to the output
+    // size directly. Otherwise I convert the full frame, and crop/scale that afterwards. A
+    // scaler split into bands can't scale vertically, so with several threads the scaler crops
+    // only if we're not scaling
+    CvRect window = cropWindow();
+    scaleCrops    = swsCrop_supported(swscalePixfmt, window) &&
+                    (maxThreads <= 1 || isCropOnly());
+
+    bool result;
+    if(scaleCrops)
+        result = scaler.setup(swscalePixfmt, window.width, window.height,
+                              outputPixfmt,  width,        height,
+                              isCropOnly() ? SWS_POINT : swsCrop_flags(interpolation),
+                              maxThreads);
+    else
+        result = scaler.setup(swscalePixfmt, pixfmt.width, pixfmt.height,
+                              outputPixfmt,  pixfmt.width, pixfmt.height,
+                              SWS_POINT, maxThreads);
+    if(!result)
     {
         fprintf(stderr, "libswscale doesn't supported my pixelformat...\n");
         uninit();
         return false;
     }
 
+    scalePixfmt        = swscalePixfmt;
+    scaleInterpolation = interpolation;
+    scaleThreads       = maxThreads;
+    if(scaleCrops) dropPreCropScaleBuffer();
+    else           restorePreCropScaleBuffer();
+
     return true;
 }
 
@@ -305,9 +353,15 @@ CameraSource_V4L2::CameraSource_V4L2(FrameSource_UserColorChoice _userColorMode,
                                      double scale)
     : FrameSource(_userColorMode),
       camera_fd(-1),
+      haveDequeuedBuf(false),
+      lastSequence(0),
+      haveSequence(false),
       buffer(NULL),
       buffer_bytes_allocated(0),
-      scaleContext(NULL),
+      scalePixfmt(AV_PIX_FMT_NONE),
+      scaleCrops(false),
+      scaleInterpolation(FRAMERESIZE_CUBIC),
+      scaleThreads(1),
       codecContext(NULL),
       ffmpegFrame(NULL)
 {
@@ -492,7 +546,7 @@ CameraSource_V4L2::CameraSource_V4L2(FrameSource_UserColorChoice _userColorMode,
         //  * the actual read bytes because some optimized bitstream readers read 32 or 64
         //  * bits at once and could read over the end.
         int bytes_alloc = pixfmt.sizeimage + FF_INPUT_BUFFER_PADDING_SIZE;
-        buffer = new unsigned char[bytes_alloc];
+        buffer = (unsigned char*)FramePool::allocAligned(bytes_alloc);
         if( buffer == NULL)
         {
             fprintf( stderr, "Out of memory\n");
@@ -504,6 +558,12 @@ CameraSource_V4L2::CameraSource_V4L2(FrameSource_UserColorChoice _userColorMode,
 
     av_init_packet(&ffmpegPacket);
 
+    // the scaler is set up for the output geometry, so I need to know it first
+    width  = pixfmt.width;
+    height = pixfmt.height;
+
+    setupCroppingScaling(_cropRect, scale);
+
     if(!findDecoder())
     {
         fprintf(stderr, "no decoder found\n");
@@ -511,10 +571,6 @@ CameraSource_V4L2::CameraSource_V4L2(FrameSource_UserColorChoice _userColorMode,
         return;
     }
 
-    width  = pixfmt.width;
-    height = pixfmt.height;
-
-    setupCroppingScaling(_cropRect, scale);
     isRunningNow.setTrue();
 }
 
@@ -523,8 +579,9 @@ void CameraSource_V4L2::uninit(void)
     #warning uninit all the extra crap
     if(buffer)
     {
-        delete[] buffer;
-        buffer = NULL;
+        FramePool::freeAligned(buffer, buffer_bytes_allocated);
+        buffer                 = NULL;
+        buffer_bytes_allocated = 0;
     }
 
     for(unsigned int i=0; i<sizeof(mmapped)/sizeof(mmapped[0]);i++)
@@ -541,11 +598,7 @@ void CameraSource_V4L2::uninit(void)
         camera_fd = -1;
     }
 
-    if(scaleContext)
-    {
-        sws_freeContext(scaleContext);
-        scaleContext = NULL;
-    }
+    scaler.free();
 
     if(ffmpegFrame)
     {
@@ -566,130 +619,238 @@ CameraSource_V4L2::~CameraSource_V4L2()
     uninit();
 }
 
-bool CameraSource_V4L2::_getNextFrame(IplImage* image, uint64_t* timestamp_us)
+bool CameraSource_V4L2::dequeueFrame(unsigned char** data, int* len, uint64_t* timestamp_us)
 {
-    bool result = false;
-    int len;
-    unsigned char** scaleSource;
-    int             pixfmt_bytesperline;
-    int*            scaleStride;
-
-    struct v4l2_buffer v4l2_buf = {};
-
-    unsigned char* buffer_here;
+    FRAMETRACE_SPAN("v4l2.dequeue");
 
     if( !streaming )
     {
-        len = pixfmt.sizeimage;
+        *len = pixfmt.sizeimage;
 
-        if( read( camera_fd, buffer, len) < 0 )
+        if( read( camera_fd, buffer, *len) < 0 )
         {
             perror ("camera read");
-            goto done;
+            return false;
         }
 
-        buffer_here = buffer;
+        *data = buffer;
         if(timestamp_us != NULL)
             *timestamp_us = 0;
+        return true;
     }
-    else
+
+    memset(&dequeued_buf, 0, sizeof(dequeued_buf));
+    dequeued_buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    dequeued_buf.memory = V4L2_MEMORY_MMAP;
+    if(ioctl_persistent(camera_fd, VIDIOC_DQBUF, &dequeued_buf) < 0)
     {
-        v4l2_buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        v4l2_buf.memory = V4L2_MEMORY_MMAP;
-        if(ioctl_persistent(camera_fd, VIDIOC_DQBUF, &v4l2_buf) < 0)
-        {
-            perror("Error VIDIOC_DQBUF");
-            goto done;
-        }
+        perror("Error VIDIOC_DQBUF");
+        return false;
+    }
+    haveDequeuedBuf = true;
+    noteSequence(dequeued_buf.sequence);
 
-        buffer_here = (unsigned char*)mmapped[v4l2_buf.index];
-        len         = v4l2_buf.bytesused;
+    *data = (unsigned char*)mmapped[dequeued_buf.index];
+    *len  = dequeued_buf.bytesused;
 
-        int     s  = v4l2_buf.timestamp.tv_sec;
-        int     us = v4l2_buf.timestamp.tv_usec;
-        if(timestamp_us != NULL)
-            *timestamp_us = (uint64_t)s*1000000UL + (uint64_t)us;
-
-        // fps detector:
-        // static int iframe = 0;
-        // static int64_t tprev = 0;
-        // if(++iframe == 10)
-        // {
-        //     int     s  = v4l2_buf.timestamp.tv_sec;
-        //     int     us = v4l2_buf.timestamp.tv_usec;
-        //     int64_t t  = s*1000000L + us;
-        //     if(tprev != 0)
-        //         printf("fps: %f seconds\n",
-        //                1.0 / ((double)(t - tprev)/1e7));
-        //     tprev = t;
-        //     iframe = 0;
-        // }
+    int     s  = dequeued_buf.timestamp.tv_sec;
+    int     us = dequeued_buf.timestamp.tv_usec;
+    if(timestamp_us != NULL)
+        *timestamp_us = (uint64_t)s*1000000UL + (uint64_t)us;
+
+    noteCapture(captureTime_us());
+
+    // fps detector:
+    // static int iframe = 0;
+    // static int64_t tprev = 0;
+    // if(++iframe == 10)
+    // {
+    //     int     s  = dequeued_buf.timestamp.tv_sec;
+    //     int     us = dequeued_buf.timestamp.tv_usec;
+    //     int64_t t  = s*1000000L + us;
+    //     if(tprev != 0)
+    //         printf("fps: %f seconds\n",
+    //                1.0 / ((double)(t - tprev)/1e7));
+    //     tprev = t;
+    //     iframe = 0;
+    // }
+
+    return true;
+}
+
+// The capture time of the dequeued frame on CLOCK_MONOTONIC, or 0 if unknown. Current drivers
+// timestamp with the monotonic clock, and say so in the flags. Older ones don't say, and use
+// gettimeofday()
+uint64_t CameraSource_V4L2::captureTime_us(void)
+{
+    uint64_t t = (uint64_t)dequeued_buf.timestamp.tv_sec*1000000ULL +
+        (uint64_t)dequeued_buf.timestamp.tv_usec;
+    if(t == 0)
+        return 0;
 
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MASK
+    switch(dequeued_buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK)
+    {
+    case V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC: return t;
+    case V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN:   break;
+
+    // copied from somewhere else (an output device). I can't tell when this was captured
+    default:                                return 0;
     }
+#endif
 
+    return FrameStats::realtimeToMonotonic_us(t);
+}
 
-    IplImage* cvbuffer;
-    if(preCropScaleBuffer == NULL) cvbuffer = image;
-    else                           cvbuffer = preCropScaleBuffer;
+// gives the buffer we got from dequeueFrame() back to the driver. Does nothing if we're not
+// streaming
+bool CameraSource_V4L2::requeueFrame(void)
+{
+    FRAMETRACE_SPAN("v4l2.requeue");
 
-    scaleSource         = &buffer_here;
-    pixfmt_bytesperline = pixfmt.bytesperline; // needed to match the pointer type
-    scaleStride         = &pixfmt_bytesperline;
+    if(!haveDequeuedBuf)
+        return true;
+
+    haveDequeuedBuf = false;
+    if(ioctl_persistent(camera_fd, VIDIOC_QBUF, &dequeued_buf) < 0)
+    {
+        perror("Error VIDIOC_QBUF");
+        return false;
+    }
+    return true;
+}
+
+bool CameraSource_V4L2::convertFrame(unsigned char* data, int len, IplImage* image)
+{
+    FRAMETRACE_SPAN("v4l2.convert");
+    FrameStats_Timer timer(&stats);
+
+    uint8_t* scaleSource[4];
+    int      scaleStride[4];
 
     if(codecContext)
     {
         int frameFinished;
 
-        ffmpegPacket.data = buffer_here;
+        ffmpegPacket.data = data;
         ffmpegPacket.size = len;
         int decodeResult  = avcodec_decode_video2(codecContext, ffmpegFrame, &frameFinished,
                                                  &ffmpegPacket);
         if(decodeResult < 0 || frameFinished == 0)
         {
             fprintf(stderr, "error decoding ffmpeg frame\n");
-            goto done;
+            return false;
         }
 
-        scaleSource = ffmpegFrame->data;
-        scaleStride = ffmpegFrame->linesize;
-
-        if(scaleContext == NULL)
+        if(!scaler.isSetup())
             // set up the scaler to transform FROM the decoded result
             if(!setupSwsContext(codecContext->pix_fmt))
-                goto done;
+                return false;
+
+        for(int i=0; i<4; i++)
+        {
+            scaleSource[i] = ffmpegFrame->data[i];
+            scaleStride[i] = ffmpegFrame->linesize[i];
+        }
+    }
+    else
+    {
+        BayerDemosaic_Pattern pattern;
+        int                   bytesPerSample;
+        if(bayerDemosaic_fromPixfmt(scalePixfmt, &pattern, &bytesPerSample))
+        {
+            if(len < (int)(pixfmt.bytesperline * pixfmt.height))
+            {
+                fprintf(stderr, "v4l2 bayer frame too short: got %d bytes\n", len);
+                return false;
+            }
+            return bayerDemosaic_convert(data, pixfmt.bytesperline, pixfmt.width, pixfmt.height,
+                                         bytesPerSample, pattern, cropWindow(), image,
+                                         preCropScaleBuffer, &resizer, interpolation, maxThreads);
+        }
+
+        // The raw buffer could have multiple planes, one after another. The driver tells me the
+        // stride of the first plane
+        if(!swsCrop_findPlanes(scalePixfmt, pixfmt.width, pixfmt.height, pixfmt.bytesperline,
+                               data, scaleSource, scaleStride))
+        {
+            fprintf(stderr, "couldn't find the planes in the v4l2 buffer\n");
+            return false;
+        }
     }
 
+    // In grayscale, the luma of most YUV frames is the output already
+    if(userColorMode == FRAMESOURCE_GRAYSCALE &&
+       lumaPlane_convert(scalePixfmt, scaleSource, scaleStride, cropWindow(), image,
+                         &resizer, interpolation, maxThreads))
+        return true;
 
-    if(scaleContext)
+    // the user may have asked for a different interpolation or thread count
+    if(scaler.isSetup() &&
+       (scaleInterpolation != interpolation || scaleThreads != maxThreads))
     {
-        sws_scale(scaleContext,
-                  scaleSource, scaleStride, 0, pixfmt.height,
-                  (unsigned char**)&cvbuffer->imageData, &cvbuffer->widthStep);
+        scaler.free();
+        if(!setupSwsContext(scalePixfmt))
+            return false;
     }
 
+    if(!scaler.isSetup())
+        return false;
+
+    if(scaleCrops)
+    {
+        CvRect   window = cropWindow();
+        uint8_t* planes[4];
+        swsCrop_planes(scalePixfmt, window, scaleSource, scaleStride, planes);
+
+        scaler.scale(planes, scaleStride,
+                     (unsigned char*)image->imageData, image->widthStep);
+        return true;
+    }
+
+    IplImage* cvbuffer;
+    if(preCropScaleBuffer == NULL) cvbuffer = image;
+    else                           cvbuffer = preCropScaleBuffer;
+
+    scaler.scale(scaleSource, scaleStride,
+                 (unsigned char*)cvbuffer->imageData, cvbuffer->widthStep);
+
     if(preCropScaleBuffer != NULL)
         applyCroppingScaling(preCropScaleBuffer, image);
 
-    result = true;
+    return true;
+}
 
+bool CameraSource_V4L2::_getNextFrame(IplImage* image, uint64_t* timestamp_us)
+{
+    unsigned char* data;
+    int            len;
 
- done:
+    if(!dequeueFrame(&data, &len, timestamp_us))
+        return false;
 
-    if(streaming && ioctl_persistent(camera_fd, VIDIOC_QBUF, &v4l2_buf) < 0)
-    {
-        perror("Error VIDIOC_QBUF");
+    bool result = convertFrame(data, len, image);
+
+    if(!requeueFrame())
         return false;
-    }
     return result;
 }
 
-bool CameraSource_V4L2::_getLatestFrame(IplImage* image, uint64_t* timestamp_us)
+// The driver numbers the frames it captures. Any gaps in the sequence are frames it had to drop,
+// because it had no buffers to put them into
+void CameraSource_V4L2::noteSequence(uint32_t sequence)
 {
-    // logic I want:
-    //
-    // if(have frames) { flush(); }
-    // _getNextFrame()
+    if(haveSequence && sequence - lastSequence > 1)
+        stats.addDropped(sequence - lastSequence - 1);
+
+    lastSequence = sequence;
+    haveSequence = true;
+}
 
+// throws away all the frames that are already available, without blocking
+bool CameraSource_V4L2::flushQueuedFrames(void)
+{
+    FRAMETRACE_SPAN("v4l2.flush");
 
     while(1)
     {
@@ -703,9 +864,9 @@ bool CameraSource_V4L2::_getLatestFrame(IplImage* image, uint64_t* timestamp_us)
             return false;
         }
 
-        // if no data is available, get the next frame that comes in
+        // if no data is available, we're done
         if( num_have_data == 0 )
-            return _getNextFrame(image, timestamp_us);
+            return true;
 
         // There are frames to read, so I flush the queues
         if( !streaming )
@@ -730,11 +891,86 @@ bool CameraSource_V4L2::_getLatestFrame(IplImage* image, uint64_t* timestamp_us)
                 perror("Error flushing a buffer");
                 return false;
             }
+            noteSequence(v4l2_buf.sequence);
         }
+
+        stats.addFlushed();
     }
+}
+
+bool CameraSource_V4L2::_getLatestFrame(IplImage* image, uint64_t* timestamp_us)
+{
+    // logic I want:
+    //
+    // if(have frames) { flush(); }
+    // _getNextFrame()
+    if(!flushQueuedFrames())
+        return false;
+
     return _getNextFrame(image, timestamp_us);
 }
 
+bool CameraSource_V4L2::_borrowFrame(IplImage* header, bool latest, uint64_t* timestamp_us)
+{
+    // I can lend out the raw buffer only if the camera is already giving me the pixel format the
+    // user wants, and if all I need to do is to crop it. Otherwise I convert into a separate buffer.
+    // In grayscale, the luma plane of a planar YUV frame is what the user wants
+    uint32_t wantedPixfmt = userColorMode == FRAMESOURCE_COLOR ? V4L2_PIX_FMT_RGB24 : V4L2_PIX_FMT_GREY;
+    bool     haveWanted   = pixfmt.pixelformat == wantedPixfmt ||
+        (userColorMode == FRAMESOURCE_GRAYSCALE &&
+         lumaPlane_layout(pixfmt_V4L2_to_swscale(pixfmt.pixelformat)) == LUMAPLANE_PLANAR);
+    if(codecContext != NULL || !haveWanted || !isCropOnly())
+        return borrowIntoBuffer(header, latest, timestamp_us);
+
+    if(latest && !flushQueuedFrames())
+        return false;
+
+    unsigned char* data;
+    int            len;
+    if(!dequeueFrame(&data, &len, timestamp_us))
+        return false;
+
+    // the buffer stays dequeued until _returnFrame()
+    initBorrowedHeader(header, data, pixfmt.bytesperline);
+    return true;
+}
+
+void CameraSource_V4L2::_returnFrame(void)
+{
+    requeueFrame();
+}
+
+bool CameraSource_V4L2::_getNativeFrame(NativeFrame* frame, bool latest, uint64_t* timestamp_us)
+{
+    bool               isJPEG        = pixfmt.pixelformat == V4L2_PIX_FMT_JPEG;
+    enum AVPixelFormat swscalePixfmt = pixfmt_V4L2_to_swscale(pixfmt.pixelformat);
+    if(!isJPEG && swscalePixfmt == AV_PIX_FMT_NONE)
+        return getNativeAsConverted(frame, latest, timestamp_us);
+
+    if(latest && !flushQueuedFrames())
+        return false;
+
+    unsigned char* data;
+    int            len;
+    if(!dequeueFrame(&data, &len, timestamp_us))
+        return false;
+
+    // The driver needs its buffer back, so I copy the frame out. This is much cheaper than
+    // converting it
+    unsigned char* native = isJPEG ?
+        frame->setMJPEG (pixfmt.width, pixfmt.height, len) :
+        frame->setPixels(swscalePixfmt, pixfmt.width, pixfmt.height, pixfmt.bytesperline, len);
+    if(native != NULL)
+    {
+        memcpy(native, data, len);
+        setNativeGeometry(frame);
+    }
+
+    if(!requeueFrame())
+        return false;
+    return native != NULL;
+}
+
 
 static bool startstop(int fd, bool start)
 {
@@ -756,5 +992,7 @@ bool CameraSource_V4L2::_stopStream(void)
 
 bool CameraSource_V4L2::_resumeStream(void)
 {
+    // the driver restarts the sequence numbers
+    haveSequence = false;
     return startstop(camera_fd, true);
 }
@@ -16,6 +16,8 @@ extern "C"
 #include <libavcodec/avcodec.h>
 }
 
+#include "swsCrop.hh"
+
 
 struct v4l2_settings
 {
@@ -36,10 +38,22 @@ class CameraSource_V4L2 : public FrameSource
     void* mmapped[NUM_STREAMING_BUFFERS_REQUESTED];
     int buf_length[NUM_STREAMING_BUFFERS_REQUESTED];
 
+    // the buffer currently dequeued from the driver. Valid if haveDequeuedBuf
+    struct v4l2_buffer dequeued_buf;
+    bool               haveDequeuedBuf;
+
+    // the sequence number of the last frame we saw. Used to detect dropped frames
+    uint32_t           lastSequence;
+    bool               haveSequence;
+
     unsigned char* buffer;
     int            buffer_bytes_allocated;
 
-    SwsContext*     scaleContext;
+    SwsCrop_Scaler            scaler;
+    enum AVPixelFormat        scalePixfmt;
+    bool                      scaleCrops; // the scaler does the cropping and scaling itself
+    FrameResize_Interpolation scaleInterpolation;
+    int                       scaleThreads;
 
     AVCodecContext* codecContext;
     AVFrame*        ffmpegFrame;
@@ -65,14 +79,28 @@ private:
     bool setupSwsContext(enum AVPixelFormat swscalePixfmt);
     bool findDecoder(void);
 
+    bool dequeueFrame(unsigned char** data, int* len, uint64_t* timestamp_us);
+    bool requeueFrame(void);
+    bool convertFrame(unsigned char* data, int len, IplImage* image);
+    bool flushQueuedFrames(void);
+    void noteSequence(uint32_t sequence);
+    uint64_t captureTime_us(void);
+
     // These functions implement the FrameSource virtuals, and are the main differentiators between
     // the various frame sources, along with the constructor and destructor
 private:
     bool _getNextFrame  (IplImage* image, uint64_t* timestamp_us = NULL);
     bool _getLatestFrame(IplImage* image, uint64_t* timestamp_us = NULL);
 
+    bool _borrowFrame(IplImage* header, bool latest, uint64_t* timestamp_us);
+    void _returnFrame(void);
+
+    // the native frames are copies of the driver's buffers, raw or MJPEG
+    bool _getNativeFrame(NativeFrame* frame, bool latest, uint64_t* timestamp_us);
+
     bool _stopStream   (void);
     bool _resumeStream (void);
+    bool _flushFrames  (void) { return flushQueuedFrames(); }
 
     // There's no concept of rewinding in a real camera, so restart == resume
     bool _restartStream(void)
@@ -9,6 +9,8 @@
 
 #include <string.h>
 
+#include "frameTrace.hh"
+
 // this class is designed for simple visualization of data passed into the class from the
 // outside. Examples of data sources are cameras, video files, still images, processed data, etc.
 
@@ -110,6 +112,7 @@ public:
     void draw()
     {
         // this is the FLTK draw-me-now callback
+        FRAMETRACE_SPAN("cvFltkWidget.draw");
         flImage->draw(x(), y());
     }
 
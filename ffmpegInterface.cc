@@ -1,5 +1,15 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ffmpegInterface.hh"
+#include "lumaPlane.hh"
+#include "frameTrace.hh"
+
+#include <opencv2/core/core_c.h>
 
 #define OUTPUT_PIX_FMT      AV_PIX_FMT_RGB32 /* pixel format always uses color. ffv1 doesn't support grayscale */
 #define OUTPUT_CODEC        AV_CODEC_ID_FFV1
@@ -9,6 +19,9 @@
 #define OUTPUT_FLAGS2       0
 #define OUTPUT_THREADS      2
 
+// ffmpeg reads the in-memory inputs through a buffer this big
+#define INPUT_BUFFER_SIZE   (256*1024)
+
 FFmpegTalker::FFmpegTalker()
 {
     av_register_all();
@@ -36,9 +49,48 @@ void FFmpegEncoder::reset(void)
     FFmpegTalker::reset();
 }
 
+// sets up everything the constructors would put in an initializer list
+void FFmpegDecoder::init(bool loopAtEnd, size_t replayCacheBytes, int decodeThreads)
+{
+    m_loopAtEnd           = loopAtEnd;
+    m_decodeThreads       = decodeThreads < 0 ? 1 : decodeThreads;
+    m_replayCache         = NULL;
+    m_readAheadDepth      = 0;
+    m_readAheadThread     = 0;
+    m_readAheadGeneration = 0;
+    m_pIOCtx              = NULL;
+    m_mapping             = NULL;
+    pthread_mutex_init(&m_readAheadMutex, NULL);
+    pthread_cond_init (&m_readAheadCond,  NULL);
+
+    if(m_loopAtEnd && replayCacheBytes > 0)
+        m_replayCache = new FrameCache(replayCacheBytes);
+
+    // FFmpegTalker's constructor reset only its own members
+    reset();
+}
+
 void FFmpegDecoder::reset(void)
 {
-    m_videoStream   = -1;
+    m_videoStream       = -1;
+    m_draining          = false;
+    m_frameNumber       = 0;
+    m_fetchedFrameNumber= 0;
+    m_readAheadEnd      = false;
+    m_readAheadStop     = false;
+    m_readAheadRestart  = false;
+    m_filename.clear();
+    m_index.clear();
+    memset(&m_memoryInput, 0, sizeof(m_memoryInput));
+    m_pIOCtx            = NULL;
+    m_mapping           = NULL;
+    m_mappingSize       = 0;
+    m_swsCrops          = false;
+    m_swsInterpolation  = FRAMERESIZE_CUBIC;
+    m_swsThreads        = 1;
+    m_replayFrameNumber = 0;
+    if(m_replayCache != NULL)
+        m_replayCache->reset();
 
     FFmpegTalker::reset();
 }
@@ -63,10 +115,37 @@ void FFmpegTalker::free(void)
 }
 void FFmpegDecoder::free(void)
 {
+    stopReadAhead();
+    for(unsigned int i=0; i<m_readAheadQueue.size(); i++)
+        av_frame_free(&m_readAheadQueue[i].frame);
+    m_readAheadQueue.clear();
+    for(unsigned int i=0; i<m_readAheadSpare.size(); i++)
+        av_frame_free(&m_readAheadSpare[i]);
+    m_readAheadSpare.clear();
+
+    for(unsigned int i=0; i<m_batchFrames.size(); i++)
+        av_frame_free(&m_batchFrames[i]);
+    m_batchFrames.clear();
+
+    // the decoded frame is refcounted, so its buffer must be let go before the codec is closed
+    if(m_pFrameYUV)
+        av_frame_unref(m_pFrameYUV);
+
     FFmpegTalker::free();
+    m_swsScaler.free();
 
     if(m_pFormatCtx)
         avformat_close_input(&m_pFormatCtx);
+
+    // ffmpeg doesn't free a custom I/O context. It may have replaced the buffer I gave it, so I
+    // free whichever one it has now
+    if(m_pIOCtx)
+    {
+        av_freep(&m_pIOCtx->buffer);
+        av_freep(&m_pIOCtx);
+    }
+    if(m_mapping)
+        munmap(m_mapping, m_mappingSize);
     reset();
 }
 void FFmpegEncoder::free(void)
@@ -74,9 +153,9 @@ void FFmpegEncoder::free(void)
     FFmpegTalker::free();
 
     if(m_bufferYUV)
-        av_free(m_bufferYUV);
+        FramePool::freeAligned(m_bufferYUV, m_bufferYUVSize);
     if(m_bufferEncoded)
-        av_free(m_bufferEncoded);
+        FramePool::freeAligned(m_bufferEncoded, m_bufferEncodedSize);
     if(m_pStream)
         av_free(m_pStream);
     if(m_pCodecCtx)
@@ -104,13 +183,13 @@ void FFmpegEncoder::close(void)
 }
 
 
-bool FFmpegDecoder::open(const char* filename,
-                         CvRect _cropRect, double scale)
+// Returns false if we're open already, and the caller should do nothing
+bool FFmpegDecoder::readyToOpen(void)
 {
     if(m_bOpen)
     {
         cerr << "FFmpegDecoder: trying to open a file while we're already open. Doing nothing." << endl;
-        return true;
+        return false;
     }
     if(!m_bOK)
     {
@@ -118,6 +197,138 @@ bool FFmpegDecoder::open(const char* filename,
         close();
     }
     m_bOK = false;
+    return true;
+}
+
+bool FFmpegDecoder::open(const char* filename, FFmpegDecoder_Input input,
+                         CvRect _cropRect, double scale)
+{
+    if(!readyToOpen())
+        return true;
+
+    if(input == FFMPEG_INPUT_MMAP && !mapFile(filename))
+        return false;
+
+    m_filename = filename;
+    return openInput(filename, _cropRect, scale);
+}
+
+bool FFmpegDecoder::open(const void* data, size_t size,
+                         CvRect _cropRect, double scale)
+{
+    if(!readyToOpen())
+        return true;
+
+    m_memoryInput.data = (const uint8_t*)data;
+    m_memoryInput.size = size;
+    m_memoryInput.pos  = 0;
+
+    // there's no filename to guess the format from. ffmpeg probes the data instead
+    return openInput("", _cropRect, scale);
+}
+
+// Maps the file into m_memoryInput. The file is read from start to end, so I tell the kernel to
+// read ahead aggressively
+bool FFmpegDecoder::mapFile(const char* filename)
+{
+    int fd = ::open(filename, O_RDONLY);
+    if(fd < 0)
+    {
+        cerr << "FFmpegDecoder: couldn't open '" << filename << "': " << strerror(errno) << endl;
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        cerr << "FFmpegDecoder: '" << filename << "' is empty, or can't be stat()ed" << endl;
+        ::close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(mapping == MAP_FAILED)
+    {
+        cerr << "FFmpegDecoder: couldn't mmap '" << filename << "': " << strerror(errno) << endl;
+        return false;
+    }
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+    m_mapping          = mapping;
+    m_mappingSize      = st.st_size;
+    m_memoryInput.data = (const uint8_t*)mapping;
+    m_memoryInput.size = st.st_size;
+    m_memoryInput.pos  = 0;
+    return true;
+}
+
+int FFmpegDecoder::memoryRead(void* _input, uint8_t* buf, int size)
+{
+    MemoryInput* input = (MemoryInput*)_input;
+
+    size_t left = input->size - input->pos;
+    if(left == 0)
+        return AVERROR_EOF;
+    if((size_t)size > left)
+        size = left;
+
+    memcpy(buf, &input->data[input->pos], size);
+    input->pos += size;
+    return size;
+}
+
+int64_t FFmpegDecoder::memorySeek(void* _input, int64_t offset, int whence)
+{
+    MemoryInput* input = (MemoryInput*)_input;
+
+    if(whence & AVSEEK_SIZE)
+        return input->size;
+
+    int64_t pos;
+    switch(whence & ~AVSEEK_FORCE)
+    {
+    case SEEK_SET: pos = offset;                       break;
+    case SEEK_CUR: pos = (int64_t)input->pos  + offset; break;
+    case SEEK_END: pos = (int64_t)input->size + offset; break;
+    default:       return AVERROR(EINVAL);
+    }
+    if(pos < 0 || pos > (int64_t)input->size)
+        return AVERROR(EINVAL);
+
+    input->pos = pos;
+    return pos;
+}
+
+bool FFmpegDecoder::openInput(const char* filename,
+                              CvRect _cropRect, double scale)
+{
+    // If the data is in memory, ffmpeg reads it through my callbacks instead of opening the file
+    if(m_memoryInput.data != NULL)
+    {
+        unsigned char* buffer = (unsigned char*)av_malloc(INPUT_BUFFER_SIZE);
+        if(buffer == NULL)
+        {
+            cerr << "ffmpeg: couldn't allocate the input buffer" << endl;
+            return false;
+        }
+        m_pIOCtx = avio_alloc_context(buffer, INPUT_BUFFER_SIZE, 0, &m_memoryInput,
+                                      &memoryRead, NULL, &memorySeek);
+        if(m_pIOCtx == NULL)
+        {
+            cerr << "ffmpeg: couldn't allocate the input context" << endl;
+            av_free(buffer);
+            return false;
+        }
+
+        m_pFormatCtx = avformat_alloc_context();
+        if(m_pFormatCtx == NULL)
+        {
+            cerr << "ffmpeg: couldn't alloc format context" << endl;
+            return false;
+        }
+        m_pFormatCtx->pb = m_pIOCtx;
+    }
 
     if(avformat_open_input(&m_pFormatCtx, filename, NULL, NULL) != 0)
     {
@@ -157,6 +368,14 @@ bool FFmpegDecoder::open(const char* filename,
         return false;
     }
 
+    // I want to be able to hold on to decoded frames, to convert a batch of them at once
+    m_pCodecCtx->refcounted_frames = 1;
+
+    // Codecs that support frame threading decode several frames in parallel; those that support
+    // slice threading split each frame. I allow both, and let the codec pick
+    m_pCodecCtx->thread_count = m_decodeThreads;
+    m_pCodecCtx->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
     if(avcodec_open2(m_pCodecCtx, pCodec, NULL) < 0)
     {
         cerr << "ffmpeg: couldn't open codec" << endl;
@@ -172,77 +391,697 @@ bool FFmpegDecoder::open(const char* filename,
 
     setupCroppingScaling(_cropRect, scale);
 
+    // the index is built only when needed, but if it was cached, I load it now. This is cheap
+    if(!m_filename.empty())
+        m_index.load(m_filename.c_str(), m_videoStream);
+
     isRunningNow.setTrue();
 
+    if(m_readAheadDepth > 0)
+        startReadAhead();
+
     return true;
 }
 
-bool FFmpegDecoder::readFrame(IplImage* image)
+bool FFmpegDecoder::setReadAhead(unsigned int depth)
+{
+    if(depth > 0 && m_replayCache != NULL)
+    {
+        cerr << "FFmpegDecoder: read-ahead isn't available with a replay cache" << endl;
+        return false;
+    }
+
+    // the queue is sized when the thread starts, so I restart it with the new depth
+    stopReadAhead();
+    m_readAheadDepth = depth;
+    if(depth > 0 && m_bOpen && m_bOK)
+        return startReadAhead();
+    return true;
+}
+
+bool FFmpegDecoder::startReadAhead(void)
+{
+    if(m_readAheadThread != 0)
+        return true;
+
+    // The queue holds as many frames as there are: the thread waits when it runs out of spares.
+    // The depth may have changed since these were allocated
+    while(m_readAheadSpare.size() + m_readAheadQueue.size() > m_readAheadDepth &&
+          !m_readAheadSpare.empty())
+    {
+        av_frame_free(&m_readAheadSpare.back());
+        m_readAheadSpare.pop_back();
+    }
+    while(m_readAheadSpare.size() + m_readAheadQueue.size() < m_readAheadDepth)
+    {
+        AVFrame* frame = av_frame_alloc();
+        if(frame == NULL)
+        {
+            cerr << "ffmpeg: couldn't allocate read-ahead frame" << endl;
+            return false;
+        }
+        m_readAheadSpare.push_back(frame);
+    }
+
+    m_readAheadEnd     = false;
+    m_readAheadStop    = false;
+    m_readAheadRestart = false;
+    if(pthread_create(&m_readAheadThread, NULL, &readAheadThread, this) != 0)
+    {
+        m_readAheadThread = 0;
+        cerr << "FFmpegDecoder: couldn't start the read-ahead thread. Decoding synchronously" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Stops the thread. The frames it decoded stay in the queue, and the reader gets them before
+// decoding any more itself
+void FFmpegDecoder::stopReadAhead(void)
+{
+    if(m_readAheadThread == 0)
+        return;
+
+    pthread_mutex_lock(&m_readAheadMutex);
+    m_readAheadStop = true;
+    pthread_cond_broadcast(&m_readAheadCond);
+    pthread_mutex_unlock(&m_readAheadMutex);
+
+    pthread_join(m_readAheadThread, NULL);
+    m_readAheadThread = 0;
+    m_readAheadStop   = false;
+
+    // a restart the thread didn't get to yet is done here
+    if(m_readAheadRestart)
+    {
+        m_readAheadRestart = false;
+        rewind();
+    }
+}
+
+void* FFmpegDecoder::readAheadThread(void* decoder)
+{
+    ((FFmpegDecoder*)decoder)->readAheadLoop();
+    return NULL;
+}
+
+void FFmpegDecoder::readAheadLoop(void)
+{
+    pthread_mutex_lock(&m_readAheadMutex);
+    while(!m_readAheadStop)
+    {
+        if(m_readAheadRestart)
+        {
+            m_readAheadRestart = false;
+            pthread_mutex_unlock(&m_readAheadMutex);
+            bool result = rewind();
+            pthread_mutex_lock(&m_readAheadMutex);
+
+            m_readAheadEnd = !result;
+            pthread_cond_broadcast(&m_readAheadCond);
+            continue;
+        }
+
+        if(m_readAheadEnd || m_readAheadSpare.empty())
+        {
+            pthread_cond_wait(&m_readAheadCond, &m_readAheadMutex);
+            continue;
+        }
+
+        // I decode without holding the lock, so the reader can keep taking frames meanwhile
+        AVFrame* frame      = m_readAheadSpare.back();
+        uint64_t generation = m_readAheadGeneration;
+        m_readAheadSpare.pop_back();
+        pthread_mutex_unlock(&m_readAheadMutex);
+
+        bool result;
+        {
+            FRAMETRACE_SPAN("ffmpeg.readahead");
+            result = decodeFrame(frame);
+        }
+
+        pthread_mutex_lock(&m_readAheadMutex);
+        if(generation != m_readAheadGeneration)
+        {
+            // the stream was restarted while I was decoding. This frame is from before that
+            av_frame_unref(frame);
+            m_readAheadSpare.push_back(frame);
+            continue;
+        }
+        if(!result)
+        {
+            m_readAheadSpare.push_back(frame);
+            m_readAheadEnd = true;
+        }
+        else
+        {
+            ReadAhead_Frame queued;
+            queued.frame       = frame;
+            queued.frameNumber = m_frameNumber;
+            m_readAheadQueue.push_back(queued);
+        }
+        pthread_cond_broadcast(&m_readAheadCond);
+    }
+    pthread_mutex_unlock(&m_readAheadMutex);
+}
+
+// Reads the next packet of the video stream. Returns false at the end of the file
+bool FFmpegDecoder::readPacket(AVPacket* packet)
+{
+    FRAMETRACE_SPAN("ffmpeg.demux");
+
+    while(av_read_frame(m_pFormatCtx, packet) >= 0)
+    {
+        if(packet->stream_index == m_videoStream)
+            return true;
+        av_packet_unref(packet);
+    }
+    return false;
+}
+
+// Decodes the next frame into the given frame. I feed the decoder packets until it gives out a frame.
+// At the end of the file I drain the frames it's still holding. Once it's empty, I start over from
+// the beginning if asked. If the replay cache has the whole file, I stop there, and the caller
+// replays from the cache instead
+bool FFmpegDecoder::decodeFrame(AVFrame* frame)
 {
     if(!m_bOpen || !m_bOK)
         return false;
 
-    AVPacket packet;
-    int frameFinished;
+    while(1)
+    {
+        // the frames are refcounted, so I let go of the previous one before decoding the next
+        av_frame_unref(frame);
+
+        int result;
+        {
+            FRAMETRACE_SPAN("ffmpeg.decode");
+            result = avcodec_receive_frame(m_pCodecCtx, frame);
+        }
+        if(result == 0)
+        {
+            m_frameNumber++;
+            return true;
+        }
+
+        if(result == AVERROR_EOF)
+        {
+            // the decoder is empty
+            if(m_loopAtEnd && !finishReplayRecording() && rewind())
+                continue;
+            return false;
+        }
+
+        if(result != AVERROR(EAGAIN))
+        {
+            cerr << "ffmpeg error avcodec_receive_frame(): " << result << endl;
+            return false;
+        }
+
+        // The decoder wants more data. At the end of the file, an empty packet tells it to give
+        // out what it's holding
+        AVPacket packet;
+        av_init_packet(&packet);
+        packet.data = NULL;
+        packet.size = 0;
+
+        if(!m_draining && !readPacket(&packet))
+            m_draining = true;
+
+        {
+            FRAMETRACE_SPAN("ffmpeg.decode");
+            result = avcodec_send_packet(m_pCodecCtx, m_draining ? NULL : &packet);
+        }
+        if(!m_draining)
+            av_packet_unref(&packet);
+
+        if(result < 0 && result != AVERROR_EOF)
+        {
+            cerr << "ffmpeg error avcodec_send_packet(): " << result << endl;
+            return false;
+        }
+    }
+}
 
-    // I keep reading frames as long as I can. If asked, I start over from the beginning when I
-    // reach the end
-    while(av_read_frame(m_pFormatCtx, &packet) >= 0 ||
-          (m_loopAtEnd && _restartStream() && av_read_frame(m_pFormatCtx, &packet) >= 0))
+// Throws away the frames waiting in the read-ahead queue. The caller holds m_readAheadMutex, or
+// the thread isn't running
+void FFmpegDecoder::discardQueuedFrames(void)
+{
+    for(unsigned int i=0; i<m_readAheadQueue.size(); i++)
     {
-        if(packet.stream_index == m_videoStream)
+        av_frame_unref(m_readAheadQueue[i].frame);
+        m_readAheadSpare.push_back(m_readAheadQueue[i].frame);
+    }
+    m_readAheadQueue.clear();
+}
+
+bool FFmpegDecoder::buildIndex(void)
+{
+    if(m_index.isValid())
+        return true;
+    if(!m_bOpen || !m_bOK)
+        return false;
+    if(m_filename.empty())
+    {
+        cerr << "FFmpegDecoder: the keyframe index needs a file. Can't build it for a memory buffer" << endl;
+        return false;
+    }
+
+    if(m_index.load(m_filename.c_str(), m_videoStream))
+        return true;
+    if(!m_index.build(m_filename.c_str(), m_videoStream))
+        return false;
+
+    // if the sidecar can't be written, we still have the index. We just don't keep it
+    m_index.save(m_filename.c_str(), m_videoStream);
+    return true;
+}
+
+bool FFmpegDecoder::seekToFrame(uint64_t frame)
+{
+    if(!m_bOpen || !m_bOK)
+        return false;
+    if(m_replayCache != NULL)
+    {
+        cerr << "FFmpegDecoder: seeking isn't available with a replay cache" << endl;
+        return false;
+    }
+    if(!buildIndex())
+        return false;
+
+    int64_t pts, seekTimestamp;
+    if(!m_index.lookup(frame, &pts, &seekTimestamp))
+    {
+        cerr << "FFmpegDecoder: can't seek to frame " << frame << ". The file has "
+             << m_index.numFrames() << " frames" << endl;
+        return false;
+    }
+
+    // The thread's frames are from the old position, and it mustn't touch the decoder while I
+    // seek. It's started again when I'm done
+    bool readAhead = m_readAheadThread != 0;
+    stopReadAhead();
+    discardQueuedFrames();
+
+    AVFrame* target;
+    if(!m_readAheadSpare.empty())
+    {
+        target = m_readAheadSpare.back();
+        m_readAheadSpare.pop_back();
+    }
+    else if((target = av_frame_alloc()) == NULL)
+    {
+        cerr << "ffmpeg: couldn't allocate seek frame" << endl;
+        return false;
+    }
+
+    // I go to the keyframe, and decode up to the frame I want. If the demuxer took me past the
+    // frame, I go back to the start of the file, and decode up to it from there. That's slow,
+    // but it gets the right frame. I don't loop at the end here: the frame is in the file
+    bool found     = false;
+    bool loopAtEnd = m_loopAtEnd;
+    m_loopAtEnd    = false;
+    for(int attempt = 0; attempt < 2 && !found; attempt++)
+    {
+        if(attempt == 0)
         {
-            if(avcodec_decode_video2(m_pCodecCtx, m_pFrameYUV, &frameFinished,
-                                     &packet) < 0)
-            {
-                cerr << "ffmpeg error avcodec_decode_video()" << endl;
-                return false;
-            }
+            if(0 > av_seek_frame(m_pFormatCtx, m_videoStream, seekTimestamp, AVSEEK_FLAG_BACKWARD))
+                continue;
+            avcodec_flush_buffers(m_pCodecCtx);
+            m_draining = false;
+        }
+        else
+        {
+            cerr << "FFmpegDecoder: couldn't seek to the keyframe before frame " << frame
+                 << ". Decoding up to it from the start of the file" << endl;
+            if(!rewind())
+                break;
+        }
+
+        bool first = true;
+        while(decodeFrame(target))
+        {
+            int64_t t = av_frame_get_best_effort_timestamp(target);
+            if(t == AV_NOPTS_VALUE)
+                t = target->pkt_dts;
 
-            if(frameFinished)
+            if(t >= pts)
             {
-                if(m_pSWSCtx == NULL)
-                {
-                    // I do this here instead of in the constructor because I was seeing the codec
-                    // pixel format not being defined at the time the constructor runs. Maybe it
-                    // needs to read at least one frame to figure it out. If we can, this SHOULD go
-                    // to the constructor
-                    m_pSWSCtx = sws_getContext(m_pCodecCtx->width, m_pCodecCtx->height, m_pCodecCtx->pix_fmt,
-                                               m_pCodecCtx->width, m_pCodecCtx->height,
-                                               userColorMode == FRAMESOURCE_COLOR ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_GRAY8,
-                                               SWS_POINT, NULL, NULL, NULL);
-                    if(m_pSWSCtx == NULL)
-                    {
-                        cerr << "ffmpeg: couldn't create sws context" << endl;
-                        return false;
-                    }
-                }
-
-                IplImage* buffer;
-                if(preCropScaleBuffer == NULL) buffer = image;
-                else                           buffer = preCropScaleBuffer;
-
-                assert( (userColorMode == FRAMESOURCE_COLOR     && buffer->nChannels == 3) ||
-                        (userColorMode == FRAMESOURCE_GRAYSCALE && buffer->nChannels == 1) );
-                assert( buffer->width == (int)m_pCodecCtx->width && buffer->height == (int)m_pCodecCtx->height );
-
-                sws_scale(m_pSWSCtx,
-                          m_pFrameYUV->data, m_pFrameYUV->linesize,
-                          0, m_pCodecCtx->height,
-                          (unsigned char**)&buffer->imageData, &buffer->widthStep);
-
-                if(preCropScaleBuffer != NULL)
-                {
-#warning this isnt very efficient. The cropping and scaling should be a part of the ffmpeg calls above. av_picture_crop looks promising
-                    applyCroppingScaling(preCropScaleBuffer, image);
-                }
-
-                av_free_packet(&packet);
-                return true;
+                found = t == pts || !first || attempt > 0;
+                break;
             }
+            first = false;
         }
     }
-    return false;
+    m_loopAtEnd = loopAtEnd;
+
+    if(!found)
+    {
+        cerr << "FFmpegDecoder: couldn't decode frame " << frame << endl;
+        av_frame_unref(target);
+        m_readAheadSpare.push_back(target);
+        return false;
+    }
+
+    // The frame waits in the queue for the next read, whether the thread is running or not
+    ReadAhead_Frame queued;
+    queued.frame       = target;
+    queued.frameNumber = m_frameNumber = frame + 1;
+    m_readAheadQueue.push_back(queued);
+
+    if(readAhead)
+        startReadAhead();
+    return true;
+}
+
+bool FFmpegDecoder::seekToTime(uint64_t timestamp_us)
+{
+    if(!m_bOpen || !m_bOK)
+        return false;
+
+    // Frame n is reported with frameTimestamp_us(n+1). That rounds down, so I find the last k
+    // with frameTimestamp_us(k) <= timestamp_us: k*num*1e6/den < timestamp_us+1
+    uint64_t num = m_pCodecCtx->time_base.num == 0 ? 1ul : (uint64_t)m_pCodecCtx->time_base.num;
+    uint64_t n   = ((timestamp_us + 1) * (uint64_t)m_pCodecCtx->time_base.den - 1) /
+                   (num * (uint64_t)1000000);
+    return seekToFrame(n > 0 ? n-1 : 0);
+}
+
+// Gets the next decoded frame into m_pFrameYUV, and its number into m_fetchedFrameNumber. If
+// reading ahead, I take it off the queue. Otherwise I decode it here
+bool FFmpegDecoder::fetchFrame(void)
+{
+    if(!m_bOpen || !m_bOK)
+        return false;
+
+    pthread_mutex_lock(&m_readAheadMutex);
+    while(m_readAheadQueue.empty() && m_readAheadThread != 0 && !m_readAheadEnd)
+        pthread_cond_wait(&m_readAheadCond, &m_readAheadMutex);
+
+    if(m_readAheadQueue.empty())
+    {
+        bool threaded = m_readAheadThread != 0;
+        pthread_mutex_unlock(&m_readAheadMutex);
+
+        // If the thread is running, it hit the end. Otherwise I decode myself
+        if(threaded || !decodeFrame(m_pFrameYUV))
+            return false;
+        m_fetchedFrameNumber = m_frameNumber;
+        return true;
+    }
+
+    ReadAhead_Frame queued = m_readAheadQueue.front();
+    m_readAheadQueue.pop_front();
+    av_frame_unref(m_pFrameYUV);
+    av_frame_move_ref(m_pFrameYUV, queued.frame);
+
+    // the frame goes back to the thread, unless the depth was lowered since it was queued
+    if(m_readAheadSpare.size() + m_readAheadQueue.size() >= m_readAheadDepth)
+        av_frame_free(&queued.frame);
+    else
+        m_readAheadSpare.push_back(queued.frame);
+    m_fetchedFrameNumber = queued.frameNumber;
+
+    // there's room in the queue now
+    pthread_cond_broadcast(&m_readAheadCond);
+    pthread_mutex_unlock(&m_readAheadMutex);
+    return true;
+}
+
+bool FFmpegDecoder::readFrame(IplImage* image)
+{
+    return fetchFrame() && convertFrame(m_pFrameYUV, image);
+}
+
+// Rewinds to the start of the file. The frames the decoder is holding are from the old position,
+// so I throw them away
+bool FFmpegDecoder::rewind(void)
+{
+    if(0 > av_seek_frame(m_pFormatCtx, m_videoStream,
+                         0, AVSEEK_FLAG_BYTE))
+    {
+        cerr << "_restartStream(): ffmpeg couldn't rewind to the start of the file" << endl;
+        return false;
+    }
+    avcodec_flush_buffers(m_pCodecCtx);
+    m_draining = false;
+    return true;
+}
+
+bool FFmpegDecoder::_restartStream(void)
+{
+    // If I'm replaying from the cache, I simply start the replay over
+    if(m_replayCache != NULL && m_replayCache->isComplete())
+    {
+        m_replayCache->rewind();
+        return true;
+    }
+
+    // The queued frames are from before the restart, so I throw them away. These can be there
+    // even if the thread isn't running: it could have been stopped with frames still queued
+    pthread_mutex_lock(&m_readAheadMutex);
+    discardQueuedFrames();
+
+    if(m_readAheadThread == 0)
+    {
+        pthread_mutex_unlock(&m_readAheadMutex);
+        return rewind();
+    }
+
+    // I have the thread rewind and refill the queue. I don't wait for it: the next read waits
+    // for the first new frame instead
+    m_readAheadGeneration++;
+    m_readAheadRestart = true;
+    m_readAheadEnd     = false;
+    pthread_cond_broadcast(&m_readAheadCond);
+    pthread_mutex_unlock(&m_readAheadMutex);
+    return true;
+}
+
+bool FFmpegDecoder::setupScaler(void)
+{
+    // I do this here instead of in the constructor because I was seeing the codec pixel format
+    // not being defined at the time the constructor runs. Maybe it needs to read at least one
+    // frame to figure it out. If we can, this SHOULD go to the constructor
+    enum AVPixelFormat outputPixfmt =
+        userColorMode == FRAMESOURCE_COLOR ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_GRAY8;
+
+    // A scaler that scales vertically can't be split into bands. If we're using several threads
+    // I thus have the scaler only convert, and I scale separately. The cropping can still be
+    // done by the scaler if we're not scaling at all
+    CvRect window      = cropWindow();
+    m_swsCrops         = swsCrop_supported(m_pCodecCtx->pix_fmt, window) &&
+                         (maxThreads <= 1 || isCropOnly());
+    m_swsInterpolation = interpolation;
+    m_swsThreads       = maxThreads;
+
+    bool result;
+    if(m_swsCrops)
+    {
+        // The scaler converts only the cropping window, scaling it to the output size
+        // directly. The intermediate buffer is then not needed
+        result = m_swsScaler.setup(m_pCodecCtx->pix_fmt, window.width, window.height,
+                                   outputPixfmt, width, height,
+                                   isCropOnly() ? SWS_POINT : swsCrop_flags(interpolation),
+                                   maxThreads);
+        dropPreCropScaleBuffer();
+    }
+    else
+    {
+        result = m_swsScaler.setup(m_pCodecCtx->pix_fmt, m_pCodecCtx->width, m_pCodecCtx->height,
+                                   outputPixfmt, m_pCodecCtx->width, m_pCodecCtx->height,
+                                   SWS_POINT, maxThreads);
+        restorePreCropScaleBuffer();
+    }
+
+    if(!result)
+    {
+        cerr << "ffmpeg: couldn't create sws context" << endl;
+        return false;
+    }
+    return true;
+}
+
+// converts a decoded frame into the output image
+bool FFmpegDecoder::convertFrame(AVFrame* frame, IplImage* image)
+{
+    FRAMETRACE_SPAN("ffmpeg.convert");
+    FrameStats_Timer timer(&stats);
+
+    // In grayscale, the luma of most YUV frames is the output already
+    if(userColorMode == FRAMESOURCE_GRAYSCALE &&
+       lumaPlane_convert(m_pCodecCtx->pix_fmt, frame->data, frame->linesize, cropWindow(), image,
+                         &resizer, interpolation, maxThreads))
+        return true;
+
+    // the user may have asked for a different interpolation or thread count
+    if(m_swsScaler.isSetup() &&
+       (m_swsInterpolation != interpolation || m_swsThreads != maxThreads))
+        m_swsScaler.free();
+
+    if(!m_swsScaler.isSetup() && !setupScaler())
+        return false;
+
+    assert( (userColorMode == FRAMESOURCE_COLOR     && image->nChannels == 3) ||
+            (userColorMode == FRAMESOURCE_GRAYSCALE && image->nChannels == 1) );
+
+    if(m_swsCrops)
+    {
+        assert( image->width == (int)width && image->height == (int)height );
+
+        CvRect   window = cropWindow();
+        uint8_t* planes[4];
+        swsCrop_planes(m_pCodecCtx->pix_fmt, window,
+                       frame->data, frame->linesize, planes);
+
+        m_swsScaler.scale(planes, frame->linesize,
+                          (unsigned char*)image->imageData, image->widthStep);
+        return true;
+    }
+
+    // I convert the whole frame, and then crop and scale the result
+    IplImage* buffer;
+    if(preCropScaleBuffer == NULL) buffer = image;
+    else                           buffer = preCropScaleBuffer;
+
+    assert( buffer->width == (int)m_pCodecCtx->width && buffer->height == (int)m_pCodecCtx->height );
+
+    m_swsScaler.scale(frame->data, frame->linesize,
+                      (unsigned char*)buffer->imageData, buffer->widthStep);
+
+    if(preCropScaleBuffer != NULL)
+        applyCroppingScaling(preCropScaleBuffer, image);
+
+    return true;
+}
+
+// Called when we hit the end of the file while looping. If we were recording into the replay
+// cache, and everything fit, the cache takes over from here. Returns true in that case
+bool FFmpegDecoder::finishReplayRecording(void)
+{
+    if(m_replayCache == NULL || !m_replayCache->finishRecording())
+        return false;
+
+    // the replayed frames keep counting up from where the decoder left off
+    m_replayFrameNumber = m_frameNumber;
+    return true;
+}
+
+uint64_t FFmpegDecoder::frameTimestamp_us(uint64_t frameNumber)
+{
+    // I've seen m_pCodecCtx->time_base.num==0 before. In that case I treat it as 1
+    return
+        frameNumber *
+        (m_pCodecCtx->time_base.num == 0 ? 1ul : (uint64_t)m_pCodecCtx->time_base.num) *
+        (uint64_t)1000000 / m_pCodecCtx->time_base.den;
+}
+
+bool FFmpegDecoder::_getNextFrame(IplImage* image, uint64_t* timestamp_us)
+{
+    if(m_replayCache != NULL && m_replayCache->isRecording())
+    {
+        // Decode into a pooled frame, so that the cache can keep it. Then give the caller a copy
+        FrameHandle frame = getFramePool()->get();
+        if(frame && readFrame(frame))
+        {
+            uint64_t t = frameTimestamp_us(m_fetchedFrameNumber);
+            m_replayCache->add(frame, t);
+            cvCopy(frame, image);
+            if(timestamp_us != NULL)
+                *timestamp_us = t;
+            return true;
+        }
+    }
+    else if(m_replayCache == NULL || !m_replayCache->isComplete())
+    {
+        if(readFrame(image))
+        {
+            if(timestamp_us != NULL)
+                *timestamp_us = frameTimestamp_us(m_fetchedFrameNumber);
+            return true;
+        }
+    }
+
+    // readFrame() can fail because the cache took over at the end of the file
+    if(m_replayCache == NULL || !m_replayCache->isComplete())
+        return false;
+
+    cvCopy(m_replayCache->replay(), image);
+    if(timestamp_us != NULL)
+        *timestamp_us = frameTimestamp_us(++m_replayFrameNumber);
+    return true;
+}
+
+unsigned int FFmpegDecoder::_getNextFrames(unsigned int n, IplImage** images,
+                                           uint64_t* timestamps_us)
+{
+    // the replay cache works a frame at a time
+    if(m_replayCache != NULL)
+        return getFramesSingly(n, images, timestamps_us);
+
+    while(m_batchFrames.size() < n)
+    {
+        AVFrame* frame = av_frame_alloc();
+        if(frame == NULL)
+        {
+            cerr << "ffmpeg: couldn't allocate batch frame" << endl;
+            break;
+        }
+        m_batchFrames.push_back(frame);
+    }
+    if(n > m_batchFrames.size())
+        n = m_batchFrames.size();
+
+    // Decode the whole batch. Each decoded frame is moved out of m_pFrameYUV, so the decoder
+    // allocates a new buffer for the next one
+    unsigned int numDecoded = 0;
+    while(numDecoded < n && fetchFrame())
+    {
+        av_frame_move_ref(m_batchFrames[numDecoded], m_pFrameYUV);
+        if(timestamps_us != NULL)
+            timestamps_us[numDecoded] = frameTimestamp_us(m_fetchedFrameNumber);
+        numDecoded++;
+    }
+
+    // then convert it
+    unsigned int numConverted = 0;
+    while(numConverted < numDecoded &&
+          convertFrame(m_batchFrames[numConverted], images[numConverted]))
+        numConverted++;
+
+    for(unsigned int i=0; i<numDecoded; i++)
+        av_frame_unref(m_batchFrames[i]);
+
+    return numConverted;
+}
+
+bool FFmpegDecoder::_borrowFrame(IplImage* header, bool latest, uint64_t* timestamp_us)
+{
+    // If all we need is the cropped luma plane, I lend out the decoded frame itself. It stays
+    // valid until the next frame is decoded
+    if(m_replayCache == NULL && userColorMode == FRAMESOURCE_GRAYSCALE && isCropOnly() &&
+       m_bOpen && lumaPlane_layout(m_pCodecCtx->pix_fmt) == LUMAPLANE_PLANAR)
+    {
+        if(!fetchFrame())
+            return false;
+
+        initBorrowedHeader(header, m_pFrameYUV->data[0], m_pFrameYUV->linesize[0]);
+        if(timestamp_us != NULL)
+            *timestamp_us = frameTimestamp_us(m_fetchedFrameNumber);
+        return true;
+    }
+
+    if(m_replayCache == NULL || !m_replayCache->isComplete())
+        return borrowIntoBuffer(header, latest, timestamp_us);
+
+    // I'm replaying, so I lend out the cached frame itself
+    IplImage* image = m_replayCache->replay();
+    cvInitImageHeader(header, cvGetSize(image), IPL_DEPTH_8U, image->nChannels);
+    cvSetData(header, image->imageData, image->widthStep);
+
+    if(timestamp_us != NULL)
+        *timestamp_us = frameTimestamp_us(++m_replayFrameNumber);
+    return true;
 }
 
 bool FFmpegEncoder::open(const char* filename, int width, int height, int fps,
@@ -326,13 +1165,18 @@ bool FFmpegEncoder::open(const char* filename, int width, int height, int fps,
         return false;
     }
     m_bufferYUVSize = avpicture_get_size(m_pCodecCtx->pix_fmt, m_pCodecCtx->width, m_pCodecCtx->height);
-    m_bufferYUV     = (uint8_t*)av_malloc(m_bufferYUVSize * sizeof(uint8_t));
+    m_bufferYUV     = (uint8_t*)FramePool::allocAligned(m_bufferYUVSize * sizeof(uint8_t));
 
     // The ffv1 encoder uses this much data. It seems like too much, but I just
     // give it what it wants
     m_bufferEncodedSize = m_pCodecCtx->width * m_pCodecCtx->height *
       ((8 * 2 + 1 + 1) * 4) / 8 + FF_MIN_BUFFER_SIZE;
-    m_bufferEncoded     = (uint8_t*)av_malloc(m_bufferEncodedSize);
+    m_bufferEncoded     = (uint8_t*)FramePool::allocAligned(m_bufferEncodedSize);
+    if(m_bufferYUV == NULL || m_bufferEncoded == NULL)
+    {
+        cerr << "ffmpeg: couldn't allocate the frame buffers" << endl;
+        return false;
+    }
 
     avpicture_fill((AVPicture *)m_pFrameYUV, m_bufferYUV, m_pCodecCtx->pix_fmt,
                    m_pCodecCtx->width, m_pCodecCtx->height);
@@ -363,6 +1207,8 @@ bool FFmpegEncoder::open(const char* filename, int width, int height, int fps,
 
 bool FFmpegEncoder::writeFrame(IplImage* image)
 {
+    FRAMETRACE_SPAN("ffmpeg.encode");
+
     if(!m_bOpen || !m_bOK)
         return false;
 
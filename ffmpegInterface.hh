@@ -8,10 +8,17 @@ extern "C"
 #include <libswscale/swscale.h>
 }
 
+#include <pthread.h>
 #include <iostream>
+#include <vector>
+#include <deque>
+#include <string>
 using namespace std;
 
 #include "frameSource.hh"
+#include "frameCache.hh"
+#include "swsCrop.hh"
+#include "keyframeIndex.hh"
 
 class FFmpegTalker
 {
@@ -38,38 +45,233 @@ public:
     }
 };
 
+// Where FFmpegDecoder reads a file from. FFMPEG_INPUT_FILE has ffmpeg read() the file a small
+// piece at a time. FFMPEG_INPUT_MMAP maps the file into memory and has ffmpeg read from there, so
+// a file in the page cache (or in tmpfs) is decoded without any read syscalls
+enum FFmpegDecoder_Input
+{
+    FFMPEG_INPUT_FILE,
+    FFMPEG_INPUT_MMAP
+};
+
 class FFmpegDecoder : public FFmpegTalker, public FrameSource
 {
     int              m_videoStream;
     bool             m_loopAtEnd;
 
+    // The decoder threads asked for. 0 means one per core. The decoder runs in the send/receive
+    // model: packets go in and frames come out, in presentation order, with a delay of up to a
+    // few frames when frame-threading. m_draining is true once the demuxer hit the end, and the
+    // decoder is giving out the frames it's still holding
+    int              m_decodeThreads;
+    bool             m_draining;
+
+    // the number of frames the decoder has given out since the file was opened. The timestamps
+    // come from this
+    uint64_t         m_frameNumber;
+
+    // If looping, the decoded frames can be cached to avoid decoding them again on subsequent
+    // passes. NULL if we're not caching
+    FrameCache*      m_replayCache;
+    uint64_t         m_replayFrameNumber;
+
+    // The decoder does its conversion with this instead of m_pSWSCtx, so it can be
+    // multithreaded. m_swsCrops is true if the scaler does the cropping and scaling as part of
+    // the conversion
+    SwsCrop_Scaler            m_swsScaler;
+    bool                      m_swsCrops;
+    FrameResize_Interpolation m_swsInterpolation;
+    int                       m_swsThreads;
+
+    // Decoded frames held by _getNextFrames() until the whole batch is converted. The decoder's
+    // frames are refcounted, so these hold on to the decoder's buffers without copying them
+    std::vector<AVFrame*>     m_batchFrames;
+
+    // The optional read-ahead thread (see setReadAhead()). It demuxes and decodes into
+    // m_readAheadQueue, up to m_readAheadDepth frames ahead of the reader. The frames are queued
+    // decoded; the reader still converts them. The queued frames are refcounted, so they hold on
+    // to the decoder's buffers without copying them. Used frames go back to m_readAheadSpare.
+    // Everything here is protected by m_readAheadMutex. When the thread isn't running,
+    // m_readAheadThread is 0, and the reader decodes the frames itself
+    struct ReadAhead_Frame
+    {
+        AVFrame* frame;
+        uint64_t frameNumber;
+    };
+    unsigned int                 m_readAheadDepth;
+    pthread_t                    m_readAheadThread;
+    pthread_mutex_t              m_readAheadMutex;
+    pthread_cond_t               m_readAheadCond;
+    std::deque<ReadAhead_Frame>  m_readAheadQueue;
+    std::vector<AVFrame*>        m_readAheadSpare;
+
+    // m_readAheadEnd is true once the decoder has nothing more to give. A restart is handed to
+    // the thread as a request, so that the reader doesn't wait for the rewind. Each restart bumps
+    // the generation; a frame decoded before the restart is thrown away
+    bool                         m_readAheadEnd;
+    bool                         m_readAheadStop;
+    bool                         m_readAheadRestart;
+    uint64_t                     m_readAheadGeneration;
+
+    // the frame number of the frame last handed to the reader in m_pFrameYUV
+    uint64_t                     m_fetchedFrameNumber;
+
+    // for seeking. The index is loaded from its sidecar in open() if it's there, and built when
+    // first needed otherwise
+    std::string                  m_filename;
+    KeyframeIndex                m_index;
+
+    // If we're reading from memory (a buffer we were given, or the mapped file), ffmpeg reads
+    // through m_pIOCtx, which copies out of m_memoryInput. m_mapping is non-NULL if we mapped
+    // the file ourselves
+    struct MemoryInput
+    {
+        const uint8_t* data;
+        size_t         size;
+        size_t         pos;
+    };
+    MemoryInput                  m_memoryInput;
+    AVIOContext*                 m_pIOCtx;
+    void*                        m_mapping;
+    size_t                       m_mappingSize;
+
+    void init(bool loopAtEnd, size_t replayCacheBytes, int decodeThreads);
     void reset(void);
+    bool readyToOpen(void);
+    bool openInput(const char* filename, CvRect _cropRect, double scale);
+    bool mapFile(const char* filename);
+    static int     memoryRead(void* input, uint8_t* buf, int size);
+    static int64_t memorySeek(void* input, int64_t offset, int whence);
+    bool readPacket(AVPacket* packet);
+    bool decodeFrame(AVFrame* frame);
+    bool fetchFrame(void);
     bool readFrame(IplImage* image);
+    bool rewind(void);
+    bool startReadAhead(void);
+    void stopReadAhead(void);
+    void readAheadLoop(void);
+    void discardQueuedFrames(void);
+    static void* readAheadThread(void* decoder);
+    bool setupScaler(void);
+    bool convertFrame(AVFrame* frame, IplImage* image);
+    bool finishReplayRecording(void);
+    uint64_t frameTimestamp_us(uint64_t frameNumber);
 
 public:
-    FFmpegDecoder(FrameSource_UserColorChoice _userColorMode, bool loopAtEnd = false)
-        : FFmpegTalker(), FrameSource(_userColorMode), m_loopAtEnd(loopAtEnd)
-    {}
+    // If loopAtEnd and replayCacheBytes > 0, the frames from the first pass through the file are
+    // cached, and replayed on subsequent passes, as long as they fit into replayCacheBytes. This
+    // is useful for short clips that are looped over and over.
+    //
+    // decodeThreads is the number of threads decoding the video. 0 means one per core. The codec
+    // decodes several frames at once (frame threading) and/or splits each frame (slice
+    // threading), whichever it supports. The default is 1: everything happens in the thread that
+    // gets the frame. This is separate from setMaxThreads(), which splits the conversion
+    FFmpegDecoder(FrameSource_UserColorChoice _userColorMode, bool loopAtEnd = false,
+                  size_t replayCacheBytes = 0, int decodeThreads = 1)
+        : FFmpegTalker(), FrameSource(_userColorMode)
+    {
+        init(loopAtEnd, replayCacheBytes, decodeThreads);
+    }
     FFmpegDecoder(const char* filename, FrameSource_UserColorChoice _userColorMode,
                   bool loopAtEnd = false,
                   CvRect _cropRect = cvRect(-1, -1, -1, -1),
-                  double scale = 1.0)
-        : FFmpegTalker(), FrameSource(_userColorMode), m_loopAtEnd(loopAtEnd)
+                  double scale = 1.0,
+                  size_t replayCacheBytes = 0,
+                  int decodeThreads = 1)
+        : FFmpegTalker(), FrameSource(_userColorMode)
     {
+        init(loopAtEnd, replayCacheBytes, decodeThreads);
         open(filename, _cropRect, scale);
     }
+    FFmpegDecoder(const char* filename, FFmpegDecoder_Input input,
+                  FrameSource_UserColorChoice _userColorMode,
+                  bool loopAtEnd = false,
+                  CvRect _cropRect = cvRect(-1, -1, -1, -1),
+                  double scale = 1.0,
+                  size_t replayCacheBytes = 0,
+                  int decodeThreads = 1)
+        : FFmpegTalker(), FrameSource(_userColorMode)
+    {
+        init(loopAtEnd, replayCacheBytes, decodeThreads);
+        open(filename, input, _cropRect, scale);
+    }
+
+    // Decodes a file that's in memory already. The buffer isn't copied, so it must stay valid
+    // until the decoder is closed
+    FFmpegDecoder(const void* data, size_t size,
+                  FrameSource_UserColorChoice _userColorMode,
+                  bool loopAtEnd = false,
+                  CvRect _cropRect = cvRect(-1, -1, -1, -1),
+                  double scale = 1.0,
+                  size_t replayCacheBytes = 0,
+                  int decodeThreads = 1)
+        : FFmpegTalker(), FrameSource(_userColorMode)
+    {
+        init(loopAtEnd, replayCacheBytes, decodeThreads);
+        open(data, size, _cropRect, scale);
+    }
     ~FFmpegDecoder()
     {
         cleanupThreads();
         close();
+        if(m_replayCache != NULL)
+            delete m_replayCache;
+        pthread_cond_destroy (&m_readAheadCond);
+        pthread_mutex_destroy(&m_readAheadMutex);
     }
 
     bool open(const char* filename,
+              CvRect _cropRect = cvRect(-1, -1, -1, -1),
+              double scale = 1.0)
+    {
+        return open(filename, FFMPEG_INPUT_FILE, _cropRect, scale);
+    }
+    bool open(const char* filename, FFmpegDecoder_Input input,
+              CvRect _cropRect = cvRect(-1, -1, -1, -1),
+              double scale = 1.0);
+    bool open(const void* data, size_t size,
               CvRect _cropRect = cvRect(-1, -1, -1, -1),
               double scale = 1.0);
     void close(void);
     void free(void);
 
+    // Demux and decode in a background thread, up to depth frames ahead of the reader. Reading a
+    // frame is then mostly taking one off the queue, and the file I/O and the decoding spikes
+    // don't stall the reader. 0 (the default) turns this off: each frame is decoded when it's
+    // asked for. Can be called before or after open(). Not available with a replay cache, which
+    // decodes each frame only once anyway
+    bool setReadAhead(unsigned int depth);
+
+    // Seeks so that the next frame read is the given frame. The frames are counted from 0, at the
+    // start of the file, and in presentation order. The decoder goes to the keyframe before the
+    // frame, and decodes from there. The timestamps then count up from this frame, as if the file
+    // was read from the start, even if we looped before. Not available with a replay cache.
+    //
+    // The first seek needs the keyframe index. If it wasn't cached in a sidecar file, the whole
+    // file is read to build it (without decoding anything), and the sidecar is written. Files
+    // decoded from a memory buffer have no index, and can't seek
+    bool seekToFrame(uint64_t frame);
+
+    // Seeks to the frame with the given timestamp, in the timestamps that getNextFrame() reports.
+    // This is the last frame at or before the timestamp
+    bool seekToTime(uint64_t timestamp_us);
+
+    // Builds the keyframe index now, instead of at the first seek. Returns true right away if we
+    // have one already
+    bool buildIndex(void);
+
+    // the number of frames in the file. 0 if there's no keyframe index yet
+    uint64_t getNumFrames(void) { return m_index.numFrames(); }
+
+    // the numbers of the keyframes, in presentation order. This builds the index if needed
+    bool getKeyframes(std::vector<uint64_t>* frames)
+    {
+        if(!buildIndex())
+            return false;
+        m_index.getKeyframes(frames);
+        return true;
+    }
+
     operator bool()
     {
         return m_bOpen && m_bOK;
@@ -77,19 +279,7 @@ public:
 
 private:
     // These support the FrameSource API
-    bool _getNextFrame  (IplImage* image, uint64_t* timestamp_us = NULL)
-    {
-        if(!readFrame(image))
-            return false;
-
-        if(timestamp_us != NULL)
-            // I've seen m_pCodecCtx->time_base.num==0 before. In that case I treat it as 1
-            *timestamp_us =
-                (uint64_t)m_pCodecCtx->frame_number *
-                (m_pCodecCtx->time_base.num == 0 ? 1ul : (uint64_t)m_pCodecCtx->time_base.num) *
-                (uint64_t)1000000 / m_pCodecCtx->time_base.den;
-        return true;
-    }
+    bool _getNextFrame  (IplImage* image, uint64_t* timestamp_us = NULL);
 
     // _getLatestFrame() and _getNextFrame() are identical here since I pull off the frames when
     // asked, without regard to the actual framerate
@@ -98,21 +288,19 @@ private:
         return _getNextFrame(image, timestamp_us);
     }
 
+    // The batch is decoded first, and then converted. The decoder and the scaler thus each stay
+    // hot in the cache for the whole batch, instead of trading places every frame
+    unsigned int _getNextFrames(unsigned int n, IplImage** images, uint64_t* timestamps_us);
+
+    // replayed frames can be lent out directly from the cache
+    bool _borrowFrame(IplImage* header, bool latest, uint64_t* timestamp_us);
+
     // static images don't have any hardware on/off switch. Thus these functions are stubs
     bool _stopStream   (void) { return true; }
     bool _resumeStream (void) { return true; }
 
-    bool _restartStream(void)
-    {
-        // I rewind to the start of the file
-        if(0 > av_seek_frame(m_pFormatCtx, m_videoStream,
-                             0, AVSEEK_FLAG_BYTE))
-        {
-            cerr << "_restartStream(): ffmpeg couldn't rewind to the start of the file" << endl;
-            return false;
-        }
-        return true;
-    }
+    // If I'm reading ahead, the thread does the rewinding, and this returns right away
+    bool _restartStream(void);
 };
 
 class FFmpegEncoder : public FFmpegTalker
@@ -0,0 +1,278 @@
+#include <unistd.h>
+#include <iostream>
+#include "ffmpegSegmentDecoder.hh"
+
+#include <opencv2/core/core_c.h>
+
+using namespace std;
+
+FFmpegSegmentDecoder::FFmpegSegmentDecoder(const char* _filename,
+                                           FrameSource_UserColorChoice _userColorMode,
+                                           unsigned int _numWorkers,
+                                           CvRect _cropRect, double scale,
+                                           unsigned int _segmentFrames,
+                                           unsigned int _queueFrames)
+    : FrameSource(_userColorMode), filename(_filename),
+      numWorkers(_numWorkers),
+      segmentFrames(_segmentFrames < 1 ? 1 : _segmentFrames),
+      queueFrames(_queueFrames == 0 ? segmentFrames : _queueFrames),
+      valid(false), stopWorkers(false), readSegment(0), readFrame(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init (&cond,  NULL);
+
+    if(numWorkers == 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        numWorkers = cores < 1 ? 1 : cores;
+    }
+
+    // The first decoder tells me where the keyframes are. Building the index writes its
+    // sidecar, so the other decoders simply load it. If the sidecar can't be written, each
+    // decoder builds its own
+    FFmpegDecoder* decoder = new FFmpegDecoder(filename.c_str(), userColorMode, false,
+                                               _cropRect, scale);
+    vector<uint64_t> keyframes;
+    if(!*decoder || !decoder->getKeyframes(&keyframes))
+    {
+        cerr << "FFmpegSegmentDecoder: couldn't index '" << filename << "'" << endl;
+        delete decoder;
+        return;
+    }
+    uint64_t numFrames = decoder->getNumFrames();
+
+    // Each segment starts at a keyframe, at least segmentFrames after the previous one. The
+    // first starts at frame 0 even if that isn't a keyframe: the seek takes care of that
+    for(unsigned int i=0; i<keyframes.size(); i++)
+    {
+        if(!segments.empty() && keyframes[i] < segments.back().start + segmentFrames)
+            continue;
+
+        Segment segment;
+        segment.start     = segments.empty() ? 0 : keyframes[i];
+        segment.numFrames = 0;
+        segments.push_back(segment);
+    }
+    for(unsigned int i=0; i<segments.size(); i++)
+        segments[i].numFrames =
+            (i+1 < segments.size() ? segments[i+1].start : numFrames) - segments[i].start;
+
+    if(numWorkers > segments.size())
+        numWorkers = segments.size();
+
+    // the workers do all the cropping and scaling. Their output is mine
+    width  = decoder->w();
+    height = decoder->h();
+    setupCroppingScaling(cvRect(-1, -1, -1, -1), 1.0);
+
+    for(unsigned int i=0; i<numWorkers; i++)
+    {
+        if(i > 0)
+            decoder = new FFmpegDecoder(filename.c_str(), userColorMode, false, _cropRect, scale);
+
+        Worker* worker  = new Worker;
+        worker->parent  = this;
+        worker->index   = i;
+        worker->thread  = 0;
+        worker->decoder = decoder;
+        worker->failed  = false;
+        workers.push_back(worker);
+
+        if(!*decoder)
+        {
+            cerr << "FFmpegSegmentDecoder: couldn't open '" << filename << "' for worker " << i << endl;
+            return;
+        }
+    }
+
+    valid = startWorkers();
+    if(valid)
+        isRunningNow.setTrue();
+}
+
+FFmpegSegmentDecoder::~FFmpegSegmentDecoder()
+{
+    cleanupThreads();
+    close();
+    pthread_cond_destroy (&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+void FFmpegSegmentDecoder::close(void)
+{
+    joinWorkers();
+    lentFrame.release();
+
+    // the workers' frames are gone by now, so their pools can go too
+    for(unsigned int i=0; i<workers.size(); i++)
+    {
+        delete workers[i]->decoder;
+        delete workers[i];
+    }
+    workers.clear();
+    segments.clear();
+    valid = false;
+    isRunningNow.reset();
+}
+
+bool FFmpegSegmentDecoder::startWorkers(void)
+{
+    stopWorkers = false;
+    readSegment = 0;
+    readFrame   = 0;
+
+    for(unsigned int i=0; i<workers.size(); i++)
+    {
+        Worker* worker = workers[i];
+        worker->failed = false;
+
+        // the conversion settings are picked up when the workers start
+        worker->decoder->setInterpolation(interpolation);
+
+        if(pthread_create(&worker->thread, NULL, &workerThread, worker) != 0)
+        {
+            worker->thread = 0;
+            cerr << "FFmpegSegmentDecoder: couldn't start worker thread " << i << endl;
+            joinWorkers();
+            return false;
+        }
+    }
+    return true;
+}
+
+void FFmpegSegmentDecoder::joinWorkers(void)
+{
+    pthread_mutex_lock(&mutex);
+    stopWorkers = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    for(unsigned int i=0; i<workers.size(); i++)
+    {
+        if(workers[i]->thread != 0)
+        {
+            pthread_join(workers[i]->thread, NULL);
+            workers[i]->thread = 0;
+        }
+        workers[i]->frames.clear();
+        workers[i]->timestamps.clear();
+    }
+}
+
+void* FFmpegSegmentDecoder::workerThread(void* worker)
+{
+    ((Worker*)worker)->parent->workerLoop((Worker*)worker);
+    return NULL;
+}
+
+void FFmpegSegmentDecoder::workerLoop(Worker* worker)
+{
+    for(unsigned int s = worker->index; s < segments.size(); s += numWorkers)
+    {
+        bool result = worker->decoder->seekToFrame(segments[s].start);
+
+        for(uint64_t i=0; result && i<segments[s].numFrames; i++)
+        {
+            // I wait for room in my queue
+            pthread_mutex_lock(&mutex);
+            while(!stopWorkers && worker->frames.size() >= queueFrames)
+                pthread_cond_wait(&cond, &mutex);
+            bool stop = stopWorkers;
+            pthread_mutex_unlock(&mutex);
+            if(stop)
+                return;
+
+            FrameHandle frame;
+            uint64_t    timestamp_us;
+            result = worker->decoder->getNextFrame(&frame, &timestamp_us);
+            if(!result)
+                break;
+
+            pthread_mutex_lock(&mutex);
+            worker->frames.push_back(frame);
+            worker->timestamps.push_back(timestamp_us);
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        if(!result)
+        {
+            cerr << "FFmpegSegmentDecoder: worker " << worker->index
+                 << " couldn't decode segment " << s << endl;
+
+            pthread_mutex_lock(&mutex);
+            worker->failed = true;
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+    }
+}
+
+// Takes the next frame, in order, from the worker decoding it. Waits for it if needed
+bool FFmpegSegmentDecoder::takeFrame(FrameHandle* frame, uint64_t* timestamp_us)
+{
+    if(!valid || readSegment >= segments.size())
+        return false;
+
+    Worker* worker = workers[readSegment % numWorkers];
+
+    pthread_mutex_lock(&mutex);
+    while(worker->frames.empty() && !worker->failed)
+        pthread_cond_wait(&cond, &mutex);
+
+    if(worker->frames.empty())
+    {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+
+    *frame = worker->frames.front();
+    if(timestamp_us != NULL)
+        *timestamp_us = worker->timestamps.front();
+    worker->frames.pop_front();
+    worker->timestamps.pop_front();
+
+    // there's room in the worker's queue now
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    if(++readFrame == segments[readSegment].numFrames)
+    {
+        readSegment++;
+        readFrame = 0;
+    }
+    return true;
+}
+
+bool FFmpegSegmentDecoder::_getNextFrame(IplImage* image, uint64_t* timestamp_us)
+{
+    FrameHandle frame;
+    if(!takeFrame(&frame, timestamp_us))
+        return false;
+
+    cvCopy(frame, image);
+    return true;
+}
+
+bool FFmpegSegmentDecoder::_borrowFrame(IplImage* header, bool latest __attribute__((unused)),
+                                        uint64_t* timestamp_us)
+{
+    if(!takeFrame(&lentFrame, timestamp_us))
+        return false;
+
+    IplImage* image = lentFrame;
+    cvInitImageHeader(header, cvGetSize(image), IPL_DEPTH_8U, image->nChannels);
+    cvSetData(header, image->imageData, image->widthStep);
+    return true;
+}
+
+bool FFmpegSegmentDecoder::_restartStream(void)
+{
+    if(workers.empty())
+        return false;
+
+    joinWorkers();
+    valid = startWorkers();
+    return valid;
+}
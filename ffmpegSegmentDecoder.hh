@@ -0,0 +1,113 @@
+// -*- c++ -*-
+
+#ifndef __FFMPEG_SEGMENT_DECODER_HH__
+#define __FFMPEG_SEGMENT_DECODER_HH__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include <string>
+#include "ffmpegInterface.hh"
+
+// Decodes a video file on several cores at once, for offline processing. The file is split into
+// segments that start at keyframes, and each segment can thus be decoded on its own. Each worker
+// has its own FFmpegDecoder, which seeks to its segments, and decodes and converts them. The
+// frames are handed out in order, with the same timestamps that a plain FFmpegDecoder gives.
+//
+// This scales best with intra-only formats (every frame is a keyframe, as in the FFV1 files
+// FFmpegEncoder writes): the segments can then be as short as we like. With long GOPs the
+// segments are at least a GOP long, and each worker can get ahead of the reader only by its
+// queue. A GOP that doesn't fit into the queue is thus decoded with less parallelism than asked
+// for.
+//
+// There's no looping, and no real-time behavior: each frame is read as soon as it's ready
+class FFmpegSegmentDecoder : public FrameSource
+{
+    struct Segment
+    {
+        uint64_t start, numFrames;
+    };
+
+    struct Worker
+    {
+        FFmpegSegmentDecoder* parent;
+        unsigned int          index;
+        pthread_t             thread;
+        FFmpegDecoder*        decoder;
+
+        // The decoded and converted frames, in order. The worker decodes segments index,
+        // index+numWorkers, index+2*numWorkers, ... so the frames of each of its segments are
+        // here in the order the reader wants them
+        std::deque<FrameHandle> frames;
+        std::deque<uint64_t>    timestamps;
+        bool                    failed;
+    };
+
+    std::string          filename;
+    std::vector<Segment> segments;
+    std::vector<Worker*> workers;
+    unsigned int         numWorkers;
+    unsigned int         segmentFrames;
+    unsigned int         queueFrames;
+    bool                 valid;
+
+    // protects the workers' queues. The workers and the reader wait on the condition
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    bool            stopWorkers;
+
+    // where the reader is: the segment, and the frame in it
+    unsigned int    readSegment;
+    uint64_t        readFrame;
+
+    // the frame lent out by _borrowFrame()
+    FrameHandle     lentFrame;
+
+    bool startWorkers(void);
+    void joinWorkers(void);
+    void workerLoop(Worker* worker);
+    static void* workerThread(void* worker);
+
+    bool takeFrame(FrameHandle* frame, uint64_t* timestamp_us);
+
+public:
+    // numWorkers is the number of decoders running in parallel. 0 means one per core. The
+    // segments are at least segmentFrames long, and each worker gets up to queueFrames ahead of
+    // the reader. queueFrames = 0 means as many as segmentFrames. The cropping and scaling are
+    // as in FFmpegDecoder, and are done by the workers
+    FFmpegSegmentDecoder(const char* _filename, FrameSource_UserColorChoice _userColorMode,
+                         unsigned int _numWorkers = 0,
+                         CvRect _cropRect = cvRect(-1, -1, -1, -1),
+                         double scale = 1.0,
+                         unsigned int _segmentFrames = 32,
+                         unsigned int _queueFrames = 0);
+    ~FFmpegSegmentDecoder();
+
+    void close(void);
+
+    operator bool() { return valid; }
+
+    unsigned int getNumSegments(void) { return segments.size(); }
+
+private:
+    bool _getNextFrame  (IplImage* image, uint64_t* timestamp_us = NULL);
+
+    // this isn't a real-time source, so the latest frame is simply the next one
+    bool _getLatestFrame(IplImage* image, uint64_t* timestamp_us = NULL)
+    {
+        return _getNextFrame(image, timestamp_us);
+    }
+
+    // the workers' frames are lent out directly
+    bool _borrowFrame(IplImage* header, bool latest, uint64_t* timestamp_us);
+    void _returnFrame(void) { lentFrame.release(); }
+
+    bool _stopStream   (void) { return true; }
+    bool _resumeStream (void) { return true; }
+
+    // goes back to the first frame. The workers are restarted from their first segments
+    bool _restartStream(void);
+};
+
+#endif
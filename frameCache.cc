@@ -0,0 +1,64 @@
+#include <iostream>
+#include "frameCache.hh"
+using namespace std;
+
+FrameCache::FrameCache(size_t _budgetBytes)
+    : budgetBytes(_budgetBytes)
+{
+    reset();
+}
+
+void FrameCache::reset(void)
+{
+    frames.clear();
+    timestamps.clear();
+    usedBytes   = 0;
+    complete    = false;
+    overBudget  = false;
+    replayIndex = 0;
+}
+
+bool FrameCache::add(const FrameHandle& frame, uint64_t timestamp_us)
+{
+    if(!isRecording())
+        return false;
+
+    IplImage* image = frame;
+    size_t    bytes = (size_t)image->widthStep * (size_t)image->height;
+    if(usedBytes + bytes > budgetBytes)
+    {
+        cerr << "FrameCache: the frames don't fit into the " << budgetBytes
+             << "-byte budget. Disabling the cache" << endl;
+        frames.clear();
+        timestamps.clear();
+        usedBytes  = 0;
+        overBudget = true;
+        return false;
+    }
+
+    frames.push_back(frame);
+    timestamps.push_back(timestamp_us);
+    usedBytes += bytes;
+    return true;
+}
+
+bool FrameCache::finishRecording(void)
+{
+    if(!isRecording() || frames.empty())
+        return false;
+
+    complete    = true;
+    replayIndex = 0;
+    return true;
+}
+
+const FrameHandle& FrameCache::replay(uint64_t* timestamp_us)
+{
+    if(replayIndex >= frames.size())
+        replayIndex = 0;
+
+    if(timestamp_us != NULL)
+        *timestamp_us = timestamps[replayIndex];
+
+    return frames[replayIndex++];
+}
@@ -0,0 +1,54 @@
+// -*- c++ -*-
+
+#ifndef __FRAME_CACHE_HH__
+#define __FRAME_CACHE_HH__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "framePool.hh"
+
+// A memory-budgeted cache of final (post-cropping, post-scaling) frames. Looping sources record
+// their first pass through the data here. If the whole pass fits into the budget, subsequent
+// passes are replayed from the cache instead of being decoded and converted again. If the budget
+// is exceeded, the cache throws everything away and stays disabled until it is reset
+class FrameCache
+{
+    std::vector<FrameHandle> frames;
+    std::vector<uint64_t>    timestamps;
+
+    size_t       budgetBytes;
+    size_t       usedBytes;
+    bool         complete;    // the full pass was recorded, and we're replaying
+    bool         overBudget;  // the pass didn't fit. We're disabled
+    unsigned int replayIndex;
+
+public:
+    FrameCache(size_t _budgetBytes);
+
+    // Records a frame. The cache keeps a reference to the frame, so the caller must not write into
+    // it afterwards. Returns false if the cache is (now) over budget and thus disabled
+    bool add(const FrameHandle& frame, uint64_t timestamp_us);
+
+    // Tells the cache that all the frames have been recorded. From now on replay() can be used.
+    // Returns false if the cache was disabled, in which case the caller must keep decoding
+    bool finishRecording(void);
+
+    bool isRecording(void) { return !complete && !overBudget; }
+    bool isComplete (void) { return complete; }
+
+    // Returns the next cached frame, wrapping around at the end. The frames must not be written
+    // into. timestamp_us is the timestamp recorded with the frame
+    const FrameHandle& replay(uint64_t* timestamp_us = NULL);
+
+    // restart the replay from the first frame
+    void rewind(void) { replayIndex = 0; }
+
+    // throws away all the frames and re-enables recording
+    void reset(void);
+
+    unsigned int numFrames(void) { return frames.size(); }
+    size_t       bytesUsed(void) { return usedBytes; }
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "framePacer.hh"
+
+// The capture latency estimate is the lowest one seen, since the higher ones include scheduling
+// delays. It creeps up by this much per frame, to follow slow drift between the clocks
+#define PHASELOCK_OFFSET_LEAK_US 20
+
+void FramePacer::start(uint64_t _period_us, bool _phaseLock)
+{
+    period_us  = _period_us;
+    phaseLock  = _phaseLock;
+    haveOffset = false;
+
+    current_us = MT_now_us();
+    next_us    = current_us + period_us;
+}
+
+// how far ahead of the frames I try to wake up when phase-locking
+uint64_t FramePacer::guard(void)
+{
+    uint64_t g = period_us / 8;
+    return g > 2000 ? 2000 : g;
+}
+
+bool FramePacer::wait(MTstopToken* stop, unsigned int* missed)
+{
+    uint64_t now = MT_now_us();
+
+    // If I'm more than a period late, I skip the deadlines I missed entirely. If I'm late by less
+    // than that, I take this deadline right away
+    unsigned int numMissed = 0;
+    wokeOnTime = now <= next_us;
+    if(!wokeOnTime)
+    {
+        numMissed = (unsigned int)((now - next_us) / period_us);
+        next_us  += (uint64_t)numMissed * period_us;
+    }
+    if(missed != NULL)
+        *missed = numMissed;
+
+    bool result;
+    if(stop != NULL)
+        result = stop->sleepUntil(next_us);
+    else
+    {
+        struct timespec t;
+        t.tv_sec  = next_us / 1000000;
+        t.tv_nsec = (next_us % 1000000) * 1000;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+            ;
+        result = true;
+    }
+
+    // A wakeup delayed by the scheduler doesn't tell me anything about the phase either
+    if(MT_now_us() > next_us + guard())
+        wokeOnTime = false;
+
+    current_us = next_us;
+    next_us   += period_us;
+    return result;
+}
+
+void FramePacer::frameTimestamp(uint64_t timestamp_us)
+{
+    if(!phaseLock || timestamp_us == 0)
+        return;
+
+    int64_t offset = (int64_t)MT_now_us() - (int64_t)timestamp_us;
+    if(!haveOffset || offset < offset_us)
+    {
+        offset_us  = offset;
+        haveOffset = true;
+    }
+    else
+        offset_us += PHASELOCK_OFFSET_LEAK_US;
+
+    // If I woke up late, the frame I got says nothing about where my deadline should be
+    if(!wokeOnTime)
+        return;
+
+    // When the frame became available, on my clock
+    int64_t arrival = (int64_t)timestamp_us + offset_us;
+
+    // I want to wake up a little before the frame comes in. I nudge the grid towards that point
+    // a bit at a time, so a single late frame doesn't throw it off. The average period is
+    // unaffected
+    int64_t error = arrival - (int64_t)guard() - (int64_t)current_us;
+    int64_t limit = (int64_t)period_us / 4;
+    int64_t correction = error / 2;
+    if(correction >  limit) correction =  limit;
+    if(correction < -limit) correction = -limit;
+
+    next_us = (uint64_t)((int64_t)next_us + correction);
+}
@@ -0,0 +1,57 @@
+// -*- c++ -*-
+
+#ifndef __FRAME_PACER_HH__
+#define __FRAME_PACER_HH__
+
+#include <stdint.h>
+#include "threadUtils.hh"
+
+// Paces a capture loop to a fixed rate. The wakeups are on a fixed grid of absolute
+// CLOCK_MONOTONIC deadlines, so the time spent capturing and processing each frame doesn't add to
+// the period: the rate doesn't drift, and the jitter doesn't accumulate. If the loop falls more
+// than a period behind, the deadlines it missed are skipped (and counted) instead of being made up
+// with a burst of frames.
+//
+// Optionally the grid can be phase-locked to the source's frame timestamps. The loop then wakes
+// up just before a frame comes in, instead of at some arbitrary point between frames. Since the
+// paced loop takes the first frame that comes in after it wakes up, this minimizes the time
+// spent waiting for it, and the latency of the delivered frames. This works if the period is a
+// multiple of the source's frame interval
+class FramePacer
+{
+    uint64_t period_us;
+    uint64_t current_us; // the deadline I last woke up at
+    uint64_t next_us;    // the deadline I'll wake up at next
+    bool     wokeOnTime; // did I get to the last deadline before it passed?
+
+    // phase-locking state. The offset between the source's timestamps and CLOCK_MONOTONIC, as seen
+    // when the frames come out of the source. This includes the capture latency
+    bool     phaseLock;
+    bool     haveOffset;
+    int64_t  offset_us;
+
+    uint64_t guard(void);
+
+public:
+    FramePacer()
+        : period_us(0), current_us(0), next_us(0), wokeOnTime(false),
+          phaseLock(false), haveOffset(false), offset_us(0)
+    {
+    }
+
+    // (re)starts the pacing. The first deadline is one period from now
+    void start(uint64_t _period_us, bool _phaseLock = false);
+
+    // Starts the grid over from now, with the same settings. For when the paced stream was
+    // paused: the deadlines that passed during the pause weren't missed
+    void restart(void) { start(period_us, phaseLock); }
+
+    // Sleeps until the next deadline. If deadlines were missed, the number missed is reported in
+    // *missed. Returns false if a stop was requested through the token
+    bool wait(MTstopToken* stop = NULL, unsigned int* missed = NULL);
+
+    // Reports the timestamp of the frame taken after the last wait(). Used only for phase-locking
+    void frameTimestamp(uint64_t timestamp_us);
+};
+
+#endif
@@ -0,0 +1,325 @@
+#include <map>
+#include <iostream>
+#include "framePipeline.hh"
+#include "ffmpegInterface.hh"
+#include "cvFltkWidget.hh"
+
+#include <opencv2/core/core_c.h>
+using namespace std;
+
+struct FramePipeline_Stage
+{
+    FramePipeline_Stage_t*    func;
+    void*                     cookie;
+    FramePipeline_Concurrency concurrency;
+    std::vector<int>          children;
+
+    // For serial stages. The frames are run in order, one at a time. Frames that come in early
+    // wait in "pending" until their turn comes
+    pthread_mutex_t                          mutex;
+    uint64_t                                 nextSeq;
+    bool                                     busy;
+    std::map<uint64_t, FramePipeline_Task*>  pending;
+};
+
+// A frame going through the pipeline. It's done when all its tasks are done
+struct FramePipeline_Frame
+{
+    FramePipeline*  pipeline;
+    uint64_t        seq;
+    uint64_t        timestamp_us;
+    int             tasksLeft; // atomic
+};
+
+// One frame going through one stage. A skipped task doesn't call the stage; it only tells the
+// children that this frame isn't coming, so that the serial ones don't wait for it
+struct FramePipeline_Task
+{
+    FramePipeline_Frame* frame;
+    int                  stage;
+    FrameHandle          input;
+    bool                 skip;
+};
+
+FramePipeline::FramePipeline(unsigned int _maxInFlight, int numThreads)
+    : maxInFlight(_maxInFlight < 1 ? 1 : _maxInFlight),
+      numInFlight(0), nextSeq(0),
+      feeder_id(0), feeder_source(NULL), feeder_frameWait_us(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init (&frameDoneCond, NULL);
+    pool = new TaskPool(numThreads);
+}
+
+FramePipeline::~FramePipeline()
+{
+    stop();
+    wait();
+    delete pool;
+
+    for(unsigned int i=0; i<stages.size(); i++)
+    {
+        pthread_mutex_destroy(&stages[i]->mutex);
+        delete stages[i];
+    }
+
+    pthread_cond_destroy (&frameDoneCond);
+    pthread_mutex_destroy(&mutex);
+}
+
+int FramePipeline::addStage(FramePipeline_Stage_t* func, void* cookie, int parent,
+                            FramePipeline_Concurrency concurrency)
+{
+    if(nextSeq != 0)
+    {
+        cerr << "FramePipeline: stages must be added before any frames are pushed" << endl;
+        return -1;
+    }
+    if(parent != FRAMEPIPELINE_SOURCE && (parent < 0 || parent >= (int)stages.size()))
+    {
+        cerr << "FramePipeline: parent stage " << parent << " doesn't exist" << endl;
+        return -1;
+    }
+
+    FramePipeline_Stage* stage = new FramePipeline_Stage;
+    stage->func        = func;
+    stage->cookie      = cookie;
+    stage->concurrency = concurrency;
+    stage->nextSeq     = 0;
+    stage->busy        = false;
+    pthread_mutex_init(&stage->mutex, NULL);
+
+    int index = (int)stages.size();
+    stages.push_back(stage);
+
+    if(parent == FRAMEPIPELINE_SOURCE) rootStages.push_back(index);
+    else                               stages[parent]->children.push_back(index);
+    return index;
+}
+
+void FramePipeline::push(const FrameHandle& frame, uint64_t timestamp_us)
+{
+    pthread_mutex_lock(&mutex);
+    while(numInFlight >= maxInFlight)
+        pthread_cond_wait(&frameDoneCond, &mutex);
+    numInFlight++;
+    uint64_t seq = nextSeq++;
+    pthread_mutex_unlock(&mutex);
+
+    FramePipeline_Frame* f = new FramePipeline_Frame;
+    f->pipeline     = this;
+    f->seq          = seq;
+    f->timestamp_us = timestamp_us;
+
+    // I hold a reference to the frame while I hand it out, so it can't finish under me
+    f->tasksLeft    = 1;
+
+    FramePipeline_Task root;
+    root.frame = f;
+    for(unsigned int i=0; i<rootStages.size(); i++)
+        deliver(rootStages[i], &root, frame, false);
+
+    if(__sync_sub_and_fetch(&f->tasksLeft, 1) == 0)
+        frameDone(f);
+}
+
+void FramePipeline::deliver(int stageIndex, FramePipeline_Task* parent, const FrameHandle& frame,
+                            bool skip)
+{
+    FramePipeline_Stage* stage = stages[stageIndex];
+
+    FramePipeline_Task* task = new FramePipeline_Task;
+    task->frame = parent->frame;
+    task->stage = stageIndex;
+    task->input = frame;
+    task->skip  = skip;
+    __sync_add_and_fetch(&task->frame->tasksLeft, 1);
+
+    if(stage->concurrency == FRAMEPIPELINE_PARALLEL)
+    {
+        pool->submit(&runTask, task);
+        return;
+    }
+
+    pthread_mutex_lock(&stage->mutex);
+    if(!stage->busy && stage->nextSeq == task->frame->seq)
+    {
+        stage->busy = true;
+        pthread_mutex_unlock(&stage->mutex);
+        pool->submit(&runTask, task);
+        return;
+    }
+    stage->pending[task->frame->seq] = task;
+    pthread_mutex_unlock(&stage->mutex);
+}
+
+// a serial stage finished a frame. I start the next one, if it's here already
+void FramePipeline::scheduleNext(FramePipeline_Stage* stage)
+{
+    pthread_mutex_lock(&stage->mutex);
+    stage->nextSeq++;
+
+    std::map<uint64_t, FramePipeline_Task*>::iterator it = stage->pending.find(stage->nextSeq);
+    if(it == stage->pending.end())
+    {
+        stage->busy = false;
+        pthread_mutex_unlock(&stage->mutex);
+        return;
+    }
+
+    FramePipeline_Task* task = it->second;
+    stage->pending.erase(it);
+    pthread_mutex_unlock(&stage->mutex);
+
+    pool->submit(&runTask, task);
+}
+
+void FramePipeline::runTask(void* _task)
+{
+    FramePipeline_Task*  task     = (FramePipeline_Task*)_task;
+    FramePipeline_Frame* frame    = task->frame;
+    FramePipeline*       pipeline = frame->pipeline;
+    FramePipeline_Stage* stage    = pipeline->stages[task->stage];
+
+    FrameHandle output;
+    bool        skip = task->skip;
+    if(!skip)
+    {
+        output = task->input;
+        skip   = !(*stage->func)(task->input, &output, frame->timestamp_us, stage->cookie);
+    }
+
+    // I don't need the input anymore. Letting it go now lets the pool reuse it sooner
+    task->input.release();
+    if(skip)
+        output.release();
+
+    for(unsigned int i=0; i<stage->children.size(); i++)
+        pipeline->deliver(stage->children[i], task, output, skip);
+    output.release();
+
+    if(stage->concurrency == FRAMEPIPELINE_SERIAL)
+        pipeline->scheduleNext(stage);
+
+    delete task;
+    if(__sync_sub_and_fetch(&frame->tasksLeft, 1) == 0)
+        pipeline->frameDone(frame);
+}
+
+void FramePipeline::frameDone(FramePipeline_Frame* frame)
+{
+    delete frame;
+
+    pthread_mutex_lock(&mutex);
+    numInFlight--;
+    pthread_cond_broadcast(&frameDoneCond);
+    pthread_mutex_unlock(&mutex);
+}
+
+void FramePipeline::wait(void)
+{
+    pthread_mutex_lock(&mutex);
+    while(numInFlight > 0)
+        pthread_cond_wait(&frameDoneCond, &mutex);
+    pthread_mutex_unlock(&mutex);
+}
+
+void* FramePipeline::feederThread(void* pipeline)
+{
+    ((FramePipeline*)pipeline)->feeder();
+    return NULL;
+}
+
+void FramePipeline::feeder(void)
+{
+    while(!feeder_stop)
+    {
+        FrameHandle            frame;
+        uint64_t               timestamp_us = 0;
+        FrameSource_WaitResult result;
+
+        if(feeder_frameWait_us != 0)
+        {
+            // same as the paced source thread: sleep until the next deadline, then take the
+            // newest frame
+            if(!feeder_pacer.wait(&feeder_stop))
+                return;
+
+            result = feeder_source->getLatestFrameTimed(&frame, MT_FOREVER, &timestamp_us,
+                                                        &feeder_stop);
+        }
+        else
+            result = feeder_source->getNextFrameTimed(&frame, MT_FOREVER, &timestamp_us,
+                                                      &feeder_stop);
+
+        // a timeout means I was asked to stop
+        if(result == FRAMESOURCE_TIMEOUT)
+            return;
+        if(result == FRAMESOURCE_ERROR)
+        {
+            cerr << "pipeline feeder couldn't get frame. Stopping" << endl;
+            return;
+        }
+
+        push(frame, timestamp_us);
+    }
+}
+
+bool FramePipeline::start(FrameSource* source, uint64_t frameWait_us)
+{
+    if(feeder_id != 0)
+        return false;
+
+    feeder_source       = source;
+    feeder_frameWait_us = frameWait_us;
+    feeder_pacer.start(frameWait_us);
+    if(pthread_create(&feeder_id, NULL, &feederThread, this) != 0)
+    {
+        feeder_id = 0;
+        cerr << "couldn't start the pipeline feeder thread" << endl;
+        return false;
+    }
+    return true;
+}
+
+void FramePipeline::stop(void)
+{
+    if(feeder_id == 0)
+        return;
+
+    // push() may be waiting for frames in flight to finish. It'll get through, since the frames
+    // keep going
+    feeder_stop.requestStop();
+    pthread_join(feeder_id, NULL);
+    feeder_id = 0;
+    feeder_stop.reset();
+}
+
+bool FramePipeline_encoderSink(const FrameHandle& input,
+                               FrameHandle*       output       __attribute__((unused)),
+                               uint64_t           timestamp_us __attribute__((unused)),
+                               void*              encoder)
+{
+    FFmpegEncoder* e = (FFmpegEncoder*)encoder;
+    if( !*e || !e->writeFrame(input) || !*e )
+    {
+        cerr << "Couldn't encode frame!" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool FramePipeline_widgetSink(const FrameHandle& input,
+                              FrameHandle*       output       __attribute__((unused)),
+                              uint64_t           timestamp_us __attribute__((unused)),
+                              void*              widget)
+{
+    CvFltkWidget* w = (CvFltkWidget*)widget;
+
+    // the widget's buffer is shared with the GUI thread
+    Fl::lock();
+    cvCopy(input, *w);
+    w->redrawNewFrame();
+    Fl::unlock();
+    return true;
+}
@@ -0,0 +1,109 @@
+// -*- c++ -*-
+
+#ifndef __FRAME_PIPELINE_HH__
+#define __FRAME_PIPELINE_HH__
+
+#include <stdint.h>
+#include <vector>
+#include "frameSource.hh"
+#include "taskPool.hh"
+
+// A processing stage. input is the frame coming from the parent stage (or from the source).
+// *output is what's passed on to the children; it starts out as the input. A stage that
+// produces a new image should write it into a new frame (from a FramePool it owns, for
+// instance), and set *output to that. The input frame may be shared with other stages running
+// concurrently, so it must NOT be modified. Returning false drops the frame: the children skip
+// it
+typedef bool (FramePipeline_Stage_t)(const FrameHandle& input, FrameHandle* output,
+                                     uint64_t timestamp_us, void* cookie);
+
+enum FramePipeline_Concurrency
+{
+    // One frame at a time, in order. For stages that have state (encoders, trackers) or that
+    // touch a shared resource (a display)
+    FRAMEPIPELINE_SERIAL,
+
+    // Any number of frames at the same time, in any order. For stateless stages
+    FRAMEPIPELINE_PARALLEL
+};
+
+// the parent of the stages that take frames directly from the source
+#define FRAMEPIPELINE_SOURCE (-1)
+
+struct FramePipeline_Stage;
+struct FramePipeline_Task;
+struct FramePipeline_Frame;
+
+// Runs frames through a tree of processing stages on a work-stealing TaskPool. Each stage takes
+// the output of its parent and passes its own output on to all its children. Different frames
+// are in different stages at the same time: while frame k is in stage N, frame k+1 can be in
+// stage N-1. Thus the throughput is limited by the slowest serial stage, not by the sum of all
+// the stages. Parallel stages can also work on several frames at once.
+//
+// Up to maxInFlight frames are in the pipeline at any time. Pushing more blocks until the oldest
+// ones are done. The stages must all be added before the first frame goes in
+class FramePipeline
+{
+    std::vector<FramePipeline_Stage*> stages;
+    std::vector<int>                  rootStages;
+
+    TaskPool* pool;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  frameDoneCond;
+    unsigned int    maxInFlight;
+    unsigned int    numInFlight;
+    uint64_t        nextSeq;
+
+    // the thread feeding frames from a source
+    pthread_t    feeder_id;
+    FrameSource* feeder_source;
+    uint64_t     feeder_frameWait_us;
+    MTstopToken  feeder_stop;
+    FramePacer   feeder_pacer;
+
+    static void* feederThread(void* pipeline);
+    void feeder(void);
+
+    static void runTask(void* task);
+    void deliver(int stage, FramePipeline_Task* parent, const FrameHandle& frame, bool skip);
+    void scheduleNext(FramePipeline_Stage* stage);
+    void frameDone(FramePipeline_Frame* frame);
+
+public:
+    // numThreads <= 0 means one thread per core
+    FramePipeline(unsigned int _maxInFlight = 4, int numThreads = 0);
+
+    // stops the feeder and waits for the frames in flight to finish
+    ~FramePipeline();
+
+    // Adds a stage that takes its frames from the given parent stage (or from the source). Returns
+    // the index of the new stage, to be used as the parent of later stages, or -1 on error
+    int addStage(FramePipeline_Stage_t* func, void* cookie,
+                 int parent = FRAMEPIPELINE_SOURCE,
+                 FramePipeline_Concurrency concurrency = FRAMEPIPELINE_SERIAL);
+
+    // Sends a frame down the pipeline. This blocks if maxInFlight frames are already in it
+    void push(const FrameHandle& frame, uint64_t timestamp_us);
+
+    // Starts a thread that pulls frames from the source and pushes them. The source's pooled
+    // frames are used, so size the source's FramePool for maxInFlight frames. frameWait_us
+    // limits the frame rate, as with FrameSource::startSourceThread(). The thread stops if the
+    // source fails to produce a frame
+    bool start(FrameSource* source, uint64_t frameWait_us = 0);
+
+    // stops the feeder thread started by start(). The frames in flight keep going
+    void stop(void);
+
+    // waits for all the frames in flight to make it through
+    void wait(void);
+};
+
+// Sink stages for the FFmpegEncoder and the CvFltkWidget. The cookie is the encoder or the
+// widget. These must be added as FRAMEPIPELINE_SERIAL stages
+bool FramePipeline_encoderSink(const FrameHandle& input, FrameHandle* output,
+                               uint64_t timestamp_us, void* encoder);
+bool FramePipeline_widgetSink (const FrameHandle& input, FrameHandle* output,
+                               uint64_t timestamp_us, void* widget);
+
+#endif
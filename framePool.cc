@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <iostream>
+#include "framePool.hh"
+
+#include <opencv2/core/core_c.h>
+using namespace std;
+
+FrameHandle::FrameHandle(FramePool_Buffer* _buf)
+    : buf(_buf)
+{
+    if(buf != NULL)
+        __sync_add_and_fetch(&buf->refcount, 1);
+}
+
+FrameHandle::FrameHandle(const FrameHandle& other)
+    : buf(other.buf)
+{
+    if(buf != NULL)
+        __sync_add_and_fetch(&buf->refcount, 1);
+}
+
+FrameHandle& FrameHandle::operator=(const FrameHandle& other)
+{
+    // take the new reference before dropping the old one, in case they're the same buffer
+    if(other.buf != NULL)
+        __sync_add_and_fetch(&other.buf->refcount, 1);
+    release();
+    buf = other.buf;
+    return *this;
+}
+
+void FrameHandle::release(void)
+{
+    if(buf == NULL)
+        return;
+
+    if(__sync_sub_and_fetch(&buf->refcount, 1) == 0)
+        buf->pool->put(buf);
+    buf = NULL;
+}
+
+int FrameHandle::refcount(void) const
+{
+    return buf == NULL ? 0 : __sync_add_and_fetch(&buf->refcount, 0);
+}
+
+
+
+void* FramePool::allocAligned(size_t size, bool tryHugepages, bool* gotHugepages)
+{
+    if(gotHugepages != NULL)
+        *gotHugepages = false;
+
+    if(tryHugepages)
+    {
+        // Explicit hugepages need to be reserved by the admin (vm.nr_hugepages), so this may
+        // fail. If it does, I fall back on a normal allocation, and ask for transparent
+        // hugepages
+        size_t sizeRounded = (size + FRAMEPOOL_HUGEPAGE_SIZE-1) & ~(size_t)(FRAMEPOOL_HUGEPAGE_SIZE-1);
+        void* data = mmap(NULL, sizeRounded, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(data != MAP_FAILED)
+        {
+            if(gotHugepages != NULL)
+                *gotHugepages = true;
+            return data;
+        }
+    }
+
+    void* data;
+    if(posix_memalign(&data,
+                      tryHugepages ? FRAMEPOOL_HUGEPAGE_SIZE : FRAMEPOOL_ALIGNMENT,
+                      size) != 0)
+        return NULL;
+
+    if(tryHugepages)
+        madvise(data, size, MADV_HUGEPAGE);
+
+    return data;
+}
+
+void FramePool::freeAligned(void* data, size_t size, bool isHugepage)
+{
+    if(data == NULL)
+        return;
+
+    if(isHugepage)
+    {
+        size_t sizeRounded = (size + FRAMEPOOL_HUGEPAGE_SIZE-1) & ~(size_t)(FRAMEPOOL_HUGEPAGE_SIZE-1);
+        munmap(data, sizeRounded);
+    }
+    else
+        free(data);
+}
+
+
+
+FramePool::FramePool(int _width, int _height, int _nChannels,
+                     unsigned int numPreallocated,
+                     bool _useHugepages,
+                     unsigned int _maxBuffers,
+                     bool alignRows)
+    : width(_width), height(_height), nChannels(_nChannels),
+      useHugepages(_useHugepages), maxBuffers(_maxBuffers),
+      freeList(NULL), numAllocated(0), numOutstanding(0)
+{
+    stride     = alignRows ? alignedStride(width, nChannels) : width * nChannels;
+    bufferSize = (size_t)stride * (size_t)height;
+
+    for(unsigned int i=0; i<numPreallocated; i++)
+    {
+        FramePool_Buffer* buf = newBuffer();
+        if(buf == NULL)
+            break;
+
+        buf->next = freeList;
+        freeList  = buf;
+    }
+}
+
+FramePool::~FramePool()
+{
+    if(numOutstanding != 0)
+        cerr << "FramePool: destroying the pool while " << numOutstanding
+             << " frames are still in use. These will leak" << endl;
+
+    while(freeList != NULL)
+    {
+        FramePool_Buffer* buf = freeList;
+        freeList = buf->next;
+        deleteBuffer(buf);
+    }
+}
+
+FramePool_Buffer* FramePool::newBuffer(void)
+{
+    if(maxBuffers != 0 && numAllocated >= maxBuffers)
+        return NULL;
+
+    FramePool_Buffer* buf = new FramePool_Buffer;
+
+    buf->size = bufferSize;
+    buf->data = (unsigned char*)allocAligned(bufferSize, useHugepages, &buf->hugepage);
+    if(buf->data == NULL)
+    {
+        cerr << "FramePool: out of memory" << endl;
+        delete buf;
+        return NULL;
+    }
+
+    cvInitImageHeader(&buf->image, cvSize(width, height), IPL_DEPTH_8U, nChannels);
+    cvSetData(&buf->image, buf->data, stride);
+
+    buf->refcount = 0;
+    buf->pool     = this;
+    buf->next     = NULL;
+
+    numAllocated++;
+    return buf;
+}
+
+void FramePool::deleteBuffer(FramePool_Buffer* buf)
+{
+    freeAligned(buf->data, buf->size, buf->hugepage);
+    delete buf;
+    numAllocated--;
+}
+
+FrameHandle FramePool::get(void)
+{
+    mutex.lock();
+
+    FramePool_Buffer* buf = freeList;
+    if(buf != NULL)
+        freeList = buf->next;
+    else
+        buf = newBuffer();
+
+    if(buf != NULL)
+        numOutstanding++;
+
+    mutex.unlock();
+
+    if(buf == NULL)
+        return FrameHandle();
+
+    // the consumer may have left an ROI or COI on the image. Clear it out
+    cvResetImageROI(&buf->image);
+    return FrameHandle(buf);
+}
+
+void FramePool::put(FramePool_Buffer* buf)
+{
+    mutex.lock();
+    buf->next = freeList;
+    freeList  = buf;
+    numOutstanding--;
+    mutex.unlock();
+}
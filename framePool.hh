@@ -0,0 +1,146 @@
+// -*- c++ -*-
+
+#ifndef __FRAME_POOL_HH__
+#define __FRAME_POOL_HH__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <opencv2/core/types_c.h>
+#include "threadUtils.hh"
+
+// Pooled frame buffers. The buffers all start on a FRAMEPOOL_ALIGNMENT boundary and (by default)
+// every row does too, so SIMD kernels can assume aligned rows. Buffers are reference-counted and
+// return to their pool when the last reference goes away, so once the pool has warmed up no
+// memory is allocated at all
+#define FRAMEPOOL_ALIGNMENT 64
+#define FRAMEPOOL_HUGEPAGE_SIZE (2*1024*1024)
+
+class FramePool;
+
+struct FramePool_Buffer
+{
+    IplImage          image;    // describes the frame stored in data
+    unsigned char*    data;
+    size_t            size;     // bytes allocated
+    bool              hugepage; // is data in a hugepage mapping?
+    int               refcount;
+    FramePool*        pool;
+    FramePool_Buffer* next;     // free-list link
+};
+
+// A reference to a pooled frame. Copying the handle adds a reference. The buffer goes back to
+// the pool when the last handle to it is released or destroyed
+class FrameHandle
+{
+    FramePool_Buffer* buf;
+
+public:
+    FrameHandle() : buf(NULL) {}
+    explicit FrameHandle(FramePool_Buffer* _buf);
+    FrameHandle(const FrameHandle& other);
+    FrameHandle& operator=(const FrameHandle& other);
+    ~FrameHandle()
+    {
+        release();
+    }
+
+    void release(void);
+
+    // Low-level reference transfer, for containers that need to store raw buffer pointers (the
+    // lock-free FrameQueue, for instance). detach() gives up this handle's reference without
+    // releasing it. adopt() takes over such a reference without adding a new one
+    FramePool_Buffer* detach(void)
+    {
+        FramePool_Buffer* b = buf;
+        buf = NULL;
+        return b;
+    }
+    void adopt(FramePool_Buffer* _buf)
+    {
+        release();
+        buf = _buf;
+    }
+
+    IplImage* image(void) const
+    {
+        return buf == NULL ? NULL : &buf->image;
+    }
+    operator IplImage*() const
+    {
+        return image();
+    }
+    operator bool() const
+    {
+        return buf != NULL;
+    }
+    bool operator==(const FrameHandle& other) const
+    {
+        return buf == other.buf;
+    }
+
+    // number of handles currently referencing this frame. Useful to tell whether anybody else is
+    // still looking at it
+    int refcount(void) const;
+};
+
+class FramePool
+{
+    friend class FrameHandle;
+
+    int          width, height, nChannels;
+    int          stride;
+    size_t       bufferSize;
+    bool         useHugepages;
+    unsigned int maxBuffers;   // 0 means "no limit"
+
+    MTmutex           mutex;
+    FramePool_Buffer* freeList;
+    unsigned int      numAllocated;
+    unsigned int      numOutstanding;
+
+    FramePool_Buffer* newBuffer(void);
+    void deleteBuffer(FramePool_Buffer* buf);
+
+    // called by FrameHandle when the last reference to a buffer goes away
+    void put(FramePool_Buffer* buf);
+
+public:
+    // A pool of frames of the given dimensions. numPreallocated buffers are allocated right away.
+    // More are allocated on demand, up to maxBuffers (0 = unlimited). If useHugepages, the
+    // buffers are backed by hugepages, if the system has any available. If !alignRows, the rows
+    // are packed together with no padding; some libraries (dc1394) require this
+    FramePool(int _width, int _height, int _nChannels,
+              unsigned int numPreallocated = 0,
+              bool _useHugepages = false,
+              unsigned int _maxBuffers = 0,
+              bool alignRows = true);
+
+    // All the handles must be released before the pool is destroyed
+    ~FramePool();
+
+    // Returns a free frame. If the pool is at its limit or we're out of memory, the returned
+    // handle is empty. The contents of the frame are undefined
+    FrameHandle get(void);
+
+    int w(void)          { return width;  }
+    int h(void)          { return height; }
+    int channels(void)   { return nChannels; }
+    unsigned int allocated  (void) { return numAllocated; }
+    unsigned int outstanding(void) { return numOutstanding; }
+
+    // Low-level allocator used by the pool. This is also usable directly for buffers that aren't
+    // images, such as compressed-data buffers. If tryHugepages, I try to back the memory with
+    // hugepages, and report if I succeeded in *gotHugepages. This must be passed to
+    // freeAligned() later
+    static void* allocAligned(size_t size, bool tryHugepages = false, bool* gotHugepages = NULL);
+    static void  freeAligned (void* data, size_t size, bool isHugepage = false);
+
+    // row stride used by pools with alignRows
+    static int alignedStride(int width, int nChannels)
+    {
+        int stride = width * nChannels;
+        return (stride + FRAMEPOOL_ALIGNMENT-1) & ~(FRAMEPOOL_ALIGNMENT-1);
+    }
+};
+
+#endif
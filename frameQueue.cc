@@ -0,0 +1,200 @@
+#include <string.h>
+#include <iostream>
+#include "frameQueue.hh"
+using namespace std;
+
+FrameQueue::FrameQueue(unsigned int _capacity, FrameQueue_Policy _policy)
+    : capacity(_capacity), policy(_policy),
+      head(0), tail(0), closed(false),
+      numPushed(0), numPopped(0), numDropped(0), maxDepth(0),
+      numWaiters(0)
+{
+    if(capacity == 0)
+    {
+        cerr << "FrameQueue: capacity must be >0. Using 1" << endl;
+        capacity = 1;
+    }
+
+    slots = new slot_t[capacity];
+    for(unsigned int i=0; i<capacity; i++)
+    {
+        slots[i].buf          = NULL;
+        slots[i].timestamp_us = 0;
+    }
+
+    if(pthread_mutex_init(&waitMutex, NULL) != 0 ||
+       pthread_cond_init (&waitCond,  NULL) != 0)
+        cerr << "FrameQueue: couldn't create the wait mutex/condition" << endl;
+}
+
+FrameQueue::~FrameQueue()
+{
+    // release whatever is left in the queue
+    for(uint32_t i = tail; i != head; i++)
+    {
+        FrameHandle frame;
+        frame.adopt(slots[i % capacity].buf);
+    }
+    delete[] slots;
+
+    pthread_cond_destroy (&waitCond);
+    pthread_mutex_destroy(&waitMutex);
+}
+
+static void unlockMutex(void* mutex)
+{
+    pthread_mutex_unlock((pthread_mutex_t*)mutex);
+}
+
+// Sleeps until *counter changes from the value we've seen or until the queue is closed. Whoever
+// changes the counter calls wakeWaiters() afterwards. The waiter registers itself before looking
+// at the counter, and the waker looks at the registration after changing the counter, so a
+// wakeup can't be lost
+void FrameQueue::sleepWhileUnchanged(uint32_t* counter, uint32_t seen)
+{
+    pthread_mutex_lock(&waitMutex);
+    pthread_cleanup_push(&unlockMutex, &waitMutex);
+
+    __atomic_add_fetch(&numWaiters, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(counter, __ATOMIC_SEQ_CST) == seen &&
+          !__atomic_load_n(&closed, __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&waitCond, &waitMutex);
+    __atomic_sub_fetch(&numWaiters, 1, __ATOMIC_SEQ_CST);
+
+    pthread_cleanup_pop(1);
+}
+
+void FrameQueue::wakeWaiters(void)
+{
+    if(__atomic_load_n(&numWaiters, __ATOMIC_SEQ_CST) == 0)
+        return;
+
+    pthread_mutex_lock(&waitMutex);
+    pthread_cond_broadcast(&waitCond);
+    pthread_mutex_unlock(&waitMutex);
+}
+
+bool FrameQueue::push(const FrameHandle& frame, uint64_t timestamp_us, bool mustQueue,
+                      const FrameStats_Marks* marks)
+{
+    // only the producer writes the head, so I can read it plainly
+    uint32_t h = head;
+
+    while(1)
+    {
+        if(__atomic_load_n(&closed, __ATOMIC_SEQ_CST))
+            return false;
+
+        uint32_t t = __atomic_load_n(&tail, __ATOMIC_SEQ_CST);
+        if(h - t < capacity)
+            break;
+
+        // the queue is full
+        if(policy == FRAMEQUEUE_DROP_NEWEST && !mustQueue)
+        {
+            __atomic_add_fetch(&numDropped, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        if(policy == FRAMEQUEUE_DROP_OLDEST && !mustQueue)
+        {
+            // Try to take the oldest frame away from the consumer. If the consumer beats me to
+            // it, there's room now anyway
+            if(__atomic_compare_exchange_n(&tail, &t, t+1, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            {
+                FrameHandle dropped;
+                dropped.adopt(slots[t % capacity].buf);
+                __atomic_add_fetch(&numDropped, 1, __ATOMIC_RELAXED);
+            }
+            continue;
+        }
+
+        // FRAMEQUEUE_BLOCK or mustQueue
+        sleepWhileUnchanged(&tail, t);
+    }
+
+    // The slot at the head is not visible to the consumer until I advance the head, so I can
+    // fill it in at my leisure
+    slot_t* slot = &slots[h % capacity];
+    FrameHandle ref(frame);
+    __atomic_store_n(&slot->buf,          ref.detach(), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->timestamp_us, timestamp_us, __ATOMIC_RELAXED);
+    if(marks != NULL)
+        slot->marks = *marks;
+    else
+        memset(&slot->marks, 0, sizeof(slot->marks));
+    __atomic_store_n(&head, h+1, __ATOMIC_SEQ_CST);
+
+    __atomic_add_fetch(&numPushed, 1, __ATOMIC_RELAXED);
+    unsigned int d = h+1 - __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    if(d > __atomic_load_n(&maxDepth, __ATOMIC_RELAXED))
+        __atomic_store_n(&maxDepth, d, __ATOMIC_RELAXED);
+
+    wakeWaiters();
+    return true;
+}
+
+bool FrameQueue::pop(FrameHandle* frame, uint64_t* timestamp_us, FrameStats_Marks* marks)
+{
+    while(1)
+    {
+        if(__atomic_load_n(&closed, __ATOMIC_SEQ_CST))
+            return false;
+
+        uint32_t t = __atomic_load_n(&tail, __ATOMIC_SEQ_CST);
+        uint32_t h = __atomic_load_n(&head, __ATOMIC_SEQ_CST);
+        if(t == h)
+        {
+            sleepWhileUnchanged(&head, h);
+            continue;
+        }
+
+        // Read the slot, THEN try to claim it. The producer won't overwrite this slot unless
+        // the tail moves past it first, in which case my claim fails and I try again
+        slot_t*           slot = &slots[t % capacity];
+        FramePool_Buffer* buf  = __atomic_load_n(&slot->buf,          __ATOMIC_RELAXED);
+        uint64_t          ts   = __atomic_load_n(&slot->timestamp_us, __ATOMIC_RELAXED);
+        FrameStats_Marks  m    = slot->marks;
+        if(!__atomic_compare_exchange_n(&tail, &t, t+1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            continue;
+
+        frame->adopt(buf);
+        if(timestamp_us != NULL)
+            *timestamp_us = ts;
+        if(marks != NULL)
+            *marks = m;
+
+        __atomic_add_fetch(&numPopped, 1, __ATOMIC_RELAXED);
+
+        // the producer may be waiting for room
+        wakeWaiters();
+        return true;
+    }
+}
+
+void FrameQueue::close(void)
+{
+    __atomic_store_n(&closed, true, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&waitMutex);
+    pthread_cond_broadcast(&waitCond);
+    pthread_mutex_unlock(&waitMutex);
+}
+
+unsigned int FrameQueue::depth(void)
+{
+    uint32_t t = __atomic_load_n(&tail, __ATOMIC_SEQ_CST);
+    uint32_t h = __atomic_load_n(&head, __ATOMIC_SEQ_CST);
+    return h - t;
+}
+
+void FrameQueue::getStats(FrameQueue_Stats* stats)
+{
+    stats->pushed   = __atomic_load_n(&numPushed,  __ATOMIC_RELAXED);
+    stats->popped   = __atomic_load_n(&numPopped,  __ATOMIC_RELAXED);
+    stats->dropped  = __atomic_load_n(&numDropped, __ATOMIC_RELAXED);
+    stats->maxDepth = __atomic_load_n(&maxDepth,   __ATOMIC_RELAXED);
+    stats->depth    = depth();
+}
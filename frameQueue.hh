@@ -0,0 +1,86 @@
+// -*- c++ -*-
+
+#ifndef __FRAME_QUEUE_HH__
+#define __FRAME_QUEUE_HH__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "framePool.hh"
+#include "frameStats.hh"
+
+// What to do when a frame comes in and the queue is full
+enum FrameQueue_Policy
+{
+    FRAMEQUEUE_BLOCK,       // wait for the consumer to make room
+    FRAMEQUEUE_DROP_OLDEST, // throw away the oldest queued frame to make room
+    FRAMEQUEUE_DROP_NEWEST  // throw away the incoming frame
+};
+
+struct FrameQueue_Stats
+{
+    uint64_t     pushed;   // frames that made it into the queue
+    uint64_t     popped;   // frames that were taken out of the queue by the consumer
+    uint64_t     dropped;  // frames that were thrown away because the queue was full
+    unsigned int depth;    // frames in the queue right now
+    unsigned int maxDepth; // highest depth seen
+};
+
+// A bounded single-producer, single-consumer queue of pooled frames. The queue holds references
+// to the frames, so the consumer can keep them after popping them. Pushing and popping are
+// lock-free. A mutex is only touched if a thread needs to go to sleep waiting for the other one.
+//
+// The head index is written only by the producer. The tail index is normally advanced only by
+// the consumer, but with FRAMEQUEUE_DROP_OLDEST the producer can advance it too, to discard a
+// frame. Thus the tail is always advanced with a compare-and-swap, and whoever wins the swap owns
+// the frame in that slot
+class FrameQueue
+{
+    struct slot_t
+    {
+        FramePool_Buffer* buf;
+        uint64_t          timestamp_us;
+        FrameStats_Marks  marks;
+    };
+
+    slot_t*           slots;
+    unsigned int      capacity;
+    FrameQueue_Policy policy;
+
+    uint32_t          head, tail; // free-running counters. Slot index is counter % capacity
+    bool              closed;
+
+    uint64_t          numPushed, numPopped, numDropped;
+    unsigned int      maxDepth;
+
+    // for sleeping when empty/full
+    pthread_mutex_t   waitMutex;
+    pthread_cond_t    waitCond;
+    int               numWaiters;
+
+    void sleepWhileUnchanged(uint32_t* counter, uint32_t seen);
+    void wakeWaiters(void);
+
+public:
+    FrameQueue(unsigned int _capacity, FrameQueue_Policy _policy);
+    ~FrameQueue();
+
+    // Producer side. Returns true if the frame was queued. false is returned if the frame was
+    // dropped (FRAMEQUEUE_DROP_NEWEST) or if the queue was closed. If mustQueue, the frame is not
+    // dropped; I wait for room, regardless of the policy. An empty handle can be pushed; this is
+    // used as an error marker. The latency marks of the frame, if given, travel with it
+    bool push(const FrameHandle& frame, uint64_t timestamp_us, bool mustQueue = false,
+              const FrameStats_Marks* marks = NULL);
+
+    // Consumer side. Blocks until a frame is available. Returns false if the queue was closed
+    bool pop(FrameHandle* frame, uint64_t* timestamp_us, FrameStats_Marks* marks = NULL);
+
+    // Wakes up everybody waiting on the queue. Subsequent push() and pop() calls fail
+    // immediately. Any frames left in the queue are released when the queue is destroyed
+    void close(void);
+
+    // These can be called from any thread
+    void getStats(FrameQueue_Stats* stats);
+    unsigned int depth(void);
+};
+
+#endif
@@ -0,0 +1,431 @@
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <iostream>
+#include "frameReactor.hh"
+using namespace std;
+
+// while some sources are stopped, I check on them this often
+#define REACTOR_PARKED_POLL_MS 100
+
+#define REACTOR_MAX_EVENTS     32
+
+enum FrameReactor_EntryType { REACTOR_SOURCE, REACTOR_PACE, REACTOR_TIMER };
+
+struct FrameReactor_Entry
+{
+    FrameReactor_EntryType type;
+    int                    fd;     // the source fd, or the timerfd for the others
+    uint32_t               events; // what I'm currently waiting for on fd
+    bool                   dead;
+
+    // for the sources
+    FrameSource*             source;
+    FrameReactor_Callback_t* callback;
+    IplImage*                buffer;
+    bool                     parked; // the source was stopped. I'm not listening to it
+    bool                     due;    // a paced source that may deliver its next frame
+
+    // the pacing timer of a paced source. Or, for a pacing timer, the source it paces
+    FrameReactor_Entry*      partner;
+
+    // for the timers
+    FrameReactor_TimerCallback_t* timerCallback;
+    bool                          repeat;
+
+    void*                         cookie;
+};
+
+static int makeTimerfd(uint64_t period_us, bool repeat)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(fd < 0)
+    {
+        perror("FrameReactor: couldn't create timerfd");
+        return -1;
+    }
+
+    // The interval timer is kept by the kernel on a fixed schedule, so late dispatches don't
+    // accumulate into drift
+    struct itimerspec spec;
+    spec.it_value.tv_sec     = period_us / 1000000;
+    spec.it_value.tv_nsec    = (period_us % 1000000) * 1000;
+    if(period_us == 0)
+        spec.it_value.tv_nsec = 1; // 0 would disarm the timer
+    spec.it_interval.tv_sec  = repeat ? spec.it_value.tv_sec  : 0;
+    spec.it_interval.tv_nsec = repeat ? spec.it_value.tv_nsec : 0;
+
+    if(timerfd_settime(fd, 0, &spec, NULL) != 0)
+    {
+        perror("FrameReactor: couldn't set timerfd");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+FrameReactor::FrameReactor()
+    : epoll_fd(-1), stop_fd(-1), numParked(0), keepGoing(false)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0)
+    {
+        perror("FrameReactor: couldn't create the epoll set");
+        return;
+    }
+
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(stop_fd < 0)
+    {
+        perror("FrameReactor: couldn't create the eventfd");
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev) != 0)
+    {
+        perror("FrameReactor: couldn't add the eventfd to the epoll set");
+        close(stop_fd);
+        stop_fd = -1;
+    }
+}
+
+FrameReactor::~FrameReactor()
+{
+    for(unsigned int i=0; i<entries.size(); i++)
+    {
+        if(entries[i]->type != REACTOR_SOURCE)
+            close(entries[i]->fd);
+        delete entries[i];
+    }
+    for(unsigned int i=0; i<removed.size(); i++)
+        delete removed[i];
+
+    if(stop_fd  >= 0) close(stop_fd);
+    if(epoll_fd >= 0) close(epoll_fd);
+}
+
+// An fd with no events is taken out of the epoll set entirely: epoll reports EPOLLERR and
+// EPOLLHUP even if they're not asked for, and a stopped V4L2 device reports EPOLLERR
+bool FrameReactor::setEvents(FrameReactor_Entry* entry, uint32_t events)
+{
+    if(entry->events == events)
+        return true;
+
+    struct epoll_event ev;
+    ev.events   = events;
+    ev.data.ptr = entry;
+
+    int         op;
+    const char* what;
+    if     (events == 0)        { op = EPOLL_CTL_DEL; what = "FrameReactor: epoll_ctl(DEL) failed"; }
+    else if(entry->events == 0) { op = EPOLL_CTL_ADD; what = "FrameReactor: epoll_ctl(ADD) failed"; }
+    else                        { op = EPOLL_CTL_MOD; what = "FrameReactor: epoll_ctl(MOD) failed"; }
+
+    if(epoll_ctl(epoll_fd, op, entry->fd, &ev) != 0)
+    {
+        perror(what);
+        return false;
+    }
+    entry->events = events;
+    return true;
+}
+
+bool FrameReactor::addSource(FrameSource* source, FrameReactor_Callback_t* callback,
+                             IplImage* buffer, uint64_t frameWait_us, void* cookie)
+{
+    if(!*this)
+        return false;
+
+    int fd = source->getFD();
+    if(fd < 0)
+    {
+        cerr << "FrameReactor: this source has no file descriptor to wait on" << endl;
+        return false;
+    }
+
+    for(unsigned int i=0; i<entries.size(); i++)
+        if(entries[i]->type == REACTOR_SOURCE && entries[i]->source == source)
+        {
+            cerr << "FrameReactor: this source was already added" << endl;
+            return false;
+        }
+
+    FrameReactor_Entry* entry = new FrameReactor_Entry();
+    entry->type     = REACTOR_SOURCE;
+    entry->fd       = fd;
+    entry->source   = source;
+    entry->callback = callback;
+    entry->buffer   = buffer;
+    entry->cookie   = cookie;
+
+    // a paced source doesn't listen for frames until its timer says it's due. Until then its fd
+    // isn't in the epoll set at all
+    entry->events   = 0;
+    if(frameWait_us == 0 && !setEvents(entry, EPOLLIN))
+    {
+        cerr << "FrameReactor: couldn't add the source to the epoll set" << endl;
+        delete entry;
+        return false;
+    }
+
+    struct epoll_event ev;
+
+    if(frameWait_us != 0)
+    {
+        FrameReactor_Entry* pace = new FrameReactor_Entry();
+        pace->type    = REACTOR_PACE;
+        pace->fd      = makeTimerfd(frameWait_us, true);
+        pace->events  = EPOLLIN;
+        pace->partner = entry;
+
+        ev.events   = EPOLLIN;
+        ev.data.ptr = pace;
+        if(pace->fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pace->fd, &ev) != 0)
+        {
+            cerr << "FrameReactor: couldn't set up the pacing timer" << endl;
+            if(pace->fd >= 0) close(pace->fd);
+            delete pace;
+            setEvents(entry, 0);
+            delete entry;
+            return false;
+        }
+
+        entry->partner = pace;
+        entries.push_back(pace);
+    }
+
+    entries.push_back(entry);
+    return true;
+}
+
+void FrameReactor::removeEntry(FrameReactor_Entry* entry)
+{
+    if(entry->dead)
+        return;
+
+    setEvents(entry, 0);
+    if(entry->type != REACTOR_SOURCE)
+        close(entry->fd);
+    if(entry->parked)
+        numParked--;
+
+    entry->dead = true;
+    for(unsigned int i=0; i<entries.size(); i++)
+        if(entries[i] == entry)
+        {
+            entries.erase(entries.begin() + i);
+            break;
+        }
+    removed.push_back(entry);
+
+    // a source and its pacing timer go together
+    if(entry->partner != NULL)
+        removeEntry(entry->partner);
+}
+
+bool FrameReactor::removeSource(FrameSource* source)
+{
+    for(unsigned int i=0; i<entries.size(); i++)
+        if(entries[i]->type == REACTOR_SOURCE && entries[i]->source == source)
+        {
+            removeEntry(entries[i]);
+            return true;
+        }
+    return false;
+}
+
+int FrameReactor::addTimer(uint64_t period_us, FrameReactor_TimerCallback_t* callback,
+                           void* cookie, bool repeat)
+{
+    if(!*this)
+        return -1;
+
+    FrameReactor_Entry* entry = new FrameReactor_Entry();
+    entry->type          = REACTOR_TIMER;
+    entry->fd            = makeTimerfd(period_us, repeat);
+    entry->events        = EPOLLIN;
+    entry->timerCallback = callback;
+    entry->repeat        = repeat;
+    entry->cookie        = cookie;
+
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.ptr = entry;
+    if(entry->fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, entry->fd, &ev) != 0)
+    {
+        cerr << "FrameReactor: couldn't add the timer" << endl;
+        if(entry->fd >= 0) close(entry->fd);
+        delete entry;
+        return -1;
+    }
+
+    entries.push_back(entry);
+
+    // the timerfd is unique while the timer exists, so it makes a fine id
+    return entry->fd;
+}
+
+bool FrameReactor::removeTimer(int timerId)
+{
+    for(unsigned int i=0; i<entries.size(); i++)
+        if(entries[i]->type == REACTOR_TIMER && entries[i]->fd == timerId)
+        {
+            removeEntry(entries[i]);
+            return true;
+        }
+    return false;
+}
+
+void FrameReactor::dispatchSource(FrameReactor_Entry* entry)
+{
+    // this event may have been collected before the source was parked
+    if(entry->parked)
+        return;
+
+    // A stopped source would block in getNextFrame() until it's resumed, and its fd may report
+    // errors in the meantime. I stop listening to it, and check on it periodically
+    if(!entry->source->isRunning())
+    {
+        setEvents(entry, 0);
+        entry->parked = true;
+        numParked++;
+        return;
+    }
+
+    // poll says a frame is ready, so this doesn't block
+    uint64_t timestamp_us = 0;
+    bool     result       = entry->source->getNextFrame(entry->buffer, &timestamp_us);
+
+    if(entry->partner != NULL)
+    {
+        // paced. I got my frame for this period
+        entry->due = false;
+        setEvents(entry, 0);
+    }
+
+    if(result)
+    {
+        (*entry->callback)(entry->source, entry->buffer, timestamp_us, entry->cookie);
+        return;
+    }
+
+    cerr << "reactor couldn't get frame" << endl;
+    if( !(*entry->callback)(entry->source, NULL, timestamp_us, entry->cookie) )
+        removeEntry(entry);
+}
+
+void FrameReactor::dispatchPace(FrameReactor_Entry* entry)
+{
+    uint64_t expirations;
+    if(read(entry->fd, &expirations, sizeof(expirations)) != (ssize_t)sizeof(expirations))
+        return;
+
+    // Time for the next frame. As with the paced source thread, I want the latest frame, so
+    // anything that piled up in the meantime is thrown away. The first frame that comes in
+    // after this is delivered
+    FrameReactor_Entry* source = entry->partner;
+    if(source->parked || !source->source->isRunning())
+        return;
+
+    if(!source->due)
+        source->source->flushFrames();
+    source->due = true;
+    setEvents(source, EPOLLIN);
+}
+
+void FrameReactor::dispatchTimer(FrameReactor_Entry* entry)
+{
+    uint64_t expirations;
+    if(read(entry->fd, &expirations, sizeof(expirations)) != (ssize_t)sizeof(expirations))
+        return;
+
+    if( !(*entry->timerCallback)(entry->cookie) || !entry->repeat )
+        removeEntry(entry);
+}
+
+void FrameReactor::checkParked(void)
+{
+    for(unsigned int i=0; i<entries.size(); i++)
+    {
+        FrameReactor_Entry* entry = entries[i];
+        if(!entry->parked || !entry->source->isRunning())
+            continue;
+
+        entry->parked = false;
+        numParked--;
+
+        // a paced source waits for its timer again
+        entry->due = false;
+        setEvents(entry, entry->partner != NULL ? 0 : (uint32_t)EPOLLIN);
+    }
+}
+
+bool FrameReactor::runOnce(int timeout_ms)
+{
+    if(!*this)
+        return false;
+
+    if(numParked > 0 && (timeout_ms < 0 || timeout_ms > REACTOR_PARKED_POLL_MS))
+        timeout_ms = REACTOR_PARKED_POLL_MS;
+
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, timeout_ms);
+    if(n < 0)
+    {
+        if(errno == EINTR)
+            return true;
+        perror("FrameReactor: epoll_wait() failed");
+        return false;
+    }
+
+    for(int i=0; i<n; i++)
+    {
+        FrameReactor_Entry* entry = (FrameReactor_Entry*)events[i].data.ptr;
+        if(entry == NULL)
+        {
+            uint64_t count;
+            if(read(stop_fd, &count, sizeof(count)) == (ssize_t)sizeof(count))
+                keepGoing = false;
+            continue;
+        }
+
+        // a callback may have removed this entry already
+        if(entry->dead)
+            continue;
+
+        if     (entry->type == REACTOR_SOURCE) dispatchSource(entry);
+        else if(entry->type == REACTOR_PACE)   dispatchPace  (entry);
+        else                                   dispatchTimer (entry);
+    }
+
+    if(numParked > 0)
+        checkParked();
+
+    for(unsigned int i=0; i<removed.size(); i++)
+        delete removed[i];
+    removed.clear();
+
+    return true;
+}
+
+bool FrameReactor::run(void)
+{
+    keepGoing = true;
+    while(keepGoing && !entries.empty())
+        if(!runOnce(-1))
+            return false;
+    return true;
+}
+
+void FrameReactor::stop(void)
+{
+    uint64_t one = 1;
+    if(write(stop_fd, &one, sizeof(one)) != (ssize_t)sizeof(one))
+        perror("FrameReactor: couldn't signal stop");
+}
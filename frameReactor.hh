@@ -0,0 +1,86 @@
+// -*- c++ -*-
+
+#ifndef __FRAME_REACTOR_HH__
+#define __FRAME_REACTOR_HH__
+
+#include <stdint.h>
+#include <vector>
+#include "frameSource.hh"
+
+// Called when a source registered with a FrameReactor has a frame. buffer is the buffer given to
+// addSource(). As with the source thread, on error this is called ONCE with buffer == NULL. If it
+// then returns false, the source is removed from the reactor
+typedef bool (FrameReactor_Callback_t)(FrameSource* source, IplImage* buffer,
+                                       uint64_t timestamp_us, void* cookie);
+
+// Called when a timer fires. Returning false cancels the timer
+typedef bool (FrameReactor_TimerCallback_t)(void* cookie);
+
+struct FrameReactor_Entry;
+
+// Drives any number of frame sources from a single thread. This is an alternative to running a
+// source thread for each source: all the source file descriptors go into one epoll set, and the
+// frames are read and handed to each source's callback as they come in. With many low-rate
+// cameras this saves a thread (and its stack) per camera, and the context switches between them.
+//
+// Only sources that have a file descriptor (getFD() != -1) can be driven this way. The callbacks
+// run in the thread that calls run(), and can add and remove sources and timers. Other than that,
+// a reactor must not be touched by other threads while run() is going, except to call stop()
+class FrameReactor
+{
+    int epoll_fd;
+    int stop_fd; // an eventfd used to wake up the loop in stop()
+
+    std::vector<FrameReactor_Entry*> entries;
+
+    // entries removed while dispatching. These are freed at the end of the iteration, since
+    // epoll may still be holding events that point to them
+    std::vector<FrameReactor_Entry*> removed;
+
+    // number of sources that were found to be stopped. I poll these periodically until they're
+    // resumed
+    int numParked;
+
+    bool keepGoing;
+
+    bool setEvents(FrameReactor_Entry* entry, uint32_t events);
+    void removeEntry(FrameReactor_Entry* entry);
+    void dispatchSource(FrameReactor_Entry* entry);
+    void dispatchPace  (FrameReactor_Entry* entry);
+    void dispatchTimer (FrameReactor_Entry* entry);
+    void checkParked(void);
+
+public:
+    FrameReactor();
+    ~FrameReactor();
+
+    operator bool() { return epoll_fd >= 0 && stop_fd >= 0; }
+
+    // Registers a source. Each frame is read into the given buffer, and passed to the callback.
+    // As with startSourceThread(), a non-zero frameWait_us limits the frame rate: at most one
+    // frame is delivered per period, and it's the latest one available, with the rest thrown
+    // away. The pacing is done with a timer on a fixed schedule, so it doesn't drift with the
+    // processing time
+    bool addSource(FrameSource* source, FrameReactor_Callback_t* callback, IplImage* buffer,
+                   uint64_t frameWait_us = 0, void* cookie = NULL);
+    bool removeSource(FrameSource* source);
+
+    // Adds a timer that fires every period_us, or just once if !repeat. Returns a timer id, or -1
+    // on error
+    int  addTimer(uint64_t period_us, FrameReactor_TimerCallback_t* callback, void* cookie = NULL,
+                  bool repeat = true);
+    bool removeTimer(int timerId);
+
+    // Waits up to timeout_ms for something to happen (-1 = forever), and dispatches everything
+    // that's ready. Returns false on error
+    bool runOnce(int timeout_ms = -1);
+
+    // Dispatches until stop() is called or until there's nothing left to wait for. Returns false
+    // on error
+    bool run(void);
+
+    // Makes run() return. This can be called from any thread, or from a callback
+    void stop(void);
+};
+
+#endif
@@ -0,0 +1,590 @@
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <iostream>
+#include "frameResize.hh"
+#include "workerPool.hh"
+using namespace std;
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// On x86 I build an AVX2 version of the vertical pass too, and use it if the CPU supports it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FRAMERESIZE_HAVE_AVX2
+#endif
+
+// Fixed-point precision. The weights have 14 bits, which is all that _mm_madd_epi16 leaves me.
+// The horizontal pass produces 16-bit intermediate values, so it rounds its results to fewer
+// bits: 255 << 7 fits into an int16_t, but the cubic filter overshoots, so it gets one bit less
+#define WEIGHT_BITS             14
+#define INTERMEDIATE_BITS       7
+#define INTERMEDIATE_BITS_CUBIC 6
+
+static double cubicWeight(double x)
+{
+    // Keys' cubic with a = -0.75, like OpenCV uses
+    const double a = -0.75;
+
+    x = fabs(x);
+    if(x < 1.0) return ((a + 2.0)*x - (a + 3.0))*x*x + 1.0;
+    if(x < 2.0) return ((a*x - 5.0*a)*x + 8.0*a)*x - 4.0*a;
+    return 0.0;
+}
+
+static int clampInt(int x, int lo, int hi)
+{
+    if(x < lo) return lo;
+    if(x > hi) return hi;
+    return x;
+}
+
+// Computes the 1D filter that maps srcSize samples to dstSize samples. Output sample i reads
+// *ntaps consecutive inputs starting at ofs[i], with weights (*weights)[i*stride ...]. The stride
+// is *ntaps, rounded up to an even number if padEven. The padding weights are 0. Taps that
+// would fall outside the input are folded onto the edge samples
+static void computeFilter(int srcSize, int dstSize, FrameResize_Interpolation interpolation,
+                          int bits, bool padEven,
+                          int* ntaps, vector<int>* ofs, vector<int16_t>* weights)
+{
+    double scale = (double)srcSize / (double)dstSize;
+
+    // averaging only makes sense when downsampling
+    if(interpolation == FRAMERESIZE_AREA && scale <= 1.0)
+        interpolation = FRAMERESIZE_BILINEAR;
+
+    int n;
+    if     (interpolation == FRAMERESIZE_BILINEAR) n = 2;
+    else if(interpolation == FRAMERESIZE_CUBIC)    n = 4;
+    else                                           n = (int)ceil(scale) + 1;
+
+    // tiny inputs can't take all the taps
+    int nUsed  = n < srcSize ? n : srcSize;
+    int stride = padEven ? (nUsed + 1) & ~1 : nUsed;
+
+    ofs    ->resize(dstSize);
+    weights->assign(dstSize * stride, 0);
+
+    vector<double> w(n), folded(nUsed);
+    for(int i=0; i<dstSize; i++)
+    {
+        int first;
+
+        if(interpolation == FRAMERESIZE_AREA)
+        {
+            // output sample i covers [x0,x1) of the input
+            double x0 = i * scale;
+            double x1 = (i+1) * scale;
+            first = (int)floor(x0);
+            for(int t=0; t<n; t++)
+            {
+                double a = x0 > first+t   ? x0 : first+t;
+                double b = x1 < first+t+1 ? x1 : first+t+1;
+                w[t] = b > a ? (b - a) / scale : 0.0;
+            }
+        }
+        else
+        {
+            // pixel centers line up
+            double sx = ((double)i + 0.5) * scale - 0.5;
+            int    ix = (int)floor(sx);
+            double f  = sx - ix;
+
+            if(interpolation == FRAMERESIZE_BILINEAR)
+            {
+                first = ix;
+                w[0]  = 1.0 - f;
+                w[1]  = f;
+            }
+            else
+            {
+                first = ix - 1;
+                for(int t=0; t<4; t++)
+                    w[t] = cubicWeight(f + 1.0 - t);
+            }
+        }
+
+        int start = clampInt(first, 0, srcSize - nUsed);
+        (*ofs)[i] = start;
+
+        for(int t=0; t<nUsed; t++)
+            folded[t] = 0.0;
+        for(int t=0; t<n; t++)
+            folded[ clampInt(first + t, 0, srcSize-1) - start ] += w[t];
+
+        // quantize. The rounding errors go into the biggest weight, so the weights sum to exactly
+        // 1 and flat areas stay flat
+        int16_t* wq      = &(*weights)[i*stride];
+        int      sum     = 0;
+        int      biggest = 0;
+        for(int t=0; t<nUsed; t++)
+        {
+            wq[t] = (int16_t)lround(folded[t] * (double)(1 << bits));
+            sum  += wq[t];
+            if(abs(wq[t]) > abs(wq[biggest]))
+                biggest = t;
+        }
+        wq[biggest] += (1 << bits) - sum;
+    }
+
+    *ntaps = nUsed;
+}
+
+
+
+// The horizontal pass: filters one source row into 16-bit intermediate values, dropping "shift"
+// bits of precision. CH and NTAPS are compile-time constants for the common cases, and 0 to use
+// the runtime values
+template<int CH, int NTAPS>
+static void horizontalPass(const uint8_t* src, int16_t* dst, int dstWidth,
+                           const int* xofs, const int16_t* weights, int ntaps, int channels,
+                           int shift)
+{
+    const int ch = CH    > 0 ? CH    : channels;
+    const int nt = NTAPS > 0 ? NTAPS : ntaps;
+    const int round = 1 << (shift - 1);
+
+    for(int x=0; x<dstWidth; x++)
+    {
+        const uint8_t* s = src + xofs[x]*ch;
+        const int16_t* w = weights + x*nt;
+        for(int c=0; c<ch; c++)
+        {
+            int sum = round;
+            for(int t=0; t<nt; t++)
+                sum += s[t*ch + c] * w[t];
+            dst[x*ch + c] = (int16_t)(sum >> shift);
+        }
+    }
+}
+
+template<int CH>
+static void horizontalPass_ch(const uint8_t* src, int16_t* dst, int dstWidth,
+                              const int* xofs, const int16_t* weights, int ntaps, int channels,
+                              int shift)
+{
+    switch(ntaps)
+    {
+    case 2:  horizontalPass<CH,2>(src, dst, dstWidth, xofs, weights, ntaps, channels, shift); break;
+    case 3:  horizontalPass<CH,3>(src, dst, dstWidth, xofs, weights, ntaps, channels, shift); break;
+    case 4:  horizontalPass<CH,4>(src, dst, dstWidth, xofs, weights, ntaps, channels, shift); break;
+    default: horizontalPass<CH,0>(src, dst, dstWidth, xofs, weights, ntaps, channels, shift); break;
+    }
+}
+
+static void horizontalPass_any(const uint8_t* src, int16_t* dst, int dstWidth,
+                               const int* xofs, const int16_t* weights, int ntaps, int channels,
+                              int shift)
+{
+    switch(channels)
+    {
+    case 1:  horizontalPass_ch<1>(src, dst, dstWidth, xofs, weights, ntaps, channels, shift); break;
+    case 3:  horizontalPass_ch<3>(src, dst, dstWidth, xofs, weights, ntaps, channels, shift); break;
+    default: horizontalPass_ch<0>(src, dst, dstWidth, xofs, weights, ntaps, channels, shift); break;
+    }
+}
+
+
+
+// The vertical pass: combines ntaps intermediate rows into one output row. ntaps is even. The
+// SIMD versions start at value "start", and return where they stopped; the scalar version
+// finishes the rest
+static void verticalPass_scalar(const int16_t* const* rows, const int16_t* weights, int ntaps,
+                                uint8_t* dst, int start, int n, int shift)
+{
+    int round = 1 << (shift - 1);
+    for(int i=start; i<n; i++)
+    {
+        int sum = round;
+        for(int t=0; t<ntaps; t++)
+            sum += rows[t][i] * weights[t];
+        dst[i] = (uint8_t)clampInt(sum >> shift, 0, 255);
+    }
+}
+
+#ifdef __SSE2__
+static int verticalPass_sse2(const int16_t* const* rows, const int16_t* weights, int ntaps,
+                             uint8_t* dst, int start, int n, int shift)
+{
+    __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    __m128i count = _mm_cvtsi32_si128(shift);
+
+    int i = start;
+    for(; i <= n-8; i += 8)
+    {
+        __m128i lo = round;
+        __m128i hi = round;
+        for(int t=0; t<ntaps; t += 2)
+        {
+            // interleave two rows, and multiply-add them with their two weights at once
+            __m128i w = _mm_set1_epi32( (uint16_t)weights[t] | ((uint32_t)(uint16_t)weights[t+1] << 16) );
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows[t]   + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(rows[t+1] + i));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        lo = _mm_sra_epi32(lo, count);
+        hi = _mm_sra_epi32(hi, count);
+
+        __m128i r = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(r, r));
+    }
+    return i;
+}
+#endif
+
+#ifdef FRAMERESIZE_HAVE_AVX2
+__attribute__((target("avx2")))
+static int verticalPass_avx2(const int16_t* const* rows, const int16_t* weights, int ntaps,
+                             uint8_t* dst, int start, int n, int shift)
+{
+    __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+    __m128i count = _mm_cvtsi32_si128(shift);
+
+    int i = start;
+    for(; i <= n-16; i += 16)
+    {
+        __m256i lo = round;
+        __m256i hi = round;
+        for(int t=0; t<ntaps; t += 2)
+        {
+            __m256i w = _mm256_set1_epi32( (uint16_t)weights[t] | ((uint32_t)(uint16_t)weights[t+1] << 16) );
+            __m256i a = _mm256_loadu_si256((const __m256i*)(rows[t]   + i));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(rows[t+1] + i));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        lo = _mm256_sra_epi32(lo, count);
+        hi = _mm256_sra_epi32(hi, count);
+
+        // the unpacks and packs work within 128-bit lanes, so these cancel out. The last pack
+        // leaves the result in 64-bit words 0 and 2
+        __m256i r = _mm256_packs_epi32(lo, hi);
+        r = _mm256_packus_epi16(r, r);
+        r = _mm256_permute4x64_epi64(r, 0x08);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(r));
+    }
+    return i;
+}
+
+static bool cpuHasAVX2(void)
+{
+    static int have = -1;
+    if(have < 0)
+        have = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return have;
+}
+#endif
+
+static void verticalPass(const int16_t* const* rows, const int16_t* weights, int ntaps,
+                         uint8_t* dst, int n, int shift)
+{
+    int done = 0;
+
+#if defined FRAMERESIZE_HAVE_AVX2
+    if(cpuHasAVX2())
+        done = verticalPass_avx2(rows, weights, ntaps, dst, done, n, shift);
+#endif
+#ifdef __SSE2__
+    done = verticalPass_sse2(rows, weights, ntaps, dst, done, n, shift);
+#endif
+
+    verticalPass_scalar(rows, weights, ntaps, dst, done, n, shift);
+}
+
+
+
+// Box filter pieces. sumRows() adds up k source rows into 16-bit sums
+static void sumRows(const uint8_t* src, int srcStride, int k, uint16_t* acc, int n)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    for(; i <= n-16; i += 16)
+    {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        for(int r=0; r<k; r++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + r*srcStride + i));
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+        }
+        _mm_storeu_si128((__m128i*)(acc + i),     lo);
+        _mm_storeu_si128((__m128i*)(acc + i + 8), hi);
+    }
+#endif
+
+    for(; i<n; i++)
+    {
+        int sum = 0;
+        for(int r=0; r<k; r++)
+            sum += src[r*srcStride + i];
+        acc[i] = (uint16_t)sum;
+    }
+}
+
+// Adds up groups of K row sums horizontally, and divides by K*K. Produces output values
+// [start,n). CH is the number of channels, or 0 to use the runtime value
+template<int CH, int K>
+static void boxHorizontal(const uint16_t* acc, uint8_t* dst, int start, int n, int channels)
+{
+    const int ch    = CH > 0 ? CH : channels;
+    const int shift = K == 2 ? 2 : 4; // log2(K*K)
+    const int round = 1 << (shift - 1);
+
+    // start at a pixel boundary
+    int x = start / ch;
+    for(int i = x*ch; i<n; i += ch, x++)
+    {
+        const uint16_t* a = acc + x*K*ch;
+        for(int c=0; c<ch; c++)
+        {
+            int sum = round;
+            for(int j=0; j<K; j++)
+                sum += a[j*ch + c];
+            dst[i + c] = (uint8_t)(sum >> shift);
+        }
+    }
+}
+
+// Grayscale 1/2 downscale of the row sums: adds up horizontal pairs and divides by 4
+static int halveGray(const uint16_t* acc, uint8_t* dst, int n)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i two  = _mm_set1_epi32(2);
+    for(; i <= n-8; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(acc + 2*i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(acc + 2*i + 8));
+        a = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(a, ones), two), 2);
+        b = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(b, ones), two), 2);
+
+        __m128i r = _mm_packs_epi32(a, b);
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(r, r));
+    }
+#endif
+
+    return i;
+}
+
+
+
+FrameResizer::FrameResizer()
+    : srcWidth(-1), srcHeight(-1), dstWidth(-1), dstHeight(-1), channels(-1),
+      interpolation(FRAMERESIZE_NEAREST), boxFactor(0),
+      ntapsX(0), ntapsY(0), intermediateBits(0),
+      jobSrc(NULL), jobSrcStride(0), jobDst(NULL), jobDstStride(0)
+{
+}
+
+void FrameResizer::plan(int _srcWidth, int _srcHeight, int _dstWidth, int _dstHeight, int _channels,
+                        FrameResize_Interpolation _interpolation)
+{
+    srcWidth      = _srcWidth;
+    srcHeight     = _srcHeight;
+    dstWidth      = _dstWidth;
+    dstHeight     = _dstHeight;
+    channels      = _channels;
+    interpolation = _interpolation;
+
+    // Integer downscales with the area filter are plain box filters. A 1/2 bilinear downscale
+    // samples exactly between the source pixels, so it's the same box filter
+    boxFactor = 0;
+    for(int k=2; k<=4; k *= 2)
+        if(srcWidth == k*dstWidth && srcHeight == k*dstHeight &&
+           (interpolation == FRAMERESIZE_AREA ||
+            (interpolation == FRAMERESIZE_BILINEAR && k == 2)))
+        {
+            boxFactor = k;
+            return;
+        }
+
+    if(interpolation == FRAMERESIZE_NEAREST)
+    {
+        // pixel centers line up. xofs is in bytes, yofs is in rows
+        xofs.resize(dstWidth);
+        yofs.resize(dstHeight);
+        for(int x=0; x<dstWidth; x++)
+            xofs[x] = clampInt((int)(((double)x + 0.5) * srcWidth / dstWidth), 0, srcWidth-1) * channels;
+        for(int y=0; y<dstHeight; y++)
+            yofs[y] = clampInt((int)(((double)y + 0.5) * srcHeight / dstHeight), 0, srcHeight-1);
+        return;
+    }
+
+    intermediateBits = interpolation == FRAMERESIZE_CUBIC ? INTERMEDIATE_BITS_CUBIC : INTERMEDIATE_BITS;
+    computeFilter(srcWidth,  dstWidth,  interpolation, WEIGHT_BITS, false, &ntapsX, &xofs, &xweights);
+    computeFilter(srcHeight, dstHeight, interpolation, WEIGHT_BITS, true,  &ntapsY, &yofs, &yweights);
+}
+
+void FrameResizer::setupScratch(FrameResizer_Scratch* scratch)
+{
+    if(boxFactor > 0)
+        scratch->boxRow.resize(srcWidth * channels);
+    else if(interpolation != FRAMERESIZE_NEAREST)
+    {
+        scratch->rowRing  .resize(ntapsY * dstWidth * channels);
+        scratch->rowInSlot.resize(ntapsY);
+        scratch->rowPtrs  .resize((ntapsY + 1) & ~1);
+    }
+}
+
+void FrameResizer::resizeBand(void* cookie, int band, int numBands)
+{
+    FrameResizer* self = (FrameResizer*)cookie;
+
+    int y0, y1;
+    WorkerPool::bandRows(band, numBands, self->dstHeight, 1, &y0, &y1);
+
+    FrameResizer_Scratch* scratch = &self->scratch[band];
+    if     (self->boxFactor > 0)
+        self->resizeBox     (self->jobSrc, self->jobSrcStride, self->jobDst, self->jobDstStride, y0, y1, scratch);
+    else if(self->interpolation == FRAMERESIZE_NEAREST)
+        self->resizeNearest (self->jobSrc, self->jobSrcStride, self->jobDst, self->jobDstStride, y0, y1);
+    else
+        self->resizeFiltered(self->jobSrc, self->jobSrcStride, self->jobDst, self->jobDstStride, y0, y1, scratch);
+}
+
+void FrameResizer::resize(const uint8_t* src, int _srcWidth, int _srcHeight, int srcStride,
+                          uint8_t*       dst, int _dstWidth, int _dstHeight, int dstStride,
+                          int _channels, FrameResize_Interpolation _interpolation,
+                          int maxThreads)
+{
+    if(_srcWidth <= 0 || _srcHeight <= 0 || _dstWidth <= 0 || _dstHeight <= 0 || _channels <= 0)
+    {
+        cerr << "FrameResizer: invalid geometry" << endl;
+        return;
+    }
+
+    if(_srcWidth == _dstWidth && _srcHeight == _dstHeight)
+    {
+        for(int y=0; y<_dstHeight; y++)
+            memcpy(dst + y*dstStride, src + y*srcStride, _dstWidth * _channels);
+        return;
+    }
+
+    bool replan =
+        _srcWidth  != srcWidth  || _srcHeight != srcHeight ||
+        _dstWidth  != dstWidth  || _dstHeight != dstHeight ||
+        _channels  != channels  || _interpolation != interpolation;
+    if(replan)
+        plan(_srcWidth, _srcHeight, _dstWidth, _dstHeight, _channels, _interpolation);
+
+    // Each band needs at least a few rows to be worth the trouble. The bands are computed
+    // independently, so the output doesn't depend on how many there are
+    int numBands = maxThreads;
+    if(numBands > dstHeight / 16) numBands = dstHeight / 16;
+    if(numBands < 1)              numBands = 1;
+
+    if(replan)
+        scratch.clear();
+    while((int)scratch.size() < numBands)
+    {
+        scratch.push_back(FrameResizer_Scratch());
+        setupScratch(&scratch.back());
+    }
+
+    jobSrc       = src;
+    jobSrcStride = srcStride;
+    jobDst       = dst;
+    jobDstStride = dstStride;
+    WorkerPool::shared()->run(&resizeBand, this, numBands, numBands);
+}
+
+void FrameResizer::resizeNearest(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                                 int y0, int y1)
+{
+    for(int y=y0; y<y1; y++)
+    {
+        const uint8_t* s = src + yofs[y]*srcStride;
+        uint8_t*       d = dst + y*dstStride;
+
+        if(channels == 1)
+            for(int x=0; x<dstWidth; x++)
+                d[x] = s[xofs[x]];
+        else if(channels == 3)
+            for(int x=0; x<dstWidth; x++)
+            {
+                d[3*x + 0] = s[xofs[x] + 0];
+                d[3*x + 1] = s[xofs[x] + 1];
+                d[3*x + 2] = s[xofs[x] + 2];
+            }
+        else
+            for(int x=0; x<dstWidth; x++)
+                memcpy(d + x*channels, s + xofs[x], channels);
+    }
+}
+
+void FrameResizer::resizeBox(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                             int y0, int y1, FrameResizer_Scratch* scratch)
+{
+    int       k     = boxFactor;
+    uint16_t* acc   = &scratch->boxRow[0];
+    int       n     = dstWidth * channels;
+
+    for(int y=y0; y<y1; y++)
+    {
+        sumRows(src + y*k*srcStride, srcStride, k, acc, srcWidth * channels);
+
+        uint8_t* d    = dst + y*dstStride;
+        int      done = 0;
+        if(k == 2 && channels == 1)
+            done = halveGray(acc, d, n);
+
+        if     (k == 2 && channels == 1) boxHorizontal<1,2>(acc, d, done, n, channels);
+        else if(k == 2 && channels == 3) boxHorizontal<3,2>(acc, d, done, n, channels);
+        else if(k == 4 && channels == 1) boxHorizontal<1,4>(acc, d, done, n, channels);
+        else if(k == 4 && channels == 3) boxHorizontal<3,4>(acc, d, done, n, channels);
+        else if(k == 2)                  boxHorizontal<0,2>(acc, d, done, n, channels);
+        else                             boxHorizontal<0,4>(acc, d, done, n, channels);
+    }
+}
+
+void FrameResizer::resizeFiltered(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                                  int y0, int y1, FrameResizer_Scratch* scratch)
+{
+    int rowLength = dstWidth * channels;
+    int ystride   = (ntapsY + 1) & ~1;
+
+    int*            rowInSlot = &scratch->rowInSlot[0];
+    int16_t*        rowRing   = &scratch->rowRing[0];
+    const int16_t** rows      = &scratch->rowPtrs[0];
+
+    // the ring is stale: this is a new frame
+    for(int i=0; i<ntapsY; i++)
+        rowInSlot[i] = -1;
+
+    for(int y=y0; y<y1; y++)
+    {
+        // Make sure the rows this output row needs have been filtered horizontally. The rows
+        // needed for each output row are consecutive and only move forward, so each one is
+        // filtered once and a ring of ntapsY rows is enough
+        for(int t=0; t<ntapsY; t++)
+        {
+            int      r    = yofs[y] + t;
+            int      slot = r % ntapsY;
+            int16_t* row  = &rowRing[slot * rowLength];
+            if(rowInSlot[slot] != r)
+            {
+                horizontalPass_any(src + r*srcStride, row, dstWidth,
+                                   &xofs[0], &xweights[0], ntapsX, channels,
+                                   WEIGHT_BITS - intermediateBits);
+                rowInSlot[slot] = r;
+            }
+            rows[t] = row;
+        }
+
+        // odd tap counts have a 0-weight padding tap
+        if(ystride != ntapsY)
+            rows[ntapsY] = rows[0];
+
+        verticalPass(rows, &yweights[y*ystride], ystride,
+                     dst + y*dstStride, rowLength, intermediateBits + WEIGHT_BITS);
+    }
+}
@@ -0,0 +1,87 @@
+// -*- c++ -*-
+
+#ifndef __FRAME_RESIZE_HH__
+#define __FRAME_RESIZE_HH__
+
+#include <stdint.h>
+#include <vector>
+
+// The interpolation used when scaling frames. Roughly in order of increasing cost
+enum FrameResize_Interpolation
+{
+    FRAMERESIZE_NEAREST,  // cheapest. Aliases badly
+    FRAMERESIZE_BILINEAR, // 2x2 taps. Good for mild scaling and upsampling
+    FRAMERESIZE_AREA,     // averages the covered source pixels. Best for downsampling
+    FRAMERESIZE_CUBIC     // 4x4 taps. Sharpest, most expensive
+};
+
+// per-band scratch space of a FrameResizer
+struct FrameResizer_Scratch
+{
+    // horizontally-filtered source rows. This is a ring of ntapsY rows
+    std::vector<int16_t>        rowRing;
+    std::vector<int>            rowInSlot;
+    std::vector<const int16_t*> rowPtrs;
+
+    // row sums for the box filter
+    std::vector<uint16_t>       boxRow;
+};
+
+// Resizes 8-bit gray or RGB images. The filters are separable and are computed in fixed point: a
+// horizontal pass produces 16-bit intermediate rows, and a vertical pass (SSE2, or AVX2 if the
+// CPU has it) combines them into the output rows. Downscales by 1/2 and 1/4 with the area filter
+// get their own box-filter kernels.
+//
+// The filter tables depend only on the geometry, so I compute them once and reuse them for as
+// long as the geometry doesn't change. A resizer is thus NOT thread-safe: each thread should
+// have its own. A resizer can itself split its work across threads in the shared WorkerPool
+class FrameResizer
+{
+    // the current plan
+    int srcWidth, srcHeight, dstWidth, dstHeight, channels;
+    FrameResize_Interpolation interpolation;
+    int boxFactor; // if >0, the integer downscale factor of the box fast path
+
+    // Filter tables. Output pixel x reads ntapsX consecutive source pixels starting at xofs[x],
+    // weighing them by xweights[x*ntapsX ...]. Same for the rows
+    int                         ntapsX, ntapsY;
+    int                         intermediateBits; // fixed-point precision of the row ring
+    std::vector<int>            xofs, yofs;
+    std::vector<int16_t>        xweights, yweights;
+
+    // per-band scratch space
+    std::vector<FrameResizer_Scratch> scratch;
+
+    // the frame being resized
+    const uint8_t* jobSrc;
+    int            jobSrcStride;
+    uint8_t*       jobDst;
+    int            jobDstStride;
+
+    void plan(int _srcWidth, int _srcHeight, int _dstWidth, int _dstHeight, int _channels,
+              FrameResize_Interpolation _interpolation);
+
+    void setupScratch(FrameResizer_Scratch* scratch);
+    static void resizeBand(void* cookie, int band, int numBands);
+
+    // these produce output rows [y0,y1)
+    void resizeNearest (const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                        int y0, int y1);
+    void resizeBox     (const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                        int y0, int y1, FrameResizer_Scratch* scratch);
+    void resizeFiltered(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                        int y0, int y1, FrameResizer_Scratch* scratch);
+
+public:
+    FrameResizer();
+
+    // src and dst each point to the top-left pixel and have the given strides (in bytes).
+    // channels is 1 or 3. The output rows are split into bands spread across up to maxThreads
+    // threads. The output is the same regardless
+    void resize(const uint8_t* src, int srcWidth, int srcHeight, int srcStride,
+                uint8_t*       dst, int dstWidth, int dstHeight, int dstStride,
+                int channels, FrameResize_Interpolation interpolation,
+                int maxThreads = 1);
+};
+
+#endif
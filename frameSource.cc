@@ -1,30 +1,67 @@
 #include <time.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
 #include <iostream>
+#include <vector>
 #include "frameSource.hh"
+#include "nativeFrame.hh"
+#include "frameTrace.hh"
 
 #include <opencv2/imgproc/imgproc_c.h>
 using namespace std;
 
 FrameSource::FrameSource (FrameSource_UserColorChoice _userColorMode)
     : userColorMode(_userColorMode),
+      width(0), height(0),
+      rawWidth(0), rawHeight(0),
       cropRect( cvRect(-1, -1, -1, -1) ),
       preCropScaleBuffer(NULL),
-      sourceThread_id(0)
+      interpolation(FRAMERESIZE_CUBIC),
+      maxThreads(1),
+      rawFramePool(NULL),
+      outputFramePool(NULL),
+      packedOutputRows(false),
+      sourceThread_id(0),
+      sourceThread_phaseLock(false),
+      streamResumes(0),
+      sourceThread_resumesSeen(0),
+      sourceThread_consumer_id(0),
+      sourceThread_queue(NULL),
+      frameIsBorrowed(false)
 {
+    memset(&frameMarks, 0, sizeof(frameMarks));
+
     // we're not yet initialized and thus not able to serve data
     isRunningNow.reset();
 }
 
-void FrameSource::setupCroppingScaling(CvRect _cropRect, double scale)
+void FrameSource::setupCroppingScaling(CvRect _cropRect, double scale, bool packedRows)
 {
-    cropRect = _cropRect;
+    cropRect  = _cropRect;
+    rawWidth  = width;
+    rawHeight = height;
+
+    // we may be reconfiguring a source that was set up before (reopening a video file, for
+    // instance), so I throw away the old buffers
+    preCropScaleFrame.release();
+    preCropScaleBuffer = NULL;
+    if(rawFramePool != NULL)
+    {
+        delete rawFramePool;
+        rawFramePool = NULL;
+    }
 
     if( (cropRect.width > 0 && cropRect.height > 0) ||
         scale != 1.0 )
     {
         // if we're cropping or scaling (or both), set up the temporary buffer image
-        preCropScaleBuffer = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U,
-                                           userColorMode == FRAMESOURCE_COLOR ? 3 : 1);
+        rawFramePool = new FramePool(width, height, userColorMode == FRAMESOURCE_COLOR ? 3 : 1,
+                                     1, false, 0, !packedRows);
+        preCropScaleFrame  = rawFramePool->get();
+        preCropScaleBuffer = preCropScaleFrame;
+        if(preCropScaleBuffer == NULL)
+            cerr << "couldn't allocate the cropping/scaling buffer" << endl;
     }
 
     if(cropRect.width > 0 && cropRect.height > 0)
@@ -37,33 +74,143 @@ void FrameSource::setupCroppingScaling(CvRect _cropRect, double scale)
         width  = lround(scale * (double)width);
         height = lround(scale * (double)height);
     }
+
+    // when cropping or scaling, the resizer writes the output, and it honors the row padding
+    packedOutputRows = packedRows && rawFramePool == NULL;
+
+    if(outputFramePool != NULL &&
+       (outputFramePool->w() != (int)width || outputFramePool->h() != (int)height))
+    {
+        // the borrow buffer is internal, so I can drop it unless it's lent out
+        if(!frameIsBorrowed)
+            borrowBuffer.release();
+        if(outputFramePool->outstanding() == 0)
+        {
+            delete outputFramePool;
+            outputFramePool = NULL;
+        }
+        else
+            cerr << "setupCroppingScaling(): frame dimensions changed while frames are in use" << endl;
+    }
 }
 
 void FrameSource::applyCroppingScaling(IplImage* src, IplImage* dst)
 {
+    FRAMETRACE_SPAN("frameSource.cropScale");
+
+    CvRect window = cvRect(0, 0, src->width, src->height);
     if(cropRect.width > 0 && cropRect.height > 0)
-        cvSetImageROI(src, cropRect);
+        window = cropRect;
 
-#warning can swscale do this faster? I dont completely trust opencv to do this optimally
+    const unsigned char* srcData = (const unsigned char*)src->imageData +
+        window.y * src->widthStep + window.x * src->nChannels;
 
-    // opencv should detect this case, but it doesn't. Manually checking results
-    // in a measurable performance gain
-    if( cropRect.width == dst->width && cropRect.height == dst->height )
-        cvCopy(src,dst);
-    else
-        cvResize(src, dst, CV_INTER_CUBIC);
+    // this copies if we're only cropping
+    resizer.resize(srcData, window.width, window.height, src->widthStep,
+                   (unsigned char*)dst->imageData, dst->width, dst->height, dst->widthStep,
+                   dst->nChannels, interpolation, maxThreads);
+}
 
-    cvResetImageROI(src);
+bool FrameSource::isCropOnly(void)
+{
+    CvRect window = cropWindow();
+    return window.width == (int)width && window.height == (int)height;
+}
+
+CvRect FrameSource::cropWindow(void)
+{
+    if(cropRect.width > 0 && cropRect.height > 0)
+        return cropRect;
+    return cvRect(0, 0, rawWidth, rawHeight);
+}
+
+void FrameSource::dropPreCropScaleBuffer(void)
+{
+    preCropScaleFrame.release();
+    preCropScaleBuffer = NULL;
+}
+
+void FrameSource::restorePreCropScaleBuffer(void)
+{
+    if(preCropScaleBuffer != NULL || rawFramePool == NULL)
+        return;
+
+    preCropScaleFrame  = rawFramePool->get();
+    preCropScaleBuffer = preCropScaleFrame;
+    if(preCropScaleBuffer == NULL)
+        cerr << "couldn't allocate the cropping/scaling buffer" << endl;
+}
+
+void FrameSource::initBorrowedHeader(IplImage* header, unsigned char* data, int stride)
+{
+    int numChannels = userColorMode == FRAMESOURCE_COLOR ? 3 : 1;
+
+    if(cropRect.width > 0 && cropRect.height > 0)
+        data += cropRect.y * stride + cropRect.x * numChannels;
+
+    cvInitImageHeader(header, cvSize(width, height), IPL_DEPTH_8U, numChannels);
+    cvSetData(header, data, stride);
+}
+
+bool FrameSource::borrowIntoBuffer(IplImage* header, bool latest, uint64_t* timestamp_us)
+{
+    if(!borrowBuffer)
+    {
+        borrowBuffer = getFramePool()->get();
+        if(!borrowBuffer)
+        {
+            cerr << "couldn't allocate the borrowed-frame buffer" << endl;
+            return false;
+        }
+    }
+
+    bool result = latest ?
+        _getLatestFrame(borrowBuffer, timestamp_us) :
+        _getNextFrame  (borrowBuffer, timestamp_us);
+    if(!result)
+        return false;
+
+    IplImage* image = borrowBuffer;
+    cvInitImageHeader(header, cvGetSize(image), IPL_DEPTH_8U, image->nChannels);
+    cvSetData(header, image->imageData, image->widthStep);
+    return true;
+}
+
+bool FrameSource::_borrowFrame(IplImage* header, bool latest, uint64_t* timestamp_us)
+{
+    return borrowIntoBuffer(header, latest, timestamp_us);
 }
 
 void FrameSource::cleanupThreads(void)
 {
+    // I ask the threads to exit instead of cancelling them: a cancelled thread could be in the
+    // middle of a conversion, or hold a lock. The stop token interrupts the source thread's waits
+    // and its sleep, so it exits within a frame period at worst. Closing the queue wakes up both
+    // threads if they're waiting on it. The consumer then exits
+    sourceThread_stop.requestStop();
+    sourceThread_errorHandled.kick();
+    if(sourceThread_queue != NULL)
+        sourceThread_queue->close();
+
     if(sourceThread_id != 0)
     {
-        pthread_cancel(sourceThread_id);
         pthread_join(sourceThread_id, NULL);
         sourceThread_id = 0;
     }
+
+    if(sourceThread_consumer_id != 0)
+    {
+        pthread_join(sourceThread_consumer_id, NULL);
+        sourceThread_consumer_id = 0;
+    }
+
+    if(sourceThread_queue != NULL)
+    {
+        delete sourceThread_queue;
+        sourceThread_queue = NULL;
+    }
+
+    sourceThread_stop.reset();
 }
 
 FrameSource::~FrameSource()
@@ -73,23 +220,388 @@ FrameSource::~FrameSource()
     // already did this, but may crash if it didn't
     cleanupThreads();
 
-    if(preCropScaleBuffer != NULL)
+    // the frames must go back to their pools before the pools go away
+    preCropScaleFrame.release();
+    preCropScaleBuffer = NULL;
+    borrowBuffer.release();
+
+    if(rawFramePool != NULL)
     {
-        cvReleaseImage(&preCropScaleBuffer);
-        preCropScaleBuffer = NULL;
+        delete rawFramePool;
+        rawFramePool = NULL;
+    }
+    if(outputFramePool != NULL)
+    {
+        delete outputFramePool;
+        outputFramePool = NULL;
     }
 }
 
+FramePool* FrameSource::getFramePool(void)
+{
+    if(outputFramePool == NULL)
+        outputFramePool = new FramePool(width, height,
+                                        userColorMode == FRAMESOURCE_COLOR ? 3 : 1,
+                                        0, false, 0, !packedOutputRows);
+    return outputFramePool;
+}
+
+bool FrameSource::setupFramePool(unsigned int numPreallocated, bool useHugepages)
+{
+    // The borrow buffer is internal, so I can drop it. If anybody else has frames, I can't
+    // replace the pool
+    if(!frameIsBorrowed)
+        borrowBuffer.release();
+
+    if(outputFramePool != NULL)
+    {
+        if(outputFramePool->outstanding() != 0)
+        {
+            cerr << "setupFramePool(): frames are still in use. Can't replace the pool" << endl;
+            return false;
+        }
+        delete outputFramePool;
+    }
+
+    outputFramePool = new FramePool(width, height,
+                                    userColorMode == FRAMESOURCE_COLOR ? 3 : 1,
+                                    numPreallocated, useHugepages, 0, !packedOutputRows);
+    return true;
+}
+
 bool FrameSource::getNextFrame  (IplImage* image, uint64_t* timestamp_us)
 {
+    if(frameStillBorrowed("getNextFrame"))
+        return false;
+
     isRunningNow.waitForTrue();
-    return _getNextFrame(image, timestamp_us);
+    beginFrame();
+    return countFrame(_getNextFrame(image, timestamp_us));
 }
 
 bool FrameSource::getLatestFrame(IplImage* image, uint64_t* timestamp_us)
 {
+    if(frameStillBorrowed("getLatestFrame"))
+        return false;
+
+    isRunningNow.waitForTrue();
+    beginFrame();
+    return countFrame(_getLatestFrame(image, timestamp_us));
+}
+
+bool FrameSource::getNextNativeFrame(NativeFrame* frame, uint64_t* timestamp_us)
+{
+    if(frameStillBorrowed("getNextNativeFrame"))
+        return false;
+
+    isRunningNow.waitForTrue();
+    beginFrame();
+    return countFrame(_getNativeFrame(frame, false, timestamp_us));
+}
+
+bool FrameSource::getLatestNativeFrame(NativeFrame* frame, uint64_t* timestamp_us)
+{
+    if(frameStillBorrowed("getLatestNativeFrame"))
+        return false;
+
     isRunningNow.waitForTrue();
-    return _getLatestFrame(image, timestamp_us);
+    beginFrame();
+    return countFrame(_getNativeFrame(frame, true, timestamp_us));
+}
+
+bool FrameSource::_getNativeFrame(NativeFrame* frame, bool latest, uint64_t* timestamp_us)
+{
+    return getNativeAsConverted(frame, latest, timestamp_us);
+}
+
+bool FrameSource::getNativeAsConverted(NativeFrame* frame, bool latest, uint64_t* timestamp_us)
+{
+    IplImage* image = frame->setConverted(userColorMode, width, height);
+    if(image == NULL)
+        return false;
+
+    bool result = latest ?
+        _getLatestFrame(image, timestamp_us) :
+        _getNextFrame  (image, timestamp_us);
+    if(!result)
+        frame->clear();
+    return result;
+}
+
+void FrameSource::setNativeGeometry(NativeFrame* frame)
+{
+    frame->setGeometry(cropWindow(), width, height, interpolation, maxThreads);
+}
+
+unsigned int FrameSource::getFramesSingly(unsigned int n, IplImage** images, uint64_t* timestamps_us)
+{
+    for(unsigned int i=0; i<n; i++)
+        if(!_getNextFrame(images[i], timestamps_us != NULL ? &timestamps_us[i] : NULL))
+            return i;
+    return n;
+}
+
+unsigned int FrameSource::_getNextFrames(unsigned int n, IplImage** images, uint64_t* timestamps_us)
+{
+    return getFramesSingly(n, images, timestamps_us);
+}
+
+unsigned int FrameSource::getNextFrames(unsigned int n, IplImage** images, uint64_t* timestamps_us)
+{
+    if(n == 0 || frameStillBorrowed("getNextFrames"))
+        return 0;
+
+    isRunningNow.waitForTrue();
+    unsigned int got = _getNextFrames(n, images, timestamps_us);
+
+    // the frames of a batch are converted together, so I don't time them individually
+    frameMarks.dequeue_us = 0;
+
+    for(unsigned int i=0; i<got; i++)
+        countFrame(true);
+    if(got < n)
+        countFrame(false);
+    return got;
+}
+
+unsigned int FrameSource::getNextFrames(unsigned int n, FrameHandle* frames, uint64_t* timestamps_us)
+{
+    std::vector<IplImage*> images(n);
+    for(unsigned int i=0; i<n; i++)
+    {
+        frames[i] = getFramePool()->get();
+        if(!frames[i])
+        {
+            // I read as many frames as I have buffers for
+            n = i;
+            break;
+        }
+        images[i] = (IplImage*)frames[i];
+    }
+
+    unsigned int got = n == 0 ? 0 : getNextFrames(n, &images[0], timestamps_us);
+
+    // the buffers that didn't get a frame go back to the pool
+    for(unsigned int i=got; i<images.size(); i++)
+        frames[i].release();
+    return got;
+}
+
+FrameSource_WaitResult FrameSource::waitForFrame(uint64_t deadline_us, MTstopToken* stop)
+{
+    int fd = getFD();
+    if(fd < 0)
+        return FRAMESOURCE_OK;
+
+    struct pollfd fds[2];
+    fds[0].fd     = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd     = stop != NULL ? stop->getFD() : -1;
+    fds[1].events = POLLIN;
+
+    while(1)
+    {
+        struct timespec  t;
+        struct timespec* pt = NULL;
+        if(deadline_us != MT_FOREVER)
+        {
+            uint64_t now = MT_now_us();
+            uint64_t left_us = deadline_us > now ? deadline_us - now : 0;
+            t.tv_sec  = left_us / 1000000;
+            t.tv_nsec = (left_us % 1000000) * 1000;
+            pt = &t;
+        }
+
+        fds[0].revents = fds[1].revents = 0;
+        int n = ppoll(fds, 2, pt, NULL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("poll() failed waiting for a frame");
+            return FRAMESOURCE_ERROR;
+        }
+
+        if(n == 0 || fds[1].revents != 0)
+            return FRAMESOURCE_TIMEOUT;
+
+        // We have a frame. Or we have POLLERR or similar, and the read will fail and report it
+        return FRAMESOURCE_OK;
+    }
+}
+
+FrameSource_WaitResult FrameSource::getFrameTimed(IplImage* image, bool latest, uint64_t timeout_us,
+                                                  uint64_t* timestamp_us, MTstopToken* stop)
+{
+    if(frameStillBorrowed(latest ? "getLatestFrameTimed" : "getNextFrameTimed"))
+        return FRAMESOURCE_ERROR;
+
+    uint64_t deadline_us = MT_deadline(timeout_us);
+
+    if(!isRunningNow && !isRunningNow.waitUntilTrue(deadline_us, stop))
+        return FRAMESOURCE_TIMEOUT;
+
+    // For "latest" I throw away what's already there, and wait for a new frame. This is what the
+    // blocking getLatestFrame() does too, but here the wait can time out
+    if(latest && getFD() >= 0 && !flushFrames())
+    {
+        countFrame(false);
+        return FRAMESOURCE_ERROR;
+    }
+
+    FrameSource_WaitResult result = waitForFrame(deadline_us, stop);
+    if(result != FRAMESOURCE_OK)
+    {
+        if(result == FRAMESOURCE_ERROR)
+            countFrame(false);
+        return result;
+    }
+
+    // the fd says there's a frame, so this doesn't block. Sources without an fd always have one
+    beginFrame();
+    bool got = latest && getFD() < 0 ?
+        _getLatestFrame(image, timestamp_us) :
+        _getNextFrame  (image, timestamp_us);
+    return countFrame(got) ? FRAMESOURCE_OK : FRAMESOURCE_ERROR;
+}
+
+FrameSource_WaitResult FrameSource::getNextFrameTimed(IplImage* image, uint64_t timeout_us,
+                                                      uint64_t* timestamp_us, MTstopToken* stop)
+{
+    return getFrameTimed(image, false, timeout_us, timestamp_us, stop);
+}
+
+FrameSource_WaitResult FrameSource::getLatestFrameTimed(IplImage* image, uint64_t timeout_us,
+                                                        uint64_t* timestamp_us, MTstopToken* stop)
+{
+    return getFrameTimed(image, true, timeout_us, timestamp_us, stop);
+}
+
+FrameSource_WaitResult FrameSource::getNextFrameTimed(FrameHandle* frame, uint64_t timeout_us,
+                                                      uint64_t* timestamp_us, MTstopToken* stop)
+{
+    *frame = getFramePool()->get();
+    if(!*frame)
+        return FRAMESOURCE_ERROR;
+
+    FrameSource_WaitResult result = getFrameTimed(*frame, false, timeout_us, timestamp_us, stop);
+    if(result != FRAMESOURCE_OK)
+        frame->release();
+    return result;
+}
+
+FrameSource_WaitResult FrameSource::getLatestFrameTimed(FrameHandle* frame, uint64_t timeout_us,
+                                                        uint64_t* timestamp_us, MTstopToken* stop)
+{
+    *frame = getFramePool()->get();
+    if(!*frame)
+        return FRAMESOURCE_ERROR;
+
+    FrameSource_WaitResult result = getFrameTimed(*frame, true, timeout_us, timestamp_us, stop);
+    if(result != FRAMESOURCE_OK)
+        frame->release();
+    return result;
+}
+
+void FrameSource::beginFrame(void)
+{
+    frameMarks.capture_us   = 0;
+    frameMarks.dequeue_us   = FrameStats::now_us();
+    frameMarks.converted_us = 0;
+}
+
+void FrameSource::noteCapture(uint64_t capture_us)
+{
+    frameMarks.capture_us = capture_us;
+    frameMarks.dequeue_us = FrameStats::now_us();
+
+    // a capture time in the future means the clocks don't agree. I don't record those
+    if(capture_us != 0 && capture_us <= frameMarks.dequeue_us)
+        stats.addLatency(FRAMESTATS_CAPTURE_TO_DEQUEUE, frameMarks.dequeue_us - capture_us);
+    else
+        frameMarks.capture_us = 0;
+}
+
+bool FrameSource::countFrame(bool result)
+{
+    if(!result)
+    {
+        stats.addError();
+        return false;
+    }
+
+    stats.addDelivered();
+
+    frameMarks.converted_us = FrameStats::now_us();
+    if(frameMarks.dequeue_us != 0)
+        stats.addLatency(FRAMESTATS_DEQUEUE_TO_CONVERTED,
+                         frameMarks.converted_us - frameMarks.dequeue_us);
+    return true;
+}
+
+bool FrameSource::getNextFrame(FrameHandle* frame, uint64_t* timestamp_us)
+{
+    *frame = getFramePool()->get();
+    if(!*frame)
+        return false;
+
+    return getNextFrame((IplImage*)*frame, timestamp_us);
+}
+
+bool FrameSource::getLatestFrame(FrameHandle* frame, uint64_t* timestamp_us)
+{
+    *frame = getFramePool()->get();
+    if(!*frame)
+        return false;
+
+    return getLatestFrame((IplImage*)*frame, timestamp_us);
+}
+
+const IplImage* FrameSource::borrowFrame(bool latest, uint64_t* timestamp_us)
+{
+    if(frameIsBorrowed)
+    {
+        cerr << "warning: borrow...Frame() before returnFrame()\n"
+            "Calling returnFrame() for you, but you should do this yourself\n"
+            "as soon as you're done with the data" << endl;
+        returnFrame();
+    }
+
+    isRunningNow.waitForTrue();
+    beginFrame();
+    if(!countFrame(_borrowFrame(&borrowedHeader, latest, timestamp_us)))
+        return NULL;
+
+    frameIsBorrowed = true;
+    return &borrowedHeader;
+}
+
+const IplImage* FrameSource::borrowNextFrame(uint64_t* timestamp_us)
+{
+    return borrowFrame(false, timestamp_us);
+}
+
+const IplImage* FrameSource::borrowLatestFrame(uint64_t* timestamp_us)
+{
+    return borrowFrame(true, timestamp_us);
+}
+
+bool FrameSource::frameStillBorrowed(const char* caller)
+{
+    if(!frameIsBorrowed)
+        return false;
+
+    cerr << caller << "(): a frame is borrowed. Return it first" << endl;
+    return true;
+}
+
+void FrameSource::returnFrame(void)
+{
+    if(!frameIsBorrowed)
+        return;
+
+    _returnFrame();
+    frameIsBorrowed = false;
 }
 
 // tell the source to stop sending data. Any queued, but not processed frames are discarded
@@ -99,12 +611,21 @@ bool FrameSource::stopStream(void)
     return _stopStream();
 }
 
+bool FrameSource::flushFrames(void)
+{
+    // the borrowed frame still belongs to the caller, so I can't throw it away
+    if(frameStillBorrowed("flushFrames"))
+        return false;
+    return _flushFrames();
+}
+
 // re-activate the stream, rewinding to the beginning if asked (restart) and if possible. This
 // is context-dependent. Video sources can rewind, but cameras cannot, for instance
 bool FrameSource::resumeStream (void)
 {
     if(_resumeStream())
     {
+        __atomic_add_fetch(&streamResumes, 1, __ATOMIC_RELAXED);
         isRunningNow.setTrue();
         return true;
     }
@@ -115,11 +636,13 @@ bool FrameSource::restartStream(void)
 {
     if(_restartStream())
     {
+        __atomic_add_fetch(&streamResumes, 1, __ATOMIC_RELAXED);
         isRunningNow.setTrue();
         return true;
     }
     return false;
 }
+
 // Instead of accessing the frame with blocking I/O, the frame source can spawn a thread to wait
 // for the frames, and callback when a new frame is available. The thread can optionally wait
 // some amount of time between successive frames to force-limit the framerate by giving a
@@ -139,6 +662,13 @@ static void* sourceThread_global(void *pArg)
     return NULL;
 }
 
+static void* sourceThread_consumer_global(void *pArg)
+{
+    FrameSource* source = (FrameSource*)pArg;
+    source->sourceThread_consumer();
+    return NULL;
+}
+
 void FrameSource::startSourceThread(FrameSourceCallback_t* callback, uint64_t frameWait_us,
                                     IplImage* buffer)
 {
@@ -148,6 +678,8 @@ void FrameSource::startSourceThread(FrameSourceCallback_t* callback, uint64_t fr
     sourceThread_callback     = callback;
     sourceThread_frameWait_us = frameWait_us;
     sourceThread_buffer       = buffer;
+    sourceThread_pacer.start(frameWait_us, sourceThread_phaseLock);
+    sourceThread_resumesSeen  = __atomic_load_n(&streamResumes, __ATOMIC_RELAXED);
 
     if(pthread_create(&sourceThread_id, NULL, &sourceThread_global, this) != 0)
     {
@@ -156,34 +688,100 @@ void FrameSource::startSourceThread(FrameSourceCallback_t* callback, uint64_t fr
     }
 }
 
-void FrameSource::sourceThread(void)
+void FrameSource::startSourceThread(FrameSourceQueuedCallback_t* callback, uint64_t frameWait_us,
+                                    unsigned int queueDepth, FrameQueue_Policy policy)
 {
-    while(1)
+    if(sourceThread_id != 0)
+        return;
+
+    sourceThread_queuedCallback = callback;
+    sourceThread_frameWait_us   = frameWait_us;
+    sourceThread_queue          = new FrameQueue(queueDepth, policy);
+    sourceThread_pacer.start(frameWait_us, sourceThread_phaseLock);
+    sourceThread_resumesSeen  = __atomic_load_n(&streamResumes, __ATOMIC_RELAXED);
+
+    if(pthread_create(&sourceThread_consumer_id, NULL, &sourceThread_consumer_global, this) != 0)
     {
-        uint64_t timestamp_us;
-        bool result;
-        if(sourceThread_frameWait_us != 0)
-        {
-            // We are limiting the framerate. Sleep for a bit, then return the newest frame in
-            // the buffer, throwing away the rest
-            struct timespec delay;
-            delay.tv_sec  = sourceThread_frameWait_us / 1000000;
-            delay.tv_nsec = (sourceThread_frameWait_us - delay.tv_sec*1000000) * 1000;
-            nanosleep(&delay, NULL);
-
-            result = getLatestFrame(sourceThread_buffer, &timestamp_us);
-        }
-        else
+        sourceThread_consumer_id = 0;
+        cerr << "couldn't start source consumer thread" << endl;
+        cleanupThreads();
+        return;
+    }
+
+    if(pthread_create(&sourceThread_id, NULL, &sourceThread_global, this) != 0)
+    {
+        sourceThread_id = 0;
+        cerr << "couldn't start source thread" << endl;
+        cleanupThreads();
+    }
+}
+
+bool FrameSource::getQueueStats(FrameQueue_Stats* stats)
+{
+    if(sourceThread_queue == NULL)
+        return false;
+
+    sourceThread_queue->getStats(stats);
+    return true;
+}
+
+FrameSource_WaitResult FrameSource::sourceThread_fetch(IplImage* buffer, uint64_t* timestamp_us)
+{
+    FRAMETRACE_SPAN("sourceThread.fetch");
+
+    if(sourceThread_frameWait_us != 0)
+    {
+        // We are limiting the framerate. Sleep until the next deadline, then return the newest
+        // frame in the buffer, throwing away the rest. If the stream was paused since the last
+        // frame, the grid starts over from now
+        uint64_t resumes = __atomic_load_n(&streamResumes, __ATOMIC_RELAXED);
+        if(resumes != sourceThread_resumesSeen)
         {
-            // We are not limiting the framerate. Try to return ALL the available frames
-            result = getNextFrame(sourceThread_buffer, &timestamp_us);
+            sourceThread_resumesSeen = resumes;
+            sourceThread_pacer.restart();
         }
 
-        if(result)
+        unsigned int missed;
+        if(!sourceThread_pacer.wait(&sourceThread_stop, &missed))
+            return FRAMESOURCE_TIMEOUT;
+        if(missed != 0)
+            stats.addMissedDeadlines(missed);
+
+        FrameSource_WaitResult result =
+            getLatestFrameTimed(buffer, MT_FOREVER, timestamp_us, &sourceThread_stop);
+        if(result == FRAMESOURCE_OK)
+            sourceThread_pacer.frameTimestamp(*timestamp_us);
+        return result;
+    }
+
+    // We are not limiting the framerate. Try to return ALL the available frames
+    return getNextFrameTimed(buffer, MT_FOREVER, timestamp_us, &sourceThread_stop);
+}
+
+void FrameSource::sourceThread(void)
+{
+    if(sourceThread_queue != NULL)
+    {
+        sourceThread_queued();
+        return;
+    }
+
+    // a timeout here means that I was asked to stop
+    while(!sourceThread_stop)
+    {
+        uint64_t timestamp_us = 0;
+        FrameSource_WaitResult result = sourceThread_fetch(sourceThread_buffer, &timestamp_us);
+        if(result == FRAMESOURCE_OK)
         {
-            (*sourceThread_callback)(sourceThread_buffer, timestamp_us);
+            {
+                FRAMETRACE_SPAN("sourceThread.callback");
+                (*sourceThread_callback)(sourceThread_buffer, timestamp_us);
+            }
+            stats.addCallback(&frameMarks);
             continue;
         }
+        if(result == FRAMESOURCE_TIMEOUT)
+            continue;
 
         // There was an error reading the frame. Alert the application and, if it tells us to, exit
         // the thread
@@ -193,6 +791,70 @@ void FrameSource::sourceThread(void)
     }
 }
 
+// The capturing half of the queued source thread. Frames go into the queue. Errors are reported
+// by queueing an empty frame. I then wait for the consumer to tell me whether to keep going
+void FrameSource::sourceThread_queued(void)
+{
+    while(!sourceThread_stop)
+    {
+        uint64_t               timestamp_us = 0;
+        FrameHandle            frame        = getFramePool()->get();
+        FrameSource_WaitResult result       = FRAMESOURCE_ERROR;
+        if(frame)
+            result = sourceThread_fetch(frame, &timestamp_us);
+
+        if(result == FRAMESOURCE_OK)
+        {
+            sourceThread_queue->push(frame, timestamp_us, false, &frameMarks);
+            continue;
+        }
+        if(result == FRAMESOURCE_TIMEOUT)
+            continue;
+
+        cerr << "thread couldn't get frame" << endl;
+
+        sourceThread_errorHandled.reset();
+        frame.release();
+
+        // the error marker must not be dropped, so I wait for room if I have to
+        if(!sourceThread_queue->push(frame, timestamp_us, true))
+            return;
+
+        if(!sourceThread_errorHandled.waitForTrue(MT_FOREVER, &sourceThread_stop))
+            return;
+        if(!sourceThread_keepGoing)
+            return;
+    }
+}
+
+// The consuming half of the queued source thread. This calls the callback. As with the
+// non-queued thread, the callback is called ONCE with an empty frame if there was an error, and if
+// it returns false, the threads exit
+void FrameSource::sourceThread_consumer(void)
+{
+    FrameHandle      frame;
+    uint64_t         timestamp_us;
+    FrameStats_Marks marks;
+    while(sourceThread_queue->pop(&frame, &timestamp_us, &marks))
+    {
+        if(frame)
+        {
+            {
+                FRAMETRACE_SPAN("sourceThread.callback");
+                (*sourceThread_queuedCallback)(frame, timestamp_us);
+            }
+            stats.addCallback(&marks);
+            frame.release();
+            continue;
+        }
+
+        sourceThread_keepGoing = (*sourceThread_queuedCallback)(frame, timestamp_us);
+        sourceThread_errorHandled.setTrue();
+        if(!sourceThread_keepGoing)
+            return;
+    }
+}
+
 int FrameSource::getFD(void)
 {
     // If no specialized getFD() exists, then this is unavailable and I simply
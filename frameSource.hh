@@ -3,13 +3,31 @@
 
 #include <stdint.h>
 #include "threadUtils.hh"
+#include "framePool.hh"
+#include "frameQueue.hh"
+#include "frameResize.hh"
+#include "frameStats.hh"
+#include "framePacer.hh"
 #include <opencv2/core/types_c.h>
 
 // user interface color choice. RGB8 or MONO8
 enum FrameSource_UserColorChoice  { FRAMESOURCE_COLOR, FRAMESOURCE_GRAYSCALE };
 
+// result of the timed frame accessors
+enum FrameSource_WaitResult
+{
+    FRAMESOURCE_OK,
+    FRAMESOURCE_TIMEOUT, // no frame before the timeout, or the wait was interrupted by a stop token
+    FRAMESOURCE_ERROR
+};
+
+class NativeFrame;
+
 typedef bool (FrameSourceCallback_t)(IplImage* buffer, uint64_t timestamp_us);
 
+// callback used by the queued source thread. The frame can be kept by copying the handle
+typedef bool (FrameSourceQueuedCallback_t)(const FrameHandle& frame, uint64_t timestamp_us);
+
 // This is the base class for different frame grabbers. The constructor allows color or monochrome
 // mode to be selected. For simplicity, color always means 8-bits-per-channel RGB and monochrome
 // always means 8-bit grayscale
@@ -21,23 +39,82 @@ protected:
     // the dimensions of the returned data. Post cropping and scaling
     unsigned int width, height;
 
+    // the dimensions of the raw data. Pre cropping and scaling
+    unsigned int rawWidth, rawHeight;
+
     // I'm cropping to this rect. If cropRect.width < 0, I don't crop at all
     CvRect    cropRect;
     // The raw frame goes here, then this gets cropped and scaled. Frame sources can bypass this
-    // image to gain efficiency.
-    IplImage* preCropScaleBuffer;
+    // image to gain efficiency. This comes from rawFramePool
+    IplImage*   preCropScaleBuffer;
+    FrameHandle preCropScaleFrame;
+
+    // how the frames are scaled, and the resizer that does it when the source can't
+    FrameResize_Interpolation interpolation;
+    FrameResizer              resizer;
+
+    // the per-frame conversion and scaling can be split across this many threads of the shared
+    // WorkerPool
+    int maxThreads;
+
+    // Pooled buffers for the frames this source produces. rawFramePool has the raw (pre-cropping,
+    // pre-scaling) dimensions. outputFramePool has the output dimensions and is created on demand
+    FramePool*  rawFramePool;
+    FramePool*  outputFramePool;
+
+    // If the source converts straight into the output frames with a library that can't pad the
+    // rows (dc1394), the output pool must pack them too
+    bool        packedOutputRows;
 
     pthread_t              sourceThread_id;
     uint64_t               sourceThread_frameWait_us;
+    FramePacer             sourceThread_pacer;
+    bool                   sourceThread_phaseLock;
+
+    // resumeStream() and restartStream() count up streamResumes. The paced source thread
+    // restarts its pacer when it sees the count change, so a pause isn't counted as missed
+    // deadlines
+    uint64_t               streamResumes;
+    uint64_t               sourceThread_resumesSeen;
 
     FrameSourceCallback_t* sourceThread_callback;
     IplImage*              sourceThread_buffer;
 
+    // used if the source thread is queued. Then the source thread only captures frames into the
+    // queue, and a separate consumer thread calls the callback
+    pthread_t                    sourceThread_consumer_id;
+    FrameQueue*                  sourceThread_queue;
+    FrameSourceQueuedCallback_t* sourceThread_queuedCallback;
+    MTcondition                  sourceThread_errorHandled;
+    bool                         sourceThread_keepGoing;
+
+    // cleanupThreads() asks the source threads to exit through this. Every blocking wait in the
+    // threads is interrupted by it, so they exit promptly
+    MTstopToken                  sourceThread_stop;
+
     // I use a condition to control the "running" state of the frame source. Every get..Frame() call
     // checks this conditon and waits for it to trigger, if necessary
     MTcondition isRunningNow;
 
+    // Capture health counters. The base class counts the delivered frames and the errors. The
+    // sources count the dropped and flushed frames and time their conversions
+    FrameStats stats;
+
+    // When the frame being read reached each stage. The base class marks the start of every read
+    // and the end of the conversion, and the sources that know when their frames were captured
+    // call noteCapture(). The source threads pass these on to the callback
+    FrameStats_Marks frameMarks;
+
+    // Frames lent out by the borrow...Frame() API are described by this header. If a source
+    // can't lend out its own buffers, the frame is converted into borrowBuffer instead
+    IplImage    borrowedHeader;
+    FrameHandle borrowBuffer;
+    bool        frameIsBorrowed;
+
 private:
+    FrameSource_WaitResult sourceThread_fetch(IplImage* buffer, uint64_t* timestamp_us);
+    void sourceThread_queued(void);
+
     // These are the internal APIs called only by the external function definitions below.
     // To impleement new frame sources, these MUST be overridden
     virtual bool _restartStream(void) = 0;
@@ -46,17 +123,113 @@ private:
     virtual bool _getLatestFrame(IplImage* image, uint64_t* timestamp_us = NULL) = 0;
     virtual bool _stopStream(void) = 0;
 
+    // Batch retrieval. Reads up to n frames, and returns how many were read. The default calls
+    // _getNextFrame() n times, with getFramesSingly(). Sources that can do better with a batch
+    // (by decoding ahead, for instance) override this
+    virtual unsigned int _getNextFrames(unsigned int n, IplImage** images, uint64_t* timestamps_us);
+
+    // Native-frame retrieval. The default has no native format to give out, and converts the
+    // frame right away, with getNativeAsConverted()
+    virtual bool _getNativeFrame(NativeFrame* frame, bool latest, uint64_t* timestamp_us);
+
+    // Throws away the frames that are already waiting, without blocking. Sources that don't
+    // buffer frames have nothing to do here
+    virtual bool _flushFrames(void) { return true; }
+
+    // Borrowed-frame API. Sources that can hand out their internal buffers directly override
+    // these. _borrowFrame() fills in the given header to point at the frame data, and the data
+    // must remain valid until _returnFrame() is called. The default implementation converts the
+    // frame into borrowBuffer
+    virtual bool _borrowFrame(IplImage* header, bool latest, uint64_t* timestamp_us);
+    virtual void _returnFrame(void) {}
+
+    const IplImage* borrowFrame(bool latest, uint64_t* timestamp_us);
+
+    // The source may still be using the borrowed frame's buffer (a V4L2 buffer it hasn't
+    // requeued, for instance), so nothing else can be read until it's returned. This complains
+    // and returns true if a frame is borrowed
+    bool frameStillBorrowed(const char* caller);
+
+    // starts the latency clock of a frame read
+    void beginFrame(void);
+
+    // updates the delivered/error counts with the result of a frame read, and passes it on. The
+    // conversion latency of a successful read is recorded here
+    bool countFrame(bool result);
+
+    // waits for the source's file descriptor to have a frame, if there is a file descriptor
+    FrameSource_WaitResult waitForFrame(uint64_t deadline_us, MTstopToken* stop);
+    FrameSource_WaitResult getFrameTimed(IplImage* image, bool latest, uint64_t timeout_us,
+                                         uint64_t* timestamp_us, MTstopToken* stop);
+
 public:
     FrameSource (FrameSource_UserColorChoice _userColorMode = FRAMESOURCE_COLOR);
 
 protected:
-    void setupCroppingScaling(CvRect _cropRect, double scale);
+    // If packedRows, the raw buffer has no padding at the end of each row. Some conversion
+    // libraries (dc1394) need this
+    void setupCroppingScaling(CvRect _cropRect, double scale, bool packedRows = false);
     void applyCroppingScaling(IplImage* src, IplImage* dst);
 
+    // true if the output frames are simply a (possibly cropped) view of the raw frames, with no
+    // scaling. Sources can lend out their raw buffers in that case
+    bool isCropOnly(void);
+
+    // the window of the raw frame that makes it into the output. This is the whole frame if
+    // we're not cropping
+    CvRect cropWindow(void);
+
+    // Sources that crop and scale as part of their conversion don't need preCropScaleBuffer.
+    // They can call this to free it
+    void dropPreCropScaleBuffer(void);
+
+    // brings back the buffer dropped by dropPreCropScaleBuffer(), if we're cropping or scaling
+    void restorePreCropScaleBuffer(void);
+
+    // fills in a header to describe the output frame given the raw frame data. The cropping is
+    // applied here. Only valid if isCropOnly()
+    void initBorrowedHeader(IplImage* header, unsigned char* data, int stride);
+
+    // fallback borrowing implementation: get the frame into borrowBuffer and point the header there
+    bool borrowIntoBuffer(IplImage* header, bool latest, uint64_t* timestamp_us);
+
+    // fallback batch implementation: get the frames one at a time
+    unsigned int getFramesSingly(unsigned int n, IplImage** images, uint64_t* timestamps_us);
+
+    // fallback native-frame implementation: the frame carries only the representation of our
+    // userColorMode, which is converted right away
+    bool getNativeAsConverted(NativeFrame* frame, bool latest, uint64_t* timestamp_us);
+
+    // tells a native frame to crop and scale its representations the way this source does
+    void setNativeGeometry(NativeFrame* frame);
+
+    // Sources call this when they take a frame from the driver, with the time the frame was
+    // captured, in us on CLOCK_MONOTONIC, or 0 if that's not known. The capture latency is
+    // recorded, and the conversion latency is counted from here
+    void noteCapture(uint64_t capture_us);
+
 public:
     virtual void cleanupThreads(void);
     virtual ~FrameSource();
 
+    // Selects the speed/quality tradeoff of the scaling, if this source is set up to scale. The
+    // default is FRAMERESIZE_CUBIC. This takes effect on the next frame
+    void setInterpolation(FrameResize_Interpolation _interpolation)
+    {
+        interpolation = _interpolation;
+    }
+    FrameResize_Interpolation getInterpolation(void) { return interpolation; }
+
+    // Caps the number of threads used to convert and scale each frame. Each frame is split into
+    // horizontal bands that are processed in parallel by the shared WorkerPool. The default is
+    // 1: everything happens in the thread that gets the frame. This takes effect on the next
+    // frame
+    void setMaxThreads(int _maxThreads)
+    {
+        maxThreads = _maxThreads < 1 ? 1 : _maxThreads;
+    }
+    int getMaxThreads(void) { return maxThreads; }
+
     // I want the derived classes to override this. It indicates whether the class is initialized
     // and ready to use
     virtual operator bool() = 0;
@@ -70,10 +243,78 @@ public:
     bool getNextFrame  (IplImage* image, uint64_t* timestamp_us = NULL);
     bool getLatestFrame(IplImage* image, uint64_t* timestamp_us = NULL);
 
+    // pooled frame accessors. These work like the above, but the frame is written into a buffer
+    // from this source's frame pool. The caller can hold on to the frame (and pass it around) for
+    // as long as it likes. The buffer goes back to the pool when the last handle to it is
+    // released.
+    bool getNextFrame  (FrameHandle* frame, uint64_t* timestamp_us = NULL);
+    bool getLatestFrame(FrameHandle* frame, uint64_t* timestamp_us = NULL);
+
+    // Batch accessors, for offline processing. These read the next n frames into images[0..n-1]
+    // (or into n pooled frames), with the timestamps going into timestamps_us[0..n-1] if it isn't
+    // NULL. Returns the number of frames read. This is less than n only if the source ran out or
+    // failed; the frames before that point are valid. The per-call overhead is paid once per
+    // batch, and FFmpegDecoder decodes the whole batch before converting it
+    unsigned int getNextFrames(unsigned int n, IplImage**   images, uint64_t* timestamps_us = NULL);
+    unsigned int getNextFrames(unsigned int n, FrameHandle* frames, uint64_t* timestamps_us = NULL);
+
+    // Native-format accessors. The frame is delivered in the source's own format (YUYV, NV12,
+    // MJPEG, dc1394 YUV411, ...), and nothing is converted until NativeFrame::get() asks for a
+    // particular representation. Each representation is converted only once per frame. This is
+    // for consumers that record the frames, pass them on, or drop many of them. Sources with no
+    // native format to give out convert into the userColorMode representation right away
+    bool getNextNativeFrame  (NativeFrame* frame, uint64_t* timestamp_us = NULL);
+    bool getLatestNativeFrame(NativeFrame* frame, uint64_t* timestamp_us = NULL);
+
+    // Timed versions of the above. These wait at most timeout_us for the frame (MT_FOREVER to wait
+    // as long as it takes). If a stop token is given, requesting a stop on it interrupts the wait.
+    // FRAMESOURCE_TIMEOUT is returned in either case. The time spent waiting for the stream to
+    // be resumed counts too. For the sources that have no file descriptor (video files, static
+    // images) a frame is always available, and these don't wait
+    FrameSource_WaitResult getNextFrameTimed  (IplImage* image, uint64_t timeout_us,
+                                               uint64_t* timestamp_us = NULL,
+                                               MTstopToken* stop = NULL);
+    FrameSource_WaitResult getLatestFrameTimed(IplImage* image, uint64_t timeout_us,
+                                               uint64_t* timestamp_us = NULL,
+                                               MTstopToken* stop = NULL);
+    FrameSource_WaitResult getNextFrameTimed  (FrameHandle* frame, uint64_t timeout_us,
+                                               uint64_t* timestamp_us = NULL,
+                                               MTstopToken* stop = NULL);
+    FrameSource_WaitResult getLatestFrameTimed(FrameHandle* frame, uint64_t timeout_us,
+                                               uint64_t* timestamp_us = NULL,
+                                               MTstopToken* stop = NULL);
+
+    // the pool the above get their buffers from. By default the pool has no preallocated buffers
+    // and grows as needed. setupFramePool() can be called to preallocate buffers and/or to back
+    // them with hugepages. This must be done before any pooled frames are taken out
+    FramePool* getFramePool(void);
+    bool setupFramePool(unsigned int numPreallocated, bool useHugepages = false);
+
+    // zero-copy frame accessors
+    //
+    // Instead of copying the frame into a caller-owned buffer, the source hands out a read-only
+    // view of its own data. If possible this points directly into the driver buffer (V4L2 mmap
+    // buffers, dc1394 DMA buffers) or into the source image. If the source needs to convert or
+    // scale the frame, the result goes into an internal buffer, and a view of THAT is returned.
+    //
+    // Only one frame can be borrowed at a time. The view is valid until returnFrame() is
+    // called. The source holds on to the underlying buffer until then, so the caller should
+    // return it as soon as it's done with the data. NULL is returned on error
+    const IplImage* borrowNextFrame  (uint64_t* timestamp_us = NULL);
+    const IplImage* borrowLatestFrame(uint64_t* timestamp_us = NULL);
+    void returnFrame(void);
+
     bool stopStream(void);
     bool resumeStream (void);
     bool restartStream(void);
 
+    // Throws away all the frames that are waiting to be read, without blocking. The next
+    // getNextFrame() then returns a frame captured after this call
+    bool flushFrames(void);
+
+    // false if the stream is stopped. The get...Frame() calls block until it's resumed
+    bool isRunning(void) { return isRunningNow; }
+
     // Instead of accessing the frame with blocking I/O, the frame source can spawn a thread to wait
     // for the frames, and callback when a new frame is available. The thread can optionally wait
     // some amount of time between successive frames to force-limit the framerate by giving a
@@ -86,7 +327,36 @@ public:
 
     void startSourceThread(FrameSourceCallback_t* callback, uint64_t frameWait_us,
                            IplImage* buffer);
+
+    // The rate-limited source threads wake up on a fixed grid of deadlines, frameWait_us apart,
+    // so the capture and callback times don't slow the rate down. If the thread falls behind by
+    // more than a period, the missed deadlines are skipped and counted in the stats. If
+    // phaseLock, the grid is also aligned to the source's frame timestamps to minimize the
+    // latency. This must be set before the thread is started
+    void setPacingPhaseLock(bool phaseLock) { sourceThread_phaseLock = phaseLock; }
+
+    // Queued version of the source thread. The frames are captured into pooled buffers and
+    // placed into a queue of the given depth. A separate consumer thread takes the frames out of
+    // the queue and calls the callback. Thus a slow callback doesn't stall the capture, and the
+    // callback can hold on to the frames after it returns. The policy specifies what happens if
+    // the consumer falls behind and the queue fills up
+    void startSourceThread(FrameSourceQueuedCallback_t* callback, uint64_t frameWait_us,
+                           unsigned int queueDepth,
+                           FrameQueue_Policy policy = FRAMEQUEUE_DROP_OLDEST);
+
+    // reports the queue depth and the dropped-frame counts of the queued source thread. Returns
+    // false if the queued source thread isn't running
+    bool getQueueStats(FrameQueue_Stats* stats);
+
+    // Reports the capture health of this source: frames delivered, dropped by the driver and
+    // flushed by getLatestFrame(), the conversion time histogram, the achieved frame rate and
+    // the recent latency percentiles of each stage from the capture to the callback. This is
+    // lock-free, and can be called from any thread at any time
+    void getStats(FrameSource_Stats* _stats) { stats.get(_stats); }
+    void resetStats(void)                    { stats.reset();      }
+
     void sourceThread(void);
+    void sourceThread_consumer(void);
 
     // Another way to drive the application is to keep everything synchronous
     // using a select() or poll() in the main loop to look at ALL the file
@@ -0,0 +1,267 @@
+#include <time.h>
+#include <math.h>
+#include "frameStats.hh"
+
+uint64_t FrameStats::now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000ULL + (uint64_t)t.tv_nsec / 1000ULL;
+}
+
+uint64_t FrameStats::realtimeToMonotonic_us(uint64_t realtime_us)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    uint64_t realNow = (uint64_t)t.tv_sec * 1000000ULL + (uint64_t)t.tv_nsec / 1000ULL;
+    uint64_t monoNow = now_us();
+
+    uint64_t offset = realNow - monoNow;
+    return realtime_us > offset ? realtime_us - offset : 0;
+}
+
+static int latencyBin(uint64_t time_us)
+{
+    if(time_us < 8)
+        return (int)time_us;
+
+    int octave = 63 - __builtin_clzll(time_us);
+    int bin    = 8 + (octave-3)*4 + (int)((time_us >> (octave-2)) & 3);
+    return bin < FRAMESTATS_LATENCY_BINS ? bin : FRAMESTATS_LATENCY_BINS-1;
+}
+
+uint64_t FrameStats::latencyBinStart_us(int bin)
+{
+    if(bin < 8)
+        return bin;
+
+    int octave = 3 + (bin-8)/4;
+    int sub    = (bin-8)%4;
+    return (uint64_t)(4 + sub) << (octave-2);
+}
+
+uint64_t FrameStats::latencyBinEnd_us(int bin)
+{
+    if(bin < FRAMESTATS_LATENCY_BINS-1)
+        return latencyBinStart_us(bin+1);
+
+    // the last bin is open-ended. I say it ends at the next power of 2
+    return latencyBinStart_us(bin) * 8 / 7;
+}
+
+void FrameStats::reset(void)
+{
+    __atomic_store_n(&delivered,          0, __ATOMIC_RELAXED);
+    __atomic_store_n(&dropped,            0, __ATOMIC_RELAXED);
+    __atomic_store_n(&flushed,            0, __ATOMIC_RELAXED);
+    __atomic_store_n(&errors,             0, __ATOMIC_RELAXED);
+    __atomic_store_n(&missedDeadlines,    0, __ATOMIC_RELAXED);
+    __atomic_store_n(&backlog,            0, __ATOMIC_RELAXED);
+    __atomic_store_n(&conversionTotal_us, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&conversionMax_us,   0, __ATOMIC_RELAXED);
+    __atomic_store_n(&lastDelivery_us,    0, __ATOMIC_RELAXED);
+    __atomic_store_n(&avgInterval_ns,     0, __ATOMIC_RELAXED);
+    for(int i=0; i<FRAMESTATS_NUM_BINS; i++)
+        __atomic_store_n(&conversionHistogram[i], 0, __ATOMIC_RELAXED);
+
+    for(int stage=0; stage<FRAMESTATS_NUM_LATENCY_STAGES; stage++)
+        for(int w=0; w<2; w++)
+        {
+            LatencyWindow* window = &latency[stage][w];
+            __atomic_store_n(&window->epoch,  0, __ATOMIC_RELAXED);
+            __atomic_store_n(&window->max_us, 0, __ATOMIC_RELAXED);
+            for(int i=0; i<FRAMESTATS_LATENCY_BINS; i++)
+                __atomic_store_n(&window->bins[i], 0, __ATOMIC_RELAXED);
+        }
+}
+
+void FrameStats::addDelivered(void)
+{
+    __atomic_add_fetch(&delivered, 1, __ATOMIC_RELAXED);
+
+    // Frames are normally delivered by one thread, so I don't bother making the moving average
+    // update atomic as a whole. If two threads race here, one interval is lost. No big deal
+    uint64_t now  = now_us();
+    uint64_t last = __atomic_exchange_n(&lastDelivery_us, now, __ATOMIC_RELAXED);
+    if(last == 0 || now < last)
+        return;
+
+    int64_t dt_ns = (int64_t)(now - last) * 1000;
+    int64_t avg   = (int64_t)__atomic_load_n(&avgInterval_ns, __ATOMIC_RELAXED);
+    if(avg == 0) avg = dt_ns;
+    else         avg += (dt_ns - avg) / 16;
+    __atomic_store_n(&avgInterval_ns, (uint64_t)avg, __ATOMIC_RELAXED);
+}
+
+void FrameStats::addDropped(uint64_t n)
+{
+    __atomic_add_fetch(&dropped, n, __ATOMIC_RELAXED);
+}
+
+void FrameStats::addFlushed(uint64_t n)
+{
+    __atomic_add_fetch(&flushed, n, __ATOMIC_RELAXED);
+}
+
+void FrameStats::addError(void)
+{
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+}
+
+void FrameStats::addMissedDeadlines(uint64_t n)
+{
+    __atomic_add_fetch(&missedDeadlines, n, __ATOMIC_RELAXED);
+}
+
+void FrameStats::setBacklog(uint32_t n)
+{
+    __atomic_store_n(&backlog, n, __ATOMIC_RELAXED);
+}
+
+void FrameStats::addConversion(uint64_t time_us)
+{
+    int bin = 0;
+    while(bin < FRAMESTATS_NUM_BINS-1 && (time_us >> bin) != 0)
+        bin++;
+
+    __atomic_add_fetch(&conversionHistogram[bin], 1,       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&conversionTotal_us,       time_us, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&conversionMax_us, __ATOMIC_RELAXED);
+    while(time_us > max &&
+          !__atomic_compare_exchange_n(&conversionMax_us, &max, time_us, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void FrameStats::addLatency(FrameStats_LatencyStage stage, uint64_t time_us)
+{
+    // the epochs start at 1, so that 0 means "never used"
+    uint64_t       epoch  = now_us() / FRAMESTATS_LATENCY_WINDOW_US + 1;
+    LatencyWindow* window = &latency[stage][epoch & 1];
+
+    // If this window holds old counts, I claim it and wipe them out. Anybody recording into it
+    // while I'm wiping may lose a sample. That's fine for statistics
+    uint64_t windowEpoch = __atomic_load_n(&window->epoch, __ATOMIC_RELAXED);
+    if(windowEpoch != epoch &&
+       __atomic_compare_exchange_n(&window->epoch, &windowEpoch, epoch, false,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&window->max_us, 0, __ATOMIC_RELAXED);
+        for(int i=0; i<FRAMESTATS_LATENCY_BINS; i++)
+            __atomic_store_n(&window->bins[i], 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_add_fetch(&window->bins[latencyBin(time_us)], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&window->max_us, __ATOMIC_RELAXED);
+    while(time_us > max &&
+          !__atomic_compare_exchange_n(&window->max_us, &max, time_us, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void FrameStats::addCallback(const FrameStats_Marks* marks)
+{
+    uint64_t now = now_us();
+
+    if(marks->converted_us != 0 && marks->converted_us <= now)
+        addLatency(FRAMESTATS_CONVERTED_TO_CALLBACK, now - marks->converted_us);
+    if(marks->capture_us != 0 && marks->capture_us <= now)
+        addLatency(FRAMESTATS_CAPTURE_TO_CALLBACK, now - marks->capture_us);
+}
+
+// the time below which the given fraction of the samples fall. Within a bin I interpolate
+// linearly
+static uint64_t latencyPercentile(const uint64_t* bins, uint64_t count, uint64_t max_us,
+                                  double fraction)
+{
+    uint64_t target = (uint64_t)ceil(fraction * (double)count);
+    if(target < 1) target = 1;
+
+    uint64_t sum = 0;
+    for(int i=0; i<FRAMESTATS_LATENCY_BINS; i++)
+    {
+        if(sum + bins[i] < target)
+        {
+            sum += bins[i];
+            continue;
+        }
+
+        uint64_t start = FrameStats::latencyBinStart_us(i);
+        uint64_t end   = FrameStats::latencyBinEnd_us(i);
+
+        // the last bin is open-ended, and runs to the longest time seen
+        if(i == FRAMESTATS_LATENCY_BINS-1 && max_us > end)
+            end = max_us;
+        uint64_t t     = start + (uint64_t)((double)(end - start) *
+                                            (double)(target - sum) / (double)bins[i]);
+        return t < max_us ? t : max_us;
+    }
+    return max_us;
+}
+
+void FrameStats::getLatency(FrameStats_LatencyStage stage, FrameStats_Latency* result)
+{
+    uint64_t epoch = now_us() / FRAMESTATS_LATENCY_WINDOW_US + 1;
+
+    // I merge the current window and the previous one
+    uint64_t bins[FRAMESTATS_LATENCY_BINS] = {};
+    result->max_us = 0;
+    for(int w=0; w<2; w++)
+    {
+        LatencyWindow* window      = &latency[stage][w];
+        uint64_t       windowEpoch = __atomic_load_n(&window->epoch, __ATOMIC_RELAXED);
+        if(windowEpoch == 0 || windowEpoch + 1 < epoch)
+            continue;
+
+        uint64_t max = __atomic_load_n(&window->max_us, __ATOMIC_RELAXED);
+        if(max > result->max_us)
+            result->max_us = max;
+        for(int i=0; i<FRAMESTATS_LATENCY_BINS; i++)
+            bins[i] += __atomic_load_n(&window->bins[i], __ATOMIC_RELAXED);
+    }
+
+    result->count = 0;
+    for(int i=0; i<FRAMESTATS_LATENCY_BINS; i++)
+        result->count += bins[i];
+
+    if(result->count == 0)
+    {
+        result->p50_us = result->p90_us = result->p99_us = result->p999_us = 0;
+        return;
+    }
+    result->p50_us  = latencyPercentile(bins, result->count, result->max_us, 0.5);
+    result->p90_us  = latencyPercentile(bins, result->count, result->max_us, 0.9);
+    result->p99_us  = latencyPercentile(bins, result->count, result->max_us, 0.99);
+    result->p999_us = latencyPercentile(bins, result->count, result->max_us, 0.999);
+}
+
+void FrameStats::get(FrameSource_Stats* stats)
+{
+    stats->delivered          = __atomic_load_n(&delivered,          __ATOMIC_RELAXED);
+    stats->dropped            = __atomic_load_n(&dropped,            __ATOMIC_RELAXED);
+    stats->flushed            = __atomic_load_n(&flushed,            __ATOMIC_RELAXED);
+    stats->errors             = __atomic_load_n(&errors,             __ATOMIC_RELAXED);
+    stats->missedDeadlines    = __atomic_load_n(&missedDeadlines,    __ATOMIC_RELAXED);
+    stats->backlog            = __atomic_load_n(&backlog,            __ATOMIC_RELAXED);
+    stats->conversionTotal_us = __atomic_load_n(&conversionTotal_us, __ATOMIC_RELAXED);
+    stats->conversionMax_us   = __atomic_load_n(&conversionMax_us,   __ATOMIC_RELAXED);
+    for(int i=0; i<FRAMESTATS_NUM_BINS; i++)
+        stats->conversionHistogram[i] = __atomic_load_n(&conversionHistogram[i], __ATOMIC_RELAXED);
+    for(int stage=0; stage<FRAMESTATS_NUM_LATENCY_STAGES; stage++)
+        getLatency((FrameStats_LatencyStage)stage, &stats->latency[stage]);
+
+    uint64_t last     = __atomic_load_n(&lastDelivery_us, __ATOMIC_RELAXED);
+    uint64_t interval = __atomic_load_n(&avgInterval_ns,  __ATOMIC_RELAXED);
+    if(last == 0 || interval == 0)
+    {
+        stats->fps = 0.0;
+        return;
+    }
+
+    uint64_t sinceLast_ns = (now_us() - last) * 1000;
+    if(sinceLast_ns > interval)
+        interval = sinceLast_ns;
+    stats->fps = 1e9 / (double)interval;
+}
@@ -0,0 +1,159 @@
+// -*- c++ -*-
+
+#ifndef __FRAME_STATS_HH__
+#define __FRAME_STATS_HH__
+
+#include <stdint.h>
+
+// The conversion times are histogrammed into power-of-2 bins of microseconds. Bin 0 has times
+// <1us, bin i has times in [2^(i-1), 2^i) us. The last bin also gets everything longer
+#define FRAMESTATS_NUM_BINS 24
+
+// The latencies are histogrammed more finely, so that percentiles can be read off them. Times
+// under 8us get a bin each. Above that, each power of 2 is split into 4 bins, so a percentile is
+// off by at most ~12%. Anything over ~30s lands in the last bin
+#define FRAMESTATS_LATENCY_BINS (8 + 22*4)
+
+// The latency histograms are rolling. Each covers a window of this many us, and the previous
+// window is kept too, so the percentiles describe the last 5-10 seconds
+#define FRAMESTATS_LATENCY_WINDOW_US 5000000ULL
+
+// The stages a frame goes through on its way to the application. All the times are on
+// CLOCK_MONOTONIC
+enum FrameStats_LatencyStage
+{
+    // From the capture, as timestamped by the driver, to the source taking the frame from the
+    // driver. This is the time the frame sat in the driver's buffers. Only the sources that
+    // know when their frames were captured (the cameras) report this
+    FRAMESTATS_CAPTURE_TO_DEQUEUE,
+
+    // From the source taking the frame to the converted frame being ready. For the sources
+    // that don't dequeue (video files, static images) this is from the start of the read
+    FRAMESTATS_DEQUEUE_TO_CONVERTED,
+
+    // From the converted frame being ready to the source thread's callback returning. This
+    // includes the wait in the queue of the queued source thread. Only the frames delivered
+    // by the source threads are timed here
+    FRAMESTATS_CONVERTED_TO_CALLBACK,
+
+    // From the capture to the callback returning: the whole trip
+    FRAMESTATS_CAPTURE_TO_CALLBACK,
+
+    FRAMESTATS_NUM_LATENCY_STAGES
+};
+
+// when a frame reached each stage, in us on CLOCK_MONOTONIC. 0 if unknown
+struct FrameStats_Marks
+{
+    uint64_t capture_us, dequeue_us, converted_us;
+};
+
+// the latency percentiles of one stage, over the recent window
+struct FrameStats_Latency
+{
+    uint64_t count; // frames timed in the window. The percentiles are 0 if this is 0
+    uint64_t p50_us, p90_us, p99_us, p999_us;
+    uint64_t max_us;
+};
+
+// A snapshot of the health of a frame source
+struct FrameSource_Stats
+{
+    uint64_t delivered; // frames returned to the caller
+    uint64_t dropped;   // frames lost before we could get to them: the driver ran out of buffers
+    uint64_t flushed;   // frames thrown away by getLatestFrame() to get to the latest one
+    uint64_t errors;    // failed frame reads
+    uint64_t missedDeadlines; // pacing deadlines skipped because the rate-limited thread fell behind
+    uint32_t backlog;   // frames waiting in the driver when the last frame was taken, if known
+
+    // the time spent converting (color conversion, cropping, scaling) each frame
+    uint64_t conversionHistogram[FRAMESTATS_NUM_BINS];
+    uint64_t conversionTotal_us;
+    uint64_t conversionMax_us;
+
+    // The recent delivery rate. This is a moving average of the frame intervals. If no frames
+    // have come in for longer than the average interval, the time since the last frame is used
+    // instead, so a stalled source shows a falling rate
+    double fps;
+
+    // the recent latencies of each stage, indexed by FrameStats_LatencyStage
+    FrameStats_Latency latency[FRAMESTATS_NUM_LATENCY_STAGES];
+};
+
+// Capture health counters. The frame sources update these as they work. Anybody can read them
+// at any time with get(): all the counters are updated and read atomically, with no locks, so
+// this is cheap enough to poll from a monitoring thread
+class FrameStats
+{
+    uint64_t delivered, dropped, flushed, errors, missedDeadlines;
+    uint32_t backlog;
+    uint64_t conversionHistogram[FRAMESTATS_NUM_BINS];
+    uint64_t conversionTotal_us, conversionMax_us;
+
+    // for the rate. The interval is a moving average in ns
+    uint64_t lastDelivery_us;
+    uint64_t avgInterval_ns;
+
+    // The rolling latency histograms. Each stage has two windows, used alternately: window
+    // (t/FRAMESTATS_LATENCY_WINDOW_US)%2 is current at time t. The epoch tells which window of
+    // time the counts belong to. The first sample of a new window wipes out the counts from two
+    // windows ago
+    struct LatencyWindow
+    {
+        uint64_t epoch;
+        uint64_t max_us;
+        uint64_t bins[FRAMESTATS_LATENCY_BINS];
+    };
+    LatencyWindow latency[FRAMESTATS_NUM_LATENCY_STAGES][2];
+
+    void getLatency(FrameStats_LatencyStage stage, FrameStats_Latency* result);
+
+public:
+    FrameStats() { reset(); }
+    void reset(void);
+
+    void addDelivered (void);
+    void addDropped   (uint64_t n = 1);
+    void addFlushed   (uint64_t n = 1);
+    void addError     (void);
+    void addMissedDeadlines(uint64_t n);
+    void setBacklog   (uint32_t n);
+    void addConversion(uint64_t time_us);
+    void addLatency   (FrameStats_LatencyStage stage, uint64_t time_us);
+
+    // Records the stages of a frame that were just completed by the source thread's callback
+    // returning. The stages with unknown marks are skipped
+    void addCallback  (const FrameStats_Marks* marks);
+
+    void get(FrameSource_Stats* stats);
+
+    // monotonic time in us
+    static uint64_t now_us(void);
+
+    // Converts a CLOCK_REALTIME time in us (a gettimeofday() timestamp, as some drivers give
+    // out) to CLOCK_MONOTONIC. This assumes the wall clock hasn't been stepped since the time
+    static uint64_t realtimeToMonotonic_us(uint64_t realtime_us);
+
+    // the range of times, in us, that go into the given latency bin
+    static uint64_t latencyBinStart_us(int bin);
+    static uint64_t latencyBinEnd_us  (int bin);
+};
+
+// Times a frame conversion. The time is recorded when this goes out of scope
+class FrameStats_Timer
+{
+    FrameStats* stats;
+    uint64_t    t0;
+
+public:
+    FrameStats_Timer(FrameStats* _stats)
+        : stats(_stats), t0(FrameStats::now_us())
+    {
+    }
+    ~FrameStats_Timer()
+    {
+        stats->addConversion(FrameStats::now_us() - t0);
+    }
+};
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <iostream>
+#include <vector>
+#include "frameTrace.hh"
+using namespace std;
+
+#ifdef VISIONIO_TRACE
+
+struct FrameTrace_Event
+{
+    const char* name;
+    uint64_t    start_ns, end_ns;
+};
+
+// The spans of one thread. Only the owning thread writes here. It fills in an event, and THEN
+// advances the written counter, so a reader knows that the events before the counter are
+// complete. A reader that's slower than the writer can see events being overwritten; it checks
+// the counter again after copying them to find out which ones
+struct FrameTrace_Ring
+{
+    FrameTrace_Ring* next;
+    pid_t            tid;
+    char             threadName[16];
+    uint64_t         written;
+    uint64_t         cleared; // the events before this were thrown away by frameTrace_clear()
+    FrameTrace_Event events[FRAMETRACE_RING_SIZE];
+};
+
+// All the rings ever created. Rings are only ever added to the front of the list, and never
+// freed: the spans of a thread that exited are still dumped
+static FrameTrace_Ring*          rings   = NULL;
+static bool                      enabled = true;
+static __thread FrameTrace_Ring* threadRing;
+
+static FrameTrace_Ring* getThreadRing(void)
+{
+    if(threadRing != NULL)
+        return threadRing;
+
+    FrameTrace_Ring* ring = (FrameTrace_Ring*)calloc(1, sizeof(FrameTrace_Ring));
+    if(ring == NULL)
+        return NULL;
+
+    ring->tid = syscall(SYS_gettid);
+    prctl(PR_GET_NAME, ring->threadName, 0, 0, 0);
+
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&rings, &ring->next, ring, false,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    threadRing = ring;
+    return ring;
+}
+
+void frameTrace_record(const char* name, uint64_t start_ns, uint64_t end_ns)
+{
+    if(!__atomic_load_n(&enabled, __ATOMIC_RELAXED))
+        return;
+
+    FrameTrace_Ring* ring = getThreadRing();
+    if(ring == NULL)
+        return;
+
+    uint64_t          w     = ring->written;
+    FrameTrace_Event* event = &ring->events[w & (FRAMETRACE_RING_SIZE-1)];
+    __atomic_store_n(&event->name,     name,     __ATOMIC_RELAXED);
+    __atomic_store_n(&event->start_ns, start_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->end_ns,   end_ns,   __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->written,   w+1,      __ATOMIC_RELEASE);
+}
+
+// copies out the complete events of a ring, oldest first
+static void readRing(FrameTrace_Ring* ring, vector<FrameTrace_Event>* events)
+{
+    uint64_t w0      = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+    uint64_t cleared = __atomic_load_n(&ring->cleared, __ATOMIC_RELAXED);
+    uint64_t first   = w0 > FRAMETRACE_RING_SIZE ? w0 - FRAMETRACE_RING_SIZE : 0;
+    if(first < cleared)
+        first = cleared;
+
+    vector<FrameTrace_Event> copy;
+    for(uint64_t i=first; i<w0; i++)
+    {
+        FrameTrace_Event* event = &ring->events[i & (FRAMETRACE_RING_SIZE-1)];
+        FrameTrace_Event  e;
+        e.name     = __atomic_load_n(&event->name,     __ATOMIC_RELAXED);
+        e.start_ns = __atomic_load_n(&event->start_ns, __ATOMIC_RELAXED);
+        e.end_ns   = __atomic_load_n(&event->end_ns,   __ATOMIC_RELAXED);
+        copy.push_back(e);
+    }
+
+    // whatever the writer got to while I was copying has been overwritten
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t w1   = __atomic_load_n(&ring->written, __ATOMIC_RELAXED);
+    uint64_t skip = 0;
+    if(w1 > FRAMETRACE_RING_SIZE && w1 - FRAMETRACE_RING_SIZE > first)
+        skip = w1 - FRAMETRACE_RING_SIZE - first;
+
+    for(uint64_t i=skip; i<copy.size(); i++)
+        events->push_back(copy[i]);
+}
+
+bool frameTrace_dump(const char* filename)
+{
+    FILE* fp = fopen(filename, "w");
+    if(fp == NULL)
+    {
+        cerr << "couldn't open '" << filename << "' to write the trace" << endl;
+        return false;
+    }
+
+    int pid = getpid();
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(fp, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"visionio\"}}",
+            pid);
+
+    for(FrameTrace_Ring* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+        ring != NULL;
+        ring = ring->next)
+    {
+        // the thread names are whatever the application set. I drop the characters that would
+        // need escaping
+        char name[sizeof(ring->threadName)];
+        for(unsigned int i=0; i<sizeof(name); i++)
+        {
+            char c = ring->threadName[i];
+            name[i] = (c == '"' || c == '\\' || (c != '\0' && c < ' ')) ? '_' : c;
+        }
+        name[sizeof(name)-1] = '\0';
+        fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                "\"args\": {\"name\": \"%s\"}}",
+                pid, ring->tid, name);
+
+        vector<FrameTrace_Event> events;
+        readRing(ring, &events);
+        for(size_t i=0; i<events.size(); i++)
+            fprintf(fp, ",\n{\"name\": \"%s\", \"cat\": \"visionio\", \"ph\": \"X\", "
+                    "\"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    events[i].name, pid, ring->tid,
+                    (double)events[i].start_ns / 1000.0,
+                    (double)(events[i].end_ns - events[i].start_ns) / 1000.0);
+    }
+
+    fprintf(fp, "\n]}\n");
+    if(fclose(fp) != 0)
+    {
+        cerr << "couldn't write the trace to '" << filename << "'" << endl;
+        return false;
+    }
+    return true;
+}
+
+void frameTrace_clear(void)
+{
+    // The rings belong to their threads, so I can't reset them from here. I mark how far
+    // they've been written instead
+    for(FrameTrace_Ring* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+        ring != NULL;
+        ring = ring->next)
+        __atomic_store_n(&ring->cleared, __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELAXED);
+}
+
+void frameTrace_setEnabled(bool _enabled)
+{
+    __atomic_store_n(&enabled, _enabled, __ATOMIC_RELAXED);
+}
+
+#else
+
+bool frameTrace_dump(const char* filename __attribute__((unused)))
+{
+    cerr << "frameTrace_dump(): libvisionio was built without tracing. Rebuild with TRACE=1" << endl;
+    return false;
+}
+
+void frameTrace_clear(void)
+{
+}
+
+void frameTrace_setEnabled(bool enabled __attribute__((unused)))
+{
+}
+
+#endif
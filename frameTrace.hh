@@ -0,0 +1,95 @@
+// -*- c++ -*-
+
+#ifndef __FRAME_TRACE_HH__
+#define __FRAME_TRACE_HH__
+
+#include <stdint.h>
+#include <time.h>
+
+// Tracing of the hot paths: the capture, conversion, decoding, encoding and drawing of each
+// frame. The code is marked up with FRAMETRACE_SPAN("name"), which times the enclosing scope.
+// The trace points are built in only if VISIONIO_TRACE is defined ("make TRACE=1"). Otherwise
+// they compile to nothing at all.
+//
+// Each span is recorded into a ring buffer owned by the thread that recorded it, so recording
+// takes no locks and makes no syscalls: it's two clock reads and a few stores. Each ring holds
+// the last FRAMETRACE_RING_SIZE spans of its thread. frameTrace_dump() writes them all out as
+// Chrome trace-event JSON, which chrome://tracing and https://ui.perfetto.dev can display.
+//
+// If VISIONIO_TRACE_USDT is defined too ("make TRACE=1" does this if <sys/sdt.h> is available),
+// each span also fires the USDT probes visionio:span__begin(name) and
+// visionio:span__end(name, duration_ns), for bpftrace, perf and SystemTap. For instance:
+//
+//   bpftrace -e 'usdt:./libvisionio.so:visionio:span__end { @[str(arg0)] = hist(arg1); }'
+//
+// The spans in the installed headers (CvFltkWidget) are traced only if the application is
+// built with VISIONIO_TRACE too
+
+// spans kept per thread. Must be a power of 2
+#define FRAMETRACE_RING_SIZE 16384
+
+// Writes all the recorded spans to the given file as Chrome trace-event JSON. Returns false if
+// the file couldn't be written, or if the library was built without tracing
+bool frameTrace_dump(const char* filename);
+
+// throws away the spans recorded so far
+void frameTrace_clear(void);
+
+// Pauses or resumes the recording into the rings. The USDT probes fire regardless. Recording
+// is on by default
+void frameTrace_setEnabled(bool enabled);
+
+
+#ifdef VISIONIO_TRACE
+
+#ifdef VISIONIO_TRACE_USDT
+#include <sys/sdt.h>
+#define FRAMETRACE_PROBE_BEGIN(name)       DTRACE_PROBE1(visionio, span__begin, name)
+#define FRAMETRACE_PROBE_END(name, dur_ns) DTRACE_PROBE2(visionio, span__end, name, dur_ns)
+#else
+#define FRAMETRACE_PROBE_BEGIN(name)       do {} while(0)
+#define FRAMETRACE_PROBE_END(name, dur_ns) do {} while(0)
+#endif
+
+static inline uint64_t frameTrace_now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+void frameTrace_record(const char* name, uint64_t start_ns, uint64_t end_ns);
+
+class FrameTrace_Span
+{
+    const char* name;
+    uint64_t    t0;
+
+public:
+    FrameTrace_Span(const char* _name)
+        : name(_name), t0(frameTrace_now_ns())
+    {
+        FRAMETRACE_PROBE_BEGIN(name);
+    }
+    ~FrameTrace_Span()
+    {
+        uint64_t t1 = frameTrace_now_ns();
+        FRAMETRACE_PROBE_END(name, t1 - t0);
+        frameTrace_record(name, t0, t1);
+    }
+};
+
+#define FRAMETRACE_CONCAT2(a,b) a ## b
+#define FRAMETRACE_CONCAT(a,b)  FRAMETRACE_CONCAT2(a,b)
+
+// Times the rest of the enclosing scope. The name must be a string literal: only the pointer is
+// stored
+#define FRAMETRACE_SPAN(name) FrameTrace_Span FRAMETRACE_CONCAT(frameTrace_span_, __LINE__)(name)
+
+#else
+
+#define FRAMETRACE_SPAN(name) do {} while(0)
+
+#endif
+
+#endif
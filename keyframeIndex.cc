@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include "keyframeIndex.hh"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+using namespace std;
+
+// The sidecar is a header followed by the frame timestamps and then the keyframes. It's a cache
+// for this machine only, so everything is in the native byte order. The version is in the magic
+#define SIDECAR_MAGIC  "VIOVIDX1"
+#define SIDECAR_SUFFIX ".vidx"
+
+struct KeyframeIndex_SidecarHeader
+{
+    char     magic[8];
+    int32_t  stream;
+    int32_t  pad;
+    uint64_t signature[3];
+    uint64_t numFrames;
+    uint64_t numKeyframes;
+};
+
+bool KeyframeIndex::keyframePtsLess(const Keyframe& a, const Keyframe& b)
+{
+    return a.pts < b.pts;
+}
+
+void KeyframeIndex::clear(void)
+{
+    framePts.clear();
+    keyframes.clear();
+    valid = false;
+}
+
+bool KeyframeIndex::build(const char* filename, int stream)
+{
+    clear();
+
+    // I open the file again, so that the scan doesn't disturb whoever is reading it already
+    AVFormatContext* formatCtx = NULL;
+    if(avformat_open_input(&formatCtx, filename, NULL, NULL) != 0)
+    {
+        cerr << "KeyframeIndex: couldn't open '" << filename << "'" << endl;
+        return false;
+    }
+    if(stream < 0 || stream >= (int)formatCtx->nb_streams)
+    {
+        cerr << "KeyframeIndex: '" << filename << "' has no stream " << stream << endl;
+        avformat_close_input(&formatCtx);
+        return false;
+    }
+
+    bool     result = true;
+    AVPacket packet;
+    av_init_packet(&packet);
+    while(av_read_frame(formatCtx, &packet) >= 0)
+    {
+        if(packet.stream_index == stream)
+        {
+            int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+            if(pts == AV_NOPTS_VALUE)
+            {
+                cerr << "KeyframeIndex: '" << filename << "' has packets without timestamps. Can't index it" << endl;
+                av_packet_unref(&packet);
+                result = false;
+                break;
+            }
+
+            framePts.push_back(pts);
+            if(packet.flags & AV_PKT_FLAG_KEY)
+            {
+                Keyframe keyframe;
+                keyframe.pts           = pts;
+                keyframe.seekTimestamp = packet.dts != AV_NOPTS_VALUE ? packet.dts : pts;
+                keyframes.push_back(keyframe);
+            }
+        }
+        av_packet_unref(&packet);
+    }
+    avformat_close_input(&formatCtx);
+
+    if(result && keyframes.empty())
+    {
+        cerr << "KeyframeIndex: '" << filename << "' has no keyframes. Can't index it" << endl;
+        result = false;
+    }
+    if(!result)
+    {
+        clear();
+        return false;
+    }
+
+    // the packets come in decoding order. I want presentation order
+    sort(framePts.begin(), framePts.end());
+    sort(keyframes.begin(), keyframes.end(), keyframePtsLess);
+    valid = true;
+    return true;
+}
+
+bool KeyframeIndex::sidecarName(const char* filename, char* sidecar, unsigned int size)
+{
+    if(strlen(filename) + strlen(SIDECAR_SUFFIX) + 1 > size)
+        return false;
+
+    strcpy(sidecar, filename);
+    strcat(sidecar, SIDECAR_SUFFIX);
+    return true;
+}
+
+// The index is good only as long as the video doesn't change. I tell by the size and the
+// modification time
+bool KeyframeIndex::fileSignature(const char* filename, uint64_t signature[3])
+{
+    struct stat st;
+    if(stat(filename, &st) != 0)
+        return false;
+
+    signature[0] = st.st_size;
+    signature[1] = st.st_mtim.tv_sec;
+    signature[2] = st.st_mtim.tv_nsec;
+    return true;
+}
+
+bool KeyframeIndex::load(const char* filename, int stream)
+{
+    clear();
+
+    char sidecar[4096];
+    uint64_t signature[3];
+    if(!sidecarName(filename, sidecar, sizeof(sidecar)) ||
+       !fileSignature(filename, signature))
+        return false;
+
+    FILE* fp = fopen(sidecar, "r");
+    if(fp == NULL)
+        return false;
+
+    KeyframeIndex_SidecarHeader header;
+    bool result =
+        fread(&header, sizeof(header), 1, fp) == 1              &&
+        memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) == 0 &&
+        header.stream == stream                                  &&
+        memcmp(header.signature, signature, sizeof(signature)) == 0 &&
+        header.numFrames > 0 && header.numKeyframes > 0 &&
+
+        // each frame takes at least a byte of the video. This keeps a broken header from
+        // having me allocate something huge
+        header.numFrames <= signature[0] && header.numKeyframes <= header.numFrames;
+
+    if(result)
+    {
+        framePts .resize(header.numFrames);
+        keyframes.resize(header.numKeyframes);
+        result =
+            fread(&framePts [0], sizeof(framePts [0]), framePts .size(), fp) == framePts .size() &&
+            fread(&keyframes[0], sizeof(keyframes[0]), keyframes.size(), fp) == keyframes.size();
+    }
+    fclose(fp);
+
+    // a stale or broken sidecar is simply rebuilt, so I don't complain about it
+    if(!result)
+    {
+        clear();
+        return false;
+    }
+    valid = true;
+    return true;
+}
+
+bool KeyframeIndex::save(const char* filename, int stream)
+{
+    if(!valid)
+        return false;
+
+    char sidecar[4096], tempname[4096 + 16];
+    KeyframeIndex_SidecarHeader header;
+    memset(&header, 0, sizeof(header));
+    if(!sidecarName(filename, sidecar, sizeof(sidecar)) ||
+       !fileSignature(filename, header.signature))
+        return false;
+
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.stream       = stream;
+    header.numFrames    = framePts.size();
+    header.numKeyframes = keyframes.size();
+
+    // I write a temporary file, and move it into place when it's complete. Somebody reading the
+    // sidecar at the same time thus never sees half of it
+    snprintf(tempname, sizeof(tempname), "%s.%d", sidecar, (int)getpid());
+    FILE* fp = fopen(tempname, "w");
+    if(fp == NULL)
+    {
+        cerr << "KeyframeIndex: couldn't write '" << tempname << "'. The index won't be cached" << endl;
+        return false;
+    }
+
+    bool result =
+        fwrite(&header,       sizeof(header),       1,                fp) == 1                &&
+        fwrite(&framePts [0], sizeof(framePts [0]), framePts .size(), fp) == framePts .size() &&
+        fwrite(&keyframes[0], sizeof(keyframes[0]), keyframes.size(), fp) == keyframes.size();
+    if(fclose(fp) != 0)
+        result = false;
+
+    if(!result || rename(tempname, sidecar) != 0)
+    {
+        cerr << "KeyframeIndex: couldn't write '" << sidecar << "'. The index won't be cached" << endl;
+        unlink(tempname);
+        return false;
+    }
+    return true;
+}
+
+void KeyframeIndex::getKeyframes(std::vector<uint64_t>* frames)
+{
+    frames->clear();
+    for(unsigned int i=0; i<keyframes.size(); i++)
+        frames->push_back(lower_bound(framePts.begin(), framePts.end(), keyframes[i].pts) -
+                          framePts.begin());
+}
+
+bool KeyframeIndex::lookup(uint64_t frame, int64_t* pts, int64_t* seekTimestamp)
+{
+    if(!valid || frame >= framePts.size())
+        return false;
+
+    *pts = framePts[frame];
+
+    // the last keyframe at or before the frame. Frames before the first keyframe (an open GOP can
+    // have some) are decoded after it, so I start at the first keyframe for those
+    Keyframe key;
+    key.pts = *pts;
+    vector<Keyframe>::iterator it = upper_bound(keyframes.begin(), keyframes.end(), key,
+                                                keyframePtsLess);
+    if(it != keyframes.begin())
+        it--;
+    *seekTimestamp = it->seekTimestamp;
+    return true;
+}
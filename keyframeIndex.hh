@@ -0,0 +1,58 @@
+// -*- c++ -*-
+
+#ifndef __KEYFRAME_INDEX_HH__
+#define __KEYFRAME_INDEX_HH__
+
+#include <stdint.h>
+#include <vector>
+
+// An index of the frames of a video stream, for seeking. It knows the presentation timestamp of
+// each frame, and where the keyframes are. To get to frame N, a decoder seeks to the last
+// keyframe at or before it, and decodes from there, throwing away the frames before N.
+//
+// The index is built by reading through the whole file, without decoding anything. That's fast,
+// but still has to read the whole file, so the index is cached in a sidecar file next to the
+// video (the video's name + ".vidx"). The sidecar is tied to the size and the modification time
+// of the video, and is ignored if either changes
+class KeyframeIndex
+{
+    struct Keyframe
+    {
+        int64_t pts;
+        int64_t seekTimestamp; // what av_seek_frame() wants to get here: the dts, if known
+    };
+
+    // the timestamps of all the frames, in presentation order
+    std::vector<int64_t>  framePts;
+    std::vector<Keyframe> keyframes; // sorted by pts
+    bool                  valid;
+
+    static bool keyframePtsLess(const Keyframe& a, const Keyframe& b);
+    bool sidecarName(const char* filename, char* sidecar, unsigned int size);
+    bool fileSignature(const char* filename, uint64_t signature[3]);
+
+public:
+    KeyframeIndex() : valid(false) {}
+
+    void clear(void);
+    bool isValid(void) { return valid; }
+
+    // Reads the packets of the given stream, and builds the index from them
+    bool build(const char* filename, int stream);
+
+    // Loads/saves the index of the given stream from/to the sidecar of filename. load() returns
+    // false if there's no sidecar, or if it doesn't match the video
+    bool load(const char* filename, int stream);
+    bool save(const char* filename, int stream);
+
+    uint64_t numFrames(void) { return framePts.size(); }
+
+    // the numbers of the keyframes, in presentation order
+    void getKeyframes(std::vector<uint64_t>* frames);
+
+    // Looks up the presentation timestamp of the given frame, and what to av_seek_frame() to, to
+    // start decoding at the keyframe before it. Returns false if there's no such frame
+    bool lookup(uint64_t frame, int64_t* pts, int64_t* seekTimestamp);
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include <string.h>
+#include "lumaPlane.hh"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// On x86 I build an AVX2 version of the deinterleaver too, and use it if the CPU supports it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LUMAPLANE_HAVE_AVX2
+#endif
+
+LumaPlane_Layout lumaPlane_layout(enum AVPixelFormat pixfmt)
+{
+    switch(pixfmt)
+    {
+    case AV_PIX_FMT_GRAY8:
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUV440P:
+    case AV_PIX_FMT_YUV411P:
+    case AV_PIX_FMT_YUV410P:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_NV21:
+        return LUMAPLANE_PLANAR;
+
+    case AV_PIX_FMT_YUYV422: return LUMAPLANE_YUYV;
+    case AV_PIX_FMT_UYVY422: return LUMAPLANE_UYVY;
+
+    default:                 return LUMAPLANE_NONE;
+    }
+}
+
+// Deinterleavers. These take the luma from n pixels of packed 4:2:2 data: src[2*i + odd]. Each
+// returns how many pixels it did; the scalar one finishes up
+static void deinterleave_scalar(const uint8_t* src, uint8_t* dst, int start, int n, int odd)
+{
+    for(int i=start; i<n; i++)
+        dst[i] = src[2*i + odd];
+}
+
+#ifdef __SSE2__
+static int deinterleave_sse2(const uint8_t* src, uint8_t* dst, int start, int n, int odd)
+{
+    __m128i mask = _mm_set1_epi16(0x00ff);
+
+    int i = start;
+    for(; i <= n-16; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + 2*i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 2*i + 16));
+
+        // the luma ends up in the low byte of each 16-bit word, and the pack takes those
+        if(odd)
+        {
+            a = _mm_srli_epi16(a, 8);
+            b = _mm_srli_epi16(b, 8);
+        }
+        else
+        {
+            a = _mm_and_si128(a, mask);
+            b = _mm_and_si128(b, mask);
+        }
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+    }
+    return i;
+}
+#endif
+
+#ifdef LUMAPLANE_HAVE_AVX2
+__attribute__((target("avx2")))
+static int deinterleave_avx2(const uint8_t* src, uint8_t* dst, int start, int n, int odd)
+{
+    __m256i mask = _mm256_set1_epi16(0x00ff);
+
+    int i = start;
+    for(; i <= n-32; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + 2*i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 2*i + 32));
+        if(odd)
+        {
+            a = _mm256_srli_epi16(a, 8);
+            b = _mm256_srli_epi16(b, 8);
+        }
+        else
+        {
+            a = _mm256_and_si256(a, mask);
+            b = _mm256_and_si256(b, mask);
+        }
+
+        // the pack works within 128-bit lanes, so the 64-bit words come out as a0 b0 a1 b1
+        __m256i r = _mm256_packus_epi16(a, b);
+        r = _mm256_permute4x64_epi64(r, 0xd8);
+        _mm256_storeu_si256((__m256i*)(dst + i), r);
+    }
+    return i;
+}
+
+static bool cpuHasAVX2(void)
+{
+    static int have = -1;
+    if(have < 0)
+        have = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return have;
+}
+#endif
+
+static void deinterleave(const uint8_t* src, uint8_t* dst, int n, int odd)
+{
+    int done = 0;
+
+#if defined LUMAPLANE_HAVE_AVX2
+    if(cpuHasAVX2())
+        done = deinterleave_avx2(src, dst, done, n, odd);
+#endif
+#ifdef __SSE2__
+    done = deinterleave_sse2(src, dst, done, n, odd);
+#endif
+
+    deinterleave_scalar(src, dst, done, n, odd);
+}
+
+void lumaPlane_extract(LumaPlane_Layout layout, uint8_t* const planes[4], const int strides[4],
+                       CvRect window, uint8_t* dst, int dstStride)
+{
+    if(layout == LUMAPLANE_PLANAR)
+    {
+        const uint8_t* src = lumaPlane_window(planes, strides, window);
+        for(int y=0; y<window.height; y++)
+            memcpy(dst + y*dstStride, src + y*strides[0], window.width);
+        return;
+    }
+
+    // Packed 4:2:2. Each pixel is 2 bytes, so the luma of pixel x is at byte 2x (or 2x+1),
+    // whichever way the window is aligned
+    int odd = layout == LUMAPLANE_UYVY ? 1 : 0;
+    const uint8_t* src = planes[0] + window.y*strides[0] + 2*window.x;
+    for(int y=0; y<window.height; y++)
+        deinterleave(src + y*strides[0], dst + y*dstStride, window.width, odd);
+}
+
+bool lumaPlane_convert(enum AVPixelFormat pixfmt, uint8_t* const planes[4], const int strides[4],
+                       CvRect window, IplImage* output,
+                       FrameResizer* resizer, FrameResize_Interpolation interpolation,
+                       int maxThreads)
+{
+    LumaPlane_Layout layout = lumaPlane_layout(pixfmt);
+    if(layout == LUMAPLANE_NONE || output->nChannels != 1)
+        return false;
+
+    if(window.width == output->width && window.height == output->height)
+    {
+        lumaPlane_extract(layout, planes, strides, window,
+                          (uint8_t*)output->imageData, output->widthStep);
+        return true;
+    }
+
+    // scaling. The planar luma can be fed to the resizer directly
+    if(layout != LUMAPLANE_PLANAR)
+        return false;
+
+    resizer->resize(lumaPlane_window(planes, strides, window),
+                    window.width,  window.height,  strides[0],
+                    (uint8_t*)output->imageData,
+                    output->width, output->height, output->widthStep,
+                    1, interpolation, maxThreads);
+    return true;
+}
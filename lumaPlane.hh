@@ -0,0 +1,53 @@
+// -*- c++ -*-
+
+#ifndef __LUMA_PLANE_HH__
+#define __LUMA_PLANE_HH__
+
+#include <stdint.h>
+#include <opencv2/core/types_c.h>
+#include "frameResize.hh"
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+}
+
+// Grayscale frames straight from the luma of YUV frames, without going through libswscale. In the
+// planar formats (and in NV12/NV21) the first plane already IS the grayscale image: it can be lent
+// out as is, or cropped with a strided memcpy. In the packed 4:2:2 formats (YUYV, UYVY) every
+// other byte is luma, and I deinterleave it with SIMD.
+//
+// The result is exactly what libswscale produces when converting these formats to GRAY8: both
+// sides are limited-range, so it copies the luma as well. The full-range (YUVJ) formats don't
+// qualify, since libswscale rescales their luma
+enum LumaPlane_Layout
+{
+    LUMAPLANE_NONE,   // no usable luma. Use libswscale
+    LUMAPLANE_PLANAR, // the first plane is the luma
+    LUMAPLANE_YUYV,   // packed, the luma is in the even bytes
+    LUMAPLANE_UYVY    // packed, the luma is in the odd bytes
+};
+
+LumaPlane_Layout lumaPlane_layout(enum AVPixelFormat pixfmt);
+
+// Extracts the luma of the given window of a frame into dst. The planes and strides are as from
+// swsCrop_findPlanes(). The layout must not be LUMAPLANE_NONE
+void lumaPlane_extract(LumaPlane_Layout layout, uint8_t* const planes[4], const int strides[4],
+                       CvRect window, uint8_t* dst, int dstStride);
+
+// Produces the grayscale output frame from the luma: the window is cropped out, and scaled to the
+// size of the output frame by the resizer. Returns false if this can't be done, and libswscale
+// should be used instead: if the format has no usable luma, or if a packed format needs scaling
+bool lumaPlane_convert(enum AVPixelFormat pixfmt, uint8_t* const planes[4], const int strides[4],
+                       CvRect window, IplImage* output,
+                       FrameResizer* resizer, FrameResize_Interpolation interpolation,
+                       int maxThreads);
+
+// the top-left luma sample of the given window. Only for LUMAPLANE_PLANAR
+static inline uint8_t* lumaPlane_window(uint8_t* const planes[4], const int strides[4],
+                                        CvRect window)
+{
+    return planes[0] + window.y*strides[0] + window.x;
+}
+
+#endif
@@ -0,0 +1,463 @@
+#include <string.h>
+#include <iostream>
+#include "nativeFrame.hh"
+#include "lumaPlane.hh"
+#include "bayerDemosaic.hh"
+
+#include <opencv2/core/core_c.h>
+#include <opencv2/imgproc/imgproc_c.h>
+using namespace std;
+
+// libavcodec reads past the end of the compressed data, so I leave this much zeroed padding
+// after the native data
+#define NATIVEFRAME_PADDING 64
+
+static int channels(FrameSource_UserColorChoice mode)
+{
+    return mode == FRAMESOURCE_COLOR ? 3 : 1;
+}
+
+static enum AVPixelFormat outputPixfmt(FrameSource_UserColorChoice mode)
+{
+    return mode == FRAMESOURCE_COLOR ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_GRAY8;
+}
+
+// Makes sure *image is a w x h image with the given number of channels, reallocating it if it
+// isn't. The converted images have aligned rows. The full-size ones are packed, since the dc1394
+// conversions need that
+static IplImage* getImage(IplImage** image, int w, int h, int nChannels, bool packed)
+{
+    IplImage* img = *image;
+    if(img != NULL &&
+       img->width == w && img->height == h && img->nChannels == nChannels)
+        return img;
+
+    if(img != NULL)
+    {
+        FramePool::freeAligned(img->imageData, (size_t)img->widthStep * img->height);
+        cvReleaseImageHeader(image);
+    }
+
+    int   stride = packed ? w * nChannels : FramePool::alignedStride(w, nChannels);
+    void* data   = FramePool::allocAligned((size_t)stride * h);
+    if(data == NULL)
+    {
+        cerr << "NativeFrame: out of memory" << endl;
+        return NULL;
+    }
+
+    *image = cvCreateImageHeader(cvSize(w, h), IPL_DEPTH_8U, nChannels);
+    cvSetData(*image, data, stride);
+    return *image;
+}
+
+static void freeImage(IplImage** image)
+{
+    if(*image == NULL)
+        return;
+
+    FramePool::freeAligned((*image)->imageData, (size_t)(*image)->widthStep * (*image)->height);
+    cvReleaseImageHeader(image);
+}
+
+NativeFrame::NativeFrame()
+    : data(NULL), size(0), allocated(0),
+      encoding(NATIVEFRAME_NONE), format(0), formatDetail(0), converter(NULL),
+      width(0), height(0), stride(0),
+      window(cvRect(0, 0, 0, 0)), outWidth(0), outHeight(0),
+      interpolation(FRAMERESIZE_CUBIC), maxThreads(1),
+      decoder(NULL), decoded(NULL), haveDecoded(false)
+{
+    for(int i=0; i<2; i++)
+    {
+        result   [i] = NULL;
+        converted[i] = NULL;
+        fullFrame[i] = NULL;
+        memset(&scalerSetup[i], 0, sizeof(scalerSetup[i]));
+    }
+}
+
+NativeFrame::~NativeFrame()
+{
+    FramePool::freeAligned(data, allocated);
+
+    for(int i=0; i<2; i++)
+    {
+        freeImage(&converted[i]);
+        freeImage(&fullFrame[i]);
+    }
+
+    if(decoded != NULL)
+        av_free(decoded);
+    if(decoder != NULL)
+    {
+        avcodec_close(decoder);
+        av_free(decoder);
+    }
+}
+
+unsigned char* NativeFrame::prepare(NativeFrame_Encoding _encoding, int _width, int _height,
+                                    int _stride, size_t _size)
+{
+    clear();
+
+    if(_size + NATIVEFRAME_PADDING > allocated)
+    {
+        FramePool::freeAligned(data, allocated);
+        allocated = 0;
+
+        data = (unsigned char*)FramePool::allocAligned(_size + NATIVEFRAME_PADDING);
+        if(data == NULL)
+        {
+            cerr << "NativeFrame: out of memory" << endl;
+            return NULL;
+        }
+        allocated = _size + NATIVEFRAME_PADDING;
+    }
+    memset(data + _size, 0, NATIVEFRAME_PADDING);
+
+    encoding = _encoding;
+    width    = _width;
+    height   = _height;
+    stride   = _stride;
+    size     = _size;
+
+    // until told otherwise, the representations are the whole frame, unscaled
+    window    = cvRect(0, 0, width, height);
+    outWidth  = width;
+    outHeight = height;
+    return data;
+}
+
+void NativeFrame::clear(void)
+{
+    encoding     = NATIVEFRAME_NONE;
+    format       = 0;
+    formatDetail = 0;
+    converter    = NULL;
+    size         = 0;
+    haveDecoded  = false;
+    result[0]    = result[1] = NULL;
+}
+
+unsigned char* NativeFrame::setPixels(enum AVPixelFormat pixfmt, int _width, int _height,
+                                      int _stride, size_t _size)
+{
+    unsigned char* buf = prepare(NATIVEFRAME_PIXELS, _width, _height, _stride, _size);
+    format = pixfmt;
+    return buf;
+}
+
+unsigned char* NativeFrame::setMJPEG(int _width, int _height, size_t _size)
+{
+    return prepare(NATIVEFRAME_MJPEG, _width, _height, 0, _size);
+}
+
+unsigned char* NativeFrame::setCustom(NativeFrame_Converter_t* _converter,
+                                      int _format, int _formatDetail,
+                                      int _width, int _height, int _stride, size_t _size)
+{
+    unsigned char* buf = prepare(NATIVEFRAME_CUSTOM, _width, _height, _stride, _size);
+    converter    = _converter;
+    format       = _format;
+    formatDetail = _formatDetail;
+    return buf;
+}
+
+IplImage* NativeFrame::setConverted(FrameSource_UserColorChoice mode, int _width, int _height)
+{
+    prepare(NATIVEFRAME_NONE, _width, _height, 0, 0);
+
+    result[mode] = getImage(&converted[mode], _width, _height, channels(mode), false);
+    return result[mode];
+}
+
+void NativeFrame::setGeometry(CvRect _window, int _outWidth, int _outHeight,
+                              FrameResize_Interpolation _interpolation, int _maxThreads)
+{
+    // the frames that carry only a converted representation are already cropped and scaled
+    if(encoding == NATIVEFRAME_NONE)
+        return;
+
+    window        = _window;
+    outWidth      = _outWidth;
+    outHeight     = _outHeight;
+    interpolation = _interpolation;
+    maxThreads    = _maxThreads < 1 ? 1 : _maxThreads;
+}
+
+const IplImage* NativeFrame::get(FrameSource_UserColorChoice mode)
+{
+    mutex.lock();
+    if(result[mode] == NULL)
+        result[mode] = convert(mode);
+    IplImage* image = result[mode];
+    mutex.unlock();
+
+    return image;
+}
+
+IplImage* NativeFrame::convert(FrameSource_UserColorChoice mode)
+{
+    IplImage* image = convertNative(mode);
+    if(image == NULL)
+        image = derive(mode);
+    return image;
+}
+
+IplImage* NativeFrame::convertNative(FrameSource_UserColorChoice mode)
+{
+    IplImage* image = getPassthrough(mode);
+    if(image != NULL)
+        return image;
+
+    switch(encoding)
+    {
+    case NATIVEFRAME_PIXELS:
+    {
+        uint8_t* planes [4];
+        int      strides[4];
+        if(!swsCrop_findPlanes((enum AVPixelFormat)format, width, height, stride, data,
+                               planes, strides))
+        {
+            cerr << "NativeFrame: couldn't find the planes of pixel format " << format << endl;
+            return NULL;
+        }
+        return convertPixels(mode, (enum AVPixelFormat)format, planes, strides);
+    }
+
+    case NATIVEFRAME_MJPEG:
+        if(!decodeMJPEG())
+            return NULL;
+        return convertPixels(mode, decoder->pix_fmt, decoded->data, decoded->linesize);
+
+    case NATIVEFRAME_CUSTOM:
+        return convertCustom(mode);
+
+    default:
+        return NULL;
+    }
+}
+
+// If the native data already has the pixels we want, and we're at most cropping them, the
+// representation is a view into the native buffer
+IplImage* NativeFrame::getPassthrough(FrameSource_UserColorChoice mode)
+{
+    if(encoding != NATIVEFRAME_PIXELS ||
+       window.width != outWidth || window.height != outHeight)
+        return NULL;
+
+    // the luma plane of planar YUV frames is the grayscale image. It comes first in the buffer
+    bool isOutput = format == outputPixfmt(mode) ||
+        (mode == FRAMESOURCE_GRAYSCALE &&
+         lumaPlane_layout((enum AVPixelFormat)format) == LUMAPLANE_PLANAR);
+    if(!isOutput)
+        return NULL;
+
+    IplImage* header = &passthrough[mode];
+    cvInitImageHeader(header, cvSize(outWidth, outHeight), IPL_DEPTH_8U, channels(mode));
+    cvSetData(header, data + window.y*stride + window.x*channels(mode), stride);
+    return header;
+}
+
+IplImage* NativeFrame::convertPixels(FrameSource_UserColorChoice mode, enum AVPixelFormat pixfmt,
+                                     uint8_t* const planes[4], const int strides[4])
+{
+    // Raw Bayer is demosaiced straight into the representation. Scaling by anything other than
+    // a half demosaics the window into the full-size buffer first
+    BayerDemosaic_Pattern pattern;
+    int                   bytesPerSample;
+    if(bayerDemosaic_fromPixfmt(pixfmt, &pattern, &bytesPerSample))
+    {
+        IplImage* image   = getImage(&converted[mode], outWidth, outHeight, channels(mode), false);
+        IplImage* scratch = NULL;
+        if(image == NULL)
+            return NULL;
+        if(bayerDemosaic_needsScratch(window, outWidth, outHeight) &&
+           (scratch = getImage(&fullFrame[mode], width, height, channels(mode), true)) == NULL)
+            return NULL;
+
+        if(!bayerDemosaic_convert(planes[0], strides[0], width, height, bytesPerSample, pattern,
+                                  window, image, scratch, &resizers[mode], interpolation,
+                                  maxThreads))
+            return NULL;
+        return image;
+    }
+
+    // in grayscale, the luma of most YUV frames is the output already
+    if(mode == FRAMESOURCE_GRAYSCALE)
+    {
+        IplImage* image = getImage(&converted[mode], outWidth, outHeight, 1, false);
+        if(image == NULL)
+            return NULL;
+        if(lumaPlane_convert(pixfmt, planes, strides, window, image,
+                             &resizers[mode], interpolation, maxThreads))
+            return image;
+    }
+
+    // As in the sources: if I can, the scaler converts only the window, scaling it to the
+    // output size directly. A scaler split into bands can't scale vertically, so with several
+    // threads the scaler crops only if we're not scaling
+    bool cropOnly = window.width == outWidth && window.height == outHeight;
+    bool crops    = swsCrop_supported(pixfmt, window) && (maxThreads <= 1 || cropOnly);
+
+    NativeFrame_ScalerSetup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.srcFormat = pixfmt;
+    setup.numBands  = maxThreads;
+    if(crops)
+    {
+        setup.srcWidth  = window.width;
+        setup.srcHeight = window.height;
+        setup.dstWidth  = outWidth;
+        setup.dstHeight = outHeight;
+        setup.flags     = cropOnly ? SWS_POINT : swsCrop_flags(interpolation);
+    }
+    else
+    {
+        setup.srcWidth  = setup.dstWidth  = width;
+        setup.srcHeight = setup.dstHeight = height;
+        setup.flags     = SWS_POINT;
+    }
+
+    SwsCrop_Scaler* scaler = &scalers[mode];
+    if(!scaler->isSetup() || memcmp(&setup, &scalerSetup[mode], sizeof(setup)) != 0)
+    {
+        if(!scaler->setup(pixfmt, setup.srcWidth, setup.srcHeight,
+                          outputPixfmt(mode), setup.dstWidth, setup.dstHeight,
+                          setup.flags, setup.numBands))
+        {
+            cerr << "NativeFrame: couldn't set up the conversion from pixel format " << pixfmt << endl;
+            return NULL;
+        }
+        scalerSetup[mode] = setup;
+    }
+
+    if(crops)
+    {
+        IplImage* image = getImage(&converted[mode], outWidth, outHeight, channels(mode), false);
+        if(image == NULL)
+            return NULL;
+
+        uint8_t* cropped[4];
+        swsCrop_planes(pixfmt, window, planes, strides, cropped);
+        scaler->scale(cropped, strides, (unsigned char*)image->imageData, image->widthStep);
+        return image;
+    }
+
+    IplImage* full = getImage(&fullFrame[mode], width, height, channels(mode), true);
+    if(full == NULL)
+        return NULL;
+
+    scaler->scale(planes, strides, (unsigned char*)full->imageData, full->widthStep);
+    return cropScale(mode, full);
+}
+
+IplImage* NativeFrame::convertCustom(FrameSource_UserColorChoice mode)
+{
+    if(converter == NULL)
+        return NULL;
+
+    IplImage* full = getImage(&fullFrame[mode], width, height, channels(mode), true);
+    if(full == NULL || !(*converter)(this, full, mode, maxThreads))
+        return NULL;
+
+    return cropScale(mode, full);
+}
+
+// crops and scales a full-size conversion into the representation. If there's nothing to do,
+// the full-size conversion is the representation
+IplImage* NativeFrame::cropScale(FrameSource_UserColorChoice mode, IplImage* full)
+{
+    if(window.x == 0 && window.y == 0 && outWidth == width && outHeight == height)
+        return full;
+
+    IplImage* image = getImage(&converted[mode], outWidth, outHeight, channels(mode), false);
+    if(image == NULL)
+        return NULL;
+
+    int            nChannels = channels(mode);
+    const uint8_t* src       = (const uint8_t*)full->imageData +
+                               window.y*full->widthStep + window.x*nChannels;
+    uint8_t*       dst       = (uint8_t*)image->imageData;
+
+    if(window.width == outWidth && window.height == outHeight)
+    {
+        for(int y=0; y<outHeight; y++)
+            memcpy(dst + y*image->widthStep, src + y*full->widthStep, outWidth*nChannels);
+    }
+    else
+        resizers[mode].resize(src, window.width, window.height, full->widthStep,
+                              dst, outWidth,     outHeight,     image->widthStep,
+                              nChannels, interpolation, maxThreads);
+    return image;
+}
+
+// Produces this representation from the other one, if this one can't be produced from the native
+// data. The other one is converted (and kept) if it hasn't been already
+IplImage* NativeFrame::derive(FrameSource_UserColorChoice mode)
+{
+    FrameSource_UserColorChoice other =
+        mode == FRAMESOURCE_COLOR ? FRAMESOURCE_GRAYSCALE : FRAMESOURCE_COLOR;
+
+    if(result[other] == NULL)
+        result[other] = convertNative(other);
+    IplImage* src = result[other];
+    if(src == NULL)
+        return NULL;
+
+    IplImage* image = getImage(&converted[mode], src->width, src->height, channels(mode), false);
+    if(image == NULL)
+        return NULL;
+
+    cvCvtColor(src, image, mode == FRAMESOURCE_COLOR ? CV_GRAY2RGB : CV_RGB2GRAY);
+    return image;
+}
+
+// Decodes the JPEG data. The decoded frame serves both representations, so I decode only once
+bool NativeFrame::decodeMJPEG(void)
+{
+    if(haveDecoded)
+        return true;
+
+    if(decoder == NULL)
+    {
+        avcodec_register_all();
+
+        AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+        if(codec == NULL)
+        {
+            cerr << "NativeFrame: couldn't find the MJPEG decoder" << endl;
+            return false;
+        }
+
+        decoder = avcodec_alloc_context3(NULL);
+        decoded = av_frame_alloc();
+        if(decoder == NULL || decoded == NULL || avcodec_open2(decoder, codec, NULL) < 0)
+        {
+            cerr << "NativeFrame: couldn't open the MJPEG decoder" << endl;
+            if(decoded != NULL) av_free(decoded);
+            if(decoder != NULL) av_free(decoder);
+            decoded = NULL;
+            decoder = NULL;
+            return false;
+        }
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = data;
+    packet.size = (int)size;
+
+    // Each JPEG is a whole frame, and the decoder has no frame threads, so the frame comes out
+    // as soon as its packet goes in
+    if(avcodec_send_packet(decoder, &packet) < 0 ||
+       avcodec_receive_frame(decoder, decoded) < 0)
+    {
+        cerr << "NativeFrame: couldn't decode the MJPEG frame" << endl;
+        return false;
+    }
+
+    haveDecoded = true;
+    return true;
+}
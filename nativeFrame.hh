@@ -0,0 +1,148 @@
+// -*- c++ -*-
+
+#ifndef __NATIVE_FRAME_HH__
+#define __NATIVE_FRAME_HH__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <opencv2/core/types_c.h>
+#include "frameSource.hh"
+#include "swsCrop.hh"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+class NativeFrame;
+
+// How the native data in a NativeFrame is stored
+enum NativeFrame_Encoding
+{
+    NATIVEFRAME_NONE,   // no native data. Only the representations already converted are available
+    NATIVEFRAME_PIXELS, // uncompressed pixels of a libav pixel format (YUYV, NV12, GRAY8, ...)
+    NATIVEFRAME_MJPEG,  // a JPEG image
+    NATIVEFRAME_CUSTOM  // something only the source understands. The source's converter is used
+};
+
+// Converts the whole native frame (no cropping, no scaling) into fullFrame, which has the native
+// dimensions and the channel count of the given mode. Used for NATIVEFRAME_CUSTOM frames.
+// Returns false if this mode can't be produced; a grayscale frame is then derived from the color
+// one
+typedef bool (NativeFrame_Converter_t)(const NativeFrame* frame, IplImage* fullFrame,
+                                       FrameSource_UserColorChoice mode, int maxThreads);
+
+// the libswscale setup of one of the representations. If this changes, the scaler is set up again
+struct NativeFrame_ScalerSetup
+{
+    int srcFormat, srcWidth, srcHeight;
+    int dstWidth, dstHeight;
+    int flags, numBands;
+};
+
+// A frame in the format the source captured it in. Nothing is converted when the frame is
+// captured. Each representation (RGB8 or GRAY8, cropped and scaled like the source's own
+// frames) is produced the first time it is asked for, and is kept until the frame is refilled.
+// Frames that are only recorded, passed along or thrown away never pay for a conversion.
+//
+// The frames are meant to be reused: the native buffer, the converted buffers and the
+// conversion machinery (scalers, the MJPEG decoder) all stay allocated from one frame to the
+// next. get() can be called from several threads at once, but not while the frame is being
+// refilled
+class NativeFrame
+{
+    // the native data. The buffer grows as needed, and is never shrunk
+    unsigned char*           data;
+    size_t                   size, allocated;
+    NativeFrame_Encoding     encoding;
+    int                      format;       // the AVPixelFormat for NATIVEFRAME_PIXELS. For
+    int                      formatDetail; // NATIVEFRAME_CUSTOM these are up to the source
+    NativeFrame_Converter_t* converter;
+    int                      width, height, stride;
+
+    // What the representations look like: this window of the native frame, scaled to
+    // outWidth x outHeight
+    CvRect                    window;
+    int                       outWidth, outHeight;
+    FrameResize_Interpolation interpolation;
+    int                       maxThreads;
+
+    // The representations, indexed by FrameSource_UserColorChoice. result[] points to the
+    // representations produced for this frame, and is NULL for the ones not produced yet. The
+    // buffers behind them stay allocated across frames. A representation that is simply a view
+    // of the native data (the native data is RGB8 already and we're only cropping, say) points
+    // into the native buffer through the passthrough header instead
+    IplImage*  result     [2];
+    IplImage*  converted  [2];
+    IplImage   passthrough[2];
+
+    // the conversion machinery
+    SwsCrop_Scaler          scalers    [2];
+    NativeFrame_ScalerSetup scalerSetup[2];
+    IplImage*               fullFrame  [2]; // full-size conversions, if the scaler can't crop
+    FrameResizer            resizers   [2];
+
+    AVCodecContext* decoder;
+    AVFrame*        decoded;
+    bool            haveDecoded;
+
+    MTmutex mutex;
+
+    unsigned char* prepare(NativeFrame_Encoding _encoding, int _width, int _height, int _stride,
+                           size_t _size);
+
+    IplImage* convert       (FrameSource_UserColorChoice mode);
+    IplImage* convertNative (FrameSource_UserColorChoice mode);
+    IplImage* convertPixels (FrameSource_UserColorChoice mode, enum AVPixelFormat pixfmt,
+                             uint8_t* const planes[4], const int strides[4]);
+    IplImage* convertCustom (FrameSource_UserColorChoice mode);
+    IplImage* cropScale     (FrameSource_UserColorChoice mode, IplImage* full);
+    IplImage* derive        (FrameSource_UserColorChoice mode);
+    IplImage* getPassthrough(FrameSource_UserColorChoice mode);
+    bool      decodeMJPEG   (void);
+
+public:
+    NativeFrame();
+    ~NativeFrame();
+
+    // Fills the frame. These are called by the sources. Each returns a buffer of the given size
+    // that the caller copies the native data into, or NULL if we ran out of memory. The stride
+    // is that of the first plane; the other planes follow it, as with swsCrop_findPlanes()
+    unsigned char* setPixels(enum AVPixelFormat pixfmt, int _width, int _height, int _stride,
+                             size_t _size);
+    unsigned char* setMJPEG (int _width, int _height, size_t _size);
+    unsigned char* setCustom(NativeFrame_Converter_t* _converter, int _format, int _formatDetail,
+                             int _width, int _height, int _stride, size_t _size);
+
+    // For sources that have no native format to give out: the frame carries only the given
+    // representation, into which the source writes its converted frame directly
+    IplImage* setConverted(FrameSource_UserColorChoice mode, int _width, int _height);
+
+    // empties the frame, after a failed fill
+    void clear(void);
+
+    // the cropping and scaling of the representations. The sources call this after they fill
+    // the frame
+    void setGeometry(CvRect _window, int _outWidth, int _outHeight,
+                     FrameResize_Interpolation _interpolation, int _maxThreads);
+
+    // Returns the given representation, converting it if this hasn't been done already. The
+    // image stays valid until the frame is refilled or destroyed, and must not be modified.
+    // Returns NULL if the conversion failed
+    const IplImage* get(FrameSource_UserColorChoice mode);
+
+    // has this representation been produced already?
+    bool isConverted(FrameSource_UserColorChoice mode) { return result[mode] != NULL; }
+
+    // the native data, for consumers that want to record or inspect it as is
+    NativeFrame_Encoding getEncoding    (void) const { return encoding; }
+    const unsigned char* getData        (void) const { return data; }
+    size_t               getSize        (void) const { return size; }
+    int                  getFormat      (void) const { return format; }
+    int                  getFormatDetail(void) const { return formatDetail; }
+    int                  getWidth       (void) const { return width; }
+    int                  getHeight      (void) const { return height; }
+    int                  getStride      (void) const { return stride; }
+};
+
+#endif
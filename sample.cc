@@ -14,6 +14,7 @@ using namespace std;
 
 #include "cameraSource_IIDC.hh"
 #include "cameraSource_v4l2.hh"
+#include "testPatternSource.hh"
 #include "IIDC_featuresWidget.hh"
 
 #include <opencv2/imgproc/imgproc_c.h>
@@ -85,9 +86,12 @@ int main(int argc, char* argv[])
     Fl::lock();
     Fl::visual(FL_RGB);
 
-    // open the first source. If there's an argument, assume it's an input video. Otherwise, try
-    // reading a camera
-    if(argc >= 2)
+    // open the first source. If there's an argument, assume it's an input video, or a synthetic
+    // test pattern if it's "--pattern". Otherwise, try reading a camera
+    if(argc >= 2 && strcmp(argv[1], "--pattern") == 0)
+        source = new TestPatternSource(FRAMESOURCE_COLOR, 640, 480,
+                                       TESTPATTERN_CHECKERBOARD, 30.0);
+    else if(argc >= 2)
         source = new FFmpegDecoder(argv[1], FRAMESOURCE_COLOR, true,
                                    cvRect(0, 0, 320, 480), 1.5);
     else
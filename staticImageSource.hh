@@ -9,6 +9,10 @@ class StaticImageSource : public FrameSource
     IplImage*            image;
     uint64_t             timestamp_now_us;
 
+    // the cropped, scaled image. This is computed once, when the image is loaded. Empty if we're
+    // neither cropping nor scaling
+    FrameHandle          scaledImage;
+
     void makeTimestamp(uint64_t* timestamp_us)
     {
         if(timestamp_us == NULL)
@@ -40,6 +44,8 @@ private:
     bool _getNextFrame  (IplImage* buffer, uint64_t* timestamp_us = NULL);
     bool _getLatestFrame(IplImage* buffer, uint64_t* timestamp_us = NULL);
 
+    bool _borrowFrame(IplImage* header, bool latest, uint64_t* timestamp_us);
+
     // static images don't have any hardware on/off switch, nor is there anything to rewind. Thus
     // these functions are all stubs
     bool _stopStream   (void) { return true; }
@@ -0,0 +1,177 @@
+#include <iostream>
+#include "swsCrop.hh"
+#include "workerPool.hh"
+using namespace std;
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+}
+
+bool swsCrop_supported(enum AVPixelFormat pixfmt, CvRect window)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pixfmt);
+    if(desc == NULL)
+        return false;
+
+    if(desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL))
+        return false;
+
+    if( window.x % (1 << desc->log2_chroma_w) != 0 ||
+        window.y % (1 << desc->log2_chroma_h) != 0 )
+        return false;
+
+    return true;
+}
+
+void swsCrop_planes(enum AVPixelFormat pixfmt, CvRect window,
+                    uint8_t* const src[], const int srcStride[],
+                    uint8_t* planes[4])
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pixfmt);
+
+    // bytes per pixel in each plane. For packed formats with chroma subsampling (YUYV, for
+    // instance) this is the size of a whole group of pixels sharing a chroma sample
+    int pixsteps[4];
+    av_image_fill_max_pixsteps(pixsteps, NULL, desc);
+
+    bool planar = desc->flags & AV_PIX_FMT_FLAG_PLANAR;
+    for(int i=0; i<4; i++)
+    {
+        if(src[i] == NULL)
+        {
+            planes[i] = NULL;
+            continue;
+        }
+
+        // In planar formats, planes 1 and 2 are the subsampled chroma planes. Packed formats
+        // are subsampled horizontally only
+        bool isChroma = planar && (i == 1 || i == 2);
+        int  shift_w  = (isChroma || !planar) ? desc->log2_chroma_w : 0;
+        int  shift_h  = isChroma              ? desc->log2_chroma_h : 0;
+
+        planes[i] = src[i] +
+            (window.y >> shift_h) * srcStride[i] +
+            (window.x >> shift_w) * pixsteps[i];
+    }
+}
+
+bool swsCrop_findPlanes(enum AVPixelFormat pixfmt, int width, int height, int stride,
+                        unsigned char* data, uint8_t* planes[4], int strides[4])
+{
+    // libavutil knows how the planes relate to the first one
+    if(av_image_fill_linesizes(strides, pixfmt, width) < 0)
+        return false;
+
+    int padding = stride - strides[0];
+    for(int i=0; i<4; i++)
+        if(strides[i] != 0)
+            strides[i] += padding * strides[i] / strides[0];
+
+    return av_image_fill_pointers(planes, pixfmt, height, data, strides) >= 0;
+}
+
+int swsCrop_flags(FrameResize_Interpolation interpolation)
+{
+    switch(interpolation)
+    {
+    case FRAMERESIZE_NEAREST:  return SWS_POINT;
+    case FRAMERESIZE_BILINEAR: return SWS_BILINEAR;
+    case FRAMERESIZE_AREA:     return SWS_AREA;
+    default:                   return SWS_BICUBIC;
+    }
+}
+
+SwsCrop_Scaler::SwsCrop_Scaler()
+    : srcFormat(AV_PIX_FMT_NONE), srcHeight(0), bandAlign(1),
+      jobSrc(NULL), jobSrcStride(NULL), jobDst(NULL), jobDstStride(0)
+{
+}
+
+bool SwsCrop_Scaler::setup(enum AVPixelFormat _srcFormat, int srcWidth, int _srcHeight,
+                           enum AVPixelFormat  dstFormat, int dstWidth, int  dstHeight,
+                           int flags, int numBands)
+{
+    free();
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(_srcFormat);
+    if(desc == NULL)
+        return false;
+
+    srcFormat = _srcFormat;
+    srcHeight = _srcHeight;
+
+    // the bands can't split the rows that share a chroma sample
+    bandAlign = 1 << desc->log2_chroma_h;
+
+    if(dstHeight != srcHeight)
+        numBands = 1;
+    if(numBands > (srcHeight + bandAlign - 1) / bandAlign)
+        numBands = (srcHeight + bandAlign - 1) / bandAlign;
+    if(numBands < 1)
+        numBands = 1;
+
+    for(int i=0; i<numBands; i++)
+    {
+        int y0, y1;
+        WorkerPool::bandRows(i, numBands, srcHeight, bandAlign, &y0, &y1);
+
+        SwsContext* context =
+            numBands == 1 ?
+            sws_getContext(srcWidth, srcHeight, srcFormat, dstWidth, dstHeight, dstFormat,
+                           flags, NULL, NULL, NULL) :
+            sws_getContext(srcWidth, y1 - y0,   srcFormat, dstWidth, y1 - y0,   dstFormat,
+                           flags, NULL, NULL, NULL);
+        if(context == NULL)
+        {
+            cerr << "libswscale couldn't create a context" << endl;
+            free();
+            return false;
+        }
+        contexts.push_back(context);
+    }
+
+    return true;
+}
+
+void SwsCrop_Scaler::free(void)
+{
+    for(unsigned int i=0; i<contexts.size(); i++)
+        sws_freeContext(contexts[i]);
+    contexts.clear();
+}
+
+void SwsCrop_Scaler::scaleBand(void* cookie, int band, int numBands)
+{
+    SwsCrop_Scaler* self = (SwsCrop_Scaler*)cookie;
+
+    int y0, y1;
+    WorkerPool::bandRows(band, numBands, self->srcHeight, self->bandAlign, &y0, &y1);
+
+    uint8_t* planes[4];
+    swsCrop_planes(self->srcFormat, cvRect(0, y0, 0, y1 - y0),
+                   self->jobSrc, self->jobSrcStride, planes);
+
+    unsigned char* dst = self->jobDst + y0 * self->jobDstStride;
+    sws_scale(self->contexts[band],
+              planes, self->jobSrcStride, 0, y1 - y0,
+              &dst, &self->jobDstStride);
+}
+
+void SwsCrop_Scaler::scale(uint8_t* const src[], const int srcStride[],
+                           unsigned char* dst, int dstStride)
+{
+    if(contexts.size() == 1)
+    {
+        sws_scale(contexts[0], src, srcStride, 0, srcHeight, &dst, &dstStride);
+        return;
+    }
+
+    jobSrc       = src;
+    jobSrcStride = srcStride;
+    jobDst       = dst;
+    jobDstStride = dstStride;
+
+    int numBands = contexts.size();
+    WorkerPool::shared()->run(&scaleBand, this, numBands, numBands);
+}
@@ -0,0 +1,75 @@
+// -*- c++ -*-
+
+#ifndef __SWS_CROP_HH__
+#define __SWS_CROP_HH__
+
+extern "C"
+{
+#include <libswscale/swscale.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <vector>
+#include <opencv2/core/types_c.h>
+#include "frameResize.hh"
+
+// Helpers to fold the cropping into the libswscale conversion. Instead of converting the whole
+// frame, and then cropping and scaling the result, I point the scaler at the cropping window of
+// the source frame, and have it convert and scale in one pass. Only the cropped pixels are
+// touched, and the output is written only once
+
+// Returns true if frames of this pixel format can be cropped to this window by simply offsetting
+// the plane pointers. This isn't possible for palettized or bitstream formats, or if the crop
+// origin is not aligned to the chroma subsampling, since the chroma samples are shared between
+// neighboring pixels
+bool swsCrop_supported(enum AVPixelFormat pixfmt, CvRect window);
+
+// Points planes[] at the top-left corner of the cropping window in src[]. The strides don't
+// change. swsCrop_supported() must be true
+void swsCrop_planes(enum AVPixelFormat pixfmt, CvRect window,
+                    uint8_t* const src[], const int srcStride[],
+                    uint8_t* planes[4]);
+
+// Finds the planes in a raw buffer holding a frame of this pixel format. The planes follow one
+// another, and the first one has the given stride. The strides of the others are scaled by the
+// same padding as the first. Returns false if libavutil doesn't know the format
+bool swsCrop_findPlanes(enum AVPixelFormat pixfmt, int width, int height, int stride,
+                        unsigned char* data, uint8_t* planes[4], int strides[4]);
+
+// the libswscale scaling flags that match the given interpolation
+int swsCrop_flags(FrameResize_Interpolation interpolation);
+
+// A libswscale conversion that can be split into horizontal bands, and spread across the shared
+// WorkerPool. Each band has its own context, since a context can't be used by several threads at
+// once. The bands are only independent if there's no vertical scaling, so a conversion that
+// scales vertically always runs as a single band
+class SwsCrop_Scaler
+{
+    std::vector<SwsContext*> contexts;
+    enum AVPixelFormat       srcFormat;
+    int                      srcHeight;
+    int                      bandAlign; // band boundaries are multiples of this
+
+    // the frame being converted
+    uint8_t* const* jobSrc;
+    const int*      jobSrcStride;
+    unsigned char*  jobDst;
+    int             jobDstStride;
+
+    static void scaleBand(void* cookie, int band, int numBands);
+
+public:
+    SwsCrop_Scaler();
+    ~SwsCrop_Scaler() { free(); }
+
+    bool setup(enum AVPixelFormat _srcFormat, int srcWidth, int _srcHeight,
+               enum AVPixelFormat  dstFormat, int dstWidth, int  dstHeight,
+               int flags, int numBands = 1);
+    void free(void);
+    bool isSetup(void) { return !contexts.empty(); }
+
+    // converts the whole source frame into the packed output frame
+    void scale(uint8_t* const src[], const int srcStride[], unsigned char* dst, int dstStride);
+};
+
+#endif
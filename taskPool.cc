@@ -0,0 +1,189 @@
+#include <unistd.h>
+#include <iostream>
+#include "taskPool.hh"
+using namespace std;
+
+struct TaskPool_Worker
+{
+    TaskPool*                 pool;
+    int                       index;
+    pthread_t                 thread;
+
+    // The owner pushes and pops at the back. Thieves take from the front
+    pthread_mutex_t           mutex;
+    std::deque<TaskPool_Task> tasks;
+};
+
+// the worker running in this thread, if any. Used to put new tasks on the local deque
+static __thread TaskPool_Worker* currentWorker = NULL;
+
+TaskPool::TaskPool(int numThreads)
+    : numPending(0), numSleeping(0), quit(false)
+{
+    pthread_mutex_init(&sharedMutex, NULL);
+    pthread_mutex_init(&sleepMutex,  NULL);
+    pthread_cond_init (&sleepCond,   NULL);
+
+    if(numThreads <= 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        numThreads = cores < 1 ? 1 : (int)cores;
+    }
+
+    // All the workers must exist before any of them starts looking for things to steal
+    for(int i=0; i<numThreads; i++)
+    {
+        TaskPool_Worker* w = new TaskPool_Worker;
+        w->pool  = this;
+        w->index = i;
+        pthread_mutex_init(&w->mutex, NULL);
+        workers.push_back(w);
+    }
+
+    for(unsigned int i=0; i<workers.size(); i++)
+        if(pthread_create(&workers[i]->thread, NULL, &workerThread, workers[i]) != 0)
+        {
+            cerr << "TaskPool: couldn't create worker thread. Have " << i << " workers" << endl;
+            for(unsigned int j=i; j<workers.size(); j++)
+            {
+                pthread_mutex_destroy(&workers[j]->mutex);
+                delete workers[j];
+            }
+            workers.resize(i);
+            break;
+        }
+}
+
+TaskPool::~TaskPool()
+{
+    pthread_mutex_lock(&sleepMutex);
+    quit = true;
+    pthread_cond_broadcast(&sleepCond);
+    pthread_mutex_unlock(&sleepMutex);
+
+    for(unsigned int i=0; i<workers.size(); i++)
+    {
+        pthread_join(workers[i]->thread, NULL);
+        pthread_mutex_destroy(&workers[i]->mutex);
+        delete workers[i];
+    }
+
+    pthread_cond_destroy (&sleepCond);
+    pthread_mutex_destroy(&sleepMutex);
+    pthread_mutex_destroy(&sharedMutex);
+}
+
+void* TaskPool::workerThread(void* worker)
+{
+    TaskPool_Worker* w = (TaskPool_Worker*)worker;
+    currentWorker = w;
+    w->pool->worker(w);
+    return NULL;
+}
+
+void TaskPool::submit(TaskPool_Func_t* func, void* arg)
+{
+    TaskPool_Task task;
+    task.func = func;
+    task.arg  = arg;
+
+    // with no workers, everything runs in the caller
+    if(workers.empty())
+    {
+        (*func)(arg);
+        return;
+    }
+
+    TaskPool_Worker* self = currentWorker;
+    if(self != NULL && self->pool == this)
+    {
+        pthread_mutex_lock(&self->mutex);
+        self->tasks.push_back(task);
+        pthread_mutex_unlock(&self->mutex);
+    }
+    else
+    {
+        pthread_mutex_lock(&sharedMutex);
+        sharedTasks.push_back(task);
+        pthread_mutex_unlock(&sharedMutex);
+    }
+
+    // The workers bump numSleeping before they check numPending, and I do the reverse here. Both
+    // are full barriers, so either the worker sees my task or I see the worker, and wake it up
+    __sync_add_and_fetch(&numPending, 1);
+    if(__sync_add_and_fetch(&numSleeping, 0) > 0)
+    {
+        pthread_mutex_lock(&sleepMutex);
+        pthread_cond_signal(&sleepCond);
+        pthread_mutex_unlock(&sleepMutex);
+    }
+}
+
+bool TaskPool::findTask(TaskPool_Worker* self, TaskPool_Task* task)
+{
+    // my own newest task first
+    pthread_mutex_lock(&self->mutex);
+    if(!self->tasks.empty())
+    {
+        *task = self->tasks.back();
+        self->tasks.pop_back();
+        pthread_mutex_unlock(&self->mutex);
+        return true;
+    }
+    pthread_mutex_unlock(&self->mutex);
+
+    // then the tasks from outside
+    pthread_mutex_lock(&sharedMutex);
+    if(!sharedTasks.empty())
+    {
+        *task = sharedTasks.front();
+        sharedTasks.pop_front();
+        pthread_mutex_unlock(&sharedMutex);
+        return true;
+    }
+    pthread_mutex_unlock(&sharedMutex);
+
+    // then I steal. I start with my neighbor, so the thieves don't all go after the same victim
+    int n = (int)workers.size();
+    for(int i=1; i<n; i++)
+    {
+        TaskPool_Worker* victim = workers[(self->index + i) % n];
+
+        pthread_mutex_lock(&victim->mutex);
+        if(!victim->tasks.empty())
+        {
+            *task = victim->tasks.front();
+            victim->tasks.pop_front();
+            pthread_mutex_unlock(&victim->mutex);
+            return true;
+        }
+        pthread_mutex_unlock(&victim->mutex);
+    }
+
+    return false;
+}
+
+void TaskPool::worker(TaskPool_Worker* self)
+{
+    while(1)
+    {
+        TaskPool_Task task;
+        if(findTask(self, &task))
+        {
+            __sync_sub_and_fetch(&numPending, 1);
+            (*task.func)(task.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&sleepMutex);
+        __sync_add_and_fetch(&numSleeping, 1);
+        while(!quit && __sync_add_and_fetch(&numPending, 0) == 0)
+            pthread_cond_wait(&sleepCond, &sleepMutex);
+        __sync_sub_and_fetch(&numSleeping, 1);
+        bool done = quit;
+        pthread_mutex_unlock(&sleepMutex);
+
+        if(done)
+            return;
+    }
+}
@@ -0,0 +1,63 @@
+// -*- c++ -*-
+
+#ifndef __TASK_POOL_HH__
+#define __TASK_POOL_HH__
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+// A task. This is called once, with the argument given to submit()
+typedef void (TaskPool_Func_t)(void* arg);
+
+struct TaskPool_Task
+{
+    TaskPool_Func_t* func;
+    void*            arg;
+};
+
+struct TaskPool_Worker;
+
+// A work-stealing thread pool for independent tasks. Each worker has its own deque of tasks.
+// Tasks submitted from inside a task go onto the submitting worker's deque, and the worker takes
+// its own tasks newest-first, so a chain of dependent tasks tends to stay on one core with its
+// data in cache. Tasks submitted from outside go onto a shared queue. An idle worker takes from
+// the shared queue, and failing that steals the oldest task of another worker.
+//
+// This is unlike the WorkerPool, which splits a single job into bands and waits for all of them.
+// Here nobody waits: tasks run whenever a worker is free, and they can submit more tasks
+class TaskPool
+{
+    friend struct TaskPool_Worker;
+
+    std::vector<TaskPool_Worker*> workers;
+
+    // tasks submitted from outside the pool
+    pthread_mutex_t           sharedMutex;
+    std::deque<TaskPool_Task> sharedTasks;
+
+    // idle workers sleep here
+    pthread_mutex_t sleepMutex;
+    pthread_cond_t  sleepCond;
+    int             numPending;  // tasks queued anywhere. Atomic
+    int             numSleeping; // atomic
+    bool            quit;
+
+    static void* workerThread(void* worker);
+    void         worker(TaskPool_Worker* self);
+    bool         findTask(TaskPool_Worker* self, TaskPool_Task* task);
+
+public:
+    // numThreads <= 0 means one thread per core
+    TaskPool(int numThreads = 0);
+
+    // Stops the workers. Tasks that haven't started yet are thrown away, so the caller should make
+    // sure everything it cares about is done first
+    ~TaskPool();
+
+    void submit(TaskPool_Func_t* func, void* arg);
+
+    int threads(void) { return (int)workers.size(); }
+};
+
+#endif
@@ -0,0 +1,614 @@
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <iostream>
+#include "testPatternSource.hh"
+#include "bayerDemosaic.hh"
+#include "workerPool.hh"
+#include "frameTrace.hh"
+
+#include <opencv2/core/core_c.h>
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+}
+using namespace std;
+
+// the rows are generated this many pixels at a time
+#define TESTPATTERN_CHUNK 256
+
+static enum AVPixelFormat outputPixfmt(FrameSource_UserColorChoice mode)
+{
+    return mode == FRAMESOURCE_COLOR ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_GRAY8;
+}
+
+static bool isSupported(enum AVPixelFormat pixfmt)
+{
+    switch(pixfmt)
+    {
+    case AV_PIX_FMT_RGB24:
+    case AV_PIX_FMT_GRAY8:
+    case AV_PIX_FMT_YUYV422:
+    case AV_PIX_FMT_UYVY422:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_BAYER_RGGB8:
+    case AV_PIX_FMT_BAYER_BGGR8:
+    case AV_PIX_FMT_BAYER_GRBG8:
+    case AV_PIX_FMT_BAYER_GBRG8:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// the chroma-subsampled formats need an even width, and the 4:2:0 ones an even height as well
+static bool isSizeOK(enum AVPixelFormat pixfmt, int w, int h)
+{
+    switch(pixfmt)
+    {
+    case AV_PIX_FMT_YUYV422:
+    case AV_PIX_FMT_UYVY422: return w % 2 == 0;
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_YUV420P: return w % 2 == 0 && h % 2 == 0;
+    default:                 return true;
+    }
+}
+
+// A small integer hash (lowbias32). This drives the noise and the frame drops
+static inline uint32_t hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// BT.601. The YUV formats are limited-range, as a camera gives them out. The grayscale is
+// full-range, as in the rest of the library
+static inline uint8_t luma   (const uint8_t* p) { return (77*p[0] + 150*p[1] + 29*p[2] + 128) >> 8; }
+static inline uint8_t videoY (const uint8_t* p) { return (( 66*p[0] + 129*p[1] +  25*p[2] + 128) >> 8) + 16;  }
+static inline uint8_t videoCb(const uint8_t* p) { return ((-38*p[0] -  74*p[1] + 112*p[2] + 128) >> 8) + 128; }
+static inline uint8_t videoCr(const uint8_t* p) { return ((112*p[0] -  94*p[1] -  18*p[2] + 128) >> 8) + 128; }
+
+// One frame to render, split into bands of rows
+struct TestPattern_Job
+{
+    TestPattern_Kind   pattern;
+    uint32_t           seed;
+    uint32_t           frame;
+    int                width, height; // of the whole frame
+
+    enum AVPixelFormat pixfmt;
+    CvRect             window;        // the part of the frame rendered into the planes
+    uint8_t*           planes [4];
+    int                strides[4];
+
+    // where the red sample is in each 2x2 quad, for the Bayer formats
+    int                redX, redY;
+};
+
+// Generates n RGB pixels of row y, starting at column x
+static void patternRow(const TestPattern_Job* job, int x, int y, int n, uint8_t* rgb)
+{
+    uint32_t k = job->frame;
+
+    switch(job->pattern)
+    {
+    case TESTPATTERN_GRADIENT:
+    {
+        // each channel ramps across the frame, and scrolls at its own speed
+        uint32_t stepX = (256u << 16) / job->width;
+        uint32_t stepY = (256u << 16) / job->height;
+        uint32_t gy    = ((uint32_t)y * stepY) >> 16;
+        for(int i=0; i<n; i++)
+        {
+            uint32_t gx = ((uint32_t)(x + i) * stepX) >> 16;
+            rgb[3*i + 0] = (uint8_t)(gx + 2*k);
+            rgb[3*i + 1] = (uint8_t)(gy + k);
+            rgb[3*i + 2] = (uint8_t)(255 - ((gx + gy) >> 1) + 3*k);
+        }
+        break;
+    }
+
+    case TESTPATTERN_CHECKERBOARD:
+    {
+        // yellow and blue squares, moving diagonally by a pixel per frame
+        static const uint8_t colors[2][3] = { {20, 40, 160}, {240, 200, 40} };
+        uint32_t row = ((uint32_t)y + k) >> 5;
+        for(int i=0; i<n; i++)
+        {
+            const uint8_t* c = colors[((((uint32_t)(x + i) + k) >> 5) ^ row) & 1];
+            rgb[3*i + 0] = c[0];
+            rgb[3*i + 1] = c[1];
+            rgb[3*i + 2] = c[2];
+        }
+        break;
+    }
+
+    default:
+    {
+        uint32_t rowSeed = hash32(job->seed ^ hash32(k * 0x9e3779b9u + (uint32_t)y));
+        for(int i=0; i<n; i++)
+        {
+            uint32_t h = hash32(rowSeed + (uint32_t)(x + i));
+            rgb[3*i + 0] = (uint8_t)(h      );
+            rgb[3*i + 1] = (uint8_t)(h >>  8);
+            rgb[3*i + 2] = (uint8_t)(h >> 16);
+        }
+        break;
+    }
+    }
+}
+
+// Writes n pixels of the frame's row y into the native format. j and i are the position of the
+// first pixel in the window. For the chroma-subsampled formats, i and n are even, and the
+// subsampled chroma comes from the top-left pixel of each block
+static void writeRow(const TestPattern_Job* job, int j, int i, int y, int n, const uint8_t* rgb)
+{
+    uint8_t* const* planes  = job->planes;
+    const int*      strides = job->strides;
+    uint8_t*        d       = planes[0] + j*strides[0];
+
+    switch(job->pixfmt)
+    {
+    case AV_PIX_FMT_RGB24:
+        memcpy(d + 3*i, rgb, 3*n);
+        break;
+
+    case AV_PIX_FMT_GRAY8:
+        for(int p=0; p<n; p++)
+            d[i + p] = luma(&rgb[3*p]);
+        break;
+
+    case AV_PIX_FMT_YUYV422:
+    case AV_PIX_FMT_UYVY422:
+    {
+        // the luma is in the even bytes for YUYV, and in the odd ones for UYVY
+        int lumaOfs   = job->pixfmt == AV_PIX_FMT_YUYV422 ? 0 : 1;
+        int chromaOfs = 1 - lumaOfs;
+        d += 2*i;
+        for(int p=0; p<n; p += 2)
+        {
+            d[2*p + lumaOfs        ] = videoY (&rgb[3*p    ]);
+            d[2*p + lumaOfs + 2    ] = videoY (&rgb[3*p + 3]);
+            d[2*p + chromaOfs      ] = videoCb(&rgb[3*p    ]);
+            d[2*p + chromaOfs + 2  ] = videoCr(&rgb[3*p    ]);
+        }
+        break;
+    }
+
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_YUV420P:
+        for(int p=0; p<n; p++)
+            d[i + p] = videoY(&rgb[3*p]);
+
+        if(j % 2 == 0)
+            for(int p=0; p<n; p += 2)
+            {
+                uint8_t cb = videoCb(&rgb[3*p]);
+                uint8_t cr = videoCr(&rgb[3*p]);
+                if(job->pixfmt == AV_PIX_FMT_NV12)
+                {
+                    uint8_t* uv = planes[1] + (j/2)*strides[1] + i + p;
+                    uv[0] = cb;
+                    uv[1] = cr;
+                }
+                else
+                {
+                    planes[1][(j/2)*strides[1] + (i + p)/2] = cb;
+                    planes[2][(j/2)*strides[2] + (i + p)/2] = cr;
+                }
+            }
+        break;
+
+    default:
+    {
+        // Bayer: each pixel keeps only the color of its filter. The green ones are on the rows
+        // and columns of the red and the blue
+        bool redRow = ((y ^ job->redY) & 1) == 0;
+        int  x0     = job->window.x + i;
+        for(int p=0; p<n; p++)
+        {
+            bool redCol = (((x0 + p) ^ job->redX) & 1) == 0;
+            int  c;
+            if(redRow != redCol) c = 1;
+            else                 c = redRow ? 0 : 2;
+            d[i + p] = rgb[3*p + c];
+        }
+        break;
+    }
+    }
+}
+
+static void renderBand(void* cookie, int band, int numBands)
+{
+    const TestPattern_Job* job = (const TestPattern_Job*)cookie;
+
+    // the 4:2:0 formats write a chroma row for every other luma row, so the bands start on even
+    // rows
+    int j0, j1;
+    WorkerPool::bandRows(band, numBands, job->window.height, 2, &j0, &j1);
+
+    uint8_t rgb[3*TESTPATTERN_CHUNK];
+    for(int j=j0; j<j1; j++)
+    {
+        int y = job->window.y + j;
+        for(int i=0; i<job->window.width; i += TESTPATTERN_CHUNK)
+        {
+            int n = job->window.width - i;
+            if(n > TESTPATTERN_CHUNK) n = TESTPATTERN_CHUNK;
+
+            patternRow(job, job->window.x + i, y, n, rgb);
+            writeRow  (job, j, i, y, n, rgb);
+        }
+    }
+}
+
+TestPatternSource::TestPatternSource(FrameSource_UserColorChoice _userColorMode,
+                                     int _width, int _height,
+                                     TestPattern_Kind _pattern,
+                                     double fps,
+                                     bool _realTime,
+                                     enum AVPixelFormat _nativePixfmt,
+                                     CvRect _cropRect,
+                                     double scale)
+    : FrameSource(_userColorMode),
+      pattern(_pattern),
+      nativePixfmt(_nativePixfmt),
+      realTime(_realTime),
+      period_us(0),
+      seed(0),
+      dropRate(0.0),
+      ringSize(4),
+      valid(false),
+      gridStart_us(0),
+      gridFirst(0),
+      nextCapture(0),
+      stopped(false),
+      timer_fd(-1)
+{
+    if(nativePixfmt == AV_PIX_FMT_NONE)
+        nativePixfmt = outputPixfmt(userColorMode);
+
+    if(!isSupported(nativePixfmt))
+    {
+        cerr << "TestPatternSource: unsupported native pixel format " << nativePixfmt << endl;
+        return;
+    }
+    if(_width <= 0 || _height <= 0 || !isSizeOK(nativePixfmt, _width, _height) || fps <= 0.0)
+    {
+        cerr << "TestPatternSource: invalid geometry or framerate" << endl;
+        return;
+    }
+
+    period_us = (uint64_t)(1e6 / fps + 0.5);
+    if(period_us == 0)
+        period_us = 1;
+
+    width  = _width;
+    height = _height;
+    setupCroppingScaling(_cropRect, scale);
+
+    // The pattern is rendered straight into the output if it's in the output's format and we're
+    // only cropping, and other formats convert through conversionFrame. The scratch buffer is
+    // needed only to scale a pattern rendered in the output's format
+    if(nativePixfmt != outputPixfmt(userColorMode) || isCropOnly())
+        dropPreCropScaleBuffer();
+
+    if(realTime)
+    {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(timer_fd < 0)
+        {
+            perror("TestPatternSource: couldn't create the timerfd");
+            return;
+        }
+    }
+
+    valid = true;
+    _resumeStream();
+    isRunningNow.setTrue();
+}
+
+TestPatternSource::~TestPatternSource()
+{
+    cleanupThreads();
+
+    if(timer_fd >= 0)
+    {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+}
+
+void TestPatternSource::setDropRate(double _dropRate)
+{
+    // something must get through
+    if(_dropRate < 0.0)  _dropRate = 0.0;
+    if(_dropRate > 0.99) _dropRate = 0.99;
+    dropRate = _dropRate;
+}
+
+uint64_t TestPatternSource::captureTime_us(uint64_t frame)
+{
+    return gridStart_us + (frame - gridFirst) * period_us;
+}
+
+bool TestPatternSource::isDropped(uint64_t frame)
+{
+    if(dropRate <= 0.0)
+        return false;
+    return (double)hash32((uint32_t)frame ^ hash32(~seed)) < dropRate * 4294967296.0;
+}
+
+// Captures the frames whose time has come. A frame that comes in when the ring is full is
+// dropped, and so is everything after it until the reader catches up
+void TestPatternSource::capture(void)
+{
+    uint64_t now = MT_now_us();
+    if(now < gridStart_us)
+        return;
+
+    uint64_t captured = gridFirst + (now - gridStart_us) / period_us + 1;
+    for(; nextCapture < captured; nextCapture++)
+    {
+        if(pending.size() >= ringSize)
+        {
+            stats.addDropped(captured - nextCapture);
+            nextCapture = captured;
+            break;
+        }
+
+        if(isDropped(nextCapture)) stats.addDropped();
+        else                       pending.push_back(nextCapture);
+    }
+}
+
+// Arms the timerfd to become readable when the next frame is there to be read: right away if
+// one is waiting, or at the next capture that won't be dropped
+void TestPatternSource::armTimer(void)
+{
+    if(timer_fd < 0)
+        return;
+
+    struct itimerspec t;
+    memset(&t, 0, sizeof(t));
+    if(!pending.empty())
+        // an absolute time long past. 0 would disarm the timer
+        t.it_value.tv_nsec = 1;
+    else
+    {
+        uint64_t frame = nextCapture;
+        for(int i=0; i<1000 && isDropped(frame); i++)
+            frame++;
+
+        uint64_t time_us = captureTime_us(frame);
+        t.it_value.tv_sec  = time_us / 1000000;
+        t.it_value.tv_nsec = (time_us % 1000000) * 1000;
+    }
+
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &t, NULL);
+}
+
+// Gets the number of the next frame to read, waiting for it to be captured if necessary
+bool TestPatternSource::takeFrame(uint64_t* frame)
+{
+    FRAMETRACE_SPAN("testPattern.dequeue");
+
+    if(!valid)
+        return false;
+
+    // a stopped camera doesn't send anything, so waiting would be forever
+    if(stopped)
+    {
+        cerr << "TestPatternSource: the stream is stopped" << endl;
+        return false;
+    }
+
+    if(!realTime)
+    {
+        // the frames are there whenever they're asked for, minus the ones lost
+        while(isDropped(nextCapture))
+        {
+            stats.addDropped();
+            nextCapture++;
+        }
+        *frame = nextCapture++;
+        return true;
+    }
+
+    while(1)
+    {
+        capture();
+        if(!pending.empty())
+            break;
+
+        uint64_t        time_us = captureTime_us(nextCapture);
+        struct timespec t;
+        t.tv_sec  = time_us / 1000000;
+        t.tv_nsec = (time_us % 1000000) * 1000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+    }
+
+    *frame = pending.front();
+    pending.pop_front();
+    stats.setBacklog(pending.size());
+    armTimer();
+
+    noteCapture(captureTime_us(*frame));
+    return true;
+}
+
+void TestPatternSource::render(uint64_t frame, enum AVPixelFormat pixfmt, CvRect window,
+                               uint8_t* const planes[4], const int strides[4])
+{
+    FRAMETRACE_SPAN("testPattern.render");
+
+    TestPattern_Job job;
+    job.pattern = pattern;
+    job.seed    = seed;
+    job.frame   = (uint32_t)frame;
+    job.width   = rawWidth;
+    job.height  = rawHeight;
+    job.pixfmt  = pixfmt;
+    job.window  = window;
+    for(int i=0; i<4; i++)
+    {
+        job.planes [i] = planes [i];
+        job.strides[i] = strides[i];
+    }
+
+    BayerDemosaic_Pattern bayer;
+    int                   bytesPerSample;
+    job.redX = job.redY = 0;
+    if(bayerDemosaic_fromPixfmt(pixfmt, &bayer, &bytesPerSample))
+    {
+        job.redX = (bayer == BAYERDEMOSAIC_RGGB || bayer == BAYERDEMOSAIC_GBRG) ? 0 : 1;
+        job.redY = (bayer == BAYERDEMOSAIC_RGGB || bayer == BAYERDEMOSAIC_GRBG) ? 0 : 1;
+    }
+
+    // Each band needs at least a few rows to be worth the trouble
+    int numBands = maxThreads;
+    if(numBands > window.height / 16) numBands = window.height / 16;
+    if(numBands < 1)                  numBands = 1;
+    WorkerPool::shared()->run(&renderBand, &job, numBands, numBands);
+}
+
+bool TestPatternSource::_getNativeFrame(NativeFrame* frame, bool latest, uint64_t* timestamp_us)
+{
+    if(latest && !_flushFrames())
+        return false;
+
+    uint64_t k;
+    if(!takeFrame(&k))
+        return false;
+
+    int strides[4];
+    if(av_image_fill_linesizes(strides, nativePixfmt, rawWidth) < 0)
+        return false;
+    int size = av_image_get_buffer_size(nativePixfmt, rawWidth, rawHeight, 1);
+
+    unsigned char* data = frame->setPixels(nativePixfmt, rawWidth, rawHeight, strides[0], size);
+    if(data == NULL)
+        return false;
+
+    uint8_t* planes[4];
+    if(!swsCrop_findPlanes(nativePixfmt, rawWidth, rawHeight, strides[0], data, planes, strides))
+    {
+        frame->clear();
+        return false;
+    }
+
+    render(k, nativePixfmt, cvRect(0, 0, rawWidth, rawHeight), planes, strides);
+    setNativeGeometry(frame);
+
+    if(timestamp_us != NULL)
+        *timestamp_us = captureTime_us(k);
+    return true;
+}
+
+bool TestPatternSource::_getNextFrame(IplImage* image, uint64_t* timestamp_us)
+{
+    // The rendering stands in for the camera's capture, so only the conversion that follows is
+    // timed
+    if(nativePixfmt != outputPixfmt(userColorMode))
+    {
+        if(!_getNativeFrame(&conversionFrame, false, timestamp_us))
+            return false;
+
+        FrameStats_Timer timer(&stats);
+        const IplImage* converted = conversionFrame.get(userColorMode);
+        if(converted == NULL)
+            return false;
+        cvCopy(converted, image);
+        return true;
+    }
+
+    uint64_t k;
+    if(!takeFrame(&k))
+        return false;
+    if(timestamp_us != NULL)
+        *timestamp_us = captureTime_us(k);
+
+    // Rendered in the output's format. If we're only cropping, only the window is rendered
+    if(preCropScaleBuffer == NULL)
+    {
+        uint8_t* planes [4] = { (uint8_t*)image->imageData, NULL, NULL, NULL };
+        int      strides[4] = { image->widthStep, 0, 0, 0 };
+        render(k, nativePixfmt, cropWindow(), planes, strides);
+        return true;
+    }
+
+    uint8_t* planes [4] = { (uint8_t*)preCropScaleBuffer->imageData, NULL, NULL, NULL };
+    int      strides[4] = { preCropScaleBuffer->widthStep, 0, 0, 0 };
+    render(k, nativePixfmt, cvRect(0, 0, rawWidth, rawHeight), planes, strides);
+
+    FrameStats_Timer timer(&stats);
+    applyCroppingScaling(preCropScaleBuffer, image);
+    return true;
+}
+
+// Like a camera: the frames already waiting are thrown away, and we wait for a new one
+bool TestPatternSource::_getLatestFrame(IplImage* image, uint64_t* timestamp_us)
+{
+    if(!_flushFrames())
+        return false;
+    return _getNextFrame(image, timestamp_us);
+}
+
+bool TestPatternSource::_flushFrames(void)
+{
+    if(!realTime || stopped)
+        return true;
+
+    capture();
+    if(!pending.empty())
+    {
+        stats.addFlushed(pending.size());
+        pending.clear();
+    }
+    stats.setBacklog(0);
+    armTimer();
+    return true;
+}
+
+// Stopping the stream throws away the frames waiting, as with V4L2. Resuming it restarts the
+// capture one period from now, with the frame numbers picking up where they left off
+bool TestPatternSource::_stopStream(void)
+{
+    stopped = true;
+    pending.clear();
+    if(timer_fd >= 0)
+    {
+        struct itimerspec t;
+        memset(&t, 0, sizeof(t));
+        timerfd_settime(timer_fd, 0, &t, NULL);
+    }
+    return true;
+}
+
+bool TestPatternSource::_resumeStream(void)
+{
+    if(!valid)
+        return false;
+
+    stopped      = false;
+    gridFirst    = nextCapture;
+    gridStart_us = MT_now_us() + period_us;
+    pending.clear();
+    stats.setBacklog(0);
+    armTimer();
+    return true;
+}
+
+bool TestPatternSource::_restartStream(void)
+{
+    nextCapture = 0;
+    return _resumeStream();
+}
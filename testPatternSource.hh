@@ -0,0 +1,116 @@
+// -*- c++ -*-
+
+#ifndef __TEST_PATTERN_SOURCE_HH__
+#define __TEST_PATTERN_SOURCE_HH__
+
+#include <stdint.h>
+#include <deque>
+#include "frameSource.hh"
+#include "nativeFrame.hh"
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+}
+
+// The patterns. Each frame is a function of the pattern, the seed and the frame number only, so
+// runs are reproducible
+enum TestPattern_Kind
+{
+    TESTPATTERN_GRADIENT,    // smooth color gradients scrolling across the frame. Low entropy
+    TESTPATTERN_CHECKERBOARD,// a scrolling checkerboard of 32x32 squares. Sharp edges
+    TESTPATTERN_NOISE        // uniform noise, different in every frame. Incompressible
+};
+
+// A synthetic frame source, for benchmarking and load-testing without any hardware. The frames
+// are generated in a "native" pixel format (RGB24, GRAY8, YUYV, UYVY, NV12, YUV420P or 8-bit
+// Bayer), and go through the same conversion, cropping and scaling machinery as the frames of a
+// real camera.
+//
+// In real-time mode the source behaves like a camera: a frame is captured every 1/fps seconds,
+// whether anybody reads it or not, into a ring of a few buffers. getNextFrame() blocks until a
+// frame is available, getLatestFrame() throws away the ones waiting, and getFD() becomes readable
+// when there's a frame to read. If the reader falls behind and the ring fills up, the newest
+// frames are dropped, as a V4L2 driver does. Drops on the "bus" can be emulated too.
+//
+// Otherwise, frames are generated as fast as they're asked for, and there's no file descriptor,
+// as with a video file. The timestamps are still 1/fps apart
+class TestPatternSource : public FrameSource
+{
+    TestPattern_Kind   pattern;
+    enum AVPixelFormat nativePixfmt;
+    bool               realTime;
+    uint64_t           period_us;
+    uint32_t           seed;
+    double             dropRate;
+    unsigned int       ringSize;
+    bool               valid;
+
+    // The capture timeline. Frame k is captured at gridStart_us + (k - gridFirst)*period_us. The
+    // frames up to nextCapture have been captured (or dropped). The captured ones that haven't
+    // been read yet are in pending
+    uint64_t             gridStart_us;
+    uint64_t             gridFirst;
+    uint64_t             nextCapture;
+    std::deque<uint64_t> pending;
+
+    // set by _stopStream(). Nothing is captured until _resumeStream()
+    bool                 stopped;
+
+    // readable when a frame is waiting. This is a timerfd armed for the next capture. Only used in
+    // real-time mode
+    int timer_fd;
+
+    // frames in a native format other than the output's are converted through this
+    NativeFrame conversionFrame;
+
+    uint64_t captureTime_us(uint64_t frame);
+    bool     isDropped     (uint64_t frame);
+    void     capture       (void);
+    void     armTimer      (void);
+    bool     takeFrame     (uint64_t* frame);
+    void     render        (uint64_t frame, enum AVPixelFormat pixfmt, CvRect window,
+                            uint8_t* const planes[4], const int strides[4]);
+
+public:
+    TestPatternSource(FrameSource_UserColorChoice _userColorMode,
+                      int _width = 640, int _height = 480,
+                      TestPattern_Kind _pattern = TESTPATTERN_GRADIENT,
+                      double fps = 30.0,
+                      bool _realTime = true,
+                      enum AVPixelFormat _nativePixfmt = AV_PIX_FMT_NONE, // NONE = the output's
+                      CvRect _cropRect = cvRect(-1, -1, -1, -1),
+                      double scale = 1.0);
+
+    ~TestPatternSource();
+
+    operator bool() { return valid; }
+
+    // The fraction of the frames lost on the way from the emulated camera, as gaps in the
+    // sequence. Which frames are lost depends only on the seed. Default 0
+    void setDropRate(double _dropRate);
+
+    // How many frames the emulated driver can hold before it starts dropping new ones. Default 4
+    void setRingSize(unsigned int _ringSize) { ringSize = _ringSize < 1 ? 1 : _ringSize; }
+
+    // Seeds the noise and the drops. Default 0
+    void setSeed(uint32_t _seed) { seed = _seed; }
+
+    int getFD(void) { return timer_fd; }
+
+private:
+    bool _getNextFrame  (IplImage* image, uint64_t* timestamp_us = NULL);
+    bool _getLatestFrame(IplImage* image, uint64_t* timestamp_us = NULL);
+
+    // the native frames are the generated frames, with nothing converted
+    bool _getNativeFrame(NativeFrame* frame, bool latest, uint64_t* timestamp_us);
+
+    bool _flushFrames  (void);
+    bool _stopStream   (void);
+    bool _resumeStream (void);
+
+    // rewinds the pattern to frame 0
+    bool _restartStream(void);
+};
+
+#endif
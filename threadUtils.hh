@@ -5,6 +5,14 @@
 
 #include <pthread.h>
 #include <iostream>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
 
 class MTmutex
 {
@@ -59,82 +67,210 @@ public:
     }
 };
 
-// Class for thread conditions. When a condition is triggered, bCond
-// becomes true. Note this variable does not reset automatically; this
-// has to be manually done with the reset() call. The reason for this
-// is to allow a condition to work if setTrue() happens before
-// waitForTrue()
-class MTcondition
+// A timeout meaning "wait as long as it takes"
+#define MT_FOREVER (~(uint64_t)0)
+
+// monotonic time in us. All the deadlines below are in these units
+static inline uint64_t MT_now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000ULL + (uint64_t)t.tv_nsec / 1000ULL;
+}
+
+static inline uint64_t MT_deadline(uint64_t timeout_us)
+{
+    return timeout_us == MT_FOREVER ? MT_FOREVER : MT_now_us() + timeout_us;
+}
+
+// Sleeps while *word == val, until woken or until the deadline. Returns false if the deadline
+// passed. Spurious wakeups are possible, so the callers check their state in a loop
+static inline bool MT_futexWait(uint32_t* word, uint32_t val, uint64_t deadline_us)
+{
+    struct timespec  t;
+    struct timespec* pt = NULL;
+    if(deadline_us != MT_FOREVER)
+    {
+        t.tv_sec  = deadline_us / 1000000;
+        t.tv_nsec = (deadline_us % 1000000) * 1000;
+        pt = &t;
+    }
+
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline, so the retries don't stretch
+    // the timeout
+    if(syscall(SYS_futex, word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, val, pt, NULL,
+               FUTEX_BITSET_MATCH_ANY) != 0 &&
+       errno == ETIMEDOUT)
+        return false;
+    return true;
+}
+
+static inline void MT_futexWakeAll(uint32_t* word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX, NULL, NULL, 0);
+}
+
+class MTcondition;
+
+// A request for a thread to stop. The thread's loop checks the token, and the token interrupts
+// the thread's blocking waits: MTcondition waits and sleeps directly, and poll() loops through
+// the eventfd returned by getFD(), which is readable while a stop is requested. Only one thread
+// should wait on a token at a time
+class MTstopToken
 {
-    bool           inited;
-    bool           bCond;
-    pthread_cond_t cond;
-    MTmutex        mutex;
+    uint32_t     stopRequested; // futex word
+    int          fd;
+    MTcondition* waitingOn;     // the condition the waiting thread is blocked on, if any
+
+    friend class MTcondition;
 
 public:
-    MTcondition()
+    MTstopToken()
+        : stopRequested(0), waitingOn(NULL)
     {
-        if(pthread_cond_init(&cond, NULL) != 0)
-        {
-            std::cerr << "Couldn't create condition" << std::endl;
-            inited = false;
-        }
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(fd < 0)
+            std::cerr << "Couldn't create the stop token eventfd" << std::endl;
+    }
 
-        inited = true;
-        bCond = false;
+    ~MTstopToken()
+    {
+        if(fd >= 0)
+            close(fd);
     }
 
-    ~MTcondition()
+    inline void requestStop(void);
+
+    // clears the stop request, to let the token be reused for a new thread
+    void reset(void)
     {
-        if(inited && pthread_cond_destroy(&cond) != 0)
-            std::cerr << "Couldn't delete condition" << std::endl;
+        __atomic_store_n(&stopRequested, 0, __ATOMIC_SEQ_CST);
+
+        uint64_t count;
+        if(fd >= 0 && read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            std::cerr << "Couldn't reset the stop token eventfd" << std::endl;
     }
 
-    bool waitForTrue(void)
+    // true if a stop was requested
+    operator bool()
     {
-        if(!inited)
-        {
-            std::cerr << __FILE__ << "[" << __LINE__ << "]: "
-                      << "Tried to wait for an un-inited condition" << std::endl;
-            return false;
-        }
+        return __atomic_load_n(&stopRequested, __ATOMIC_SEQ_CST) != 0;
+    }
 
-        if(bCond)
-            return true;
+    int getFD(void) { return fd; }
 
-        mutex.lock();
-        while(!bCond)
-            pthread_cond_wait(&cond, &(pthread_mutex_t&)mutex);
-        mutex.unlock();
+    // Sleeps until the deadline. Returns false if a stop was requested before or during the sleep
+    bool sleepUntil(uint64_t deadline_us)
+    {
+        while(!*this)
+            if(!MT_futexWait(&stopRequested, 0, deadline_us))
+                return !*this;
+        return false;
+    }
+    bool sleep_us(uint64_t us)
+    {
+        return sleepUntil(MT_deadline(us));
+    }
+};
 
-        return true;
+// Class for thread conditions. When a condition is triggered, it becomes true. Note this does not
+// reset automatically; this has to be manually done with the reset() call. The reason for this is
+// to allow a condition to work if setTrue() happens before waitForTrue().
+//
+// This is a futex: the state is a single atomic word, so checking the condition is just a load,
+// and setting it wakes up ALL the waiters. The waits can time out, and can be interrupted by a
+// stop token
+class MTcondition
+{
+    // bit 0 is the condition. The rest is a counter bumped by kick() to wake up the waiters
+    // without changing the condition
+    uint32_t state;
+
+public:
+    MTcondition()
+        : state(0)
+    {
     }
 
-    bool setTrue(void)
+    // Waits until the condition is true, the deadline passes, or a stop is requested through the
+    // given token. Returns true if the condition is true
+    bool waitUntilTrue(uint64_t deadline_us, MTstopToken* stop = NULL)
     {
-        if(!inited)
+        if(stop != NULL)
+            __atomic_store_n(&stop->waitingOn, this, __ATOMIC_SEQ_CST);
+
+        // I read the state before checking the stop token. A requestStop() after the check thus
+        // changes the state, and the futex wait doesn't sleep through it
+        bool result;
+        while(1)
         {
-            std::cerr << __FILE__ << "[" << __LINE__ << "]: "
-                      << "Tried to set an un-inited condition" << std::endl;
-            return false;
+            uint32_t s = __atomic_load_n(&state, __ATOMIC_SEQ_CST);
+            if(s & 1)
+            {
+                result = true;
+                break;
+            }
+            if(stop != NULL && *stop)
+            {
+                result = false;
+                break;
+            }
+            if(!MT_futexWait(&state, s, deadline_us))
+            {
+                result = *this;
+                break;
+            }
         }
 
-        mutex.lock();
-        bCond = true;
-        pthread_cond_signal(&cond);
-        mutex.unlock();
+        if(stop != NULL)
+            __atomic_store_n(&stop->waitingOn, (MTcondition*)NULL, __ATOMIC_SEQ_CST);
+        return result;
+    }
+
+    bool waitForTrue(uint64_t timeout_us = MT_FOREVER, MTstopToken* stop = NULL)
+    {
+        if(*this)
+            return true;
+        return waitUntilTrue(MT_deadline(timeout_us), stop);
+    }
 
+    bool setTrue(void)
+    {
+        __atomic_fetch_or(&state, 1, __ATOMIC_SEQ_CST);
+        MT_futexWakeAll(&state);
         return true;
     }
 
     void reset(void)
     {
-        bCond = false;
+        __atomic_fetch_and(&state, ~(uint32_t)1, __ATOMIC_SEQ_CST);
     }
+
+    // wakes up the waiters to have them recheck their stop tokens
+    void kick(void)
+    {
+        __atomic_fetch_add(&state, 2, __ATOMIC_SEQ_CST);
+        MT_futexWakeAll(&state);
+    }
+
     operator bool()
     {
-        return bCond;
+        return (__atomic_load_n(&state, __ATOMIC_ACQUIRE) & 1) != 0;
     }
 };
 
+inline void MTstopToken::requestStop(void)
+{
+    __atomic_store_n(&stopRequested, 1, __ATOMIC_SEQ_CST);
+    MT_futexWakeAll(&stopRequested);
+
+    uint64_t one = 1;
+    if(fd >= 0 && write(fd, &one, sizeof(one)) != (ssize_t)sizeof(one))
+        std::cerr << "Couldn't signal the stop token eventfd" << std::endl;
+
+    MTcondition* c = __atomic_load_n(&waitingOn, __ATOMIC_SEQ_CST);
+    if(c != NULL)
+        c->kick();
+}
+
 #endif
@@ -0,0 +1,168 @@
+#include <unistd.h>
+#include <iostream>
+#include "workerPool.hh"
+using namespace std;
+
+struct WorkerPool_Job
+{
+    WorkerPool_Job_t* func;
+    void*             cookie;
+    int               numBands;
+
+    int               nextBand;      // the next band nobody has claimed yet. Atomic
+    int               helpersWanted; // how many more workers may join. Protected by the mutex
+    int               helpersActive; // how many workers are in this job. Protected by the mutex
+
+    WorkerPool_Job*   next;
+};
+
+static WorkerPool*    sharedPool     = NULL;
+static pthread_once_t sharedPoolOnce = PTHREAD_ONCE_INIT;
+
+void WorkerPool::createShared(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cores < 1)
+        cores = 1;
+
+    // the pool is never destroyed: the workers may be in use until the process exits
+    sharedPool = new WorkerPool(cores - 1);
+}
+
+WorkerPool* WorkerPool::shared(void)
+{
+    pthread_once(&sharedPoolOnce, &createShared);
+    return sharedPool;
+}
+
+WorkerPool::WorkerPool(int _numWorkers)
+    : jobs(NULL), numWorkers(0)
+{
+    if(pthread_mutex_init(&mutex,    NULL) != 0 ||
+       pthread_cond_init (&workCond, NULL) != 0 ||
+       pthread_cond_init (&doneCond, NULL) != 0)
+    {
+        cerr << "WorkerPool: couldn't create the mutex/conditions. Running single-threaded" << endl;
+        return;
+    }
+
+    for(int i=0; i<_numWorkers; i++)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, &workerThread, this) != 0)
+        {
+            cerr << "WorkerPool: couldn't create worker thread. Have " << numWorkers << " workers" << endl;
+            break;
+        }
+        pthread_detach(thread);
+        numWorkers++;
+    }
+}
+
+void* WorkerPool::workerThread(void* pool)
+{
+    ((WorkerPool*)pool)->worker();
+    return NULL;
+}
+
+void WorkerPool::runBands(WorkerPool_Job* job)
+{
+    int band;
+    while((band = __sync_fetch_and_add(&job->nextBand, 1)) < job->numBands)
+        (*job->func)(job->cookie, band, job->numBands);
+}
+
+void WorkerPool::worker(void)
+{
+    pthread_mutex_lock(&mutex);
+    while(1)
+    {
+        // find a job that wants help
+        WorkerPool_Job* job;
+        for(job = jobs; job != NULL; job = job->next)
+            if(job->helpersWanted > 0 &&
+               __sync_add_and_fetch(&job->nextBand, 0) < job->numBands)
+                break;
+
+        if(job == NULL)
+        {
+            pthread_cond_wait(&workCond, &mutex);
+            continue;
+        }
+
+        job->helpersWanted--;
+        job->helpersActive++;
+        pthread_mutex_unlock(&mutex);
+
+        runBands(job);
+
+        // The job lives on the caller's stack. Once I say I'm done with it, I can't touch it
+        // anymore
+        pthread_mutex_lock(&mutex);
+        if(--job->helpersActive == 0)
+            pthread_cond_broadcast(&doneCond);
+    }
+}
+
+void WorkerPool::run(WorkerPool_Job_t* func, void* cookie, int numBands, int maxThreads)
+{
+    if(maxThreads > numWorkers + 1)
+        maxThreads = numWorkers + 1;
+    if(maxThreads > numBands)
+        maxThreads = numBands;
+
+    if(maxThreads <= 1)
+    {
+        for(int i=0; i<numBands; i++)
+            (*func)(cookie, i, numBands);
+        return;
+    }
+
+    WorkerPool_Job job;
+    job.func          = func;
+    job.cookie        = cookie;
+    job.numBands      = numBands;
+    job.nextBand      = 0;
+    job.helpersWanted = maxThreads - 1;
+    job.helpersActive = 0;
+
+    // The job is on my stack, so I can't be cancelled until it's finished
+    int oldCancelState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldCancelState);
+
+    pthread_mutex_lock(&mutex);
+    job.next = jobs;
+    jobs     = &job;
+    pthread_cond_broadcast(&workCond);
+    pthread_mutex_unlock(&mutex);
+
+    runBands(&job);
+
+    // All the bands have been claimed. I wait for the workers still running theirs, and take the
+    // job off the list
+    pthread_mutex_lock(&mutex);
+    while(job.helpersActive > 0)
+        pthread_cond_wait(&doneCond, &mutex);
+
+    for(WorkerPool_Job** j = &jobs; *j != NULL; j = &(*j)->next)
+        if(*j == &job)
+        {
+            *j = job.next;
+            break;
+        }
+    pthread_mutex_unlock(&mutex);
+
+    pthread_setcancelstate(oldCancelState, NULL);
+}
+
+void WorkerPool::bandRows(int band, int numBands, int rows, int align, int* y0, int* y1)
+{
+    // I split the aligned blocks of rows as evenly as I can. The last band gets the leftovers
+    int blocks = (rows + align - 1) / align;
+
+    *y0 = (int)((long)blocks *  band      / numBands) * align;
+    *y1 = (int)((long)blocks * (band + 1) / numBands) * align;
+
+    if(*y1 > rows) *y1 = rows;
+    if(*y0 > rows) *y0 = rows;
+}
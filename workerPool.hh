@@ -0,0 +1,52 @@
+// -*- c++ -*-
+
+#ifndef __WORKER_POOL_HH__
+#define __WORKER_POOL_HH__
+
+#include <pthread.h>
+
+// A job split into bands. This is called once for each band in [0, numBands)
+typedef void (WorkerPool_Job_t)(void* cookie, int band, int numBands);
+
+struct WorkerPool_Job;
+
+// A pool of worker threads shared by all the frame sources. The per-frame operations (color
+// conversion, scaling) are split into horizontal bands, and the bands are spread across the
+// workers. The caller works on its own job too, so a job with a thread cap of N uses the caller
+// and at most N-1 workers. The pool is created on first use, with one worker per core (minus
+// the caller), and lives as long as the process.
+//
+// The bands write disjoint parts of the output, so the result doesn't depend on which thread
+// ran what
+class WorkerPool
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t  workCond; // a job was posted
+    pthread_cond_t  doneCond; // a worker left a job
+    WorkerPool_Job* jobs;     // jobs that may still want helpers
+    int             numWorkers;
+
+    WorkerPool(int _numWorkers);
+
+    static void* workerThread(void* pool);
+    static void  createShared(void);
+    void         worker(void);
+    void         runBands(WorkerPool_Job* job);
+
+public:
+    // the pool everybody uses
+    static WorkerPool* shared(void);
+
+    // Runs job(cookie, band, numBands) for every band, and returns when they're all done. At most
+    // maxThreads threads (including the caller) work on this job. maxThreads <= 1 runs
+    // everything in the calling thread
+    void run(WorkerPool_Job_t* job, void* cookie, int numBands, int maxThreads);
+
+    int workers(void) { return numWorkers; }
+
+    // Splits "rows" rows into numBands bands, and returns the bounds of band "band" in
+    // [*y0,*y1). The band boundaries are multiples of "align"
+    static void bandRows(int band, int numBands, int rows, int align, int* y0, int* y1);
+};
+
+#endif